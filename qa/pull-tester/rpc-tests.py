@@ -101,6 +101,9 @@ testScripts = [
     'mempool_spendcoinbase.py',
     'mempool_reorg.py',
     'mempool_limit.py',
+    'mempool_persist.py',
+    'mempool_events.py',
+    'compactblocks.py',
     'httpbasics.py',
     'multi_rpc.py',
     'zapwallettxes.py',
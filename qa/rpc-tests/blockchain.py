@@ -59,6 +59,9 @@ class BlockchainTest(BitcoinTestFramework):
         assert_equal(len(res[u'bestblock']), 64)
         assert_equal(len(res[u'hash_serialized']), 64)
 
+        full = node.gettxoutsetinfo("full")
+        assert_equal(full, res)
+
     def _test_getblockheader(self):
         node = self.nodes[0]
 
@@ -0,0 +1,80 @@
+#!/usr/bin/env python2
+# Copyright (c) 2016 The Bitcoin Core developers
+# Distributed under the MIT software license, see the accompanying
+# file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#
+# Test relaying new blocks as compact blocks (BIP152) and rebuilding
+# them from the mempool, as seen in getpeerinfo.
+#
+
+from test_framework.test_framework import BitcoinTestFramework
+from test_framework.util import *
+
+class CompactBlocksTest(BitcoinTestFramework):
+
+    def setup_chain(self):
+        print("Initializing test directory "+self.options.tmpdir)
+        initialize_chain_clean(self.options.tmpdir, 2)
+
+    def setup_network(self):
+        self.nodes = start_nodes(2, self.options.tmpdir)
+        connect_nodes(self.nodes[1], 0)
+        self.is_network_split = False
+        self.sync_all()
+
+    def cmpct_stats(self, node):
+        peers = node.getpeerinfo()
+        assert_equal(len(peers), 1)
+        return peers[0]["cmpctblock"]
+
+    def run_test(self):
+        self.nodes[0].generate(101)
+        self.sync_all()
+
+        stats = self.cmpct_stats(self.nodes[1])
+        for key in ["highbandwidth_to", "highbandwidth_from", "received", "rebuilt",
+                    "txn_requested", "fallback", "reconstruction_rate"]:
+            assert(key in stats)
+
+        # Blocks with transactions both nodes have in their mempool are
+        # rebuilt without asking for anything
+        for i in range(3):
+            for j in range(3):
+                self.nodes[0].sendtoaddress(self.nodes[1].getnewaddress(), 1)
+            self.sync_all()
+            self.nodes[0].generate(1)
+            self.sync_all()
+            assert_equal(self.nodes[0].getrawmempool(), [])
+            assert_equal(self.nodes[1].getrawmempool(), [])
+
+        # The transactions were announced in trickled inv batches
+        invrelay = self.nodes[0].getnettotals()["invrelay"]
+        assert(invrelay["objects_relayed"] >= 9)
+        assert(invrelay["invs_sent"] >= 9)
+        assert(invrelay["inv_bytes_per_object"] > 0)
+        # and served to node1 from the relay cache
+        relaycache = self.nodes[0].getnetworkinfo()["relaycache"]
+        assert(relaycache["entries"] >= 9)
+        assert(relaycache["hits"] >= 9)
+        assert(0 < relaycache["bytes"] <= relaycache["max_bytes"])
+
+        after = self.cmpct_stats(self.nodes[1])
+        assert(after["received"] > stats["received"])
+        assert(after["rebuilt"] > stats["rebuilt"])
+        assert_equal(after["fallback"], 0)
+        # The receiving node asked for high bandwidth announcements
+        assert_equal(after["highbandwidth_from"], True)
+        assert_equal(self.cmpct_stats(self.nodes[0])["highbandwidth_to"], True)
+
+        # Blocks with transactions missing from the mempool still get through
+        stop_node(self.nodes[1], 1)
+        self.nodes[0].sendtoaddress(self.nodes[0].getnewaddress(), 1)
+        self.nodes[1] = start_node(1, self.options.tmpdir)
+        connect_nodes(self.nodes[1], 0)
+        self.nodes[0].generate(1)
+        sync_blocks(self.nodes)
+        assert_equal(self.nodes[0].getbestblockhash(), self.nodes[1].getbestblockhash())
+
+if __name__ == '__main__':
+    CompactBlocksTest().main()
@@ -0,0 +1,80 @@
+#!/usr/bin/env python2
+# Copyright (c) 2016 The Bitcoin Core developers
+# Distributed under the MIT software license, see the accompanying
+# file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#
+# Test following the mempool with getrawmempool false true and
+# getmempoolevents, including removal reasons and running off the end
+# of the event log.
+#
+
+from test_framework.test_framework import BitcoinTestFramework
+from test_framework.util import *
+
+class MempoolEventsTest(BitcoinTestFramework):
+
+    def setup_chain(self):
+        print("Initializing test directory "+self.options.tmpdir)
+        initialize_chain_clean(self.options.tmpdir, 1)
+
+    def setup_network(self):
+        self.nodes = start_nodes(1, self.options.tmpdir)
+        self.is_network_split = False
+
+    def events(self, since, count=None):
+        if count is None:
+            return self.nodes[0].getmempoolevents(since)
+        return self.nodes[0].getmempoolevents(since, count)
+
+    def run_test(self):
+        node = self.nodes[0]
+        node.generate(101)
+
+        start = node.getrawmempool(False, True)
+        assert_equal(start["txids"], [])
+        assert_raises(JSONRPCException, node.getrawmempool, True, True)
+
+        txids = [node.sendtoaddress(node.getnewaddress(), 1) for i in range(2)]
+        res = self.events(start["mempool_sequence"])
+        assert_equal(res["more"], False)
+        assert_equal([e["txid"] for e in res["events"]], txids)
+        assert_equal([e["event"] for e in res["events"]], ["added", "added"])
+        assert_equal(res["sequence"], start["mempool_sequence"] + 2)
+        assert_equal(node.getrawmempool(False, True)["mempool_sequence"], res["sequence"])
+
+        # At most count events at a time
+        res = self.events(start["mempool_sequence"], 1)
+        assert_equal(res["more"], True)
+        assert_equal(len(res["events"]), 1)
+        res = self.events(res["sequence"], 1)
+        assert_equal(res["events"][0]["txid"], txids[1])
+
+        # Nothing new
+        res = self.events(res["sequence"])
+        assert_equal(res["events"], [])
+        seq = res["sequence"]
+
+        # Mined transactions are removed for the block, and come back in a reorg
+        blockhash = node.generate(1)[0]
+        res = self.events(seq)
+        assert_equal(sorted(e["txid"] for e in res["events"]), sorted(txids))
+        assert_equal(set(e["reason"] for e in res["events"]), set(["block"]))
+        seq = res["sequence"]
+
+        node.invalidateblock(blockhash)
+        res = self.events(seq)
+        assert_equal(sorted(e["txid"] for e in res["events"] if e["event"] == "added"), sorted(txids))
+        seq = res["sequence"]
+
+        # The log only keeps the last -mempooleventlog events
+        stop_node(node, 0)
+        self.nodes[0] = node = start_node(0, self.options.tmpdir, ["-mempooleventlog=1"])
+        seq = node.getrawmempool(False, True)["mempool_sequence"]
+        node.generate(1)
+        assert_raises(JSONRPCException, self.events, seq)
+        seq = node.getrawmempool(False, True)["mempool_sequence"]
+        assert_equal(self.events(seq)["events"], [])
+
+if __name__ == '__main__':
+    MempoolEventsTest().main()
@@ -0,0 +1,66 @@
+#!/usr/bin/env python2
+# Copyright (c) 2016 The Bitcoin Core developers
+# Distributed under the MIT software license, see the accompanying
+# file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#
+# Test that the mempool is saved to mempool.dat on shutdown and loaded
+# again on startup, unless -persistmempool=0 is given, and that
+# savemempool writes mempool.dat on demand.
+#
+
+from test_framework.test_framework import BitcoinTestFramework
+from test_framework.util import *
+import os
+import time
+
+class MempoolPersistTest(BitcoinTestFramework):
+
+    def setup_network(self):
+        # node1 only signs transactions for node0, so node0's wallet does not
+        # know them and cannot put them back into the mempool by itself
+        self.nodes = start_nodes(2, self.options.tmpdir)
+        self.is_network_split = True
+
+    def wait_for_mempool_size(self, node, size):
+        for i in range(60):
+            if len(node.getrawmempool()) == size:
+                return
+            time.sleep(0.5)
+        assert_equal(len(node.getrawmempool()), size)
+
+    def run_test(self):
+        address = self.nodes[1].getnewaddress()
+        txids = []
+        for utxo in self.nodes[1].listunspent()[:5]:
+            inputs = [{ "txid" : utxo["txid"], "vout" : utxo["vout"] }]
+            outputs = { address : utxo["amount"] - Decimal("0.001") }
+            rawtx = self.nodes[1].createrawtransaction(inputs, outputs)
+            signedtx = self.nodes[1].signrawtransaction(rawtx)
+            txids.append(self.nodes[0].sendrawtransaction(signedtx["hex"]))
+        assert_equal(set(self.nodes[0].getrawmempool()), set(txids))
+        self.nodes[0].prioritisetransaction(txids[0], 0, 1000)
+        entry_time = self.nodes[0].getrawmempool(True)[txids[0]]["time"]
+
+        # Without -persistmempool the restarted node starts empty
+        stop_node(self.nodes[0], 0)
+        self.nodes[0] = start_node(0, self.options.tmpdir, ["-persistmempool=0"])
+        time.sleep(2)
+        assert_equal(len(self.nodes[0].getrawmempool()), 0)
+
+        # The dump written by the first shutdown is still there
+        stop_node(self.nodes[0], 0)
+        self.nodes[0] = start_node(0, self.options.tmpdir)
+        self.wait_for_mempool_size(self.nodes[0], 5)
+        entry = self.nodes[0].getrawmempool(True)[txids[0]]
+        assert_equal(entry["time"], entry_time)
+        assert_equal(entry["modifiedfee"], entry["fee"] + Decimal("0.00001"))
+
+        # savemempool writes mempool.dat on demand
+        mempooldat = os.path.join(self.options.tmpdir, "node0", "regtest", "mempool.dat")
+        os.remove(mempooldat)
+        self.nodes[0].savemempool()
+        assert(os.path.isfile(mempooldat))
+
+if __name__ == '__main__':
+    MempoolPersistTest().main()
@@ -82,5 +82,31 @@ class NodeHandlingTest (BitcoinTestFramework):
                 found = True
         assert(found)
 
+        ########################
+        # socket handler tests #
+        ########################
+        totals = self.nodes[0].getnettotals()
+        assert(totals['socketevents']['loops'] > 0)
+        assert(totals['socketevents']['mode'] in ['select', 'epoll'])
+        assert(totals['socketevents']['send_calls'] > 0)
+        assert(totals['socketevents']['send_msgs'] > 0)
+
+        # the select fallback must keep working
+        stop_node(self.nodes[1], 1)
+        self.nodes[1] = start_node(1, self.options.tmpdir, ["-socketevents=select"])
+        assert_equal(self.nodes[1].getnettotals()['socketevents']['mode'], 'select')
+        connect_nodes_bi(self.nodes,0,1)
+        self.nodes[0].generate(1)
+        sync_blocks(self.nodes[0:2])
+
+        # the block went out on the block lane
+        blocks_sent = 0
+        for node in self.nodes[0].getpeerinfo():
+            lanes = node['sendlanes']
+            assert_equal(sorted(lanes.keys()), ['block', 'bulk', 'instantsend', 'normal'])
+            assert(lanes['normal']['sent'] > 0)
+            blocks_sent += lanes['block']['sent']
+        assert(blocks_sent > 0)
+
 if __name__ == '__main__':
     NodeHandlingTest ().main ()
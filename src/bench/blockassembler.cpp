@@ -0,0 +1,57 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+#include "arith_uint256.h"
+#include "chainparams.h"
+#include "miner.h"
+#include "primitives/transaction.h"
+#include "random.h"
+#include "txmempool.h"
+
+static const int BLOCKASSEMBLER_BENCH_PACKAGES = 10000;
+static const int BLOCKASSEMBLER_BENCH_MAX_DEPTH = 4;
+
+// Fill pool with chains of 1 to 4 P2PKH-sized transactions. Parents pay little
+// or nothing and the last transaction of a chain usually pays for the whole
+// package (child-pays-for-parent), so the mempool is several blocks worth of
+// packages whose ancestor feerate differs from their own feerate.
+static void FillSyntheticMempool(CTxMemPool& pool)
+{
+    seed_insecure_rand(true);
+    LOCK(pool.cs);
+    for (int i = 0; i < BLOCKASSEMBLER_BENCH_PACKAGES; i++) {
+        int nDepth = 1 + insecure_rand() % BLOCKASSEMBLER_BENCH_MAX_DEPTH;
+        COutPoint prevout(ArithToUint256(arith_uint256(i + 1)), 0);
+        for (int j = 0; j < nDepth; j++) {
+            CMutableTransaction tx;
+            tx.vin.resize(1);
+            tx.vin[0].prevout = prevout;
+            tx.vin[0].scriptSig = CScript() << std::vector<unsigned char>(72) << std::vector<unsigned char>(33);
+            tx.vout.resize(1);
+            tx.vout[0].scriptPubKey = CScript() << OP_DUP << OP_HASH160 << std::vector<unsigned char>(20) << OP_EQUALVERIFY << OP_CHECKSIG;
+            tx.vout[0].nValue = COIN;
+
+            CAmount nFee = (j == nDepth - 1) ? 2000 + insecure_rand() % 100000 : insecure_rand() % 2000;
+            pool.addUnchecked(tx.GetHash(), CTxMemPoolEntry(tx, nFee, 0, 0.0, 1, j == 0, 0, false, 1, LockPoints()));
+            prevout = COutPoint(tx.GetHash(), 0);
+        }
+    }
+}
+
+// Select the transactions of a block template from the synthetic mempool, as
+// CreateNewBlock does (without the coinbase and TestBlockValidity).
+static void AssembleBlock(benchmark::State& state)
+{
+    CTxMemPool pool(CFeeRate(0));
+    FillSyntheticMempool(pool);
+
+    BlockAssembler assembler(Params(CBaseChainParams::MAIN), pool);
+    while (state.KeepRunning()) {
+        assembler.AddTransactions(1, 0);
+        assert(assembler.GetBlockTx() > 0);
+    }
+}
+
+BENCHMARK(AssembleBlock);
@@ -0,0 +1,94 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+#include "checkqueue.h"
+#include "coins.h"
+#include "key.h"
+#include "main.h"
+#include "primitives/transaction.h"
+#include "pubkey.h"
+#include "script/interpreter.h"
+#include "script/standard.h"
+#include "util.h"
+
+#include <boost/bind.hpp>
+#include <boost/thread.hpp>
+
+static const int CHECKQUEUE_BENCH_TRANSACTIONS = 20;
+static const int CHECKQUEUE_BENCH_INPUTS_PER_TX = 100;
+
+// Verify the scripts of a synthetic block of 2,000 P2PKH inputs on the
+// script check queue, with as many threads as -par would use for
+// ConnectBlock. Checks are added per transaction, as ConnectBlock does.
+static void CheckQueueP2PKHBlock(benchmark::State& state)
+{
+    ECCVerifyHandle verifyHandle;
+
+    std::vector<CCoins> coins(CHECKQUEUE_BENCH_TRANSACTIONS);
+    std::vector<CTransaction> txs(CHECKQUEUE_BENCH_TRANSACTIONS);
+    std::vector<PrecomputedTransactionData> txdata;
+    txdata.reserve(CHECKQUEUE_BENCH_TRANSACTIONS);
+    for (int i = 0; i < CHECKQUEUE_BENCH_TRANSACTIONS; i++) {
+        CKey key;
+        key.MakeNewKey(true);
+        CScript scriptPubKey = GetScriptForDestination(key.GetPubKey().GetID());
+
+        CMutableTransaction txFrom;
+        txFrom.vout.resize(CHECKQUEUE_BENCH_INPUTS_PER_TX);
+        for (int j = 0; j < CHECKQUEUE_BENCH_INPUTS_PER_TX; j++) {
+            txFrom.vout[j].nValue = 1000;
+            txFrom.vout[j].scriptPubKey = scriptPubKey;
+        }
+        coins[i] = CCoins(txFrom, 1);
+
+        CMutableTransaction tx;
+        tx.vin.resize(CHECKQUEUE_BENCH_INPUTS_PER_TX);
+        for (int j = 0; j < CHECKQUEUE_BENCH_INPUTS_PER_TX; j++)
+            tx.vin[j].prevout = COutPoint(txFrom.GetHash(), j);
+        tx.vout.resize(1);
+        tx.vout[0].nValue = 1000 * CHECKQUEUE_BENCH_INPUTS_PER_TX;
+        tx.vout[0].scriptPubKey = scriptPubKey;
+        for (int j = 0; j < CHECKQUEUE_BENCH_INPUTS_PER_TX; j++) {
+            std::vector<unsigned char> vchSig;
+            uint256 hash = SignatureHash(scriptPubKey, tx, j, SIGHASH_ALL);
+            assert(key.Sign(hash, vchSig));
+            vchSig.push_back((unsigned char)SIGHASH_ALL);
+            tx.vin[j].scriptSig << vchSig << ToByteVector(key.GetPubKey());
+        }
+        txs[i] = tx;
+        txdata.push_back(PrecomputedTransactionData(txs[i]));
+    }
+
+    int nThreads = GetArg("-par", DEFAULT_SCRIPTCHECK_THREADS);
+    if (nThreads <= 0)
+        nThreads += GetNumCores();
+    nThreads = std::max(1, std::min(nThreads, MAX_SCRIPTCHECK_THREADS));
+
+    CCheckQueue<CScriptCheck> queue(128);
+    boost::thread_group threadGroup;
+    for (int i = 0; i < nThreads - 1; i++)
+        threadGroup.create_thread(boost::bind(&CCheckQueue<CScriptCheck>::Thread, &queue));
+
+    unsigned int flags = SCRIPT_VERIFY_P2SH | SCRIPT_VERIFY_DERSIG | SCRIPT_VERIFY_CHECKLOCKTIMEVERIFY;
+    while (state.KeepRunning()) {
+        CCheckQueueControl<CScriptCheck> control(&queue);
+        for (int i = 0; i < CHECKQUEUE_BENCH_TRANSACTIONS; i++) {
+            std::vector<CScriptCheck> vChecks;
+            vChecks.reserve(CHECKQUEUE_BENCH_INPUTS_PER_TX);
+            for (int j = 0; j < CHECKQUEUE_BENCH_INPUTS_PER_TX; j++) {
+                vChecks.push_back(CScriptCheck());
+                CScriptCheck check(coins[i], txs[i], j, flags, false, txdata[i]);
+                check.swap(vChecks.back());
+            }
+            control.Add(vChecks);
+        }
+        assert(control.Wait());
+    }
+
+    threadGroup.interrupt_all();
+    threadGroup.join_all();
+}
+
+BENCHMARK(CheckQueueP2PKHBlock);
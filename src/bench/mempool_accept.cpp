@@ -0,0 +1,135 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+#include "chain.h"
+#include "chainparams.h"
+#include "coins.h"
+#include "consensus/validation.h"
+#include "key.h"
+#include "main.h"
+#include "primitives/transaction.h"
+#include "script/interpreter.h"
+#include "script/standard.h"
+#include "txmempool.h"
+#include "util.h"
+
+#include <boost/foreach.hpp>
+#include <boost/thread.hpp>
+
+static const int MEMPOOL_ACCEPT_BENCH_TRANSACTIONS = 1000;
+
+// Chainstate with MEMPOOL_ACCEPT_BENCH_TRANSACTIONS confirmed transactions
+// paying to P2PKH and a signed transaction spending each of them, plus as
+// many script check threads as -par would start. The signature and script
+// execution caches are never set up here, so every iteration runs all scripts.
+class MempoolAcceptBenchSetup
+{
+private:
+    ECCVerifyHandle verifyHandle;
+    CCoinsView viewDummy;
+    CBlockIndex index;
+    boost::thread_group threadGroup;
+
+public:
+    std::vector<CTransaction> vtx;
+
+    MempoolAcceptBenchSetup()
+    {
+        SelectParams(CBaseChainParams::MAIN);
+
+        CKey key;
+        key.MakeNewKey(true);
+        CScript scriptPubKey = GetScriptForDestination(key.GetPubKey().GetID());
+
+        LOCK(cs_main);
+        uint256 hashTip = GetRandHash();
+        index.phashBlock = &mapBlockIndex.insert(std::make_pair(hashTip, &index)).first->first;
+        index.nTime = GetTime();
+        chainActive.SetTip(&index);
+        pcoinsTip = new CCoinsViewCache(&viewDummy);
+        pcoinsTip->SetBestBlock(hashTip);
+
+        for (int i = 0; i < MEMPOOL_ACCEPT_BENCH_TRANSACTIONS; i++) {
+            CMutableTransaction txFrom;
+            txFrom.vout.resize(1);
+            txFrom.vout[0].nValue = COIN;
+            txFrom.vout[0].scriptPubKey = scriptPubKey;
+            txFrom.nLockTime = i;
+            *pcoinsTip->ModifyNewCoins(txFrom.GetHash()) = CCoins(txFrom, 0);
+
+            CMutableTransaction tx;
+            tx.vin.resize(1);
+            tx.vin[0].prevout = COutPoint(txFrom.GetHash(), 0);
+            tx.vout.resize(1);
+            tx.vout[0].nValue = COIN - COIN / 1000;
+            tx.vout[0].scriptPubKey = scriptPubKey;
+            std::vector<unsigned char> vchSig;
+            uint256 hash = SignatureHash(scriptPubKey, tx, 0, SIGHASH_ALL);
+            bool fSigned = key.Sign(hash, vchSig);
+            assert(fSigned);
+            vchSig.push_back((unsigned char)SIGHASH_ALL);
+            tx.vin[0].scriptSig << vchSig << ToByteVector(key.GetPubKey());
+            vtx.push_back(tx);
+        }
+
+        nScriptCheckThreads = GetArg("-par", DEFAULT_SCRIPTCHECK_THREADS);
+        if (nScriptCheckThreads <= 0)
+            nScriptCheckThreads += GetNumCores();
+        nScriptCheckThreads = std::max(1, std::min(nScriptCheckThreads, MAX_SCRIPTCHECK_THREADS)) - 1;
+        for (int i = 0; i < nScriptCheckThreads; i++)
+            threadGroup.create_thread(&ThreadScriptCheck);
+    }
+
+    ~MempoolAcceptBenchSetup()
+    {
+        threadGroup.interrupt_all();
+        threadGroup.join_all();
+        nScriptCheckThreads = 0;
+
+        LOCK(cs_main);
+        delete pcoinsTip;
+        pcoinsTip = NULL;
+        chainActive.SetTip(NULL);
+        mapBlockIndex.erase(index.GetBlockHash());
+    }
+};
+
+// Accept 1,000 independent P2PKH transactions one at a time, as the
+// message handler does for transactions relayed to us.
+static void MempoolAcceptSerial(benchmark::State& state)
+{
+    MempoolAcceptBenchSetup setup;
+    CTxMemPool pool(CFeeRate(0));
+
+    LOCK(cs_main);
+    while (state.KeepRunning()) {
+        BOOST_FOREACH(const CTransaction& tx, setup.vtx) {
+            CValidationState validationState;
+            bool fAccepted = AcceptToMemoryPool(pool, validationState, tx, false, NULL);
+            assert(fAccepted);
+        }
+        pool.clear();
+    }
+}
+
+// The same transactions in one AcceptToMemoryPoolBatch call, which verifies
+// their scripts on the script check threads.
+static void MempoolAcceptBatch(benchmark::State& state)
+{
+    MempoolAcceptBenchSetup setup;
+    CTxMemPool pool(CFeeRate(0));
+
+    LOCK(cs_main);
+    while (state.KeepRunning()) {
+        std::vector<CValidationState> vState;
+        std::vector<bool> vAccepted, vMissingInputs;
+        AcceptToMemoryPoolBatch(pool, setup.vtx, false, vState, vAccepted, vMissingInputs);
+        assert(pool.size() == setup.vtx.size());
+        pool.clear();
+    }
+}
+
+BENCHMARK(MempoolAcceptSerial);
+BENCHMARK(MempoolAcceptBatch);
@@ -0,0 +1,55 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+#include "arith_uint256.h"
+#include "primitives/transaction.h"
+#include "txmempool.h"
+
+#include <vector>
+
+#include <boost/foreach.hpp>
+
+static const int MEMPOOL_FILL_TX = 5000;
+
+// Independent two-in two-out P2PKH transactions, the bulk of a busy mempool
+static std::vector<CTransaction> CreateIndependentTxs(int nCount)
+{
+    std::vector<CTransaction> vTx;
+    for (int i = 0; i < nCount; i++) {
+        CMutableTransaction tx;
+        tx.vin.resize(2);
+        for (int j = 0; j < 2; j++) {
+            tx.vin[j].prevout = COutPoint(ArithToUint256(arith_uint256(i + 1)), j);
+            tx.vin[j].scriptSig = CScript() << std::vector<unsigned char>(72) << std::vector<unsigned char>(33);
+        }
+        tx.vout.resize(2);
+        for (int j = 0; j < 2; j++) {
+            tx.vout[j].scriptPubKey = CScript() << OP_DUP << OP_HASH160 << std::vector<unsigned char>(20) << OP_EQUALVERIFY << OP_CHECKSIG;
+            tx.vout[j].nValue = COIN;
+        }
+        vTx.push_back(tx);
+    }
+    return vTx;
+}
+
+// Fill an empty mempool and clear it again. The memory used by the full pool
+// is what -maxmempool is compared against.
+static void MempoolFill(benchmark::State& state)
+{
+    CTxMemPool pool(CFeeRate(0));
+    std::vector<CTransaction> vTx = CreateIndependentTxs(MEMPOOL_FILL_TX);
+    std::vector<CTxMemPoolEntry> vEntries;
+    BOOST_FOREACH(const CTransaction& tx, vTx)
+        vEntries.push_back(CTxMemPoolEntry(tx, 1000, 0, 0.0, 1, true, 0, false, 2, LockPoints()));
+
+    LOCK(pool.cs);
+    while (state.KeepRunning()) {
+        BOOST_FOREACH(const CTxMemPoolEntry& entry, vEntries)
+            pool.addUnchecked(entry.GetTx().GetHash(), entry);
+        pool.clear();
+    }
+}
+
+BENCHMARK(MempoolFill);
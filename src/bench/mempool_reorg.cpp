@@ -0,0 +1,90 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+#include "arith_uint256.h"
+#include "primitives/transaction.h"
+#include "txmempool.h"
+
+#include <list>
+#include <vector>
+
+#include <boost/foreach.hpp>
+
+static const int MEMPOOL_BENCH_BLOCK_TX = 100;
+static const int MEMPOOL_BENCH_CHAIN_TX = 500;
+
+// A chain of P2PKH-sized transactions, each spending the previous one
+static std::vector<CTransaction> CreateChain(int nLength)
+{
+    std::vector<CTransaction> vChain;
+    COutPoint prevout(ArithToUint256(arith_uint256(1)), 0);
+    for (int i = 0; i < nLength; i++) {
+        CMutableTransaction tx;
+        tx.vin.resize(1);
+        tx.vin[0].prevout = prevout;
+        tx.vin[0].scriptSig = CScript() << std::vector<unsigned char>(72) << std::vector<unsigned char>(33);
+        tx.vout.resize(1);
+        tx.vout[0].scriptPubKey = CScript() << OP_DUP << OP_HASH160 << std::vector<unsigned char>(20) << OP_EQUALVERIFY << OP_CHECKSIG;
+        tx.vout[0].nValue = COIN;
+        vChain.push_back(tx);
+        prevout = COutPoint(tx.GetHash(), 0);
+    }
+    return vChain;
+}
+
+static void AddTx(CTxMemPool& pool, const CTransaction& tx)
+{
+    pool.addUnchecked(tx.GetHash(), CTxMemPoolEntry(tx, 1000, 0, 0.0, 1, false, 0, false, 1, LockPoints()));
+}
+
+// Add a transaction to the end of a deep in-mempool chain and take it out
+// again, which walks (and updates) every ancestor.
+static void MempoolDeepChainAccept(benchmark::State& state)
+{
+    CTxMemPool pool(CFeeRate(0));
+    std::vector<CTransaction> vChain = CreateChain(MEMPOOL_BENCH_CHAIN_TX + 1);
+    LOCK(pool.cs);
+    for (int i = 0; i < MEMPOOL_BENCH_CHAIN_TX; i++)
+        AddTx(pool, vChain[i]);
+
+    const CTransaction& tx = vChain.back();
+    std::list<CTransaction> removed;
+    while (state.KeepRunning()) {
+        AddTx(pool, tx);
+        pool.remove(tx, removed, false);
+        removed.clear();
+    }
+}
+
+// Mine the first MEMPOOL_BENCH_BLOCK_TX transactions of a chain and reorg
+// them back into the mempool, as ConnectTip and DisconnectTip do. Every
+// re-added transaction has all of the rest of the chain as descendants.
+static void MempoolReorgChain(benchmark::State& state)
+{
+    CTxMemPool pool(CFeeRate(0));
+    std::vector<CTransaction> vChain = CreateChain(MEMPOOL_BENCH_BLOCK_TX + MEMPOOL_BENCH_CHAIN_TX);
+    std::vector<CTransaction> vBlock(vChain.begin(), vChain.begin() + MEMPOOL_BENCH_BLOCK_TX);
+    std::vector<uint256> vHashUpdate;
+    BOOST_FOREACH(const CTransaction& tx, vBlock)
+        vHashUpdate.push_back(tx.GetHash());
+
+    LOCK(pool.cs);
+    BOOST_FOREACH(const CTransaction& tx, vChain)
+        AddTx(pool, tx);
+
+    std::list<CTransaction> conflicts;
+    unsigned int nHeight = 1;
+    while (state.KeepRunning()) {
+        pool.removeForBlock(vBlock, nHeight++, conflicts, false);
+        assert(pool.size() == (unsigned long)MEMPOOL_BENCH_CHAIN_TX);
+        BOOST_FOREACH(const CTransaction& tx, vBlock)
+            AddTx(pool, tx);
+        pool.UpdateTransactionsFromBlock(vHashUpdate);
+        assert(pool.mapTx.find(vChain.back().GetHash())->GetCountWithAncestors() == vChain.size());
+    }
+}
+
+BENCHMARK(MempoolDeepChainAccept);
+BENCHMARK(MempoolReorgChain);
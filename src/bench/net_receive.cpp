@@ -0,0 +1,111 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+#include "chainparams.h"
+#include "hash.h"
+#include "net.h"
+#include "protocol.h"
+#include "random.h"
+#include "util.h"
+
+#include <iostream>
+
+// Number of messages in the replayed trace
+static const int NET_RECEIVE_BENCH_MESSAGES = 5000;
+
+static void AppendMessage(std::vector<char>& vTrace, const char* pszCommand, unsigned int nSize)
+{
+    std::vector<unsigned char> vPayload(nSize);
+    for (unsigned int i = 0; i < nSize; i++)
+        vPayload[i] = insecure_rand() & 0xff;
+
+    CMessageHeader hdr(Params().MessageStart(), pszCommand, nSize);
+    uint256 hash = Hash(vPayload.begin(), vPayload.end());
+    memcpy(&hdr.nChecksum, hash.begin(), CMessageHeader::CHECKSUM_SIZE);
+
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << hdr;
+    vTrace.insert(vTrace.end(), ss.begin(), ss.end());
+    vTrace.insert(vTrace.end(), vPayload.begin(), vPayload.end());
+}
+
+// Traffic with the mix of a mainnet peer: mostly invs and transactions,
+// some masternode messages and pings, and every now and then a block.
+static void BuildTrace(std::vector<char>& vTrace)
+{
+    seed_insecure_rand(true);
+    for (int i = 0; i < NET_RECEIVE_BENCH_MESSAGES; i++) {
+        unsigned int n = insecure_rand() % 100;
+        if (n < 45)
+            AppendMessage(vTrace, NetMsgType::INV, 1 + 36 * (1 + insecure_rand() % 35));
+        else if (n < 80)
+            AppendMessage(vTrace, NetMsgType::TX, 190 + insecure_rand() % 800);
+        else if (n < 90)
+            AppendMessage(vTrace, NetMsgType::MNPING, 200 + insecure_rand() % 40);
+        else if (n < 95)
+            AppendMessage(vTrace, NetMsgType::GETDATA, 1 + 36 * (1 + insecure_rand() % 10));
+        else if (n < 99)
+            AppendMessage(vTrace, NetMsgType::PING, 8);
+        else
+            AppendMessage(vTrace, NetMsgType::BLOCK, 20000 + insecure_rand() % 400000);
+    }
+}
+
+// Replay a recorded byte stream through the receive path as the socket
+// handler would, reading chunks of typical recv() sizes, and consume the
+// messages as ProcessMessages would. Reports how many payload buffers
+// had to be allocated.
+static void NetReceiveReplay(benchmark::State& state)
+{
+    SelectParams(CBaseChainParams::MAIN);
+
+    std::vector<char> vTrace;
+    BuildTrace(vTrace);
+
+    CAddress addr(CService("1.2.3.4", 1), NODE_NONE);
+    CNode node(INVALID_SOCKET, addr, "", true);
+    node.nVersion = 1;
+
+    const unsigned int vChunkSizes[] = {1448, 2896, 8192, 16384, 65536};
+    uint64_t nAllocsStart = recvBufferPool.nAllocs, nReusesStart = recvBufferPool.nReuses;
+    int64_t nReplays = 0, nMessages = 0;
+
+    while (state.KeepRunning()) {
+        LOCK(node.cs_vRecvMsg);
+        size_t nPos = 0;
+        unsigned int nChunk = 0;
+        while (nPos < vTrace.size()) {
+            unsigned int nBytes = std::min((size_t)vChunkSizes[nChunk++ % 5], vTrace.size() - nPos);
+            unsigned int nSpace = 0;
+            char *pchInPlace = node.GetReceiveBuffer(nSpace);
+            if (pchInPlace) {
+                nBytes = std::min(nBytes, nSpace);
+                memcpy(pchInPlace, &vTrace[nPos], nBytes);
+                node.ReceivedInPlace(nBytes);
+            } else {
+                bool fOk = node.ReceiveMsgBytes(&vTrace[nPos], nBytes);
+                assert(fOk);
+            }
+            nPos += nBytes;
+
+            std::deque<CNetMessage>::iterator it = node.vRecvMsg.begin();
+            while (it != node.vRecvMsg.end() && it->complete()) {
+                assert(ReadLE32(it->GetMessageHash().begin()) == it->hdr.nChecksum);
+                ++it;
+                nMessages++;
+            }
+            node.PopRecvMsgs(it);
+        }
+        nReplays++;
+    }
+
+    if (nReplays > 0) {
+        std::cerr << "NetReceiveReplay: " << nMessages / nReplays << " messages, "
+                  << (recvBufferPool.nAllocs - nAllocsStart) / nReplays << " buffer allocations, "
+                  << (recvBufferPool.nReuses - nReusesStart) / nReplays << " buffers reused per replay\n";
+    }
+}
+
+BENCHMARK(NetReceiveReplay);
@@ -0,0 +1,153 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+#include "chainparams.h"
+#include "net.h"
+#include "netbase.h"
+#include "protocol.h"
+#include "random.h"
+#include "util.h"
+
+#include <iostream>
+
+#include <boost/foreach.hpp>
+
+// Number of loopback connections written to each round
+static const int NET_SEND_BENCH_PEERS = 100;
+
+// A listening socket on 127.0.0.1 and NET_SEND_BENCH_PEERS connections to it.
+// Our side of every connection is wrapped in an inbound CNode, the other side
+// only drains what we send.
+class LoopbackPeers
+{
+public:
+    SOCKET hListen;
+    std::vector<SOCKET> vClients;
+    std::vector<CNode*> vNodes;
+
+    LoopbackPeers()
+    {
+        hListen = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+        assert(hListen != INVALID_SOCKET);
+        struct sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        addr.sin_port = 0;
+        socklen_t len = sizeof(addr);
+        bool fOk = bind(hListen, (struct sockaddr*)&addr, sizeof(addr)) != SOCKET_ERROR &&
+                   listen(hListen, NET_SEND_BENCH_PEERS) != SOCKET_ERROR &&
+                   getsockname(hListen, (struct sockaddr*)&addr, &len) != SOCKET_ERROR;
+        assert(fOk);
+
+        for (int i = 0; i < NET_SEND_BENCH_PEERS; i++) {
+            SOCKET hClient = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+            fOk = connect(hClient, (struct sockaddr*)&addr, sizeof(addr)) != SOCKET_ERROR;
+            assert(fOk);
+            SOCKET hServer = accept(hListen, NULL, NULL);
+            assert(hServer != INVALID_SOCKET);
+            SetSocketNonBlocking(hClient, true);
+            SetSocketNonBlocking(hServer, true);
+            vClients.push_back(hClient);
+            vNodes.push_back(new CNode(hServer, CAddress(CService("127.0.0.1", 1 + i), NODE_NONE), "", true));
+        }
+    }
+
+    ~LoopbackPeers()
+    {
+        BOOST_FOREACH(CNode* pnode, vNodes)
+            delete pnode;
+        BOOST_FOREACH(SOCKET& hClient, vClients)
+            CloseSocket(hClient);
+        CloseSocket(hListen);
+    }
+
+    // Write and read until every node has sent everything it queued
+    void Flush()
+    {
+        static char buf[65536];
+        bool fPending = true;
+        while (fPending) {
+            fPending = false;
+            for (size_t i = 0; i < vNodes.size(); i++) {
+                while (recv(vClients[i], buf, sizeof(buf), 0) > 0) {}
+                LOCK(vNodes[i]->cs_vSend);
+                ReadZeroCopyCompletions(vNodes[i]);
+                if (vNodes[i]->nSendSize > 0) {
+                    SocketSendData(vNodes[i]);
+                    fPending = true;
+                }
+            }
+        }
+    }
+};
+
+// Every round each peer gets what a masternode relays to it between two
+// SendMessages calls: an inv, masternode pings and InstantSend votes, and
+// every tenth round a block. With fCorked the messages are queued as
+// ThreadMessageHandler queues them and then written together, otherwise
+// every message is written as soon as it is pushed.
+static void NetSendLoopback(benchmark::State& state, bool fCorked)
+{
+    SelectParams(CBaseChainParams::MAIN);
+
+    std::vector<CInv> vInv;
+    for (int i = 0; i < 20; i++)
+        vInv.push_back(CInv(MSG_TX, GetRandHash()));
+    std::vector<unsigned char> vPing(210, 0x5a);
+    std::vector<unsigned char> vVote(180, 0xa5);
+    std::vector<unsigned char> vBlock(250000, 0x42);
+
+    LoopbackPeers peers;
+    CSocketLoopStats statsStart;
+    GetSocketLoopStats(statsStart);
+    uint64_t nAllocsStart = sendBufferPool.nAllocs, nReusesStart = sendBufferPool.nReuses;
+    int64_t nRounds = 0;
+
+    while (state.KeepRunning()) {
+        BOOST_FOREACH(CNode* pnode, peers.vNodes) {
+            LOCK(pnode->cs_vSend);
+            bool fWasEmpty = pnode->nSendSize == 0;
+            pnode->fSendCorked = fCorked;
+            pnode->PushMessage(NetMsgType::INV, vInv);
+            for (int i = 0; i < 10; i++) {
+                pnode->PushMessage(NetMsgType::MNPING, vPing);
+                pnode->PushMessage(NetMsgType::TXLOCKVOTE, vVote);
+            }
+            if (nRounds % 10 == 0)
+                pnode->PushMessage(NetMsgType::BLOCK, vBlock);
+            pnode->fSendCorked = false;
+            if (fWasEmpty && pnode->nSendSize > 0)
+                SocketSendData(pnode);
+        }
+        peers.Flush();
+        nRounds++;
+    }
+
+    if (nRounds > 0) {
+        CSocketLoopStats stats;
+        GetSocketLoopStats(stats);
+        uint64_t nCalls = stats.nSendCalls - statsStart.nSendCalls;
+        uint64_t nMsgs = stats.nSendMsgs - statsStart.nSendMsgs;
+        std::cerr << "NetSendLoopback" << (fCorked ? "Batched" : "Unbatched") << ": "
+                  << nMsgs / nRounds << " messages in " << nCalls / nRounds << " writes ("
+                  << (stats.nZeroCopySends - statsStart.nZeroCopySends) / nRounds << " zerocopy), "
+                  << (sendBufferPool.nAllocs - nAllocsStart) / nRounds << " buffer allocations, "
+                  << (sendBufferPool.nReuses - nReusesStart) / nRounds << " buffers reused per round\n";
+    }
+}
+
+static void NetSendLoopbackBatched(benchmark::State& state)
+{
+    NetSendLoopback(state, true);
+}
+
+static void NetSendLoopbackUnbatched(benchmark::State& state)
+{
+    NetSendLoopback(state, false);
+}
+
+BENCHMARK(NetSendLoopbackBatched);
+BENCHMARK(NetSendLoopbackUnbatched);
@@ -0,0 +1,85 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+#include "policy/fees.h"
+#include "random.h"
+#include "txmempool.h"
+
+#include <map>
+#include <math.h>
+#include <vector>
+
+#include <boost/foreach.hpp>
+
+static const int POLICY_BENCH_BLOCKS = 500;
+static const int POLICY_BENCH_BLOCK_TX = 100;
+
+// What the estimator saw while one block was being mined: the transactions
+// entering the mempool and then the ones in the block.
+struct PolicyBenchBlock
+{
+    std::vector<CTxMemPoolEntry> vArrived;
+    std::vector<CTxMemPoolEntry> vMined;
+};
+
+// A reproducible stream of mempool and block events. Every block
+// POLICY_BENCH_BLOCK_TX transactions arrive, with feerates spread over eight
+// doublings, and the miner takes the best paying ones that fit into a block
+// of between half and one and a half times that.
+static std::vector<PolicyBenchBlock> CreateEventStream()
+{
+    seed_insecure_rand(true);
+    std::vector<PolicyBenchBlock> vBlocks(POLICY_BENCH_BLOCKS);
+    // All transactions have the same size, so fee order is feerate order
+    std::multimap<CAmount, CTxMemPoolEntry> mapWaiting;
+    CMutableTransaction tx;
+    tx.vin.resize(1);
+    tx.vout.resize(1);
+    tx.vout[0].nValue = 0;
+    for (int nHeight = 0; nHeight < POLICY_BENCH_BLOCKS; nHeight++) {
+        PolicyBenchBlock& block = vBlocks[nHeight];
+        for (int i = 0; i < POLICY_BENCH_BLOCK_TX; i++) {
+            tx.vin[0].prevout.n = nHeight * POLICY_BENCH_BLOCK_TX + i;
+            CAmount nFee = 1000 * pow(2, (insecure_rand() % 800) / 100.0);
+            CTxMemPoolEntry entry(tx, nFee, 0, 0.0, nHeight, true, 0, false, 1, LockPoints());
+            block.vArrived.push_back(entry);
+            mapWaiting.insert(std::make_pair(nFee, entry));
+        }
+
+        int nBlockTx = POLICY_BENCH_BLOCK_TX / 2 + insecure_rand() % POLICY_BENCH_BLOCK_TX;
+        while (nBlockTx-- > 0 && !mapWaiting.empty()) {
+            std::multimap<CAmount, CTxMemPoolEntry>::iterator it = --mapWaiting.end();
+            block.vMined.push_back(it->second);
+            mapWaiting.erase(it);
+        }
+    }
+    return vBlocks;
+}
+
+// Replay the event stream into a fresh estimator, asking for the estimates
+// wallets typically ask for after every block.
+static void PolicyEstimatorReplay(benchmark::State& state)
+{
+    std::vector<PolicyBenchBlock> vBlocks = CreateEventStream();
+    CTxMemPool pool(CFeeRate(1000));
+
+    while (state.KeepRunning()) {
+        CBlockPolicyEstimator estimator(CFeeRate(1000));
+        for (unsigned int i = 0; i < vBlocks.size(); i++) {
+            BOOST_FOREACH(const CTxMemPoolEntry& entry, vBlocks[i].vArrived)
+                estimator.processTransaction(entry, true);
+            BOOST_FOREACH(const CTxMemPoolEntry& entry, vBlocks[i].vMined)
+                estimator.removeTx(entry.GetTx().GetHash());
+            estimator.processBlock(i + 1, vBlocks[i].vMined, true);
+
+            estimator.estimateSmartFee(2, NULL, pool);
+            estimator.estimateSmartFee(6, NULL, pool);
+            estimator.estimateSmartFee(24, NULL, pool);
+            estimator.estimateSmartFee(144, NULL, pool);
+        }
+    }
+}
+
+BENCHMARK(PolicyEstimatorReplay);
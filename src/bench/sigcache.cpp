@@ -0,0 +1,70 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+#include "key.h"
+#include "main.h"
+#include "primitives/transaction.h"
+#include "pubkey.h"
+#include "random.h"
+#include "script/sigcache.h"
+#include "util.h"
+
+#include <boost/bind.hpp>
+#include <boost/thread.hpp>
+
+static const int SIGCACHE_BENCH_SIGNATURES = 1000;
+static const int SIGCACHE_BENCH_LOOKUPS = 2000;
+
+struct SigCacheBenchEntry
+{
+    uint256 hash;
+    CPubKey pubkey;
+    std::vector<unsigned char> vchSig;
+};
+
+static void LookupSignatures(const std::vector<SigCacheBenchEntry>* pentries, int nOffset)
+{
+    CTransaction txDummy;
+    CachingTransactionSignatureChecker checker(&txDummy, 0, true);
+    for (int i = 0; i < SIGCACHE_BENCH_LOOKUPS; i++) {
+        const SigCacheBenchEntry& entry = (*pentries)[(nOffset + i) % pentries->size()];
+        assert(checker.VerifySignature(entry.vchSig, entry.pubkey, entry.hash));
+    }
+}
+
+// Cached signature lookups from as many threads as -par script check threads
+// would use, as when script checks and mempool acceptance run concurrently.
+static void SigCacheContention(benchmark::State& state)
+{
+    ECCVerifyHandle verifyHandle;
+    InitSignatureCache();
+
+    std::vector<SigCacheBenchEntry> entries(SIGCACHE_BENCH_SIGNATURES);
+    CTransaction txDummy;
+    CachingTransactionSignatureChecker checker(&txDummy, 0, true);
+    for (int i = 0; i < SIGCACHE_BENCH_SIGNATURES; i++) {
+        CKey key;
+        key.MakeNewKey(true);
+        entries[i].hash = GetRandHash();
+        entries[i].pubkey = key.GetPubKey();
+        assert(key.Sign(entries[i].hash, entries[i].vchSig));
+        // Populate the cache
+        assert(checker.VerifySignature(entries[i].vchSig, entries[i].pubkey, entries[i].hash));
+    }
+
+    int nThreads = GetArg("-par", DEFAULT_SCRIPTCHECK_THREADS);
+    if (nThreads <= 0)
+        nThreads += GetNumCores();
+    nThreads = std::max(1, std::min(nThreads, MAX_SCRIPTCHECK_THREADS));
+
+    while (state.KeepRunning()) {
+        boost::thread_group threadGroup;
+        for (int i = 0; i < nThreads; i++)
+            threadGroup.create_thread(boost::bind(&LookupSignatures, &entries, i * SIGCACHE_BENCH_SIGNATURES / nThreads));
+        threadGroup.join_all();
+    }
+}
+
+BENCHMARK(SigCacheContention);
@@ -0,0 +1,57 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+#include "primitives/transaction.h"
+#include "random.h"
+#include "script/interpreter.h"
+#include "script/script.h"
+
+static const int SIGHASH_BENCH_INPUTS = 1000;
+
+// A consolidation-style transaction: many inputs with P2PKH-sized scriptSigs
+static CTransaction MakeManyInputsTransaction(CScript& scriptCode)
+{
+    scriptCode = CScript() << OP_DUP << OP_HASH160 << std::vector<unsigned char>(20, 0x01) << OP_EQUALVERIFY << OP_CHECKSIG;
+    CMutableTransaction tx;
+    tx.vin.resize(SIGHASH_BENCH_INPUTS);
+    for (int i = 0; i < SIGHASH_BENCH_INPUTS; i++) {
+        tx.vin[i].prevout = COutPoint(GetRandHash(), i);
+        tx.vin[i].scriptSig = CScript() << std::vector<unsigned char>(72, 0x02) << std::vector<unsigned char>(33, 0x03);
+    }
+    tx.vout.resize(2);
+    tx.vout[0].nValue = 1000;
+    tx.vout[0].scriptPubKey = scriptCode;
+    tx.vout[1].nValue = 2000;
+    tx.vout[1].scriptPubKey = scriptCode;
+    return tx;
+}
+
+// Signature hashes of all inputs of a 1,000-input transaction, serializing
+// the whole transaction for each of them
+static void SignatureHashManyInputs(benchmark::State& state)
+{
+    CScript scriptCode;
+    CTransaction tx = MakeManyInputsTransaction(scriptCode);
+    while (state.KeepRunning()) {
+        for (int i = 0; i < SIGHASH_BENCH_INPUTS; i++)
+            SignatureHash(scriptCode, tx, i, SIGHASH_ALL);
+    }
+}
+
+// Same, reusing PrecomputedTransactionData (built once per iteration, as
+// CheckInputs does per transaction)
+static void SignatureHashManyInputsPrecomputed(benchmark::State& state)
+{
+    CScript scriptCode;
+    CTransaction tx = MakeManyInputsTransaction(scriptCode);
+    while (state.KeepRunning()) {
+        PrecomputedTransactionData txdata(tx);
+        for (int i = 0; i < SIGHASH_BENCH_INPUTS; i++)
+            SignatureHash(scriptCode, tx, i, SIGHASH_ALL, &txdata);
+    }
+}
+
+BENCHMARK(SignatureHashManyInputs);
+BENCHMARK(SignatureHashManyInputsPrecomputed);
@@ -6,9 +6,12 @@
 #define BITCOIN_CHECKQUEUE_H
 
 #include <algorithm>
+#include <atomic>
+#include <deque>
 #include <vector>
 
 #include <boost/foreach.hpp>
+#include <boost/scoped_array.hpp>
 #include <boost/thread/condition_variable.hpp>
 #include <boost/thread/locks.hpp>
 #include <boost/thread/mutex.hpp>
@@ -25,13 +28,36 @@ class CCheckQueueControl;
   * onto the queue, where they are processed by N-1 worker threads. When
   * the master is done adding work, it temporarily joins the worker pool
   * as an N'th worker, until all jobs are done.
+  *
+  * Queued verifications are spread over per-worker lanes, each with its own
+  * lock: a worker takes batches from the back of its own lane and, when that
+  * is empty, steals from the front of the others. Batches shrink as the
+  * queue drains so all workers finish at about the same time. Workers only
+  * touch the shared sleep mutex when they run out of work, and Add() only
+  * wakes workers that are actually idle, so the master can keep adding the
+  * checks of the next transactions while earlier ones are being verified.
   */
 template <typename T>
 class CCheckQueue
 {
 private:
-    //! Mutex to protect the inner state
-    boost::mutex mutex;
+    struct Lane {
+        //! Protects checks
+        boost::mutex mutex;
+        //! The owner pops from the back (most recently added), thieves from the front.
+        std::deque<T> checks;
+        //! Size of checks, readable without taking the lock
+        std::atomic<size_t> nSize;
+
+        Lane() : nSize(0) {}
+    };
+
+    //! The lanes; worker i owns lane i % nLanes.
+    boost::scoped_array<Lane> lanes;
+    const unsigned int nLanes;
+
+    //! Mutex that idle workers and the waiting master sleep on
+    boost::mutex mutexSleep;
 
     //! Worker threads block on this when out of work
     boost::condition_variable condWorker;
@@ -39,96 +65,128 @@ private:
     //! Master thread blocks on this when out of work
     boost::condition_variable condMaster;
 
-    //! The queue of elements to be processed.
-    //! As the order of booleans doesn't matter, it is used as a LIFO (stack)
-    std::vector<T> queue;
+    //! The number of worker threads that have started.
+    std::atomic<unsigned int> nWorkers;
 
-    //! The number of workers (including the master) that are idle.
-    int nIdle;
+    //! The number of workers (excluding the master) that are idle.
+    std::atomic<int> nIdle;
 
     //! The total number of workers (including the master).
-    int nTotal;
+    std::atomic<int> nTotal;
 
     //! The temporary evaluation result.
-    bool fAllOk;
+    std::atomic<bool> fAllOk;
+
+    //! Number of verifications sitting in the lanes.
+    std::atomic<unsigned int> nQueued;
 
     /**
      * Number of verifications that haven't completed yet.
      * This includes elements that are no longer queued, but still in the
      * worker's own batches.
      */
-    unsigned int nTodo;
+    std::atomic<unsigned int> nTodo;
 
-    //! Whether we're shutting down.
-    bool fQuit;
+    //! The lane the next Add() starts filling. Only used by the master.
+    unsigned int nNextLane;
 
     //! The maximum number of elements to be processed in one batch
     unsigned int nBatchSize;
 
+    /**
+     * Move a batch of checks into vChecks, from lane nHome if it has any,
+     * stolen from another lane otherwise. Returns false if all lanes are empty.
+     */
+    bool Take(unsigned int nHome, std::vector<T>& vChecks)
+    {
+        for (unsigned int i = 0; i < nLanes; i++) {
+            Lane& lane = lanes[(nHome + i) % nLanes];
+            if (lane.nSize == 0)
+                continue;
+            boost::unique_lock<boost::mutex> lock(lane.mutex);
+            size_t nSize = lane.checks.size();
+            if (nSize == 0)
+                continue;
+            // Decide how many work units to process now.
+            // * Do not try to do everything at once, but aim for increasingly smaller batches so
+            //   all workers finish approximately simultaneously.
+            // * Don't do batches smaller than 1 (duh), or larger than nBatchSize.
+            // * Leave at least half of another worker's lane to its owner.
+            unsigned int nNow = std::max(1U, std::min(nBatchSize, nQueued / (2 * std::max(1, (int)nTotal))));
+            nNow = std::min(nNow, (unsigned int)(i == 0 ? nSize : (nSize + 1) / 2));
+            vChecks.resize(nNow);
+            for (unsigned int j = 0; j < nNow; j++) {
+                // Swap jobs from the lane to the local batch vector instead of copying.
+                if (i == 0) {
+                    vChecks[j].swap(lane.checks.back());
+                    lane.checks.pop_back();
+                } else {
+                    vChecks[j].swap(lane.checks.front());
+                    lane.checks.pop_front();
+                }
+            }
+            lane.nSize = lane.checks.size();
+            nQueued -= nNow;
+            return true;
+        }
+        return false;
+    }
+
     /** Internal function that does bulk of the verification work. */
     bool Loop(bool fMaster = false)
     {
-        boost::condition_variable& cond = fMaster ? condMaster : condWorker;
+        unsigned int nHome = fMaster ? 0 : nWorkers++ % nLanes;
         std::vector<T> vChecks;
         vChecks.reserve(nBatchSize);
-        unsigned int nNow = 0;
-        bool fOk = true;
+        nTotal++;
         do {
-            {
-                boost::unique_lock<boost::mutex> lock(mutex);
-                // first do the clean-up of the previous loop run (allowing us to do it in the same critsect)
-                if (nNow) {
-                    fAllOk &= fOk;
-                    nTodo -= nNow;
-                    if (nTodo == 0 && !fMaster)
-                        // We processed the last element; inform the master it can exit and return the result
-                        condMaster.notify_one();
-                } else {
-                    // first iteration
-                    nTotal++;
-                }
-                // logically, the do loop starts here
-                while (queue.empty()) {
-                    if ((fMaster || fQuit) && nTodo == 0) {
-                        nTotal--;
-                        bool fRet = fAllOk;
-                        // reset the status for new work later
-                        if (fMaster)
-                            fAllOk = true;
-                        // return the current status
-                        return fRet;
-                    }
-                    nIdle++;
-                    cond.wait(lock); // wait
-                    nIdle--;
+            if (Take(nHome, vChecks)) {
+                // Once a check failed there is no need to run the others
+                bool fOk = fAllOk;
+                BOOST_FOREACH (T& check, vChecks)
+                    if (fOk)
+                        fOk = check();
+                if (!fOk)
+                    fAllOk = false;
+                unsigned int nNow = vChecks.size();
+                vChecks.clear();
+                if (nTodo.fetch_sub(nNow) == nNow && !fMaster) {
+                    // We processed the last element; inform the master it can exit and return the result
+                    boost::unique_lock<boost::mutex> lock(mutexSleep);
+                    condMaster.notify_one();
                 }
-                // Decide how many work units to process now.
-                // * Do not try to do everything at once, but aim for increasingly smaller batches so
-                //   all workers finish approximately simultaneously.
-                // * Try to account for idle jobs which will instantly start helping.
-                // * Don't do batches smaller than 1 (duh), or larger than nBatchSize.
-                nNow = std::max(1U, std::min(nBatchSize, (unsigned int)queue.size() / (nTotal + nIdle + 1)));
-                vChecks.resize(nNow);
-                for (unsigned int i = 0; i < nNow; i++) {
-                    // We want the lock on the mutex to be as short as possible, so swap jobs from the global
-                    // queue to the local batch vector instead of copying.
-                    vChecks[i].swap(queue.back());
-                    queue.pop_back();
+                continue;
+            }
+
+            boost::unique_lock<boost::mutex> lock(mutexSleep);
+            if (fMaster) {
+                if (nQueued > 0)
+                    continue;
+                if (nTodo == 0) {
+                    nTotal--;
+                    bool fRet = fAllOk;
+                    // reset the status for new work later
+                    fAllOk = true;
+                    // return the current status
+                    return fRet;
                 }
-                // Check whether we need to do work at all
-                fOk = fAllOk;
+                condMaster.wait(lock); // wait
+            } else {
+                // Announce we are about to sleep before checking for work, so
+                // that Add() either sees us idle or we see its checks.
+                nIdle++;
+                if (nQueued == 0)
+                    condWorker.wait(lock); // wait
+                nIdle--;
             }
-            // execute work
-            BOOST_FOREACH (T& check, vChecks)
-                if (fOk)
-                    fOk = check();
-            vChecks.clear();
         } while (true);
     }
 
 public:
     //! Create a new check queue
-    CCheckQueue(unsigned int nBatchSizeIn) : nIdle(0), nTotal(0), fAllOk(true), nTodo(0), fQuit(false), nBatchSize(nBatchSizeIn) {}
+    CCheckQueue(unsigned int nBatchSizeIn, unsigned int nLanesIn = 16) :
+        lanes(new Lane[nLanesIn]), nLanes(nLanesIn), nWorkers(0), nIdle(0), nTotal(0), fAllOk(true),
+        nQueued(0), nTodo(0), nNextLane(0), nBatchSize(nBatchSizeIn) {}
 
     //! Worker thread
     void Thread()
@@ -145,26 +203,43 @@ public:
     //! Add a batch of checks to the queue
     void Add(std::vector<T>& vChecks)
     {
-        boost::unique_lock<boost::mutex> lock(mutex);
-        BOOST_FOREACH (T& check, vChecks) {
-            queue.push_back(T());
-            check.swap(queue.back());
-        }
+        if (vChecks.empty())
+            return;
         nTodo += vChecks.size();
-        if (vChecks.size() == 1)
-            condWorker.notify_one();
-        else if (vChecks.size() > 1)
-            condWorker.notify_all();
+        // Spread the checks over the lanes of the running workers, in
+        // contiguous chunks; small batches go to a single lane.
+        unsigned int nActive = std::max(1U, std::min((unsigned int)nWorkers, nLanes));
+        unsigned int nChunks = std::min(nActive, (unsigned int)vChecks.size());
+        size_t nChunkSize = (vChecks.size() + nChunks - 1) / nChunks;
+        for (size_t nStart = 0; nStart < vChecks.size(); nStart += nChunkSize) {
+            size_t nEnd = std::min(vChecks.size(), nStart + nChunkSize);
+            Lane& lane = lanes[nNextLane++ % nActive];
+            boost::unique_lock<boost::mutex> lock(lane.mutex);
+            for (size_t i = nStart; i < nEnd; i++) {
+                lane.checks.push_back(T());
+                vChecks[i].swap(lane.checks.back());
+            }
+            lane.nSize = lane.checks.size();
+            nQueued += nEnd - nStart;
+        }
+        if (nIdle > 0) {
+            boost::unique_lock<boost::mutex> lock(mutexSleep);
+            if (vChecks.size() == 1)
+                condWorker.notify_one();
+            else
+                condWorker.notify_all();
+        }
     }
 
     ~CCheckQueue()
     {
     }
 
+    //! Whether no checks are outstanding, i.e. the queue can be used by a new master.
     bool IsIdle()
     {
-        boost::unique_lock<boost::mutex> lock(mutex);
-        return (nTotal == nIdle && nTodo == 0 && fAllOk == true);
+        boost::unique_lock<boost::mutex> lock(mutexSleep);
+        return (nTodo == 0 && fAllOk == true);
     }
 
 };
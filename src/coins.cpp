@@ -4,6 +4,9 @@
 
 #include "coins.h"
 
+#include "arith_uint256.h"
+#include "clientversion.h"
+#include "hash.h"
 #include "memusage.h"
 #include "random.h"
 
@@ -41,6 +44,61 @@ bool CCoins::Spend(uint32_t nPos)
     return true;
 }
 
+static arith_uint256 CoinsRecordHash(const uint256 &txid, const CCoins &coins)
+{
+    CHashWriter ss(SER_GETHASH, PROTOCOL_VERSION);
+    ss << txid << coins;
+    return UintToArith256(ss.GetHash());
+}
+
+void CCoinsStats::Add(const uint256 &txid, const CCoins &coins)
+{
+    if (coins.IsPruned())
+        return;
+    nTransactions++;
+    BOOST_FOREACH(const CTxOut &out, coins.vout) {
+        if (!out.IsNull()) {
+            nTransactionOutputs++;
+            nTotalAmount += out.nValue;
+        }
+    }
+    nSerializedSize += 32 + ::GetSerializeSize(coins, SER_DISK, CLIENT_VERSION);
+    hashSerialized = ArithToUint256(UintToArith256(hashSerialized) + CoinsRecordHash(txid, coins));
+}
+
+void CCoinsStats::Remove(const uint256 &txid, const CCoins &coins)
+{
+    if (coins.IsPruned())
+        return;
+    nTransactions--;
+    BOOST_FOREACH(const CTxOut &out, coins.vout) {
+        if (!out.IsNull()) {
+            nTransactionOutputs--;
+            nTotalAmount -= out.nValue;
+        }
+    }
+    nSerializedSize -= 32 + ::GetSerializeSize(coins, SER_DISK, CLIENT_VERSION);
+    hashSerialized = ArithToUint256(UintToArith256(hashSerialized) - CoinsRecordHash(txid, coins));
+}
+
+void CCoinsStats::Merge(const CCoinsStats &other)
+{
+    nTransactions += other.nTransactions;
+    nTransactionOutputs += other.nTransactionOutputs;
+    nSerializedSize += other.nSerializedSize;
+    nTotalAmount += other.nTotalAmount;
+    hashSerialized = ArithToUint256(UintToArith256(hashSerialized) + UintToArith256(other.hashSerialized));
+}
+
+bool CCoinsStats::SameTotals(const CCoinsStats &other) const
+{
+    return nTransactions == other.nTransactions &&
+           nTransactionOutputs == other.nTransactionOutputs &&
+           nSerializedSize == other.nSerializedSize &&
+           nTotalAmount == other.nTotalAmount &&
+           hashSerialized == other.hashSerialized;
+}
+
 bool CCoinsView::GetCoins(const uint256 &txid, CCoins &coins) const { return false; }
 bool CCoinsView::HaveCoins(const uint256 &txid) const { return false; }
 uint256 CCoinsView::GetBestBlock() const { return uint256(); }
@@ -297,6 +297,14 @@ struct CCoinsCacheEntry
 
 typedef boost::unordered_map<uint256, CCoinsCacheEntry, CCoinsKeyHasher> CCoinsMap;
 
+/**
+ * Statistics about a set of coins records. All fields except nHeight and
+ * hashBlock are sums over the records, so they can be maintained
+ * incrementally (Add/Remove) as blocks are connected and disconnected, and
+ * partial results of a parallel scan can be combined (Merge).
+ * hashSerialized is the sum modulo 2^256 of the hashes of the individual
+ * serialized records, which makes it independent of iteration order.
+ */
 struct CCoinsStats
 {
     int nHeight;
@@ -308,6 +316,27 @@ struct CCoinsStats
     CAmount nTotalAmount;
 
     CCoinsStats() : nHeight(0), nTransactions(0), nTransactionOutputs(0), nSerializedSize(0), nTotalAmount(0) {}
+
+    //! Account for the coins record of txid (pruned records are ignored)
+    void Add(const uint256 &txid, const CCoins &coins);
+    //! Undo a previous Add of the same record
+    void Remove(const uint256 &txid, const CCoins &coins);
+    //! Add the totals of a disjoint set of records
+    void Merge(const CCoinsStats &other);
+    //! Whether both describe the same set of records (ignores nHeight and hashBlock)
+    bool SameTotals(const CCoinsStats &other) const;
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion) {
+        READWRITE(hashBlock);
+        READWRITE(nTransactions);
+        READWRITE(nTransactionOutputs);
+        READWRITE(nSerializedSize);
+        READWRITE(hashSerialized);
+        READWRITE(nTotalAmount);
+    }
 };
 
 
@@ -36,6 +36,10 @@ static inline size_t RecursiveDynamicUsage(const CTransaction& tx) {
     return mem;
 }
 
+static inline size_t RecursiveDynamicUsage(const CTransactionRef& tx) {
+    return memusage::DynamicUsage(tx) + RecursiveDynamicUsage(*tx);
+}
+
 static inline size_t RecursiveDynamicUsage(const CMutableTransaction& tx) {
     size_t mem = memusage::DynamicUsage(tx.vin) + memusage::DynamicUsage(tx.vout);
     for (std::vector<CTxIn>::const_iterator it = tx.vin.begin(); it != tx.vin.end(); it++) {
@@ -175,6 +175,12 @@ void CGovernanceManager::ProcessMessage(CNode* pfrom, std::string& strCommand, C
             return;
         }
 
+        // Don't wait for cs_main just to find out we have it already
+        if(HaveObjectForHash(nHash)) {
+            LogPrint("gobject", "MNGOVERNANCEOBJECT -- Received already seen object: %s\n", strHash);
+            return;
+        }
+
         LOCK2(cs_main, cs);
 
         if(mapObjects.count(nHash) || mapPostponedObjects.count(nHash) ||
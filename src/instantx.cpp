@@ -523,7 +523,7 @@ bool CInstantSend::ResolveConflicts(const CTxLockCandidate& txLockCandidate, int
             return false; // can't/shouldn't do anything
         } else if (mempool.mapNextTx.count(txin.prevout)) {
             // check if it's in mempool
-            hashConflicting = mempool.mapNextTx[txin.prevout].ptx->GetHash();
+            hashConflicting = mempool.mapNextTx[txin.prevout]->GetHash();
             if(txHash == hashConflicting) continue; // matches current, not a conflict, skip to next txin
             // conflicting with tx in mempool
             fMempoolConflict = true;
@@ -541,7 +541,7 @@ bool CInstantSend::ResolveConflicts(const CTxLockCandidate& txLockCandidate, int
     if(fMempoolConflict) {
         std::list<CTransaction> removed;
         // remove every tx conflicting with current Transaction Lock Request
-        mempool.removeConflicts(txLockCandidate.txLockRequest, removed);
+        mempool.removeConflicts(txLockCandidate.txLockRequest, removed, REMOVAL_REPLACED);
         // and try to accept it in mempool again
         CValidationState state;
         bool fMissingInputs = false;
@@ -709,6 +709,15 @@ bool CInstantSend::GetTxLockRequest(const uint256& txHash, CTxLockRequest& txLoc
     return true;
 }
 
+void CInstantSend::GetTxLockRequests(std::vector<CTransactionRef>& vTxRet)
+{
+    LOCK(cs_instantsend);
+
+    std::map<uint256, CTxLockCandidate>::iterator it = mapTxLockCandidates.begin();
+    for(; it != mapTxLockCandidates.end(); ++it)
+        vTxRet.push_back(MakeTransactionRef(it->second.txLockRequest));
+}
+
 bool CInstantSend::GetTxLockVote(const uint256& hash, CTxLockVote& txLockVoteRet)
 {
     LOCK(cs_instantsend);
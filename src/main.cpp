@@ -10,12 +10,14 @@
 #include "addrman.h"
 #include "alert.h"
 #include "arith_uint256.h"
+#include "blockencodings.h"
 #include "chainparams.h"
 #include "checkpoints.h"
 #include "checkqueue.h"
 #include "consensus/consensus.h"
 #include "consensus/merkle.h"
 #include "consensus/validation.h"
+#include "crypto/sha256.h"
 #include "hash.h"
 #include "init.h"
 #include "merkleblock.h"
@@ -24,12 +26,14 @@
 #include "pow.h"
 #include "primitives/block.h"
 #include "primitives/transaction.h"
+#include "random.h"
 #include "script/script.h"
 #include "script/sigcache.h"
 #include "script/standard.h"
 #include "tinyformat.h"
 #include "txdb.h"
 #include "txmempool.h"
+#include "txorphanpool.h"
 #include "ui_interface.h"
 #include "undo.h"
 #include "util.h"
@@ -53,6 +57,8 @@
 #include <boost/filesystem/fstream.hpp>
 #include <boost/lexical_cast.hpp>
 #include <boost/math/distributions/poisson.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <boost/shared_ptr.hpp>
 #include <boost/thread.hpp>
 
 using namespace std;
@@ -97,14 +103,8 @@ CFeeRate minRelayTxFee = CFeeRate(DEFAULT_MIN_RELAY_TX_FEE);
 
 CTxMemPool mempool(::minRelayTxFee);
 
-struct COrphanTx {
-    CTransaction tx;
-    NodeId fromPeer;
-};
-map<uint256, COrphanTx> mapOrphanTransactions GUARDED_BY(cs_main);;
-map<uint256, set<uint256> > mapOrphanTransactionsByPrev GUARDED_BY(cs_main);;
+static CTxOrphanPool orphanpool;
 map<uint256, int64_t> mapRejectedBlocks GUARDED_BY(cs_main);
-void EraseOrphansFor(NodeId peer) EXCLUSIVE_LOCKS_REQUIRED(cs_main);
 
 /**
  * Returns true if there are nRequired or more blocks of minVersion or above
@@ -112,6 +112,10 @@ void EraseOrphansFor(NodeId peer) EXCLUSIVE_LOCKS_REQUIRED(cs_main);
  */
 static bool IsSuperMajority(int minVersion, const CBlockIndex* pstart, unsigned nRequired, const Consensus::Params& consensusParams);
 static void CheckBlockIndex(const Consensus::Params& consensusParams);
+static unsigned int GetBlockScriptFlags(const CBlockIndex* pindexPrev, int nVersion, int64_t nBlockTime, const Consensus::Params& consensusparams);
+
+/** Script checks of blocks being connected and of transactions being accepted by AcceptToMemoryPoolBatch */
+static CCheckQueue<CScriptCheck> scriptcheckqueue(128);
 
 /** Constant stuff for coinbase transactions we create: */
 CScript COINBASE_FLAGS;
@@ -209,9 +213,13 @@ namespace {
         uint256 hash;
         CBlockIndex* pindex;     //!< Optional.
         bool fValidatedHeaders;  //!< Whether this block has validated headers at the time of request.
+        boost::shared_ptr<PartiallyDownloadedBlock> partialBlock;  //!< Optional, used for CMPCTBLOCK downloads
     };
     map<uint256, pair<NodeId, list<QueuedBlock>::iterator> > mapBlocksInFlight;
 
+    /** Stack of nodes which we have set to announce using compact blocks */
+    list<NodeId> lNodesAnnouncingHeaderAndIDs;
+
     /** Number of preferable block download peers. */
     int nPreferredDownload = 0;
 
@@ -278,6 +286,20 @@ struct CNodeState {
     bool fPreferredDownload;
     //! Whether this peer wants invs or headers (when possible) for block announcements.
     bool fPreferHeaders;
+    //! Whether this peer wants invs or cmpctblocks (when possible) for block announcements.
+    bool fPreferHeaderAndIDs;
+    //! Whether this peer will send us cmpctblocks if we request them
+    bool fProvidesHeaderAndIDs;
+    //! Whether we asked this peer to announce new blocks with cmpctblocks
+    bool fRequestedHeaderAndIDs;
+    //! Compact blocks from this peer we tried to rebuild
+    int nCmpctBlocks;
+    //! ...of which all transactions were found locally
+    int nCmpctNoRoundTrip;
+    //! ...for which transactions had to be requested with getblocktxn
+    int nCmpctTxnRequested;
+    //! ...for which we fell back to downloading the full block
+    int nCmpctFallback;
 
     CNodeState() {
         fCurrentlyConnected = false;
@@ -294,6 +316,13 @@ struct CNodeState {
         nBlocksInFlightValidHeaders = 0;
         fPreferredDownload = false;
         fPreferHeaders = false;
+        fPreferHeaderAndIDs = false;
+        fProvidesHeaderAndIDs = false;
+        fRequestedHeaderAndIDs = false;
+        nCmpctBlocks = 0;
+        nCmpctNoRoundTrip = 0;
+        nCmpctTxnRequested = 0;
+        nCmpctFallback = 0;
     }
 };
 
@@ -345,10 +374,11 @@ void FinalizeNode(NodeId nodeid) {
     BOOST_FOREACH(const QueuedBlock& entry, state->vBlocksInFlight) {
         mapBlocksInFlight.erase(entry.hash);
     }
-    EraseOrphansFor(nodeid);
+    orphanpool.EraseForPeer(nodeid);
     nPreferredDownload -= state->fPreferredDownload;
     nPeersWithValidatedDownloads -= (state->nBlocksInFlightValidHeaders != 0);
     assert(nPeersWithValidatedDownloads >= 0);
+    lNodesAnnouncingHeaderAndIDs.remove(nodeid);
 
     mapNodeState.erase(nodeid);
 
@@ -385,14 +415,27 @@ bool MarkBlockAsReceived(const uint256& hash) {
 }
 
 // Requires cs_main.
-void MarkBlockAsInFlight(NodeId nodeid, const uint256& hash, const Consensus::Params& consensusParams, CBlockIndex *pindex = NULL) {
+// Returns false if the block was already in flight from the same peer.
+// With pit set, a PartiallyDownloadedBlock is attached to a new entry and
+// *pit points to the entry.
+bool MarkBlockAsInFlight(NodeId nodeid, const uint256& hash, const Consensus::Params& consensusParams, CBlockIndex *pindex = NULL, list<QueuedBlock>::iterator **pit = NULL) {
     CNodeState *state = State(nodeid);
     assert(state != NULL);
 
+    // Short-circuit most stuff in case its from the same node
+    map<uint256, pair<NodeId, list<QueuedBlock>::iterator> >::iterator itInFlight = mapBlocksInFlight.find(hash);
+    if (itInFlight != mapBlocksInFlight.end() && itInFlight->second.first == nodeid) {
+        if (pit)
+            *pit = &itInFlight->second.second;
+        return false;
+    }
+
     // Make sure it's not listed somewhere already.
     MarkBlockAsReceived(hash);
 
-    QueuedBlock newentry = {hash, pindex, pindex != NULL};
+    QueuedBlock newentry = {hash, pindex, pindex != NULL, boost::shared_ptr<PartiallyDownloadedBlock>()};
+    if (pit)
+        newentry.partialBlock.reset(new PartiallyDownloadedBlock(&mempool));
     list<QueuedBlock>::iterator it = state->vBlocksInFlight.insert(state->vBlocksInFlight.end(), newentry);
     state->nBlocksInFlight++;
     state->nBlocksInFlightValidHeaders += newentry.fValidatedHeaders;
@@ -403,7 +446,10 @@ void MarkBlockAsInFlight(NodeId nodeid, const uint256& hash, const Consensus::Pa
     if (state->nBlocksInFlightValidHeaders == 1 && pindex != NULL) {
         nPeersWithValidatedDownloads++;
     }
-    mapBlocksInFlight[hash] = std::make_pair(nodeid, it);
+    itInFlight = mapBlocksInFlight.insert(std::make_pair(hash, std::make_pair(nodeid, it))).first;
+    if (pit)
+        *pit = &itInFlight->second.second;
+    return true;
 }
 
 /** Check whether the last unknown block a peer advertised is not yet known. */
@@ -445,6 +491,33 @@ bool CanDirectFetch(const Consensus::Params &consensusParams)
     return chainActive.Tip()->GetBlockTime() > GetAdjustedTime() - consensusParams.nPowTargetSpacing * 20;
 }
 
+// Requires cs_main
+void MaybeSetPeerAsAnnouncingHeaderAndIDs(CNodeState* nodestate, CNode* pfrom)
+{
+    if (!nodestate->fProvidesHeaderAndIDs || nodestate->fRequestedHeaderAndIDs)
+        return;
+    bool fAnnounceUsingCMPCTBLOCK = false;
+    uint64_t nCMPCTBLOCKVersion = 1;
+    if (lNodesAnnouncingHeaderAndIDs.size() >= 3) {
+        // As per BIP152, we only get 3 of our peers to announce
+        // blocks using compact encodings.
+        NodeId nodeStop = lNodesAnnouncingHeaderAndIDs.front();
+        lNodesAnnouncingHeaderAndIDs.pop_front();
+        State(nodeStop)->fRequestedHeaderAndIDs = false;
+        LOCK(cs_vNodes);
+        BOOST_FOREACH(CNode* pnode, vNodes) {
+            if (pnode->GetId() == nodeStop) {
+                pnode->PushMessage(NetMsgType::SENDCMPCT, fAnnounceUsingCMPCTBLOCK, nCMPCTBLOCKVersion);
+                break;
+            }
+        }
+    }
+    fAnnounceUsingCMPCTBLOCK = true;
+    pfrom->PushMessage(NetMsgType::SENDCMPCT, fAnnounceUsingCMPCTBLOCK, nCMPCTBLOCKVersion);
+    nodestate->fRequestedHeaderAndIDs = true;
+    lNodesAnnouncingHeaderAndIDs.push_back(pfrom->GetId());
+}
+
 // Requires cs_main
 bool PeerHasHeader(CNodeState *state, CBlockIndex *pindex)
 {
@@ -572,6 +645,12 @@ bool GetNodeStateStats(NodeId nodeid, CNodeStateStats &stats) {
         if (queue.pindex)
             stats.vHeightInFlight.push_back(queue.pindex->nHeight);
     }
+    stats.fPreferHeaderAndIDs = state->fPreferHeaderAndIDs;
+    stats.fRequestedHeaderAndIDs = state->fRequestedHeaderAndIDs;
+    stats.nCmpctBlocks = state->nCmpctBlocks;
+    stats.nCmpctNoRoundTrip = state->nCmpctNoRoundTrip;
+    stats.nCmpctTxnRequested = state->nCmpctTxnRequested;
+    stats.nCmpctFallback = state->nCmpctFallback;
     return true;
 }
 
@@ -610,90 +689,55 @@ CBlockIndex* FindForkInGlobalIndex(const CChain& chain, const CBlockLocator& loc
 
 CCoinsViewCache *pcoinsTip = NULL;
 CBlockTreeDB *pblocktree = NULL;
+CCoinsStats coinsStatsTip;
 
-//////////////////////////////////////////////////////////////////////////////
-//
-// mapOrphanTransactions
-//
-
-bool AddOrphanTx(const CTransaction& tx, NodeId peer) EXCLUSIVE_LOCKS_REQUIRED(cs_main)
+bool LoadCoinsStats(CCoinsViewDB *pcoinsdbview)
 {
-    uint256 hash = tx.GetHash();
-    if (mapOrphanTransactions.count(hash))
-        return false;
-
-    // Ignore big transactions, to avoid a
-    // send-big-orphans memory exhaustion attack. If a peer has a legitimate
-    // large transaction with a missing parent then we assume
-    // it will rebroadcast it later, after the parent transaction(s)
-    // have been mined or received.
-    // 10,000 orphans, each of which is at most 5,000 bytes big is
-    // at most 500 megabytes of orphans:
-    unsigned int sz = tx.GetSerializeSize(SER_NETWORK, CTransaction::CURRENT_VERSION);
-    if (sz > 5000)
-    {
-        LogPrint("mempool", "ignoring large orphan tx (size: %u, hash: %s)\n", sz, hash.ToString());
-        return false;
-    }
-
-    mapOrphanTransactions[hash].tx = tx;
-    mapOrphanTransactions[hash].fromPeer = peer;
-    BOOST_FOREACH(const CTxIn& txin, tx.vin)
-        mapOrphanTransactionsByPrev[txin.prevout.hash].insert(hash);
-
-    LogPrint("mempool", "stored orphan tx %s (mapsz %u prevsz %u)\n", hash.ToString(),
-             mapOrphanTransactions.size(), mapOrphanTransactionsByPrev.size());
+    LOCK(cs_main);
+    uint256 hashBestBlock = pcoinsdbview->GetBestBlock();
+    coinsStatsTip = CCoinsStats();
+    if (!hashBestBlock.IsNull() && !(pcoinsdbview->ReadStats(coinsStatsTip) && coinsStatsTip.hashBlock == hashBestBlock)) {
+        // Databases written before the statistics were maintained, or after
+        // an unclean shutdown of such a version: rebuild them once.
+        LogPrintf("Computing UTXO set statistics...\n");
+        int64_t nStart = GetTimeMillis();
+        coinsStatsTip = CCoinsStats();
+        if (!pcoinsdbview->GetStats(coinsStatsTip))
+            return error("%s: unable to scan the coin database", __func__);
+        LogPrintf("UTXO set statistics computed in %dms\n", GetTimeMillis() - nStart);
+    }
+    coinsStatsTip.hashBlock = hashBestBlock;
+    BlockMap::iterator mi = mapBlockIndex.find(hashBestBlock);
+    coinsStatsTip.nHeight = mi == mapBlockIndex.end() ? 0 : mi->second->nHeight;
+    pcoinsdbview->SetTipStats(&coinsStatsTip);
     return true;
 }
 
-void static EraseOrphanTx(uint256 hash) EXCLUSIVE_LOCKS_REQUIRED(cs_main)
-{
-    map<uint256, COrphanTx>::iterator it = mapOrphanTransactions.find(hash);
-    if (it == mapOrphanTransactions.end())
-        return;
-    BOOST_FOREACH(const CTxIn& txin, it->second.tx.vin)
-    {
-        map<uint256, set<uint256> >::iterator itPrev = mapOrphanTransactionsByPrev.find(txin.prevout.hash);
-        if (itPrev == mapOrphanTransactionsByPrev.end())
-            continue;
-        itPrev->second.erase(hash);
-        if (itPrev->second.empty())
-            mapOrphanTransactionsByPrev.erase(itPrev);
-    }
-    mapOrphanTransactions.erase(it);
-}
-
-void EraseOrphansFor(NodeId peer)
+/**
+ * Update coinsStatsTip for a block being connected or disconnected: every
+ * coins record the block can touch is removed as it was in viewOld and added
+ * back as it is in viewNew.
+ */
+static void UpdateCoinsStats(const CBlock& block, const CCoinsViewCache& viewOld, const CCoinsViewCache& viewNew, const CBlockIndex* pindexNew)
 {
-    int nErased = 0;
-    map<uint256, COrphanTx>::iterator iter = mapOrphanTransactions.begin();
-    while (iter != mapOrphanTransactions.end())
-    {
-        map<uint256, COrphanTx>::iterator maybeErase = iter++; // increment to avoid iterator becoming invalid
-        if (maybeErase->second.fromPeer == peer)
-        {
-            EraseOrphanTx(maybeErase->second.tx.GetHash());
-            ++nErased;
+    std::set<uint256> setTouched;
+    BOOST_FOREACH(const CTransaction& tx, block.vtx) {
+        setTouched.insert(tx.GetHash());
+        if (!tx.IsCoinBase()) {
+            BOOST_FOREACH(const CTxIn& txin, tx.vin)
+                setTouched.insert(txin.prevout.hash);
         }
     }
-    if (nErased > 0) LogPrint("mempool", "Erased %d orphan tx from peer %d\n", nErased, peer);
-}
-
-
-unsigned int LimitOrphanTxSize(unsigned int nMaxOrphans) EXCLUSIVE_LOCKS_REQUIRED(cs_main)
-{
-    unsigned int nEvicted = 0;
-    while (mapOrphanTransactions.size() > nMaxOrphans)
-    {
-        // Evict a random orphan:
-        uint256 randomhash = GetRandHash();
-        map<uint256, COrphanTx>::iterator it = mapOrphanTransactions.lower_bound(randomhash);
-        if (it == mapOrphanTransactions.end())
-            it = mapOrphanTransactions.begin();
-        EraseOrphanTx(it->first);
-        ++nEvicted;
+    BOOST_FOREACH(const uint256& txid, setTouched) {
+        const CCoins* coins = viewOld.AccessCoins(txid);
+        if (coins)
+            coinsStatsTip.Remove(txid, *coins);
+        coins = viewNew.AccessCoins(txid);
+        if (coins)
+            coinsStatsTip.Add(txid, *coins);
     }
-    return nEvicted;
+    coinsStatsTip.hashBlock = pindexNew->GetBlockHash();
+    coinsStatsTip.nHeight = pindexNew->nHeight;
 }
 
 bool IsFinalTx(const CTransaction &tx, int nBlockHeight, int64_t nBlockTime)
@@ -1062,11 +1106,60 @@ std::string FormatStateMessage(const CValidationState &state)
         state.GetRejectCode());
 }
 
-bool AcceptToMemoryPoolWorker(CTxMemPool& pool, CValidationState &state, const CTransaction &tx, bool fLimitFree,
-                              bool* pfMissingInputs, bool fOverrideMempoolLimit, bool fRejectAbsurdFee,
-                              std::vector<uint256>& vHashTxnToUncache, bool fDryRun)
+namespace {
+
+/**
+ * A transaction on its way into the memory pool: what the policy checks
+ * found out about it, kept around for its script checks and for adding it.
+ */
+struct CMempoolAcceptWorkspace
+{
+    const CTransaction& tx;
+    const uint256 hash;
+    //! The inputs of tx, detached from the pool and the chainstate
+    CCoinsView dummy;
+    CCoinsViewCache view;
+    boost::scoped_ptr<CTxMemPoolEntry> pentry;
+    CTxMemPool::setEntries setAncestors;
+    //! In-mempool transactions replaced by tx, with their descendants
+    CTxMemPool::setEntries allConflicting;
+    CAmount nModifiedFees;
+    CAmount nConflictingFees;
+    size_t nConflictingSize;
+    //! Only computed for transactions that pass the policy checks
+    boost::scoped_ptr<PrecomputedTransactionData> ptxdata;
+    //! When tx entered the pool, earlier than now if it is reloaded from disk
+    int64_t nAcceptTime;
+    //! Whether the pool may pass tx on to the fee estimator
+    bool fValidFeeEstimate;
+
+    CMempoolAcceptWorkspace(const CTransaction& txIn, int64_t nAcceptTimeIn, bool fValidFeeEstimateIn) :
+        tx(txIn), hash(txIn.GetHash()), view(&dummy),
+        nModifiedFees(0), nConflictingFees(0), nConflictingSize(0),
+        nAcceptTime(nAcceptTimeIn), fValidFeeEstimate(fValidFeeEstimateIn) {}
+};
+
+} // anon namespace
+
+static bool CalculateMemPoolAncestorsWithLimits(CTxMemPool& pool, CValidationState& state, const CTxMemPoolEntry& entry, CTxMemPool::setEntries& setAncestors)
+{
+    size_t nLimitAncestors = GetArg("-limitancestorcount", DEFAULT_ANCESTOR_LIMIT);
+    size_t nLimitAncestorSize = GetArg("-limitancestorsize", DEFAULT_ANCESTOR_SIZE_LIMIT)*1000;
+    size_t nLimitDescendants = GetArg("-limitdescendantcount", DEFAULT_DESCENDANT_LIMIT);
+    size_t nLimitDescendantSize = GetArg("-limitdescendantsize", DEFAULT_DESCENDANT_SIZE_LIMIT)*1000;
+    std::string errString;
+    if (!pool.CalculateMemPoolAncestors(entry, setAncestors, nLimitAncestors, nLimitAncestorSize, nLimitDescendants, nLimitDescendantSize, errString)) {
+        return state.DoS(0, false, REJECT_NONSTANDARD, "too-long-mempool-chain", false, errString);
+    }
+    return true;
+}
+
+/** Everything AcceptToMemoryPool checks about a transaction before running its scripts */
+static bool AcceptToMemoryPoolPreChecks(CTxMemPool& pool, CValidationState &state, CMempoolAcceptWorkspace& ws, bool fLimitFree,
+                                        bool* pfMissingInputs, bool fRejectAbsurdFee, std::vector<uint256>& vHashTxnToUncache)
 {
     AssertLockHeld(cs_main);
+    const CTransaction& tx = ws.tx;
     if (pfMissingInputs)
         *pfMissingInputs = false;
 
@@ -1097,7 +1190,7 @@ bool AcceptToMemoryPoolWorker(CTxMemPool& pool, CValidationState &state, const C
         return state.DoS(0, false, REJECT_NONSTANDARD, "non-final");
 
     // is it already in the memory pool?
-    uint256 hash = tx.GetHash();
+    const uint256& hash = ws.hash;
     if (pool.exists(hash))
         return state.Invalid(false, REJECT_ALREADY_KNOWN, "txn-already-in-mempool");
 
@@ -1124,7 +1217,7 @@ bool AcceptToMemoryPoolWorker(CTxMemPool& pool, CValidationState &state, const C
     {
         if (pool.mapNextTx.count(txin.prevout))
         {
-            const CTransaction *ptxConflicting = pool.mapNextTx[txin.prevout].ptx;
+            const CTransaction *ptxConflicting = pool.mapNextTx[txin.prevout];
             if (!setConflicts.count(ptxConflicting->GetHash()))
             {
                 // InstantSend txes are not replacable
@@ -1173,8 +1266,7 @@ bool AcceptToMemoryPoolWorker(CTxMemPool& pool, CValidationState &state, const C
     }
 
     {
-        CCoinsView dummy;
-        CCoinsViewCache view(&dummy);
+        CCoinsViewCache& view = ws.view;
 
         CAmount nValueIn = 0;
         LockPoints lp;
@@ -1214,7 +1306,7 @@ bool AcceptToMemoryPoolWorker(CTxMemPool& pool, CValidationState &state, const C
         nValueIn = view.GetValueIn(tx);
 
         // we have all inputs cached now, so switch back to dummy, so we don't need to keep lock on mempool
-        view.SetBackend(dummy);
+        view.SetBackend(ws.dummy);
 
         // Only accept BIP68 sequence locked transactions that can be mined in the next
         // block; we don't want our mempool filled up with transactions that can't
@@ -1235,7 +1327,8 @@ bool AcceptToMemoryPoolWorker(CTxMemPool& pool, CValidationState &state, const C
         CAmount nValueOut = tx.GetValueOut();
         CAmount nFees = nValueIn-nValueOut;
         // nModifiedFees includes any fee deltas from PrioritiseTransaction
-        CAmount nModifiedFees = nFees;
+        CAmount& nModifiedFees = ws.nModifiedFees;
+        nModifiedFees = nFees;
         double nPriorityDummy = 0;
         pool.ApplyDeltas(hash, nPriorityDummy, nModifiedFees);
 
@@ -1253,7 +1346,8 @@ bool AcceptToMemoryPoolWorker(CTxMemPool& pool, CValidationState &state, const C
             }
         }
 
-        CTxMemPoolEntry entry(tx, nFees, GetTime(), dPriority, chainActive.Height(), pool.HasNoInputsOf(tx), inChainInputValue, fSpendsCoinbase, nSigOps, lp);
+        ws.pentry.reset(new CTxMemPoolEntry(tx, nFees, ws.nAcceptTime, dPriority, chainActive.Height(), pool.HasNoInputsOf(tx), inChainInputValue, fSpendsCoinbase, nSigOps, lp));
+        const CTxMemPoolEntry& entry = *ws.pentry;
         unsigned int nSize = entry.GetTxSize();
 
         // Check that the transaction doesn't have an excessive number of
@@ -1302,15 +1396,9 @@ bool AcceptToMemoryPoolWorker(CTxMemPool& pool, CValidationState &state, const C
                 strprintf("%d > %d", nFees, ::minRelayTxFee.GetFee(nSize) * 10000));
 
         // Calculate in-mempool ancestors, up to a limit.
-        CTxMemPool::setEntries setAncestors;
-        size_t nLimitAncestors = GetArg("-limitancestorcount", DEFAULT_ANCESTOR_LIMIT);
-        size_t nLimitAncestorSize = GetArg("-limitancestorsize", DEFAULT_ANCESTOR_SIZE_LIMIT)*1000;
-        size_t nLimitDescendants = GetArg("-limitdescendantcount", DEFAULT_DESCENDANT_LIMIT);
-        size_t nLimitDescendantSize = GetArg("-limitdescendantsize", DEFAULT_DESCENDANT_SIZE_LIMIT)*1000;
-        std::string errString;
-        if (!pool.CalculateMemPoolAncestors(entry, setAncestors, nLimitAncestors, nLimitAncestorSize, nLimitDescendants, nLimitDescendantSize, errString)) {
-            return state.DoS(0, false, REJECT_NONSTANDARD, "too-long-mempool-chain", false, errString);
-        }
+        CTxMemPool::setEntries& setAncestors = ws.setAncestors;
+        if (!CalculateMemPoolAncestorsWithLimits(pool, state, entry, setAncestors))
+            return false;
 
         // A transaction that spends outputs that would be replaced by it is invalid. Now
         // that we have the set of all ancestors we can detect this
@@ -1330,10 +1418,10 @@ bool AcceptToMemoryPoolWorker(CTxMemPool& pool, CValidationState &state, const C
 
         // Check if it's economically rational to mine this transaction rather
         // than the ones it replaces.
-        CAmount nConflictingFees = 0;
-        size_t nConflictingSize = 0;
+        CAmount& nConflictingFees = ws.nConflictingFees;
+        size_t& nConflictingSize = ws.nConflictingSize;
         uint64_t nConflictingCount = 0;
-        CTxMemPool::setEntries allConflicting;
+        CTxMemPool::setEntries& allConflicting = ws.allConflicting;
 
         // If we don't hold the lock allConflicting might be incomplete; the
         // subsequent RemoveStaged() and addUnchecked() calls don't guarantee
@@ -1354,20 +1442,6 @@ bool AcceptToMemoryPoolWorker(CTxMemPool& pool, CValidationState &state, const C
                 // Save these to avoid repeated lookups
                 setIterConflicting.insert(mi);
 
-                // If this entry is "dirty", then we don't have descendant
-                // state for this transaction, which means we probably have
-                // lots of in-mempool descendants.
-                // Don't allow replacements of dirty transactions, to ensure
-                // that we don't spend too much time walking descendants.
-                // This should be rare.
-                if (mi->IsDirty()) {
-                    return state.DoS(0,
-                            error("AcceptToMemoryPool: rejecting replacement %s; cannot replace tx %s with untracked descendants",
-                                hash.ToString(),
-                                mi->GetTx().GetHash().ToString()),
-                            REJECT_NONSTANDARD, "too many potential replacements");
-                }
-
                 // Don't allow the replacement to reduce the feerate of the
                 // mempool.
                 //
@@ -1465,63 +1539,103 @@ bool AcceptToMemoryPoolWorker(CTxMemPool& pool, CValidationState &state, const C
                         REJECT_INSUFFICIENTFEE, "insufficient fee");
             }
         }
+    }
 
-        // If we aren't going to actually accept it but just were verifying it, we are fine already
-        if(fDryRun) return true;
+    return true;
+}
 
-        // Check against previous transactions
-        // This is done last to help prevent CPU exhaustion denial-of-service attacks.
-        if (!CheckInputs(tx, state, view, true, STANDARD_SCRIPT_VERIFY_FLAGS, true))
-            return false;
+/** Add a transaction whose scripts passed the standard checks to the pool */
+static bool AcceptToMemoryPoolFinalize(CTxMemPool& pool, CValidationState &state, CMempoolAcceptWorkspace& ws)
+{
+    AssertLockHeld(cs_main);
+    AssertLockHeld(pool.cs);
+    const CTransaction& tx = ws.tx;
+    const uint256& hash = ws.hash;
+    const CTxMemPoolEntry& entry = *ws.pentry;
+    const CCoinsViewCache& view = ws.view;
+    const CChainParams& chainparams = Params();
 
-        // Check again against just the consensus-critical mandatory script
-        // verification flags, in case of bugs in the standard flags that cause
-        // transactions to pass as valid when they're actually invalid. For
-        // instance the STRICTENC flag was incorrectly allowing certain
-        // CHECKSIG NOT scripts to pass, even though they were invalid.
-        //
-        // There is a similar check in CreateNewBlock() to prevent creating
-        // invalid blocks, however allowing such transactions into the mempool
-        // can be exploited as a DoS attack.
-        if (!CheckInputs(tx, state, view, true, MANDATORY_SCRIPT_VERIFY_FLAGS, true))
-        {
-            return error("%s: BUG! PLEASE REPORT THIS! ConnectInputs failed against MANDATORY but not STANDARD flags %s, %s",
-                __func__, hash.ToString(), FormatStateMessage(state));
-        }
+    // Check again against the consensus-critical script verification
+    // flags a block on top of the current tip would use, in case of bugs
+    // in the standard flags that cause transactions to pass as valid when
+    // they're actually invalid. For instance the STRICTENC flag was
+    // incorrectly allowing certain CHECKSIG NOT scripts to pass, even
+    // though they were invalid.
+    //
+    // There is a similar check in CreateNewBlock() to prevent creating
+    // invalid blocks, however allowing such transactions into the mempool
+    // can be exploited as a DoS attack.
+    //
+    // Using the block flags here also fills the script execution cache
+    // with the entry ConnectBlock() will look up once this transaction is
+    // mined, so its scripts need not be run again then.
+    const Consensus::Params& consensusParams = chainparams.GetConsensus();
+    unsigned int nBlockScriptFlags = GetBlockScriptFlags(chainActive.Tip(), ComputeBlockVersion(chainActive.Tip(), consensusParams), GetAdjustedTime(), consensusParams);
+    if (!CheckInputs(tx, state, view, true, nBlockScriptFlags, true, true, *ws.ptxdata))
+    {
+        return error("%s: BUG! PLEASE REPORT THIS! ConnectInputs failed against MANDATORY but not STANDARD flags %s, %s",
+            __func__, hash.ToString(), FormatStateMessage(state));
+    }
 
-        // Remove conflicting transactions from the mempool
-        BOOST_FOREACH(const CTxMemPool::txiter it, allConflicting)
-        {
-            LogPrint("mempool", "replacing tx %s with %s for %s BTC additional fees, %d delta bytes\n",
-                    it->GetTx().GetHash().ToString(),
-                    hash.ToString(),
-                    FormatMoney(nModifiedFees - nConflictingFees),
-                    (int)nSize - (int)nConflictingSize);
-        }
-        pool.RemoveStaged(allConflicting);
+    // Remove conflicting transactions from the mempool
+    BOOST_FOREACH(const CTxMemPool::txiter it, ws.allConflicting)
+    {
+        LogPrint("mempool", "replacing tx %s with %s for %s BTC additional fees, %d delta bytes\n",
+                it->GetTx().GetHash().ToString(),
+                hash.ToString(),
+                FormatMoney(ws.nModifiedFees - ws.nConflictingFees),
+                (int)entry.GetTxSize() - (int)ws.nConflictingSize);
+    }
+    pool.RemoveStaged(ws.allConflicting);
 
-        // Store transaction in memory
-        pool.addUnchecked(hash, entry, setAncestors, !IsInitialBlockDownload());
+    // Store transaction in memory
+    pool.addUnchecked(hash, entry, ws.setAncestors, ws.fValidFeeEstimate && !IsInitialBlockDownload());
 
-        // Add memory address index
-        if (fAddressIndex) {
-            pool.addAddressIndex(entry, view);
-        }
+    // Add memory address index
+    if (fAddressIndex) {
+        pool.addAddressIndex(entry, view);
+    }
 
-        // Add memory spent index
-        if (fSpentIndex) {
-            pool.addSpentIndex(entry, view);
-        }
+    // Add memory spent index
+    if (fSpentIndex) {
+        pool.addSpentIndex(entry, view);
+    }
+
+    return true;
+}
+
+bool AcceptToMemoryPoolWorker(CTxMemPool& pool, CValidationState &state, const CTransaction &tx, bool fLimitFree,
+                              bool* pfMissingInputs, bool fOverrideMempoolLimit, bool fRejectAbsurdFee,
+                              std::vector<uint256>& vHashTxnToUncache, bool fDryRun)
+{
+    CMempoolAcceptWorkspace ws(tx, GetTime(), true);
+    if (!AcceptToMemoryPoolPreChecks(pool, state, ws, fLimitFree, pfMissingInputs, fRejectAbsurdFee, vHashTxnToUncache))
+        return false;
+
+    // If we aren't going to actually accept it but just were verifying it, we are fine already
+    if(fDryRun) return true;
+
+    {
+        LOCK(pool.cs);
+
+        // Check against previous transactions
+        // This is done last to help prevent CPU exhaustion denial-of-service attacks.
+        ws.ptxdata.reset(new PrecomputedTransactionData(tx));
+        if (!CheckInputs(tx, state, ws.view, true, STANDARD_SCRIPT_VERIFY_FLAGS, true, false, *ws.ptxdata))
+            return false;
+
+        if (!AcceptToMemoryPoolFinalize(pool, state, ws))
+            return false;
 
         // trim mempool and check if tx was trimmed
         if (!fOverrideMempoolLimit) {
             LimitMempoolSize(pool, GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000, GetArg("-mempoolexpiry", DEFAULT_MEMPOOL_EXPIRY) * 60 * 60);
-            if (!pool.exists(hash))
+            if (!pool.exists(ws.hash))
                 return state.DoS(0, false, REJECT_INSUFFICIENTFEE, "mempool full");
         }
     }
 
-    if(!fDryRun) SyncWithWallets(tx, NULL);
+    SyncWithWallets(tx, NULL);
 
     return true;
 }
@@ -1539,6 +1653,175 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransa
     return res;
 }
 
+namespace {
+
+/**
+ * Runs AcceptToMemoryPoolBatch: transactions that pass the policy checks
+ * queue their script checks and wait as pending until the pending
+ * transactions are flushed, which waits for the script checks and adds them
+ * to the pool in order.
+ */
+class CMempoolBatchAcceptor
+{
+private:
+    CTxMemPool& pool;
+    const std::vector<CTransaction>& vtx;
+    const bool fLimitFree;
+    const std::vector<int64_t>* pvAcceptTime;
+    std::vector<CValidationState>& vState;
+    std::vector<bool>& vAccepted;
+    std::vector<bool>& vMissingInputs;
+    std::vector<std::vector<uint256> > vHashTxnToUncache;
+
+    //! Pending transactions, by index into vtx
+    std::vector<std::pair<size_t, boost::shared_ptr<CMempoolAcceptWorkspace> > > vPending;
+    std::set<uint256> setPendingTx;
+    std::set<COutPoint> setPendingSpent;
+    boost::scoped_ptr<CCheckQueueControl<CScriptCheck> > pcontrol;
+
+    void Reject(size_t i)
+    {
+        LogPrint("mempool", "%s: %s %s\n", "AcceptToMemoryPoolBatch", vtx[i].GetHash().ToString(), vState[i].GetRejectReason());
+        BOOST_FOREACH(const uint256& hashTx, vHashTxnToUncache[i])
+            pcoinsTip->Uncache(hashTx);
+    }
+
+    /** Does tx have to see the pool with the pending transactions added? */
+    bool DependsOnPending(const CTransaction& tx)
+    {
+        LOCK(pool.cs);
+        BOOST_FOREACH(const CTxIn& txin, tx.vin) {
+            // Spending or double spending a pending transaction, or a
+            // conflict with the pool (a replacement could evict the
+            // ancestors of pending transactions)
+            if (setPendingTx.count(txin.prevout.hash) || setPendingSpent.count(txin.prevout) ||
+                pool.mapNextTx.count(txin.prevout))
+                return true;
+        }
+        return false;
+    }
+
+    void Flush()
+    {
+        if (vPending.empty())
+            return;
+        bool fScriptsOk = pcontrol->Wait();
+        pcontrol.reset();
+
+        {
+            LOCK(pool.cs);
+            std::vector<size_t> vAdded;
+            for (size_t k = 0; k < vPending.size(); k++) {
+                size_t i = vPending[k].first;
+                CMempoolAcceptWorkspace& ws = *vPending[k].second;
+                CValidationState& state = vState[i];
+                // The script check queue only reports whether all checks
+                // passed; check the transactions one by one to find which
+                // failed. Valid signatures are in the signature cache by now.
+                if (!fScriptsOk && !CheckInputs(ws.tx, state, ws.view, true, STANDARD_SCRIPT_VERIFY_FLAGS, true, false, *ws.ptxdata)) {
+                    Reject(i);
+                    continue;
+                }
+                // The transactions added before this one may share ancestors
+                // with it, whose package limits have to be checked again.
+                if (k > 0) {
+                    ws.setAncestors.clear();
+                    if (!CalculateMemPoolAncestorsWithLimits(pool, state, *ws.pentry, ws.setAncestors)) {
+                        Reject(i);
+                        continue;
+                    }
+                }
+                if (!AcceptToMemoryPoolFinalize(pool, state, ws)) {
+                    Reject(i);
+                    continue;
+                }
+                vAdded.push_back(i);
+            }
+
+            // Trim once for all of them
+            LimitMempoolSize(pool, GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000, GetArg("-mempoolexpiry", DEFAULT_MEMPOOL_EXPIRY) * 60 * 60);
+            BOOST_FOREACH(size_t i, vAdded) {
+                if (pool.exists(vtx[i].GetHash())) {
+                    vAccepted[i] = true;
+                } else {
+                    vState[i].DoS(0, false, REJECT_INSUFFICIENTFEE, "mempool full");
+                    Reject(i);
+                }
+            }
+        }
+
+        vPending.clear();
+        setPendingTx.clear();
+        setPendingSpent.clear();
+    }
+
+public:
+    CMempoolBatchAcceptor(CTxMemPool& poolIn, const std::vector<CTransaction>& vtxIn, bool fLimitFreeIn, const std::vector<int64_t>* pvAcceptTimeIn,
+                          std::vector<CValidationState>& vStateIn, std::vector<bool>& vAcceptedIn, std::vector<bool>& vMissingInputsIn) :
+        pool(poolIn), vtx(vtxIn), fLimitFree(fLimitFreeIn), pvAcceptTime(pvAcceptTimeIn),
+        vState(vStateIn), vAccepted(vAcceptedIn), vMissingInputs(vMissingInputsIn),
+        vHashTxnToUncache(vtxIn.size()) {}
+
+    void Run()
+    {
+        for (size_t i = 0; i < vtx.size(); i++) {
+            const CTransaction& tx = vtx[i];
+            if (DependsOnPending(tx))
+                Flush();
+
+            boost::shared_ptr<CMempoolAcceptWorkspace> pws(pvAcceptTime ? new CMempoolAcceptWorkspace(tx, (*pvAcceptTime)[i], false)
+                                                                        : new CMempoolAcceptWorkspace(tx, GetTime(), true));
+            bool fMissingInputs = false;
+            if (!AcceptToMemoryPoolPreChecks(pool, vState[i], *pws, fLimitFree, &fMissingInputs, false, vHashTxnToUncache[i])) {
+                vMissingInputs[i] = fMissingInputs;
+                Reject(i);
+                continue;
+            }
+
+            // Without script check threads there is nothing to gain from
+            // deferring the checks, so they run right here.
+            pws->ptxdata.reset(new PrecomputedTransactionData(tx));
+            std::vector<CScriptCheck> vChecks;
+            if (!CheckInputs(tx, vState[i], pws->view, true, STANDARD_SCRIPT_VERIFY_FLAGS, true, false, *pws->ptxdata, nScriptCheckThreads ? &vChecks : NULL)) {
+                Reject(i);
+                continue;
+            }
+            if (!pcontrol)
+                pcontrol.reset(new CCheckQueueControl<CScriptCheck>(nScriptCheckThreads ? &scriptcheckqueue : NULL));
+            pcontrol->Add(vChecks);
+
+            vPending.push_back(std::make_pair(i, pws));
+            setPendingTx.insert(pws->hash);
+            BOOST_FOREACH(const CTxIn& txin, tx.vin)
+                setPendingSpent.insert(txin.prevout);
+            // A replacement evicts transactions from the pool: add it before
+            // checking anything else against the pool.
+            if (!pws->allConflicting.empty())
+                Flush();
+        }
+        Flush();
+
+        for (size_t i = 0; i < vtx.size(); i++) {
+            if (vAccepted[i])
+                SyncWithWallets(vtx[i], NULL);
+        }
+    }
+};
+
+} // anon namespace
+
+void AcceptToMemoryPoolBatch(CTxMemPool& pool, const std::vector<CTransaction>& vtx, bool fLimitFree,
+                             std::vector<CValidationState>& vState, std::vector<bool>& vAccepted, std::vector<bool>& vMissingInputs,
+                             const std::vector<int64_t>* pvAcceptTime)
+{
+    AssertLockHeld(cs_main);
+    assert(!pvAcceptTime || pvAcceptTime->size() == vtx.size());
+    vState.assign(vtx.size(), CValidationState());
+    vAccepted.assign(vtx.size(), false);
+    vMissingInputs.assign(vtx.size(), false);
+    CMempoolBatchAcceptor(pool, vtx, fLimitFree, pvAcceptTime, vState, vAccepted, vMissingInputs).Run();
+}
+
 bool GetTimestampIndex(const unsigned int &high, const unsigned int &low, std::vector<uint256> &hashes)
 {
     if (!fTimestampIndex)
@@ -2034,7 +2317,7 @@ void UpdateCoins(const CTransaction& tx, CValidationState &state, CCoinsViewCach
 
 bool CScriptCheck::operator()() {
     const CScript &scriptSig = ptxTo->vin[nIn].scriptSig;
-    if (!VerifyScript(scriptSig, scriptPubKey, nFlags, CachingTransactionSignatureChecker(ptxTo, nIn, cacheStore), &error)) {
+    if (!VerifyScript(scriptSig, scriptPubKey, nFlags, CachingTransactionSignatureChecker(ptxTo, nIn, cacheStore, txdata), &error)) {
         return false;
     }
     return true;
@@ -2093,7 +2376,43 @@ bool CheckTxInputs(const CTransaction& tx, CValidationState& state, const CCoins
 }
 }// namespace Consensus
 
-bool CheckInputs(const CTransaction& tx, CValidationState &state, const CCoinsViewCache &inputs, bool fScriptChecks, unsigned int flags, bool cacheStore, std::vector<CScriptCheck> *pvChecks)
+namespace {
+
+/**
+ * Transactions whose scripts fully validated under a given set of flags, keyed
+ * by SHA256(nonce || txid || flags). Filled when transactions enter the memory
+ * pool so that ConnectBlock can skip all script execution (not only signature
+ * checks) for transactions it has already seen.
+ */
+uint256 scriptExecutionCacheNonce;
+CSetAssociativeCache scriptExecutionCache;
+
+uint256 ScriptExecutionCacheEntry(const CTransaction& tx, unsigned int flags)
+{
+    uint256 entry;
+    CSHA256().Write(scriptExecutionCacheNonce.begin(), 32).Write(tx.GetHash().begin(), 32).Write((unsigned char*)&flags, sizeof(flags)).Finalize(entry.begin());
+    return entry;
+}
+
+} // anon namespace
+
+void InitScriptExecutionCache()
+{
+    // The other half of -maxsigcachesize goes to the signature cache
+    size_t nMaxCacheSize = GetArg("-maxsigcachesize", DEFAULT_MAX_SIG_CACHE_SIZE) * ((size_t) 1 << 20) / 2;
+    GetRandBytes(scriptExecutionCacheNonce.begin(), 32);
+    scriptExecutionCache.Setup(nMaxCacheSize);
+    CSetAssociativeCacheStats stats;
+    scriptExecutionCache.GetStats(stats);
+    LogPrintf("Using %u MiB for the script execution cache, able to store %u elements\n", (unsigned int)(nMaxCacheSize >> 20), (unsigned int)stats.nCapacity);
+}
+
+void GetScriptExecutionCacheStats(CSetAssociativeCacheStats& stats)
+{
+    scriptExecutionCache.GetStats(stats);
+}
+
+bool CheckInputs(const CTransaction& tx, CValidationState &state, const CCoinsViewCache &inputs, bool fScriptChecks, unsigned int flags, bool cacheStore, bool cacheFullScriptStore, const PrecomputedTransactionData& txdata, std::vector<CScriptCheck> *pvChecks)
 {
     if (!tx.IsCoinBase())
     {
@@ -2111,13 +2430,19 @@ bool CheckInputs(const CTransaction& tx, CValidationState &state, const CCoinsVi
         // before the last block chain checkpoint. This is safe because block merkle hashes are
         // still computed and checked, and any change will be caught at the next checkpoint.
         if (fScriptChecks) {
+            // All scripts of this transaction already passed with these
+            // flags, e.g. when it was accepted to the memory pool.
+            uint256 hashCacheEntry = ScriptExecutionCacheEntry(tx, flags);
+            if (scriptExecutionCache.Contains(hashCacheEntry))
+                return true;
+
             for (unsigned int i = 0; i < tx.vin.size(); i++) {
                 const COutPoint &prevout = tx.vin[i].prevout;
                 const CCoins* coins = inputs.AccessCoins(prevout.hash);
                 assert(coins);
 
                 // Verify signature
-                CScriptCheck check(*coins, tx, i, flags, cacheStore);
+                CScriptCheck check(*coins, tx, i, flags, cacheStore, txdata);
                 if (pvChecks) {
                     pvChecks->push_back(CScriptCheck());
                     check.swap(pvChecks->back());
@@ -2130,7 +2455,7 @@ bool CheckInputs(const CTransaction& tx, CValidationState &state, const CCoinsVi
                         // avoid splitting the network between upgraded and
                         // non-upgraded nodes.
                         CScriptCheck check2(*coins, tx, i,
-                                flags & ~STANDARD_NOT_MANDATORY_VERIFY_FLAGS, cacheStore);
+                                flags & ~STANDARD_NOT_MANDATORY_VERIFY_FLAGS, cacheStore, txdata);
                         if (check2())
                             return state.Invalid(false, REJECT_NONSTANDARD, strprintf("non-mandatory-script-verify-flag (%s)", ScriptErrorString(check.GetScriptError())));
                     }
@@ -2144,6 +2469,12 @@ bool CheckInputs(const CTransaction& tx, CValidationState &state, const CCoinsVi
                     return state.DoS(100,false, REJECT_INVALID, strprintf("mandatory-script-verify-flag-failed (%s)", ScriptErrorString(check.GetScriptError())));
                 }
             }
+
+            if (cacheFullScriptStore && !pvChecks) {
+                // Only cache results that were actually computed above;
+                // deferred checks have not run yet.
+                scriptExecutionCache.Insert(hashCacheEntry);
+            }
         }
     }
 
@@ -2431,8 +2762,6 @@ void static FlushBlockFile(bool fFinalize = false)
 
 bool FindUndoPos(CValidationState &state, int nFile, CDiskBlockPos &pos, unsigned int nAddSize);
 
-static CCheckQueue<CScriptCheck> scriptcheckqueue(128);
-
 void ThreadScriptCheck() {
     RenameThread("sibcoin-scriptch");
     scriptcheckqueue.Thread();
@@ -2501,6 +2830,37 @@ static int64_t nTimeIndex = 0;
 static int64_t nTimeCallbacks = 0;
 static int64_t nTimeTotal = 0;
 
+/** Script verification flags for a block with the given version and time on top of pindexPrev */
+static unsigned int GetBlockScriptFlags(const CBlockIndex* pindexPrev, int nVersion, int64_t nBlockTime, const Consensus::Params& consensusparams)
+{
+    AssertLockHeld(cs_main);
+
+    // BIP16 didn't become active until Apr 1 2012
+    int64_t nBIP16SwitchTime = 1333238400;
+    bool fStrictPayToScriptHash = (nBlockTime >= nBIP16SwitchTime);
+
+    unsigned int flags = fStrictPayToScriptHash ? SCRIPT_VERIFY_P2SH : SCRIPT_VERIFY_NONE;
+
+    // Start enforcing the DERSIG (BIP66) rules, for block.nVersion=3 blocks,
+    // when 75% of the network has upgraded:
+    if (nVersion >= 3 && IsSuperMajority(3, pindexPrev, consensusparams.nMajorityEnforceBlockUpgrade, consensusparams)) {
+        flags |= SCRIPT_VERIFY_DERSIG;
+    }
+
+    // Start enforcing CHECKLOCKTIMEVERIFY, (BIP65) for block.nVersion=4
+    // blocks, when 75% of the network has upgraded:
+    if (nVersion >= 4 && IsSuperMajority(4, pindexPrev, consensusparams.nMajorityEnforceBlockUpgrade, consensusparams)) {
+        flags |= SCRIPT_VERIFY_CHECKLOCKTIMEVERIFY;
+    }
+
+    // Start enforcing BIP112 (CHECKSEQUENCEVERIFY) using versionbits logic.
+    if (VersionBitsState(pindexPrev, consensusparams, Consensus::DEPLOYMENT_CSV, versionbitscache) == THRESHOLD_ACTIVE) {
+        flags |= SCRIPT_VERIFY_CHECKSEQUENCEVERIFY;
+    }
+
+    return flags;
+}
+
 bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pindex, CCoinsViewCache& view, bool fJustCheck)
 {
     const CChainParams& chainparams = Params();
@@ -2571,28 +2931,12 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
         }
     }
 
-    // BIP16 didn't become active until Apr 1 2012
-    int64_t nBIP16SwitchTime = 1333238400;
-    bool fStrictPayToScriptHash = (pindex->GetBlockTime() >= nBIP16SwitchTime);
-
-    unsigned int flags = fStrictPayToScriptHash ? SCRIPT_VERIFY_P2SH : SCRIPT_VERIFY_NONE;
+    unsigned int flags = GetBlockScriptFlags(pindex->pprev, block.nVersion, pindex->GetBlockTime(), chainparams.GetConsensus());
+    bool fStrictPayToScriptHash = (flags & SCRIPT_VERIFY_P2SH) != 0;
 
-    // Start enforcing the DERSIG (BIP66) rules, for block.nVersion=3 blocks,
-    // when 75% of the network has upgraded:
-    if (block.nVersion >= 3 && IsSuperMajority(3, pindex->pprev, chainparams.GetConsensus().nMajorityEnforceBlockUpgrade, chainparams.GetConsensus())) {
-        flags |= SCRIPT_VERIFY_DERSIG;
-    }
-
-    // Start enforcing CHECKLOCKTIMEVERIFY, (BIP65) for block.nVersion=4
-    // blocks, when 75% of the network has upgraded:
-    if (block.nVersion >= 4 && IsSuperMajority(4, pindex->pprev, chainparams.GetConsensus().nMajorityEnforceBlockUpgrade, chainparams.GetConsensus())) {
-        flags |= SCRIPT_VERIFY_CHECKLOCKTIMEVERIFY;
-    }
-
-    // Start enforcing BIP68 (sequence locks) and BIP112 (CHECKSEQUENCEVERIFY) using versionbits logic.
+    // Start enforcing BIP68 (sequence locks) along with BIP112 (CHECKSEQUENCEVERIFY).
     int nLockTimeFlags = 0;
-    if (VersionBitsState(pindex->pprev, chainparams.GetConsensus(), Consensus::DEPLOYMENT_CSV, versionbitscache) == THRESHOLD_ACTIVE) {
-        flags |= SCRIPT_VERIFY_CHECKSEQUENCEVERIFY;
+    if (flags & SCRIPT_VERIFY_CHECKSEQUENCEVERIFY) {
         nLockTimeFlags |= LOCKTIME_VERIFY_SEQUENCE;
     }
 
@@ -2608,6 +2952,8 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
     int nInputs = 0;
     unsigned int nSigOps = 0;
     CDiskTxPos pos(pindex->GetBlockPos(), GetSizeOfCompactSize(block.vtx.size()));
+    std::vector<PrecomputedTransactionData> txdata;
+    txdata.reserve(block.vtx.size()); // Queued script checks point into txdata, so it must never reallocate
     std::vector<std::pair<uint256, CDiskTxPos> > vPos;
     vPos.reserve(block.vtx.size());
     blockundo.vtxundo.reserve(block.vtx.size() - 1);
@@ -2697,7 +3043,8 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
 
             std::vector<CScriptCheck> vChecks;
             bool fCacheResults = fJustCheck; /* Don't cache results if we're actually connecting blocks (still consult the cache, though) */
-            if (!CheckInputs(tx, state, view, fScriptChecks, flags, fCacheResults, nScriptCheckThreads ? &vChecks : NULL))
+            txdata.push_back(PrecomputedTransactionData(tx));
+            if (!CheckInputs(tx, state, view, fScriptChecks, flags, fCacheResults, fCacheResults, txdata.back(), nScriptCheckThreads ? &vChecks : NULL))
                 return error("ConnectBlock(): CheckInputs on %s failed with %s",
                     tx.GetHash().ToString(), FormatStateMessage(state));
             control.Add(vChecks);
@@ -2769,6 +3116,11 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
         return state.DoS(100, false);
     int64_t nTime4 = GetTimeMicros(); nTimeVerify += nTime4 - nTime2;
     LogPrint("bench", "    - Verify %u txins: %.2fms (%.3fms/txin) [%.2fs]\n", nInputs - 1, 0.001 * (nTime4 - nTime2), nInputs <= 1 ? 0 : 0.001 * (nTime4 - nTime2) / (nInputs-1), nTimeVerify * 0.000001);
+    CSetAssociativeCacheStats sigcachestats, scriptcachestats;
+    GetSignatureCacheStats(sigcachestats);
+    GetScriptExecutionCacheStats(scriptcachestats);
+    LogPrint("bench", "    - Signature cache: %u hits, %u misses, %u evictions\n", sigcachestats.nHits, sigcachestats.nMisses, sigcachestats.nEvictions);
+    LogPrint("bench", "    - Script execution cache: %u hits, %u misses, %u evictions\n", scriptcachestats.nHits, scriptcachestats.nMisses, scriptcachestats.nEvictions);
 
     if (fJustCheck)
         return true;
@@ -3025,6 +3377,7 @@ bool static DisconnectTip(CValidationState& state, const Consensus::Params& cons
         CCoinsViewCache view(pcoinsTip);
         if (!DisconnectBlock(block, state, pindexDelete, view))
             return error("DisconnectTip(): DisconnectBlock %s failed", pindexDelete->GetBlockHash().ToString());
+        UpdateCoinsStats(block, *pcoinsTip, view, pindexDelete->pprev);
         assert(view.Flush());
     }
     LogPrint("bench", "- Disconnect block: %.2fms\n", (GetTimeMicros() - nStart) * 0.001);
@@ -3038,7 +3391,7 @@ bool static DisconnectTip(CValidationState& state, const Consensus::Params& cons
         list<CTransaction> removed;
         CValidationState stateDummy;
         if (tx.IsCoinBase() || !AcceptToMemoryPool(mempool, stateDummy, tx, false, NULL, true)) {
-            mempool.remove(tx, removed, true);
+            mempool.remove(tx, removed, true, REMOVAL_REORG);
         } else if (mempool.exists(tx.GetHash())) {
             vHashUpdate.push_back(tx.GetHash());
         }
@@ -3096,6 +3449,7 @@ bool static ConnectTip(CValidationState& state, const CChainParams& chainparams,
         mapBlockSource.erase(pindexNew->GetBlockHash());
         nTime3 = GetTimeMicros(); nTimeConnectTotal += nTime3 - nTime2;
         LogPrint("bench", "  - Connect total: %.2fms [%.2fs]\n", (nTime3 - nTime2) * 0.001, nTimeConnectTotal * 0.000001);
+        UpdateCoinsStats(*pblock, *pcoinsTip, view, pindexNew);
         assert(view.Flush());
     }
     int64_t nTime4 = GetTimeMicros(); nTimeFlush += nTime4 - nTime3;
@@ -4463,8 +4817,7 @@ void UnloadBlockIndex()
     pindexBestInvalid = NULL;
     pindexBestHeader = NULL;
     mempool.clear();
-    mapOrphanTransactions.clear();
-    mapOrphanTransactionsByPrev.clear();
+    orphanpool.clear();
     nSyncStarted = 0;
     mapBlocksUnlinked.clear();
     vinfoBlockFile.clear();
@@ -4947,7 +5300,7 @@ bool static AlreadyHave(const CInv& inv) EXCLUSIVE_LOCKS_REQUIRED(cs_main)
 
             return recentRejects->contains(inv.hash) ||
                    mempool.exists(inv.hash) ||
-                   mapOrphanTransactions.count(inv.hash) ||
+                   orphanpool.HaveTx(inv.hash) ||
                    pcoinsTip->HaveCoins(inv.hash);
         }
 
@@ -5021,7 +5374,7 @@ void static ProcessGetData(CNode* pfrom, const Consensus::Params& consensusParam
             boost::this_thread::interruption_point();
             it++;
 
-            if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK)
+            if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK || inv.type == MSG_CMPCT_BLOCK)
             {
                 bool send = false;
                 BlockMap::iterator mi = mapBlockIndex.find(inv.hash);
@@ -5062,7 +5415,7 @@ void static ProcessGetData(CNode* pfrom, const Consensus::Params& consensusParam
                         assert(!"cannot load block from disk");
                     if (inv.type == MSG_BLOCK)
                         pfrom->PushMessage(NetMsgType::BLOCK, block);
-                    else // MSG_FILTERED_BLOCK)
+                    else if (inv.type == MSG_FILTERED_BLOCK)
                     {
                         LOCK(pfrom->cs_filter);
                         if (pfrom->pfilter)
@@ -5082,6 +5435,18 @@ void static ProcessGetData(CNode* pfrom, const Consensus::Params& consensusParam
                         // else
                             // no response
                     }
+                    else // MSG_CMPCT_BLOCK
+                    {
+                        // If a peer is asking for old blocks, we're almost guaranteed
+                        // they wont have a useful mempool to match against a compact block,
+                        // and we don't feel like constructing the object for them, so
+                        // instead we respond with the full, non-compact block.
+                        if (mi->second->nHeight >= chainActive.Height() - MAX_CMPCTBLOCK_DEPTH) {
+                            CBlockHeaderAndShortTxIDs cmpctblock(block);
+                            pfrom->PushMessage(NetMsgType::CMPCTBLOCK, cmpctblock);
+                        } else
+                            pfrom->PushMessage(NetMsgType::BLOCK, block);
+                    }
 
                     // Trigger the peer node to send a getblocks request for the next batch of inventory
                     if (inv.hash == pfrom->hashContinue)
@@ -5098,28 +5463,16 @@ void static ProcessGetData(CNode* pfrom, const Consensus::Params& consensusParam
             }
             else if (inv.IsKnownType())
             {
-                // Send stream from relay memory
                 bool pushed = false;
-                {
-                    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
-                    {
-                        LOCK(cs_mapRelay);
-                        map<CInv, CDataStream>::iterator mi = mapRelay.find(inv);
-                        if (mi != mapRelay.end()) {
-                            ss += (*mi).second;
-                            pushed = true;
-                        }
-                    }
-                    if(pushed)
-                        pfrom->PushMessage(inv.GetCommand(), ss);
-                }
-
-                if (!pushed && inv.type == MSG_TX) {
-                    CTransaction tx;
-                    if (mempool.lookup(inv.hash, tx)) {
+                if (inv.type == MSG_TX) {
+                    // Send the transaction from relay memory or the mempool
+                    CTransactionRef ptx = relayCache.Find(inv.hash);
+                    if (!ptx)
+                        ptx = mempool.get(inv.hash);
+                    if (ptx) {
                         CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
                         ss.reserve(1000);
-                        ss << tx;
+                        ss << *ptx;
                         pfrom->PushMessage(NetMsgType::TX, ss);
                         pushed = true;
                     }
@@ -5293,6 +5646,34 @@ void static ProcessGetData(CNode* pfrom, const Consensus::Params& consensusParam
     }
 }
 
+/**
+ * Several message handler threads may process messages of different peers
+ * at the same time, but the handlers here and in SendMessages were written
+ * for a single thread. They stay serialized on cs_coreMessages. The
+ * masternode, governance, InstantSend, spork and PrivateSend managers take
+ * their own locks and are serialized on cs_extensionMessages instead, so a
+ * slow governance object or masternode broadcast doesn't hold up blocks and
+ * transactions.
+ */
+static CCriticalSection cs_coreMessages;
+static CCriticalSection cs_extensionMessages;
+
+static bool IsExtensionMessage(const std::string& strCommand)
+{
+    static const char* const ppszExtensionMessages[] = {
+        NetMsgType::TXLOCKVOTE, NetMsgType::SPORK, NetMsgType::GETSPORKS,
+        NetMsgType::MASTERNODEPAYMENTVOTE, NetMsgType::MASTERNODEPAYMENTSYNC,
+        NetMsgType::MNANNOUNCE, NetMsgType::MNPING, NetMsgType::DSEG, NetMsgType::MNVERIFY,
+        NetMsgType::DSACCEPT, NetMsgType::DSVIN, NetMsgType::DSFINALTX, NetMsgType::DSSIGNFINALTX,
+        NetMsgType::DSCOMPLETE, NetMsgType::DSSTATUSUPDATE, NetMsgType::DSQUEUE,
+        NetMsgType::SYNCSTATUSCOUNT, NetMsgType::MNGOVERNANCESYNC, NetMsgType::MNGOVERNANCEOBJECT,
+        NetMsgType::MNGOVERNANCEOBJECTVOTE,
+    };
+    static const std::set<std::string> setExtensionMessages(ppszExtensionMessages,
+        ppszExtensionMessages + ARRAYLEN(ppszExtensionMessages));
+    return setExtensionMessages.count(strCommand) != 0;
+}
+
 bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv, int64_t nTimeReceived)
 {
     const CChainParams& chainparams = Params();
@@ -5495,6 +5876,14 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
             // nodes)
             pfrom->PushMessage(NetMsgType::SENDHEADERS);
         }
+
+        // Tell our peer we are willing to provide version-1 cmpctblocks.
+        // However, we do not request new block announcements using
+        // cmpctblock messages yet, see MaybeSetPeerAsAnnouncingHeaderAndIDs.
+        // Peers that do not know compact blocks ignore the message.
+        bool fAnnounceUsingCMPCTBLOCK = false;
+        uint64_t nCMPCTBLOCKVersion = 1;
+        pfrom->PushMessage(NetMsgType::SENDCMPCT, fAnnounceUsingCMPCTBLOCK, nCMPCTBLOCKVersion);
     }
 
 
@@ -5574,6 +5963,29 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
         State(pfrom->GetId())->fPreferHeaders = true;
     }
 
+    else if (strCommand == NetMsgType::SENDCMPCT)
+    {
+        bool fAnnounceUsingCMPCTBLOCK = false;
+        uint64_t nCMPCTBLOCKVersion = 1;
+        vRecv >> fAnnounceUsingCMPCTBLOCK >> nCMPCTBLOCKVersion;
+        if (nCMPCTBLOCKVersion == 1) {
+            bool fMasternodeLink = fMasterNode && mnodeman.HasAddress(pfrom->addr);
+            LOCK(cs_main);
+            CNodeState *nodestate = State(pfrom->GetId());
+            nodestate->fProvidesHeaderAndIDs = true;
+            nodestate->fPreferHeaderAndIDs = fAnnounceUsingCMPCTBLOCK;
+            // Masternodes have all seen the same InstantSend locks, so compact
+            // blocks between them rebuild without a round trip. Have every
+            // masternode peer announce with cmpctblocks, on top of the three
+            // peers BIP152 picks.
+            if (fMasternodeLink && !nodestate->fRequestedHeaderAndIDs) {
+                fAnnounceUsingCMPCTBLOCK = true;
+                pfrom->PushMessage(NetMsgType::SENDCMPCT, fAnnounceUsingCMPCTBLOCK, nCMPCTBLOCKVersion);
+                nodestate->fRequestedHeaderAndIDs = true;
+            }
+        }
+    }
+
 
     else if (strCommand == NetMsgType::INV)
     {
@@ -5627,7 +6039,10 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
                     CNodeState *nodestate = State(pfrom->GetId());
                     if (CanDirectFetch(chainparams.GetConsensus()) &&
                         nodestate->nBlocksInFlight < MAX_BLOCKS_IN_TRANSIT_PER_PEER) {
-                        vToFetch.push_back(inv);
+                        if (nodestate->fProvidesHeaderAndIDs)
+                            vToFetch.push_back(CInv(MSG_CMPCT_BLOCK, inv.hash));
+                        else
+                            vToFetch.push_back(inv);
                         // Mark block as in flight already, even though the actual "getdata" message only goes out
                         // later (within the same cs_main lock, though).
                         MarkBlockAsInFlight(pfrom->GetId(), inv.hash, chainparams.GetConsensus());
@@ -5782,8 +6197,6 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
             return true;
         }
 
-        vector<uint256> vWorkQueue;
-        vector<uint256> vEraseQueue;
         CTransaction tx;
         CTxLockRequest txLockRequest;
         CDarksendBroadcastTx dstx;
@@ -5798,7 +6211,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
             nInvType = MSG_TXLOCK_REQUEST;
         } else if (strCommand == NetMsgType::DSTX) {
             vRecv >> dstx;
-            tx = dstx.tx;
+            tx = *dstx.tx;
             nInvType = MSG_DSTX;
         }
 
@@ -5856,6 +6269,10 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
             if (strCommand == NetMsgType::DSTX) {
                 LogPrintf("DSTX -- Masternode transaction accepted, txid=%s, peer=%d\n",
                         tx.GetHash().ToString(), pfrom->id);
+                // Share the mempool's copy rather than keeping our own
+                CTransactionRef ptx = mempool.get(tx.GetHash());
+                if (ptx)
+                    dstx.tx = ptx;
                 mapDarksendBroadcastTxes.insert(make_pair(tx.GetHash(), dstx));
             } else if (strCommand == NetMsgType::TXLOCKREQUEST) {
                 LogPrintf("TXLOCKREQUEST -- Transaction Lock Request accepted, txid=%s, peer=%d\n",
@@ -5865,7 +6282,6 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
 
             mempool.check(pcoinsTip);
             RelayTransaction(tx);
-            vWorkQueue.push_back(inv.hash);
 
             pfrom->nLastTXTime = GetTime();
 
@@ -5874,40 +6290,53 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
                 tx.GetHash().ToString(),
                 mempool.size(), mempool.DynamicMemoryUsage() / 1000);
 
-            // Recursively process any orphan transactions that depended on this one
+            // Recursively process any orphan transactions that depended on this one,
+            // a generation at a time. The orphans of a generation are mostly
+            // independent of each other; accept them as a batch so their
+            // scripts are checked in parallel.
             set<NodeId> setMisbehaving;
-            for (unsigned int i = 0; i < vWorkQueue.size(); i++)
+            vector<CTransaction> vParents(1, tx);
+            while (!vParents.empty())
             {
-                map<uint256, set<uint256> >::iterator itByPrev = mapOrphanTransactionsByPrev.find(vWorkQueue[i]);
-                if (itByPrev == mapOrphanTransactionsByPrev.end())
-                    continue;
-                for (set<uint256>::iterator mi = itByPrev->second.begin();
-                     mi != itByPrev->second.end();
-                     ++mi)
+                vector<CTransaction> vOrphanTx;
+                vector<NodeId> vFromPeer;
+                orphanpool.GetChildren(vParents, vOrphanTx, vFromPeer);
+                vParents.clear();
+                size_t nKept = 0;
+                for (size_t j = 0; j < vOrphanTx.size(); j++)
                 {
-                    const uint256& orphanHash = *mi;
-                    const CTransaction& orphanTx = mapOrphanTransactions[orphanHash].tx;
-                    NodeId fromPeer = mapOrphanTransactions[orphanHash].fromPeer;
-                    bool fMissingInputs2 = false;
-                    // Use a dummy CValidationState so someone can't setup nodes to counter-DoS based on orphan
-                    // resolution (that is, feeding people an invalid transaction based on LegitTxX in order to get
-                    // anyone relaying LegitTxX banned)
-                    CValidationState stateDummy;
-
-
-                    if (setMisbehaving.count(fromPeer))
+                    if (setMisbehaving.count(vFromPeer[j]))
                         continue;
-                    if (AcceptToMemoryPool(mempool, stateDummy, orphanTx, true, &fMissingInputs2))
+                    vOrphanTx[nKept] = vOrphanTx[j];
+                    vFromPeer[nKept] = vFromPeer[j];
+                    nKept++;
+                }
+                vOrphanTx.resize(nKept);
+                vFromPeer.resize(nKept);
+                if (vOrphanTx.empty())
+                    break;
+
+                // Use dummy CValidationStates so someone can't setup nodes to counter-DoS based on orphan
+                // resolution (that is, feeding people an invalid transaction based on LegitTxX in order to get
+                // anyone relaying LegitTxX banned)
+                vector<CValidationState> vStateDummy;
+                vector<bool> vAccepted, vMissingInputs2;
+                AcceptToMemoryPoolBatch(mempool, vOrphanTx, true, vStateDummy, vAccepted, vMissingInputs2);
+                for (size_t j = 0; j < vOrphanTx.size(); j++)
+                {
+                    const uint256& orphanHash = vOrphanTx[j].GetHash();
+                    NodeId fromPeer = vFromPeer[j];
+                    if (vAccepted[j])
                     {
                         LogPrint("mempool", "   accepted orphan tx %s\n", orphanHash.ToString());
-                        RelayTransaction(orphanTx);
-                        vWorkQueue.push_back(orphanHash);
-                        vEraseQueue.push_back(orphanHash);
+                        RelayTransaction(vOrphanTx[j]);
+                        vParents.push_back(vOrphanTx[j]);
+                        orphanpool.EraseTx(orphanHash);
                     }
-                    else if (!fMissingInputs2)
+                    else if (!vMissingInputs2[j])
                     {
                         int nDos = 0;
-                        if (stateDummy.IsInvalid(nDos) && nDos > 0)
+                        if (vStateDummy[j].IsInvalid(nDos) && nDos > 0 && !setMisbehaving.count(fromPeer))
                         {
                             // Punish peer that gave us an invalid orphan tx
                             Misbehaving(fromPeer, nDos);
@@ -5917,26 +6346,23 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
                         // Has inputs but not accepted to mempool
                         // Probably non-standard or insufficient fee/priority
                         LogPrint("mempool", "   removed orphan tx %s\n", orphanHash.ToString());
-                        vEraseQueue.push_back(orphanHash);
+                        orphanpool.EraseTx(orphanHash);
                         assert(recentRejects);
                         recentRejects->insert(orphanHash);
                     }
-                    mempool.check(pcoinsTip);
                 }
+                mempool.check(pcoinsTip);
             }
-
-            BOOST_FOREACH(uint256 hash, vEraseQueue)
-                EraseOrphanTx(hash);
         }
         else if (fMissingInputs)
         {
-            AddOrphanTx(tx, pfrom->GetId());
+            orphanpool.AddTx(tx, pfrom->GetId());
 
-            // DoS prevention: do not allow mapOrphanTransactions to grow unbounded
+            // DoS prevention: do not allow the orphan pool to grow unbounded
             unsigned int nMaxOrphanTx = (unsigned int)std::max((int64_t)0, GetArg("-maxorphantx", DEFAULT_MAX_ORPHAN_TRANSACTIONS));
-            unsigned int nEvicted = LimitOrphanTxSize(nMaxOrphanTx);
+            unsigned int nEvicted = orphanpool.LimitOrphans(nMaxOrphanTx);
             if (nEvicted > 0)
-                LogPrint("mempool", "mapOrphan overflow, removed %u tx\n", nEvicted);
+                LogPrint("mempool", "orphan pool overflow, removed %u tx\n", nEvicted);
         } else {
             assert(recentRejects);
             recentRejects->insert(tx.GetHash());
@@ -6085,6 +6511,13 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
                             pindexLast->GetBlockHash().ToString(), pindexLast->nHeight);
                 }
                 if (vGetData.size() > 0) {
+                    if (nodestate->fProvidesHeaderAndIDs && vGetData.size() == 1 && mapBlocksInFlight.size() == 1 && pindexLast->pprev->IsValid(BLOCK_VALID_CHAIN)) {
+                        // We seem to be rather well-synced, so it appears pfrom was the first to provide us
+                        // with this block! Let's get them to announce using compact blocks in the future.
+                        MaybeSetPeerAsAnnouncingHeaderAndIDs(nodestate, pfrom);
+                        // In any case, we want to download using a compact block, not a regular one
+                        vGetData[0] = CInv(MSG_CMPCT_BLOCK, vGetData[0].hash);
+                    }
                     pfrom->PushMessage(NetMsgType::GETDATA, vGetData);
                 }
             }
@@ -6127,6 +6560,228 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
     }
 
 
+    else if (strCommand == NetMsgType::GETBLOCKTXN)
+    {
+        BlockTransactionsRequest req;
+        vRecv >> req;
+
+        LOCK(cs_main);
+
+        BlockMap::iterator it = mapBlockIndex.find(req.blockhash);
+        if (it == mapBlockIndex.end() || !(it->second->nStatus & BLOCK_HAVE_DATA)) {
+            LogPrintf("Peer %d sent us a getblocktxn for a block we don't have\n", pfrom->id);
+            return true;
+        }
+
+        if (it->second->nHeight < chainActive.Height() - MAX_BLOCKTXN_DEPTH) {
+            // If an older block is requested (should never happen in practice,
+            // but can happen in tests) send a block response instead of a
+            // blocktxn response. Sending a full block response instead of a
+            // small blocktxn response is preferable in the case where a peer
+            // might maliciously send lots of getblocktxn requests to trigger
+            // expensive disk reads, because it will require the peer to
+            // actually receive all the data read from disk over the network.
+            LogPrint("net", "Peer %d sent us a getblocktxn for a block > %i deep\n", pfrom->id, MAX_BLOCKTXN_DEPTH);
+            pfrom->vRecvGetData.push_back(CInv(MSG_BLOCK, req.blockhash));
+            ProcessGetData(pfrom, chainparams.GetConsensus());
+            return true;
+        }
+
+        CBlock block;
+        if (!ReadBlockFromDisk(block, it->second, chainparams.GetConsensus()))
+            assert(!"cannot load block from disk");
+
+        BlockTransactions resp(req);
+        for (size_t i = 0; i < req.indexes.size(); i++) {
+            if (req.indexes[i] >= block.vtx.size()) {
+                Misbehaving(pfrom->GetId(), 100);
+                LogPrintf("Peer %d sent us a getblocktxn with out-of-bounds tx indices\n", pfrom->id);
+                return true;
+            }
+            resp.txn[i] = block.vtx[req.indexes[i]];
+        }
+        pfrom->PushMessage(NetMsgType::BLOCKTXN, resp);
+    }
+
+
+    else if (strCommand == NetMsgType::CMPCTBLOCK && !fImporting && !fReindex) // Ignore blocks received while importing
+    {
+        CBlockHeaderAndShortTxIDs cmpctblock;
+        vRecv >> cmpctblock;
+
+        // InstantSend lock requests help rebuilding blocks with txs we no longer have in the mempool
+        std::vector<CTransactionRef> vExtraTxn;
+        instantsend.GetTxLockRequests(vExtraTxn);
+
+        LOCK(cs_main);
+
+        if (mapBlockIndex.find(cmpctblock.header.hashPrevBlock) == mapBlockIndex.end()) {
+            // Doesn't connect (or is genesis), instead of DoSing in AcceptBlockHeader, request deeper headers
+            if (!IsInitialBlockDownload())
+                pfrom->PushMessage(NetMsgType::GETHEADERS, chainActive.GetLocator(pindexBestHeader), uint256());
+            return true;
+        }
+
+        CBlockIndex *pindex = NULL;
+        CValidationState state;
+        if (!AcceptBlockHeader(cmpctblock.header, state, chainparams, &pindex)) {
+            int nDoS;
+            if (state.IsInvalid(nDoS)) {
+                if (nDoS > 0)
+                    Misbehaving(pfrom->GetId(), nDoS);
+                LogPrintf("Peer %d sent us invalid header via cmpctblock\n", pfrom->id);
+                return true;
+            }
+        }
+
+        // If AcceptBlockHeader returned true, it set pindex
+        assert(pindex);
+        UpdateBlockAvailability(pfrom->GetId(), pindex->GetBlockHash());
+
+        map<uint256, pair<NodeId, list<QueuedBlock>::iterator> >::iterator blockInFlightIt = mapBlocksInFlight.find(pindex->GetBlockHash());
+        bool fAlreadyInFlight = blockInFlightIt != mapBlocksInFlight.end();
+
+        if (pindex->nStatus & BLOCK_HAVE_DATA) // Nothing to do here
+            return true;
+
+        if (pindex->nChainWork <= chainActive.Tip()->nChainWork || // We know something better
+                pindex->nTx != 0) { // We had this block at some point, but pruned it
+            if (fAlreadyInFlight) {
+                // We requested this block for some reason, but our mempool will probably be useless
+                // so we just grab the block via normal getdata
+                std::vector<CInv> vInv(1);
+                vInv[0] = CInv(MSG_BLOCK, cmpctblock.header.GetHash());
+                pfrom->PushMessage(NetMsgType::GETDATA, vInv);
+            }
+            return true;
+        }
+
+        // If we're not close to tip yet, give up and let parallel block fetch work its magic
+        if (!fAlreadyInFlight && !CanDirectFetch(chainparams.GetConsensus()))
+            return true;
+
+        CNodeState *nodestate = State(pfrom->GetId());
+
+        // We want to be a bit conservative just to be extra careful about DoS
+        // possibilities in compact block processing...
+        if (pindex->nHeight <= chainActive.Height() + 2) {
+            if ((!fAlreadyInFlight && nodestate->nBlocksInFlight < MAX_BLOCKS_IN_TRANSIT_PER_PEER) ||
+                 (fAlreadyInFlight && blockInFlightIt->second.first == pfrom->GetId())) {
+                list<QueuedBlock>::iterator *queuedBlockIt = NULL;
+                if (!MarkBlockAsInFlight(pfrom->GetId(), pindex->GetBlockHash(), chainparams.GetConsensus(), pindex, &queuedBlockIt)) {
+                    if (!(*queuedBlockIt)->partialBlock)
+                        (*queuedBlockIt)->partialBlock.reset(new PartiallyDownloadedBlock(&mempool));
+                    else {
+                        // The block was already in flight using compact blocks from the same peer
+                        LogPrint("net", "Peer sent us compact block we were already syncing!\n");
+                        return true;
+                    }
+                }
+
+                PartiallyDownloadedBlock& partialBlock = *(*queuedBlockIt)->partialBlock;
+                ReadStatus status = partialBlock.InitData(cmpctblock, vExtraTxn);
+                if (status == READ_STATUS_INVALID) {
+                    MarkBlockAsReceived(pindex->GetBlockHash()); // Reset in-flight state in case of whitelist
+                    Misbehaving(pfrom->GetId(), 100);
+                    LogPrintf("Peer %d sent us invalid compact block\n", pfrom->id);
+                    return true;
+                }
+                nodestate->nCmpctBlocks++;
+                if (status == READ_STATUS_FAILED) {
+                    // Duplicate txindexes, the block is now in-flight, so just request it
+                    nodestate->nCmpctFallback++;
+                    std::vector<CInv> vInv(1);
+                    vInv[0] = CInv(MSG_BLOCK, cmpctblock.header.GetHash());
+                    pfrom->PushMessage(NetMsgType::GETDATA, vInv);
+                    return true;
+                }
+
+                BlockTransactionsRequest req;
+                for (size_t i = 0; i < cmpctblock.BlockTxCount(); i++) {
+                    if (!partialBlock.IsTxAvailable(i))
+                        req.indexes.push_back(i);
+                }
+                if (req.indexes.empty()) {
+                    // Dirty hack to jump to BLOCKTXN code (TODO: move message handling into their own functions)
+                    BlockTransactions txn;
+                    txn.blockhash = cmpctblock.header.GetHash();
+                    CDataStream blockTxnMsg(SER_NETWORK, PROTOCOL_VERSION);
+                    blockTxnMsg << txn;
+                    return ProcessMessage(pfrom, NetMsgType::BLOCKTXN, blockTxnMsg, nTimeReceived);
+                } else {
+                    nodestate->nCmpctTxnRequested++;
+                    req.blockhash = pindex->GetBlockHash();
+                    pfrom->PushMessage(NetMsgType::GETBLOCKTXN, req);
+                }
+            }
+        } else {
+            if (fAlreadyInFlight) {
+                // We requested this block, but its far into the future, so our
+                // mempool will probably be useless - request the block normally
+                std::vector<CInv> vInv(1);
+                vInv[0] = CInv(MSG_BLOCK, cmpctblock.header.GetHash());
+                pfrom->PushMessage(NetMsgType::GETDATA, vInv);
+                return true;
+            } else {
+                // If this was an announce-cmpctblock, we want the same treatment as a header message
+                // Dirty hack to process as if it were just a headers message (TODO: move message handling into their own functions)
+                std::vector<CBlock> headers;
+                headers.push_back(cmpctblock.header);
+                CDataStream vHeadersMsg(SER_NETWORK, PROTOCOL_VERSION);
+                vHeadersMsg << headers;
+                return ProcessMessage(pfrom, NetMsgType::HEADERS, vHeadersMsg, nTimeReceived);
+            }
+        }
+
+        CheckBlockIndex(chainparams.GetConsensus());
+    }
+
+    else if (strCommand == NetMsgType::BLOCKTXN && !fImporting && !fReindex) // Ignore blocks received while importing
+    {
+        BlockTransactions resp;
+        vRecv >> resp;
+
+        LOCK(cs_main);
+
+        map<uint256, pair<NodeId, list<QueuedBlock>::iterator> >::iterator it = mapBlocksInFlight.find(resp.blockhash);
+        if (it == mapBlocksInFlight.end() || !it->second.second->partialBlock ||
+                it->second.first != pfrom->GetId()) {
+            LogPrint("net", "Peer %d sent us block transactions for block we weren't expecting\n", pfrom->id);
+            return true;
+        }
+
+        CNodeState *nodestate = State(pfrom->GetId());
+        PartiallyDownloadedBlock& partialBlock = *it->second.second->partialBlock;
+        CBlock block;
+        ReadStatus status = partialBlock.FillBlock(block, resp.txn);
+        if (status == READ_STATUS_INVALID) {
+            MarkBlockAsReceived(resp.blockhash); // Reset in-flight state in case of whitelist
+            Misbehaving(pfrom->GetId(), 100);
+            LogPrintf("Peer %d sent us invalid compact block/non-matching block transactions\n", pfrom->id);
+            return true;
+        } else if (status == READ_STATUS_FAILED) {
+            // Might have collided, fall back to getdata now :(
+            nodestate->nCmpctFallback++;
+            std::vector<CInv> invs;
+            invs.push_back(CInv(MSG_BLOCK, resp.blockhash));
+            pfrom->PushMessage(NetMsgType::GETDATA, invs);
+        } else {
+            if (resp.txn.empty())
+                nodestate->nCmpctNoRoundTrip++;
+            CValidationState state;
+            ProcessNewBlock(state, chainparams, pfrom, &block, false, NULL);
+            int nDoS;
+            if (state.IsInvalid(nDoS)) {
+                assert (state.GetRejectCode() < REJECT_INTERNAL); // Blocks are never rejected with internal reject codes
+                pfrom->PushMessage(NetMsgType::REJECT, strCommand, (unsigned char)state.GetRejectCode(),
+                                   state.GetRejectReason().substr(0, MAX_REJECT_MESSAGE_LENGTH), block.GetHash());
+                if (nDoS > 0)
+                    Misbehaving(pfrom->GetId(), nDoS);
+            }
+        }
+    }
+
+
     else if (strCommand == NetMsgType::GETADDR)
     {
         // This asymmetric behavior for inbound and outbound connections was introduced
@@ -6415,8 +7070,10 @@ bool ProcessMessages(CNode* pfrom)
     //
     bool fOk = true;
 
-    if (!pfrom->vRecvGetData.empty())
+    if (!pfrom->vRecvGetData.empty()) {
+        LOCK(cs_coreMessages);
         ProcessGetData(pfrom, chainparams.GetConsensus());
+    }
 
     // this maintains the order of responses
     if (!pfrom->vRecvGetData.empty()) return fOk;
@@ -6461,10 +7118,10 @@ bool ProcessMessages(CNode* pfrom)
         // Message size
         unsigned int nMessageSize = hdr.nMessageSize;
 
-        // Checksum
+        // Checksum, computed while the data was received
         CDataStream& vRecv = msg.vRecv;
-        uint256 hash = Hash(vRecv.begin(), vRecv.begin() + nMessageSize);
-        unsigned int nChecksum = ReadLE32((unsigned char*)&hash);
+        const uint256& hash = msg.GetMessageHash();
+        unsigned int nChecksum = ReadLE32(hash.begin());
         if (nChecksum != hdr.nChecksum)
         {
             LogPrintf("%s(%s, %u bytes): CHECKSUM ERROR nChecksum=%08x hdr.nChecksum=%08x\n", __func__,
@@ -6476,6 +7133,7 @@ bool ProcessMessages(CNode* pfrom)
         bool fRet = false;
         try
         {
+            LOCK(IsExtensionMessage(strCommand) ? cs_extensionMessages : cs_coreMessages);
             fRet = ProcessMessage(pfrom, strCommand, vRecv, msg.nTime);
             boost::this_thread::interruption_point();
         }
@@ -6514,11 +7172,34 @@ bool ProcessMessages(CNode* pfrom)
 
     // In case the connection got shut down, its receive buffer was wiped
     if (!pfrom->fDisconnect)
-        pfrom->vRecvMsg.erase(pfrom->vRecvMsg.begin(), it);
+        pfrom->PopRecvMsgs(it);
 
     return fOk;
 }
 
+/**
+ * How many relayed items of this inventory type are announced to a peer per
+ * trickle, so a flood of one kind does not hold back the others. Zero means
+ * the type is not trickled at all.
+ */
+static unsigned int GetInventoryBroadcastMax(int nType)
+{
+    switch (nType) {
+    case MSG_TX:
+    case MSG_DSTX:
+        return INVENTORY_BROADCAST_MAX;
+    case MSG_MASTERNODE_ANNOUNCE:
+    case MSG_MASTERNODE_PING:
+    case MSG_MASTERNODE_PAYMENT_VOTE:
+    case MSG_MASTERNODE_VERIFY:
+    case MSG_GOVERNANCE_OBJECT:
+    case MSG_GOVERNANCE_OBJECT_VOTE:
+        return INVENTORY_BROADCAST_MAX_MASTERNODE;
+    default:
+        // InstantSend has to be fast, sporks and blocks are rare
+        return 0;
+    }
+}
 
 bool SendMessages(CNode* pto)
 {
@@ -6528,6 +7209,11 @@ bool SendMessages(CNode* pto)
         if (pto->nVersion == 0)
             return true;
 
+        // Try again later if another thread is handling a message
+        TRY_LOCK(cs_coreMessages, lockCore);
+        if (!lockCore)
+            return true;
+
         //
         // Message: ping
         //
@@ -6652,14 +7338,16 @@ bool SendMessages(CNode* pto)
         {
             // If we have less than MAX_BLOCKS_TO_ANNOUNCE in our
             // list of block hashes we're relaying, and our peer wants
-            // headers announcements, then find the first header
-            // not yet known to our peer but would connect, and send.
-            // If no header would connect, or if we have too many
-            // blocks, or if the peer doesn't want headers, just
+            // headers or compact block announcements, then find the
+            // first header not yet known to our peer but would connect,
+            // and send. If no header would connect, or if we have too
+            // many blocks, or if the peer doesn't want headers, just
             // add all to the inv queue.
             LOCK(pto->cs_inventory);
             vector<CBlock> vHeaders;
-            bool fRevertToInv = (!state.fPreferHeaders || pto->vBlockHashesToAnnounce.size() > MAX_BLOCKS_TO_ANNOUNCE);
+            bool fRevertToInv = ((!state.fPreferHeaders &&
+                                 (!state.fPreferHeaderAndIDs || pto->vBlockHashesToAnnounce.size() > 1)) ||
+                                pto->vBlockHashesToAnnounce.size() > MAX_BLOCKS_TO_ANNOUNCE);
             CBlockIndex *pBestIndex = NULL; // last header queued for delivery
             ProcessBlockAvailability(pto->id); // ensure pindexBestKnownBlock is up-to-date
 
@@ -6711,6 +7399,33 @@ bool SendMessages(CNode* pto)
                     }
                 }
             }
+            if (!fRevertToInv && !vHeaders.empty()) {
+                if (vHeaders.size() == 1 && state.fPreferHeaderAndIDs) {
+                    // We only send up to 1 block as header-and-ids, as otherwise
+                    // probably means we're doing an initial-ish-sync or they're slow
+                    LogPrint("net", "%s: sending cmpctblock %s to peer=%d\n", __func__,
+                            vHeaders.front().GetHash().ToString(), pto->id);
+                    CBlock block;
+                    if (!ReadBlockFromDisk(block, pBestIndex, consensusParams))
+                        assert(!"cannot load block from disk");
+                    CBlockHeaderAndShortTxIDs cmpctblock(block);
+                    pto->PushMessage(NetMsgType::CMPCTBLOCK, cmpctblock);
+                    state.pindexBestHeaderSent = pBestIndex;
+                } else if (state.fPreferHeaders) {
+                    if (vHeaders.size() > 1) {
+                        LogPrint("net", "%s: %u headers, range (%s, %s), to peer=%d\n", __func__,
+                                vHeaders.size(),
+                                vHeaders.front().GetHash().ToString(),
+                                vHeaders.back().GetHash().ToString(), pto->id);
+                    } else {
+                        LogPrint("net", "%s: sending header %s to peer=%d\n", __func__,
+                                vHeaders.front().GetHash().ToString(), pto->id);
+                    }
+                    pto->PushMessage(NetMsgType::HEADERS, vHeaders);
+                    state.pindexBestHeaderSent = pBestIndex;
+                } else
+                    fRevertToInv = true;
+            }
             if (fRevertToInv) {
                 // If falling back to using an inv, just try to inv the tip.
                 // The last entry in vBlockHashesToAnnounce was our tip at some point
@@ -6738,18 +7453,6 @@ bool SendMessages(CNode* pto)
                             pto->id, hashToAnnounce.ToString());
                     }
                 }
-            } else if (!vHeaders.empty()) {
-                if (vHeaders.size() > 1) {
-                    LogPrint("net", "%s: %u headers, range (%s, %s), to peer=%d\n", __func__,
-                            vHeaders.size(),
-                            vHeaders.front().GetHash().ToString(),
-                            vHeaders.back().GetHash().ToString(), pto->id);
-                } else {
-                    LogPrint("net", "%s: sending header %s to peer=%d\n", __func__,
-                            vHeaders.front().GetHash().ToString(), pto->id);
-                }
-                pto->PushMessage(NetMsgType::HEADERS, vHeaders);
-                state.pindexBestHeaderSent = pBestIndex;
             }
             pto->vBlockHashesToAnnounce.clear();
         }
@@ -6758,40 +7461,25 @@ bool SendMessages(CNode* pto)
         // Message: inventory
         //
         vector<CInv> vInv;
-        vector<CInv> vInvWait;
+        vector<CInv> vInvTrickle;
         {
             bool fSendTrickle = pto->fWhitelisted;
             if (pto->nNextInvSend < nNow) {
                 fSendTrickle = true;
-                pto->nNextInvSend = PoissonNextSend(nNow, AVG_INVENTORY_BROADCAST_INTERVAL);
+                // All inbound peers share one schedule, so they get the same
+                // batches (which are then serialized only once) and the time
+                // an inv arrives tells less about where it came from
+                if (pto->fInbound)
+                    pto->nNextInvSend = PoissonNextSendInbound(nNow, AVG_INVENTORY_BROADCAST_INTERVAL);
+                else
+                    pto->nNextInvSend = PoissonNextSend(nNow, AVG_INVENTORY_BROADCAST_INTERVAL >> 1);
             }
             LOCK(pto->cs_inventory);
             vInv.reserve(std::min<size_t>(1000, pto->vInventoryToSend.size()));
-            vInvWait.reserve(pto->vInventoryToSend.size());
             BOOST_FOREACH(const CInv& inv, pto->vInventoryToSend)
             {
                 if (inv.type == MSG_TX && pto->filterInventoryKnown.contains(inv.hash))
                     continue;
-
-                // trickle out tx inv to protect privacy
-                if (inv.type == MSG_TX && !fSendTrickle)
-                {
-                    // 1/4 of tx invs blast to all immediately
-                    static uint256 hashSalt;
-                    if (hashSalt.IsNull())
-                        hashSalt = GetRandHash();
-                    uint256 hashRand = ArithToUint256(UintToArith256(inv.hash) ^ UintToArith256(hashSalt));
-                    hashRand = Hash(BEGIN(hashRand), END(hashRand));
-                    bool fTrickleWait = ((UintToArith256(hashRand) & 3) != 0);
-
-                    if (fTrickleWait)
-                    {
-                        LogPrint("net", "SendMessages -- queued inv(vInvWait): %s  index=%d peer=%d\n", inv.ToString(), vInvWait.size(), pto->id);
-                        vInvWait.push_back(inv);
-                        continue;
-                    }
-                }
-
                 pto->filterInventoryKnown.insert(inv.hash);
 
                 LogPrint("net", "SendMessages -- queued inv: %s  index=%d peer=%d\n", inv.ToString(), vInv.size(), pto->id);
@@ -6799,15 +7487,47 @@ bool SendMessages(CNode* pto)
                 if (vInv.size() >= 1000)
                 {
                     LogPrint("net", "SendMessages -- pushing inv's: count=%d peer=%d\n", vInv.size(), pto->id);
-                    pto->PushMessage(NetMsgType::INV, vInv);
+                    PushInventoryMessage(pto, vInv);
                     vInv.clear();
                 }
             }
-            pto->vInventoryToSend = vInvWait;
+            pto->vInventoryToSend.clear();
+
+            // Relayed inventory waits for the trickle, up to the cap of its type
+            std::map<int, unsigned int> mapTypeCount;
+            std::deque<CInv> vRelayWait;
+            BOOST_FOREACH(const CInv& inv, pto->vInventoryToRelay)
+            {
+                if (pto->filterInventoryKnown.contains(inv.hash))
+                    continue;
+                unsigned int nMax = GetInventoryBroadcastMax(inv.type);
+                if (nMax > 0 && (!fSendTrickle || mapTypeCount[inv.type] >= nMax)) {
+                    vRelayWait.push_back(inv);
+                    continue;
+                }
+                pto->filterInventoryKnown.insert(inv.hash);
+
+                vector<CInv>& vBatch = nMax > 0 ? vInvTrickle : vInv;
+                if (nMax > 0)
+                    mapTypeCount[inv.type]++;
+                LogPrint("net", "SendMessages -- queued inv: %s  index=%d peer=%d\n", inv.ToString(), vBatch.size(), pto->id);
+                vBatch.push_back(inv);
+                if (vBatch.size() >= 1000)
+                {
+                    LogPrint("net", "SendMessages -- pushing inv's: count=%d peer=%d\n", vBatch.size(), pto->id);
+                    PushInventoryMessage(pto, vBatch);
+                    vBatch.clear();
+                }
+            }
+            pto->vInventoryToRelay.swap(vRelayWait);
         }
         if (!vInv.empty()) {
             LogPrint("net", "SendMessages -- pushing tailing inv's: count=%d peer=%d\n", vInv.size(), pto->id);
-            pto->PushMessage(NetMsgType::INV, vInv);
+            PushInventoryMessage(pto, vInv);
+        }
+        if (!vInvTrickle.empty()) {
+            LogPrint("net", "SendMessages -- pushing trickled inv's: count=%d peer=%d\n", vInvTrickle.size(), pto->id);
+            PushInventoryMessage(pto, vInvTrickle);
         }
 
         // Detect whether we're stalling
@@ -6897,6 +7617,147 @@ ThresholdState VersionBitsTipState(const Consensus::Params& params, Consensus::D
     return VersionBitsState(chainActive.Tip(), params, pos, versionbitscache);
 }
 
+static const uint64_t MEMPOOL_DUMP_VERSION = 1;
+/** Transactions LoadMempool adds to the mempool per cs_main acquisition */
+static const size_t MEMPOOL_LOAD_BATCH_SIZE = 1000;
+
+namespace {
+
+/** Parents before children: a transaction has more ancestors than any of its parents */
+struct CompareTxIterByAncestorCount
+{
+    bool operator()(const CTxMemPool::txiter& a, const CTxMemPool::txiter& b) const
+    {
+        return a->GetCountWithAncestors() < b->GetCountWithAncestors();
+    }
+};
+
+} // anon namespace
+
+bool LoadMempool()
+{
+    int64_t nExpiryTimeout = GetArg("-mempoolexpiry", DEFAULT_MEMPOOL_EXPIRY) * 60 * 60;
+    FILE* filestr = fopen((GetDataDir() / "mempool.dat").string().c_str(), "rb");
+    CAutoFile file(filestr, SER_DISK, CLIENT_VERSION);
+    if (file.IsNull()) {
+        LogPrintf("Failed to open mempool file from disk. Continuing anyway.\n");
+        return false;
+    }
+
+    int64_t nStart = GetTimeMillis();
+    int64_t nNow = GetTime();
+    std::vector<CTransaction> vtx;
+    std::vector<int64_t> vAcceptTime;
+    std::map<uint256, std::pair<double, CAmount> > mapDeltas;
+    int nExpired = 0;
+    try {
+        uint64_t nVersion;
+        file >> nVersion;
+        if (nVersion != MEMPOOL_DUMP_VERSION) {
+            LogPrintf("Unknown mempool file version %d. Continuing anyway.\n", nVersion);
+            return false;
+        }
+        uint64_t nCount;
+        file >> nCount;
+        while (nCount--) {
+            CTransaction tx;
+            int64_t nTime;
+            file >> tx;
+            file >> nTime;
+            if (nTime + nExpiryTimeout > nNow) {
+                vtx.push_back(tx);
+                vAcceptTime.push_back(nTime);
+            } else {
+                ++nExpired;
+            }
+        }
+        file >> mapDeltas;
+    } catch (const std::exception& e) {
+        LogPrintf("Failed to deserialize mempool data on disk: %s. Continuing anyway.\n", e.what());
+        return false;
+    }
+
+    // Fee deltas first, so the transactions are accepted with them
+    for (std::map<uint256, std::pair<double, CAmount> >::const_iterator it = mapDeltas.begin(); it != mapDeltas.end(); ++it)
+        mempool.PrioritiseTransaction(it->first, it->first.ToString(), it->second.first, it->second.second);
+
+    // The dump has parents before their children, so most batches are
+    // accepted without waiting on each other's script checks. cs_main is
+    // released between batches to let the node carry on meanwhile.
+    int nSuccess = 0, nFailed = 0, nAlreadyThere = 0;
+    for (size_t nBegin = 0; nBegin < vtx.size(); nBegin += MEMPOOL_LOAD_BATCH_SIZE) {
+        if (ShutdownRequested())
+            return false;
+        size_t nEnd = std::min(vtx.size(), nBegin + MEMPOOL_LOAD_BATCH_SIZE);
+        std::vector<CTransaction> vBatch(vtx.begin() + nBegin, vtx.begin() + nEnd);
+        std::vector<int64_t> vBatchTime(vAcceptTime.begin() + nBegin, vAcceptTime.begin() + nEnd);
+        std::vector<CValidationState> vState;
+        std::vector<bool> vAccepted, vMissingInputs;
+        {
+            LOCK(cs_main);
+            AcceptToMemoryPoolBatch(mempool, vBatch, true, vState, vAccepted, vMissingInputs, &vBatchTime);
+        }
+        for (size_t i = 0; i < vBatch.size(); i++) {
+            if (vAccepted[i])
+                ++nSuccess;
+            else if (vState[i].GetRejectReason() == "txn-already-in-mempool")
+                ++nAlreadyThere;
+            else
+                ++nFailed;
+        }
+        LogPrintf("Loading mempool: %u of %u transactions\n", nEnd, vtx.size());
+    }
+
+    LogPrintf("Imported mempool transactions from disk: %i successes, %i failed, %i expired, %i already there (%dms)\n",
+              nSuccess, nFailed, nExpired, nAlreadyThere, GetTimeMillis() - nStart);
+    return true;
+}
+
+bool DumpMempool()
+{
+    int64_t nStart = GetTimeMicros();
+
+    // Serialize in memory with the pool locked, write without
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    {
+        LOCK(mempool.cs);
+        std::vector<CTxMemPool::txiter> vEntries;
+        vEntries.reserve(mempool.mapTx.size());
+        for (CTxMemPool::txiter it = mempool.mapTx.begin(); it != mempool.mapTx.end(); ++it)
+            vEntries.push_back(it);
+        std::sort(vEntries.begin(), vEntries.end(), CompareTxIterByAncestorCount());
+
+        ss << MEMPOOL_DUMP_VERSION;
+        ss << (uint64_t)vEntries.size();
+        BOOST_FOREACH(const CTxMemPool::txiter& it, vEntries) {
+            ss << it->GetTx();
+            ss << it->GetTime();
+        }
+        ss << mempool.mapDeltas;
+    }
+
+    int64_t nMid = GetTimeMicros();
+
+    try {
+        boost::filesystem::path pathTmp = GetDataDir() / "mempool.dat.new";
+        FILE* filestr = fopen(pathTmp.string().c_str(), "wb");
+        if (!filestr)
+            return false;
+
+        CAutoFile file(filestr, SER_DISK, CLIENT_VERSION);
+        file.write(&ss[0], ss.size());
+        FileCommit(file.Get());
+        file.fclose();
+        RenameOver(pathTmp, GetDataDir() / "mempool.dat");
+        int64_t nLast = GetTimeMicros();
+        LogPrintf("Dumped mempool: %gs to copy, %gs to dump\n", (nMid-nStart)*0.000001, (nLast-nMid)*0.000001);
+    } catch (const std::exception& e) {
+        LogPrintf("Failed to dump mempool: %s. Continuing anyway.\n", e.what());
+        return false;
+    }
+    return true;
+}
+
 class CMainCleanup
 {
 public:
@@ -6909,7 +7770,6 @@ public:
         mapBlockIndex.clear();
 
         // orphan transactions
-        mapOrphanTransactions.clear();
-        mapOrphanTransactionsByPrev.clear();
+        orphanpool.clear();
     }
 } instance_of_cmaincleanup;
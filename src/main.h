@@ -36,6 +36,7 @@ class CBlockIndex;
 class CBlockTreeDB;
 class CBloomFilter;
 class CChainParams;
+class CCoinsViewDB;
 class CInv;
 class CScriptCheck;
 class CTxMemPool;
@@ -43,7 +44,9 @@ class CValidationInterface;
 class CValidationState;
 
 struct CNodeStateStats;
+struct CSetAssociativeCacheStats;
 struct LockPoints;
+struct PrecomputedTransactionData;
 
 /** Default for accepting alerts from the P2P network. */
 static const bool DEFAULT_ALERTS = true;
@@ -68,6 +71,8 @@ static const unsigned int DEFAULT_DESCENDANT_LIMIT = 25;
 static const unsigned int DEFAULT_DESCENDANT_SIZE_LIMIT = 101;
 /** Default for -mempoolexpiry, expiration time for mempool transactions in hours */
 static const unsigned int DEFAULT_MEMPOOL_EXPIRY = 72;
+/** Default for -persistmempool */
+static const bool DEFAULT_PERSIST_MEMPOOL = true;
 /** The maximum size of a blk?????.dat file (since 0.8) */
 static const unsigned int MAX_BLOCKFILE_SIZE = 0x8000000; // 128 MiB
 /** The pre-allocation chunk size for blk?????.dat files (since 0.8) */
@@ -101,9 +106,13 @@ static const unsigned int MAX_REJECT_MESSAGE_LENGTH = 111;
 static const unsigned int AVG_LOCAL_ADDRESS_BROADCAST_INTERVAL = 24 * 24 * 60;
 /** Average delay between peer address broadcasts in seconds. */
 static const unsigned int AVG_ADDRESS_BROADCAST_INTERVAL = 30;
-/** Average delay between trickled inventory broadcasts in seconds.
- *  Blocks, whitelisted receivers, and a random 25% of transactions bypass this. */
+/** Average delay between trickled inventory broadcasts to inbound peers in seconds, outbound
+ *  peers get half of it. Blocks, InstantSend, sporks and whitelisted receivers bypass this. */
 static const unsigned int AVG_INVENTORY_BROADCAST_INTERVAL = 5;
+/** Maximum number of transactions announced to a peer per trickle. */
+static const unsigned int INVENTORY_BROADCAST_MAX = 7 * AVG_INVENTORY_BROADCAST_INTERVAL;
+/** Maximum number of items of each masternode and governance inventory type announced to a peer per trickle. */
+static const unsigned int INVENTORY_BROADCAST_MAX_MASTERNODE = 50 * AVG_INVENTORY_BROADCAST_INTERVAL;
 /** Block download timeout base, expressed in millionths of the block interval (i.e. 2.5 min) */
 static const int64_t BLOCK_DOWNLOAD_TIMEOUT_BASE = 250000;
 /** Additional block download timeout per parallel downloading peer (i.e. 1.25 min) */
@@ -129,6 +138,12 @@ static const bool DEFAULT_ENABLE_REPLACEMENT = false;
 /** Maximum number of headers to announce when relaying blocks with headers message.*/
 static const unsigned int MAX_BLOCKS_TO_ANNOUNCE = 8;
 
+/** Maximum depth of blocks we're willing to serve as compact blocks to peers
+ *  when requested. For older blocks, a regular BLOCK response will be sent. */
+static const int MAX_CMPCTBLOCK_DEPTH = 5;
+/** Maximum depth of blocks we're willing to respond to GETBLOCKTXN requests for. */
+static const int MAX_BLOCKTXN_DEPTH = 10;
+
 struct BlockHasher
 {
     size_t operator()(const uint256& hash) const { return hash.GetCheapHash(); }
@@ -289,6 +304,27 @@ void PruneAndFlush();
 bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransaction &tx, bool fLimitFree,
                         bool* pfMissingInputs, bool fOverrideMempoolLimit=false, bool fRejectAbsurdFee=false, bool fDryRun=false);
 
+/**
+ * (try to) add transactions to memory pool, in order, as AcceptToMemoryPool
+ * would one after the other. The script checks of transactions that neither
+ * spend, double spend nor replace anything not yet in the pool are run on the
+ * script check threads while the following transactions are checked; they
+ * are added to the pool once their scripts passed, in order. The mempool is
+ * trimmed once per group of such transactions rather than after each one.
+ * vState, vAccepted and vMissingInputs receive the outcome for each of vtx.
+ * Transactions reloaded from disk pass the times they first entered the
+ * pool in pvAcceptTime; they are not used for fee estimation.
+ */
+void AcceptToMemoryPoolBatch(CTxMemPool& pool, const std::vector<CTransaction>& vtx, bool fLimitFree,
+                             std::vector<CValidationState>& vState, std::vector<bool>& vAccepted, std::vector<bool>& vMissingInputs,
+                             const std::vector<int64_t>* pvAcceptTime = NULL);
+
+/** Write the transactions in the mempool and the fee deltas to mempool.dat */
+bool DumpMempool();
+
+/** Add the transactions saved by DumpMempool back to the mempool */
+bool LoadMempool();
+
 int GetUTXOHeight(const COutPoint& outpoint);
 int GetInputAge(const CTxIn &txin);
 int GetInputAgeIX(const uint256 &nTXHash, const CTxIn &txin);
@@ -305,6 +341,12 @@ struct CNodeStateStats {
     int nSyncHeight;
     int nCommonHeight;
     std::vector<int> vHeightInFlight;
+    bool fPreferHeaderAndIDs;
+    bool fRequestedHeaderAndIDs;
+    int nCmpctBlocks;
+    int nCmpctNoRoundTrip;
+    int nCmpctTxnRequested;
+    int nCmpctFallback;
 };
 
 struct CTimestampIndexIteratorKey {
@@ -626,10 +668,20 @@ unsigned int GetP2SHSigOpCount(const CTransaction& tx, const CCoinsViewCache& ma
 /**
  * Check whether all inputs of this transaction are valid (no double spends, scripts & sigs, amounts)
  * This does not modify the UTXO set. If pvChecks is not NULL, script checks are pushed onto it
- * instead of being performed inline.
+ * instead of being performed inline; they refer to tx and txdata, which must outlive them. txdata
+ * holds the parts of tx shared by all of its signature hashes, see PrecomputedTransactionData.
+ * If cacheFullScriptStore is set and the scripts were checked
+ * inline, the transaction is remembered in the script execution cache, so that later checks with
+ * the same flags succeed without running its scripts again.
  */
 bool CheckInputs(const CTransaction& tx, CValidationState &state, const CCoinsViewCache &view, bool fScriptChecks,
-                 unsigned int flags, bool cacheStore, std::vector<CScriptCheck> *pvChecks = NULL);
+                 unsigned int flags, bool cacheStore, bool cacheFullScriptStore, const PrecomputedTransactionData& txdata,
+                 std::vector<CScriptCheck> *pvChecks = NULL);
+
+/** Allocate the script execution cache, sized by -maxsigcachesize. Call once before script verification starts. */
+void InitScriptExecutionCache();
+
+void GetScriptExecutionCacheStats(CSetAssociativeCacheStats& stats);
 
 /** Apply the effects of this transaction on the UTXO set represented by view */
 void UpdateCoins(const CTransaction& tx, CValidationState &state, CCoinsViewCache &inputs, int nHeight);
@@ -689,12 +741,13 @@ private:
     unsigned int nFlags;
     bool cacheStore;
     ScriptError error;
+    const PrecomputedTransactionData *txdata;
 
 public:
-    CScriptCheck(): ptxTo(0), nIn(0), nFlags(0), cacheStore(false), error(SCRIPT_ERR_UNKNOWN_ERROR) {}
-    CScriptCheck(const CCoins& txFromIn, const CTransaction& txToIn, unsigned int nInIn, unsigned int nFlagsIn, bool cacheIn) :
+    CScriptCheck(): ptxTo(0), nIn(0), nFlags(0), cacheStore(false), error(SCRIPT_ERR_UNKNOWN_ERROR), txdata(0) {}
+    CScriptCheck(const CCoins& txFromIn, const CTransaction& txToIn, unsigned int nInIn, unsigned int nFlagsIn, bool cacheIn, const PrecomputedTransactionData& txdataIn) :
         scriptPubKey(txFromIn.vout[txToIn.vin[nInIn].prevout.n].scriptPubKey),
-        ptxTo(&txToIn), nIn(nInIn), nFlags(nFlagsIn), cacheStore(cacheIn), error(SCRIPT_ERR_UNKNOWN_ERROR) { }
+        ptxTo(&txToIn), nIn(nInIn), nFlags(nFlagsIn), cacheStore(cacheIn), error(SCRIPT_ERR_UNKNOWN_ERROR), txdata(&txdataIn) { }
 
     bool operator()();
 
@@ -705,6 +758,7 @@ public:
         std::swap(nFlags, check.nFlags);
         std::swap(cacheStore, check.cacheStore);
         std::swap(error, check.error);
+        std::swap(txdata, check.txdata);
     }
 
     ScriptError GetScriptError() const { return error; }
@@ -830,6 +884,12 @@ extern CCoinsViewCache *pcoinsTip;
 /** Global variable that points to the active block tree (protected by cs_main) */
 extern CBlockTreeDB *pblocktree;
 
+/** Statistics of the UTXO set at pcoinsTip's best block, kept up to date by ConnectTip/DisconnectTip (protected by cs_main) */
+extern CCoinsStats coinsStatsTip;
+
+/** Load coinsStatsTip from the coin database, rebuilding it with a full scan if missing or stale. */
+bool LoadCoinsStats(CCoinsViewDB *pcoinsdbview);
+
 /**
  * Return the spend height, which is one more than the inputs.GetBestBlock().
  * While checking, GetBestBlock() refers to the parent block. (protected by cs_main)
@@ -535,6 +535,15 @@ bool CMasternodeMan::Has(const CTxIn& vin)
     return (pMN != NULL);
 }
 
+bool CMasternodeMan::HasAddress(const CNetAddr& addr)
+{
+    LOCK(cs);
+    BOOST_FOREACH(CMasternode& mn, vMasternodes) {
+        if((CNetAddr)mn.addr == addr) return true;
+    }
+    return false;
+}
+
 //
 // Deterministically select the oldest/best masternode to pay on the network
 //
@@ -837,6 +846,12 @@ void CMasternodeMan::ProcessMessage(CNode* pfrom, std::string& strCommand, CData
 
         LogPrint("masternode", "MNPING -- Masternode ping, masternode=%s\n", mnp.vin.prevout.ToStringShort());
 
+        {
+            // Don't wait for cs_main just to find out we have seen it already
+            LOCK(cs);
+            if(mapSeenMasternodePing.count(nHash)) return; //seen
+        }
+
         // Need LOCK2 here to ensure consistent locking order because the CheckAndUpdate call below locks cs_main
         LOCK2(cs_main, cs);
 
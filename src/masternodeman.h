@@ -279,6 +279,8 @@ public:
     }
 
     bool Has(const CTxIn& vin);
+    /// Whether a masternode is running at this address, any port
+    bool HasAddress(const CNetAddr& addr);
 
     masternode_info_t GetMasternodeInfo(const CTxIn& vin);
 
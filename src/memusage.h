@@ -12,6 +12,7 @@
 #include <vector>
 
 #include <boost/foreach.hpp>
+#include <boost/shared_ptr.hpp>
 #include <boost/unordered_set.hpp>
 #include <boost/unordered_map.hpp>
 
@@ -127,6 +128,26 @@ static inline size_t DynamicUsage(const boost::unordered_map<X, Y, Z>& m)
     return MallocUsage(sizeof(boost_unordered_node<std::pair<const X, Y> >)) * m.size() + MallocUsage(sizeof(void*) * m.bucket_count());
 }
 
+struct boost_shared_counter
+{
+private:
+    void* vtable;
+    int use_count;
+    int weak_count;
+    bool initialized;
+};
+
+/**
+ * Objects we share are created with make_shared, which puts the object and
+ * its reference count in a single allocation. The allocation is counted in
+ * full by every holder, so shared objects are counted once per holder.
+ */
+template<typename X>
+static inline size_t DynamicUsage(const boost::shared_ptr<X>& p)
+{
+    return p ? MallocUsage(sizeof(boost_shared_counter) + sizeof(X)) : 0;
+}
+
 }
 
 #endif // BITCOIN_MEMUSAGE_H
@@ -17,8 +17,10 @@
 #include "consensus/consensus.h"
 #include "crypto/common.h"
 #include "hash.h"
+#include "main.h"
 #include "primitives/transaction.h"
 #include "scheduler.h"
+#include "txmempool.h"
 #include "ui_interface.h"
 #include "wallet/wallet.h"
 #include "utilstrencodings.h"
@@ -34,6 +36,15 @@
 #include <fcntl.h>
 #endif
 
+#ifdef HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#endif
+
+#if defined(HAVE_LINUX_ERRQUEUE_H) && defined(SO_ZEROCOPY) && defined(MSG_ZEROCOPY)
+#include <linux/errqueue.h>
+#define USE_ZEROCOPY_SEND 1
+#endif
+
 #ifdef USE_UPNP
 #include <miniupnpc/miniupnpc.h>
 #include <miniupnpc/miniwget.h>
@@ -79,6 +90,47 @@ namespace {
 
         ListenSocket(SOCKET socket, bool whitelisted) : socket(socket), whitelisted(whitelisted) {}
     };
+
+    /** Longest wait for socket events, the frequency to poll pnode->vSend */
+    const int SOCKET_EVENTS_TIMEOUT_MS = 50;
+    /** Most socket events handled per epoll_wait */
+    const int MAX_EPOLL_EVENTS = 256;
+
+    /** Message data left to receive for it to be read straight into the message */
+    const unsigned int MIN_RECV_IN_PLACE = 16 * 1024;
+    /** Most message data read into the message at once */
+    const unsigned int MAX_RECV_IN_PLACE = 256 * 1024;
+    /** Receive buffers are allocated up to this far ahead of the received data */
+    const unsigned int RECV_ALLOC_AHEAD = 256 * 1024;
+    /** Smallest buffer allocated, so it can be reused for most messages */
+    const size_t MIN_NET_BUFFER_SIZE = 4096;
+
+    /** Most messages written with one call */
+    const int MAX_SEND_BATCH_MSGS = 64;
+    /** No more messages are added to a write once it has this many bytes */
+    const size_t MAX_SEND_BATCH_BYTES = 256 * 1024;
+    /** Smallest message written with MSG_ZEROCOPY, below it copying is cheaper */
+    const size_t MIN_ZEROCOPY_SEND_SIZE = 64 * 1024;
+
+    /** The socket events the socket handler waits for */
+    enum {
+        SOCKET_EVENT_RECV  = (1 << 0),
+        SOCKET_EVENT_SEND  = (1 << 1),
+        SOCKET_EVENT_ERROR = (1 << 2),
+    };
+
+    struct SocketInterest {
+        //! The node the socket belongs to, -1 for listening sockets
+        NodeId owner;
+        int nEvents;
+
+        SocketInterest(NodeId owner = -1, int nEvents = 0) : owner(owner), nEvents(nEvents) {}
+    };
+
+    typedef std::map<SOCKET, SocketInterest> SocketInterestMap;
+
+    /** Share of the socket each lane gets while all lanes have data queued */
+    const unsigned int SEND_LANE_WEIGHT[SEND_LANE_MAX] = {64, 32, 8, 1};
 }
 
 const static std::string NET_MESSAGE_COMMAND_OTHER = "*other*";
@@ -103,12 +155,29 @@ int nMaxConnections = DEFAULT_MAX_PEER_CONNECTIONS;
 bool fAddressesInitialized = false;
 std::string strSubVersion;
 
+static SocketEventsMode socketEventsMode = SOCKETEVENTS_SELECT;
+#ifdef HAVE_SYS_EPOLL_H
+static int hEpoll = -1;
+//! What hEpoll waits for, only used by the socket handler thread
+static SocketInterestMap mapEpollInterest;
+#endif
+static CCriticalSection cs_socketLoopStats;
+static CSocketLoopStats socketLoopStats;
+static std::atomic<uint64_t> nSendCalls(0);
+static std::atomic<uint64_t> nSendMsgs(0);
+static std::atomic<uint64_t> nZeroCopySends(0);
+
 std::vector<CNode*> vNodes;
 CCriticalSection cs_vNodes;
-std::map<CInv, CDataStream> mapRelay;
-std::deque<pair<int64_t, CInv> > vRelayExpiration;
-CCriticalSection cs_mapRelay;
+CRelayCache relayCache;
+static CCriticalSection cs_invRelay;
+static CInvRelayStats invRelayStats;
+//! Inv batches sent recently with their messages, most recent first
+static std::deque<std::pair<std::vector<CInv>, boost::shared_ptr<const CSerializeData> > > vRecentInvMessages;
+static int64_t nNextInvSendInbound = 0;
 limitedmap<uint256, int64_t> mapAlreadyAskedFor(MAX_INV_SZ);
+CNetBufferPool recvBufferPool;
+CNetBufferPool sendBufferPool;
 
 static std::deque<std::string> vOneShots;
 CCriticalSection cs_vOneShots;
@@ -715,6 +784,11 @@ void CNode::copyStats(CNodeStats &stats)
     X(mapSendBytesPerMsgCmd);
     X(nRecvBytes);
     X(mapRecvBytesPerMsgCmd);
+    {
+        LOCK(cs_vSend);
+        for (int i = 0; i < SEND_LANE_MAX; i++)
+            stats.sendLaneStats[i] = sendLaneStats[i];
+    }
     X(fWhitelisted);
 
     // It is common for nodes with good ping times to suddenly become lagged,
@@ -768,24 +842,66 @@ bool CNode::ReceiveMsgBytes(const char *pch, unsigned int nBytes)
         pch += handled;
         nBytes -= handled;
 
-        if (msg.complete()) {
-
-            //store received bytes per message command
-            //to prevent a memory DOS, only allow valid commands
-            mapMsgCmdSize::iterator i = mapRecvBytesPerMsgCmd.find(msg.hdr.pchCommand);
-            if (i == mapRecvBytesPerMsgCmd.end())
-                i = mapRecvBytesPerMsgCmd.find(NET_MESSAGE_COMMAND_OTHER);
-            assert(i != mapRecvBytesPerMsgCmd.end());
-            i->second += msg.hdr.nMessageSize + CMessageHeader::HEADER_SIZE;
-
-            msg.nTime = GetTimeMicros();
-            messageHandlerCondition.notify_one();
-        }
+        if (msg.complete())
+            RecvMsgComplete(msg);
     }
 
     return true;
 }
 
+// requires LOCK(cs_vRecvMsg)
+char* CNode::GetReceiveBuffer(unsigned int& nSpace)
+{
+    // Only worth it for the bulk of a large message, smaller ones are read
+    // many at a time through the socket handler's buffer
+    if (vRecvMsg.empty() || !vRecvMsg.back().in_data)
+        return NULL;
+    CNetMessage& msg = vRecvMsg.back();
+    if (msg.hdr.nMessageSize - msg.nDataPos < MIN_RECV_IN_PLACE)
+        return NULL;
+    return msg.GetDataBuffer(MAX_RECV_IN_PLACE, nSpace);
+}
+
+// requires LOCK(cs_vRecvMsg)
+void CNode::ReceivedInPlace(unsigned int nBytes)
+{
+    CNetMessage& msg = vRecvMsg.back();
+    msg.ReceivedData(nBytes);
+    if (msg.complete())
+        RecvMsgComplete(msg);
+}
+
+// requires LOCK(cs_vRecvMsg)
+void CNode::RecvMsgComplete(CNetMessage& msg)
+{
+    //store received bytes per message command
+    //to prevent a memory DOS, only allow valid commands
+    mapMsgCmdSize::iterator i = mapRecvBytesPerMsgCmd.find(msg.hdr.pchCommand);
+    if (i == mapRecvBytesPerMsgCmd.end())
+        i = mapRecvBytesPerMsgCmd.find(NET_MESSAGE_COMMAND_OTHER);
+    assert(i != mapRecvBytesPerMsgCmd.end());
+    i->second += msg.hdr.nMessageSize + CMessageHeader::HEADER_SIZE;
+
+    msg.nTime = GetTimeMicros();
+    messageHandlerCondition.notify_one();
+}
+
+// requires LOCK(cs_vRecvMsg)
+void CNode::PopRecvMsgs(std::deque<CNetMessage>::iterator itEnd)
+{
+    for (std::deque<CNetMessage>::iterator it = vRecvMsg.begin(); it != itEnd; ++it)
+        recvBufferPool.Put(it->vRecv);
+    vRecvMsg.erase(vRecvMsg.begin(), itEnd);
+}
+
+const uint256& CNetMessage::GetMessageHash() const
+{
+    assert(complete());
+    if (data_hash.IsNull())
+        hasher.Finalize(data_hash.begin());
+    return data_hash;
+}
+
 int CNetMessage::readHeader(const char *pch, unsigned int nBytes)
 {
     // copy data to temporary parsing buffer
@@ -813,60 +929,326 @@ int CNetMessage::readHeader(const char *pch, unsigned int nBytes)
 
     // switch state to reading message data
     in_data = true;
+    if (hdr.nMessageSize > 0)
+        recvBufferPool.Get(vRecv, std::min(hdr.nMessageSize, RECV_ALLOC_AHEAD));
 
     return nCopy;
 }
 
 int CNetMessage::readData(const char *pch, unsigned int nBytes)
 {
-    unsigned int nRemaining = hdr.nMessageSize - nDataPos;
-    unsigned int nCopy = std::min(nRemaining, nBytes);
+    unsigned int nCopy;
+    char *pchData = GetDataBuffer(nBytes, nCopy);
+
+    memcpy(pchData, pch, nCopy);
+    ReceivedData(nCopy);
+
+    return nCopy;
+}
 
-    if (vRecv.size() < nDataPos + nCopy) {
+char* CNetMessage::GetDataBuffer(unsigned int nMax, unsigned int& nSpace)
+{
+    assert(in_data && !complete());
+    nSpace = std::min(hdr.nMessageSize - nDataPos, nMax);
+
+    if (vRecv.size() < nDataPos + nSpace) {
         // Allocate up to 256 KiB ahead, but never more than the total message size.
-        vRecv.resize(std::min(hdr.nMessageSize, nDataPos + nCopy + 256 * 1024));
+        size_t nCapacity = vRecv.capacity();
+        vRecv.resize(std::min(hdr.nMessageSize, nDataPos + nSpace + RECV_ALLOC_AHEAD));
+        if (vRecv.capacity() != nCapacity)
+            recvBufferPool.nAllocs++;
     }
 
-    memcpy(&vRecv[nDataPos], pch, nCopy);
-    nDataPos += nCopy;
+    return &vRecv[nDataPos];
+}
 
-    return nCopy;
+void CNetMessage::ReceivedData(unsigned int nBytes)
+{
+    assert(nDataPos + nBytes <= vRecv.size());
+    hasher.Write((const unsigned char*)&vRecv[nDataPos], nBytes);
+    nDataPos += nBytes;
+}
+
+void CNetBufferPool::Get(CDataStream& s, size_t nSize)
+{
+    assert(s.capacity() == 0);
+    {
+        LOCK(cs);
+        // Take the smallest buffer that is large enough
+        int nBest = -1;
+        for (unsigned int i = 0; i < vFree.size(); i++) {
+            if (vFree[i].capacity() >= nSize && (nBest < 0 || vFree[i].capacity() < vFree[nBest].capacity()))
+                nBest = i;
+        }
+        if (nBest >= 0) {
+            nFreeBytes -= vFree[nBest].capacity();
+            s.swap(vFree[nBest]);
+            vFree[nBest].swap(vFree.back());
+            vFree.pop_back();
+            nReuses++;
+            return;
+        }
+    }
+    s.reserve(std::max(nSize, MIN_NET_BUFFER_SIZE));
+    nAllocs++;
 }
 
+void CNetBufferPool::Put(CDataStream& s)
+{
+    CSerializeData vch;
+    s.swap(vch);
+    Put(vch);
+}
+
+void CNetBufferPool::Put(CSerializeData& vch)
+{
+    size_t nCapacity = vch.capacity();
+    if (nCapacity == 0)
+        return;
+
+    LOCK(cs);
+    if (vFree.size() >= MAX_NET_BUFFER_POOL_SIZE || nFreeBytes + nCapacity > MAX_NET_BUFFER_POOL_BYTES)
+        return;
+    vFree.push_back(CSerializeData());
+    vFree.back().swap(vch);
+    vFree.back().clear();
+    nFreeBytes += nCapacity;
+}
+
+
+
+
 
 
 
 
 
+// requires LOCK(cs_vSend)
+SendLane GetSendLane(const std::string& strCommand)
+{
+    if (strCommand == NetMsgType::BLOCK || strCommand == NetMsgType::HEADERS ||
+        strCommand == NetMsgType::CMPCTBLOCK || strCommand == NetMsgType::GETBLOCKTXN || strCommand == NetMsgType::BLOCKTXN)
+        return SEND_LANE_BLOCK;
+    if (strCommand == NetMsgType::TXLOCKREQUEST || strCommand == NetMsgType::TXLOCKVOTE)
+        return SEND_LANE_INSTANTSEND;
+    if (strCommand == NetMsgType::MNANNOUNCE || strCommand == NetMsgType::MNPING ||
+        strCommand == NetMsgType::MASTERNODEPAYMENTVOTE || strCommand == NetMsgType::SYNCSTATUSCOUNT ||
+        strCommand == NetMsgType::MNGOVERNANCEOBJECT || strCommand == NetMsgType::MNGOVERNANCEOBJECTVOTE)
+        return SEND_LANE_BULK;
+    // merkleblock stays here, SPV clients expect the matched txs right after it
+    return SEND_LANE_NORMAL;
+}
+
+std::string GetSendLaneName(int nLane)
+{
+    switch (nLane) {
+    case SEND_LANE_BLOCK:
+        return "block";
+    case SEND_LANE_INSTANTSEND:
+        return "instantsend";
+    case SEND_LANE_NORMAL:
+        return "normal";
+    case SEND_LANE_BULK:
+        return "bulk";
+    default:
+        return "unknown";
+    }
+}
+
+// The lane with the lowest pass that still has messages besides the
+// vBatched ones, -1 if there is none
+static int PickSendLane(const CNode *pnode, const uint64_t *vPass, const size_t *vBatched)
+{
+    int nLane = -1;
+    for (int i = 0; i < SEND_LANE_MAX; i++) {
+        if (pnode->vSendMsg[i].size() <= vBatched[i])
+            continue;
+        if (nLane < 0 || vPass[i] < vPass[nLane])
+            nLane = i;
+    }
+    return nLane;
+}
 
+static uint64_t SendLanePassIncrement(int nLane, size_t nSize)
+{
+    return nSize * SEND_LANE_WEIGHT[SEND_LANE_BLOCK] / SEND_LANE_WEIGHT[nLane];
+}
+
+// Write the buffers with one call, returns like send()
+static int SendBuffers(SOCKET hSocket, const std::pair<const char*, size_t> *vBufs, int nBufs, int nFlags)
+{
+#ifdef WIN32
+    return send(hSocket, vBufs[0].first, vBufs[0].second, nFlags);
+#else
+    struct iovec vIov[MAX_SEND_BATCH_MSGS];
+    for (int i = 0; i < nBufs; i++) {
+        vIov[i].iov_base = (void*)vBufs[i].first;
+        vIov[i].iov_len = vBufs[i].second;
+    }
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = vIov;
+    msg.msg_iovlen = nBufs;
+    return sendmsg(hSocket, &msg, nFlags);
+#endif
+}
+
+static bool EnableZeroCopySend(SOCKET hSocket)
+{
+#ifdef USE_ZEROCOPY_SEND
+    int nOne = 1;
+    return hSocket != INVALID_SOCKET && setsockopt(hSocket, SOL_SOCKET, SO_ZEROCOPY, &nOne, sizeof(nOne)) == 0;
+#else
+    return false;
+#endif
+}
 
+// Release the buffers of MSG_ZEROCOPY writes the kernel is done with
+// requires LOCK(cs_vSend)
+void ReadZeroCopyCompletions(CNode *pnode)
+{
+#ifdef USE_ZEROCOPY_SEND
+    while (pnode->nZeroCopyDone != pnode->nZeroCopyNext) {
+        char control[128];
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        if (recvmsg(pnode->hSocket, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0)
+            break;
+        for (struct cmsghdr *cm = CMSG_FIRSTHDR(&msg); cm != NULL; cm = CMSG_NXTHDR(&msg, cm)) {
+            if (!(cm->cmsg_level == IPPROTO_IP && cm->cmsg_type == IP_RECVERR) &&
+                !(cm->cmsg_level == IPPROTO_IPV6 && cm->cmsg_type == IPV6_RECVERR))
+                continue;
+            const struct sock_extended_err *serr = (const struct sock_extended_err*)CMSG_DATA(cm);
+            if (serr->ee_errno != 0 || serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+                continue;
+            // The kernel had to copy anyway (e.g. loopback), plain writes are cheaper then
+            if (serr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+                pnode->fZeroCopySend = false;
+            // TCP completes writes in order, ee_data is the last one of the range
+            pnode->nZeroCopyDone = serr->ee_data + 1;
+        }
+    }
+#endif
+    while (!pnode->vZeroCopyPending.empty() && (int32_t)(pnode->vZeroCopyPending.front().first - pnode->nZeroCopyDone) < 0) {
+        sendBufferPool.Put(pnode->vZeroCopyPending.front().second);
+        pnode->vZeroCopyPending.pop_front();
+    }
+}
 
 // requires LOCK(cs_vSend)
 void SocketSendData(CNode *pnode)
 {
-    std::deque<CSerializeData>::iterator it = pnode->vSendMsg.begin();
+    while (pnode->nSendSize > 0) {
+        // Gather messages in the order the lanes serve them and write as
+        // many as fit with one call. The lane with the lowest pass goes
+        // first. Sending a message advances the pass of its lane by the
+        // message size over the lane weight, so busy lanes share the socket
+        // by weight while an idle lane is served as soon as it has
+        // something queued. A message is sent completely before another
+        // lane gets its turn.
+        uint64_t vPass[SEND_LANE_MAX];
+        size_t vBatched[SEND_LANE_MAX];
+        for (int i = 0; i < SEND_LANE_MAX; i++) {
+            vPass[i] = pnode->nSendLanePass[i];
+            vBatched[i] = 0;
+        }
+        std::pair<const char*, size_t> vBufs[MAX_SEND_BATCH_MSGS];
+        int vLanes[MAX_SEND_BATCH_MSGS];
+        int nMsgs = 0;
+        size_t nBatchBytes = 0;
+        int nFlags = MSG_NOSIGNAL | MSG_DONTWAIT;
+
+        int nLane = pnode->nSendOffset > 0 ? pnode->nSendLane : PickSendLane(pnode, vPass, vBatched);
+        assert(nLane >= 0);
+        // Large messages (blocks) go on their own, without copying them
+        // into the kernel where that is supported
+        bool fZeroCopy = false;
+#ifdef USE_ZEROCOPY_SEND
+        fZeroCopy = pnode->fZeroCopySend && pnode->vSendMsg[nLane].front().second.size() >= MIN_ZEROCOPY_SEND_SIZE;
+        if (fZeroCopy)
+            nFlags |= MSG_ZEROCOPY;
+#endif
+#ifdef WIN32
+        const int nMaxMsgs = 1;
+#else
+        const int nMaxMsgs = fZeroCopy ? 1 : MAX_SEND_BATCH_MSGS;
+#endif
+        while (nLane >= 0 && nMsgs < nMaxMsgs && nBatchBytes < MAX_SEND_BATCH_BYTES) {
+            const CSerializeData &data = pnode->vSendMsg[nLane][vBatched[nLane]].second;
+            size_t nOffset = nMsgs == 0 ? pnode->nSendOffset : 0;
+            assert(data.size() > nOffset);
+            vBufs[nMsgs] = std::make_pair(&data[nOffset], data.size() - nOffset);
+            vLanes[nMsgs] = nLane;
+            nMsgs++;
+            nBatchBytes += data.size() - nOffset;
+            vPass[nLane] += SendLanePassIncrement(nLane, data.size());
+            vBatched[nLane]++;
+            nLane = PickSendLane(pnode, vPass, vBatched);
+        }
 
-    while (it != pnode->vSendMsg.end()) {
-        const CSerializeData &data = *it;
-        assert(data.size() > pnode->nSendOffset);
-        int nBytes = send(pnode->hSocket, &data[pnode->nSendOffset], data.size() - pnode->nSendOffset, MSG_NOSIGNAL | MSG_DONTWAIT);
+        int nBytes = SendBuffers(pnode->hSocket, vBufs, nMsgs, nFlags);
         if (nBytes > 0) {
             pnode->nLastSend = GetTime();
             pnode->nSendBytes += nBytes;
-            pnode->nSendOffset += nBytes;
             pnode->RecordBytesSent(nBytes);
-            if (pnode->nSendOffset == data.size()) {
+            nSendCalls++;
+            if (fZeroCopy) {
+                pnode->nZeroCopyNext++;
+                pnode->fZeroCopyMsg = true;
+                nZeroCopySends++;
+            }
+
+            // Retire the messages that were written completely, in the order they were gathered
+            size_t nLeft = nBytes;
+            bool fComplete = true;
+            for (int i = 0; i < nMsgs; i++) {
+                std::deque<std::pair<int64_t, CSerializeData> >& queue = pnode->vSendMsg[vLanes[i]];
+                CSerializeData &data = queue.front().second;
+                if (nLeft < data.size() - pnode->nSendOffset) {
+                    // could not send full message; stop sending more
+                    pnode->nSendLane = vLanes[i];
+                    pnode->nSendOffset += nLeft;
+                    fComplete = false;
+                    break;
+                }
+                nLeft -= data.size() - pnode->nSendOffset;
+
+                int64_t nDelay = GetTimeMicros() - queue.front().first;
+                CSendLaneStats& stats = pnode->sendLaneStats[vLanes[i]];
+                stats.nQueuedBytes -= data.size();
+                stats.nMsgs++;
+                stats.nDelayMicros += nDelay;
+                stats.nMaxDelayMicros = std::max(stats.nMaxDelayMicros, nDelay);
+                pnode->nSendPass = pnode->nSendLanePass[vLanes[i]];
+                pnode->nSendLanePass[vLanes[i]] += SendLanePassIncrement(vLanes[i], data.size());
                 pnode->nSendOffset = 0;
                 pnode->nSendSize -= data.size();
-                it++;
-            } else {
-                // could not send full message; stop sending more
-                break;
+                nSendMsgs++;
+                if (pnode->fZeroCopyMsg) {
+                    // the kernel still reads from it until the write completed
+                    pnode->vZeroCopyPending.push_back(std::make_pair(pnode->nZeroCopyNext - 1, CSerializeData()));
+                    pnode->vZeroCopyPending.back().second.swap(data);
+                    pnode->fZeroCopyMsg = false;
+                } else {
+                    sendBufferPool.Put(data);
+                }
+                queue.pop_front();
             }
+            if (!fComplete)
+                break;
         } else {
             if (nBytes < 0) {
                 // error
                 int nErr = WSAGetLastError();
+#ifdef USE_ZEROCOPY_SEND
+                if (fZeroCopy && nErr == ENOBUFS) {
+                    // out of memory for pinning pages, fall back to copying
+                    pnode->fZeroCopySend = false;
+                    continue;
+                }
+#endif
                 if (nErr != WSAEWOULDBLOCK && nErr != WSAEMSGSIZE && nErr != WSAEINTR && nErr != WSAEINPROGRESS)
                 {
                     LogPrintf("socket send error %s\n", NetworkErrorString(nErr));
@@ -878,11 +1260,8 @@ void SocketSendData(CNode *pnode)
         }
     }
 
-    if (it == pnode->vSendMsg.end()) {
+    if (pnode->nSendSize == 0)
         assert(pnode->nSendOffset == 0);
-        assert(pnode->nSendSize == 0);
-    }
-    pnode->vSendMsg.erase(pnode->vSendMsg.begin(), it);
 }
 
 static std::list<CNode*> vNodesDisconnected;
@@ -1081,7 +1460,7 @@ static void AcceptConnection(const ListenSocket& hListenSocket) {
         return;
     }
 
-    if (!IsSelectableSocket(hSocket))
+    if (!IsPollableSocket(hSocket))
     {
         LogPrintf("connection from %s dropped: non-selectable socket\n", addr.ToString());
         CloseSocket(hSocket);
@@ -1132,11 +1511,264 @@ static void AcceptConnection(const ListenSocket& hListenSocket) {
     }
 }
 
+bool SetSocketEventsMode(const std::string& strMode, std::string& strError)
+{
+    if (strMode == "select") {
+        socketEventsMode = SOCKETEVENTS_SELECT;
+        return true;
+    }
+    if (strMode == "epoll") {
+#ifdef HAVE_SYS_EPOLL_H
+        if (hEpoll == -1)
+            hEpoll = epoll_create1(EPOLL_CLOEXEC);
+        if (hEpoll == -1) {
+            LogPrintf("Unable to create epoll instance (%s), falling back to select\n", NetworkErrorString(errno));
+            socketEventsMode = SOCKETEVENTS_SELECT;
+        } else {
+            socketEventsMode = SOCKETEVENTS_EPOLL;
+        }
+        return true;
+#else
+        strError = strprintf(_("-socketevents=%s is not supported on this platform"), strMode);
+        return false;
+#endif
+    }
+    strError = strprintf(_("Unknown -socketevents mode '%s'"), strMode);
+    return false;
+}
+
+SocketEventsMode GetSocketEventsMode()
+{
+    return socketEventsMode;
+}
+
+std::string GetSocketEventsModeName()
+{
+    switch (socketEventsMode) {
+    case SOCKETEVENTS_SELECT: return "select";
+    case SOCKETEVENTS_EPOLL: return "epoll";
+    }
+    return "unknown";
+}
+
+bool IsPollableSocket(SOCKET hSocket)
+{
+    return socketEventsMode == SOCKETEVENTS_EPOLL || IsSelectableSocket(hSocket);
+}
+
+void GetSocketLoopStats(CSocketLoopStats& stats)
+{
+    LOCK(cs_socketLoopStats);
+    stats = socketLoopStats;
+    stats.nSendCalls = nSendCalls;
+    stats.nSendMsgs = nSendMsgs;
+    stats.nZeroCopySends = nZeroCopySends;
+}
+
+void GetInvRelayStats(CInvRelayStats& stats)
+{
+    LOCK(cs_invRelay);
+    stats = invRelayStats;
+}
+
+static void RecordSocketLoop(size_t nEvents, int64_t nWaitMicros, int64_t nBusyMicros)
+{
+    LOCK(cs_socketLoopStats);
+    socketLoopStats.nLoops++;
+    socketLoopStats.nEvents += nEvents;
+    socketLoopStats.nWaitMicros += nWaitMicros;
+    socketLoopStats.nBusyMicros += nBusyMicros;
+    socketLoopStats.nMaxBusyMicros = std::max(socketLoopStats.nMaxBusyMicros, nBusyMicros);
+}
+
+static int GetReadyEvents(const std::map<SOCKET, int>& mapReady, SOCKET hSocket)
+{
+    std::map<SOCKET, int>::const_iterator it = mapReady.find(hSocket);
+    return it == mapReady.end() ? 0 : it->second;
+}
+
+/** Collect the sockets of the listening sockets and the nodes, with the events to wait for */
+static void GenerateSocketInterest(SocketInterestMap& mapInterest)
+{
+    BOOST_FOREACH(const ListenSocket& hListenSocket, vhListenSocket) {
+        mapInterest[hListenSocket.socket] = SocketInterest(-1, SOCKET_EVENT_RECV);
+    }
+
+    LOCK(cs_vNodes);
+    BOOST_FOREACH(CNode* pnode, vNodes)
+    {
+        if (pnode->hSocket == INVALID_SOCKET)
+            continue;
+        SocketInterest& interest = mapInterest[pnode->hSocket];
+        interest = SocketInterest(pnode->id, SOCKET_EVENT_ERROR);
+
+        // Implement the following logic:
+        // * If there is data to send, select() for sending data. As this only
+        //   happens when optimistic write failed, we choose to first drain the
+        //   write buffer in this case before receiving more. This avoids
+        //   needlessly queueing received data, if the remote peer is not themselves
+        //   receiving data. This means properly utilizing TCP flow control signalling.
+        // * Otherwise, if there is no (complete) message in the receive buffer,
+        //   or there is space left in the buffer, select() for receiving data.
+        // * (if neither of the above applies, there is certainly one message
+        //   in the receiver buffer ready to be processed).
+        // Together, that means that at least one of the following is always possible,
+        // so we don't deadlock:
+        // * We send some data.
+        // * We wait for data to be received (and disconnect after timeout).
+        // * We process a message in the buffer (message handler thread).
+        {
+            TRY_LOCK(pnode->cs_vSend, lockSend);
+            if (lockSend && pnode->nSendSize > 0) {
+                interest.nEvents |= SOCKET_EVENT_SEND;
+                continue;
+            }
+        }
+        {
+            TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
+            if (lockRecv && (
+                pnode->vRecvMsg.empty() || !pnode->vRecvMsg.front().complete() ||
+                pnode->GetTotalRecvSize() <= ReceiveFloodSize()))
+                interest.nEvents |= SOCKET_EVENT_RECV;
+        }
+    }
+}
+
+static void SocketEventsSelect(const SocketInterestMap& mapInterest, std::map<SOCKET, int>& mapReady)
+{
+    struct timeval timeout;
+    timeout.tv_sec  = 0;
+    timeout.tv_usec = SOCKET_EVENTS_TIMEOUT_MS * 1000;
+
+    fd_set fdsetRecv;
+    fd_set fdsetSend;
+    fd_set fdsetError;
+    FD_ZERO(&fdsetRecv);
+    FD_ZERO(&fdsetSend);
+    FD_ZERO(&fdsetError);
+    SOCKET hSocketMax = 0;
+    bool have_fds = false;
+
+    BOOST_FOREACH(const PAIRTYPE(SOCKET, SocketInterest)& item, mapInterest) {
+        if (item.second.nEvents & SOCKET_EVENT_RECV)
+            FD_SET(item.first, &fdsetRecv);
+        if (item.second.nEvents & SOCKET_EVENT_SEND)
+            FD_SET(item.first, &fdsetSend);
+        if (item.second.nEvents & SOCKET_EVENT_ERROR)
+            FD_SET(item.first, &fdsetError);
+        hSocketMax = std::max(hSocketMax, item.first);
+        have_fds = true;
+    }
+
+    int nSelect = select(have_fds ? hSocketMax + 1 : 0,
+                         &fdsetRecv, &fdsetSend, &fdsetError, &timeout);
+
+    if (nSelect == SOCKET_ERROR)
+    {
+        if (have_fds)
+        {
+            int nErr = WSAGetLastError();
+            LogPrintf("socket select error %s\n", NetworkErrorString(nErr));
+            BOOST_FOREACH(const PAIRTYPE(SOCKET, SocketInterest)& item, mapInterest)
+                mapReady[item.first] = SOCKET_EVENT_RECV;
+        }
+        MilliSleep(SOCKET_EVENTS_TIMEOUT_MS);
+        return;
+    }
+
+    BOOST_FOREACH(const PAIRTYPE(SOCKET, SocketInterest)& item, mapInterest) {
+        int nEvents = 0;
+        if (FD_ISSET(item.first, &fdsetRecv))
+            nEvents |= SOCKET_EVENT_RECV;
+        if (FD_ISSET(item.first, &fdsetSend))
+            nEvents |= SOCKET_EVENT_SEND;
+        if (FD_ISSET(item.first, &fdsetError))
+            nEvents |= SOCKET_EVENT_ERROR;
+        if (nEvents)
+            mapReady[item.first] = nEvents;
+    }
+}
+
+#ifdef HAVE_SYS_EPOLL_H
+/**
+ * Wait for socket events with epoll. Unlike select() the set of sockets
+ * lives in the kernel, so only sockets whose interest changed since the
+ * last call cost a system call, and sockets need not be below FD_SETSIZE.
+ * Sockets waiting for neither receiving nor sending are left out entirely,
+ * as a hung up socket would otherwise be reported on every call.
+ */
+static void SocketEventsEpoll(const SocketInterestMap& mapInterest, std::map<SOCKET, int>& mapReady)
+{
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+
+    SocketInterestMap::iterator itOld = mapEpollInterest.begin();
+    while (itOld != mapEpollInterest.end()) {
+        SocketInterestMap::const_iterator itNew = mapInterest.find(itOld->first);
+        if (itNew == mapInterest.end() || itNew->second.owner != itOld->second.owner ||
+            !(itNew->second.nEvents & (SOCKET_EVENT_RECV | SOCKET_EVENT_SEND))) {
+            // Fails if the socket was closed already, which removed it from the set
+            epoll_ctl(hEpoll, EPOLL_CTL_DEL, itOld->first, &event);
+            mapEpollInterest.erase(itOld++);
+        } else {
+            ++itOld;
+        }
+    }
+
+    BOOST_FOREACH(const PAIRTYPE(SOCKET, SocketInterest)& item, mapInterest) {
+        int nEvents = item.second.nEvents & (SOCKET_EVENT_RECV | SOCKET_EVENT_SEND);
+        if (nEvents == 0)
+            continue;
+        SocketInterestMap::iterator it = mapEpollInterest.find(item.first);
+        if (it != mapEpollInterest.end() && it->second.nEvents == nEvents)
+            continue;
+
+        event.events = ((nEvents & SOCKET_EVENT_RECV) ? EPOLLIN : 0) | ((nEvents & SOCKET_EVENT_SEND) ? EPOLLOUT : 0);
+        event.data.fd = item.first;
+        int op = it == mapEpollInterest.end() ? EPOLL_CTL_ADD : EPOLL_CTL_MOD;
+        if (epoll_ctl(hEpoll, op, item.first, &event) != 0) {
+            // The socket number may have been closed and reused behind our back
+            if (errno == EEXIST || errno == ENOENT)
+                op = (op == EPOLL_CTL_ADD ? EPOLL_CTL_MOD : EPOLL_CTL_ADD);
+            if (epoll_ctl(hEpoll, op, item.first, &event) != 0) {
+                LogPrintf("socket epoll_ctl error %s\n", NetworkErrorString(errno));
+                if (it != mapEpollInterest.end())
+                    mapEpollInterest.erase(it);
+                continue;
+            }
+        }
+        mapEpollInterest[item.first] = SocketInterest(item.second.owner, nEvents);
+    }
+
+    struct epoll_event events[MAX_EPOLL_EVENTS];
+    int nEvents = epoll_wait(hEpoll, events, MAX_EPOLL_EVENTS, SOCKET_EVENTS_TIMEOUT_MS);
+    if (nEvents < 0) {
+        if (errno != EINTR) {
+            LogPrintf("socket epoll error %s\n", NetworkErrorString(errno));
+            MilliSleep(SOCKET_EVENTS_TIMEOUT_MS);
+        }
+        return;
+    }
+
+    for (int i = 0; i < nEvents; i++) {
+        int& nReady = mapReady[events[i].data.fd];
+        if (events[i].events & EPOLLIN)
+            nReady |= SOCKET_EVENT_RECV;
+        if (events[i].events & EPOLLOUT)
+            nReady |= SOCKET_EVENT_SEND;
+        if (events[i].events & (EPOLLERR | EPOLLHUP))
+            nReady |= SOCKET_EVENT_ERROR;
+    }
+}
+#endif
+
 void ThreadSocketHandler()
 {
     unsigned int nPrevNodeCount = 0;
     while (true)
     {
+        int64_t nLoopStart = GetTimeMicros();
+
         //
         // Disconnect nodes
         //
@@ -1209,91 +1841,26 @@ void ThreadSocketHandler()
         //
         // Find which sockets have data to receive
         //
-        struct timeval timeout;
-        timeout.tv_sec  = 0;
-        timeout.tv_usec = 50000; // frequency to poll pnode->vSend
-
-        fd_set fdsetRecv;
-        fd_set fdsetSend;
-        fd_set fdsetError;
-        FD_ZERO(&fdsetRecv);
-        FD_ZERO(&fdsetSend);
-        FD_ZERO(&fdsetError);
-        SOCKET hSocketMax = 0;
-        bool have_fds = false;
-
-        BOOST_FOREACH(const ListenSocket& hListenSocket, vhListenSocket) {
-            FD_SET(hListenSocket.socket, &fdsetRecv);
-            hSocketMax = std::max(hSocketMax, hListenSocket.socket);
-            have_fds = true;
-        }
-
-        {
-            LOCK(cs_vNodes);
-            BOOST_FOREACH(CNode* pnode, vNodes)
-            {
-                if (pnode->hSocket == INVALID_SOCKET)
-                    continue;
-                FD_SET(pnode->hSocket, &fdsetError);
-                hSocketMax = std::max(hSocketMax, pnode->hSocket);
-                have_fds = true;
-
-                // Implement the following logic:
-                // * If there is data to send, select() for sending data. As this only
-                //   happens when optimistic write failed, we choose to first drain the
-                //   write buffer in this case before receiving more. This avoids
-                //   needlessly queueing received data, if the remote peer is not themselves
-                //   receiving data. This means properly utilizing TCP flow control signalling.
-                // * Otherwise, if there is no (complete) message in the receive buffer,
-                //   or there is space left in the buffer, select() for receiving data.
-                // * (if neither of the above applies, there is certainly one message
-                //   in the receiver buffer ready to be processed).
-                // Together, that means that at least one of the following is always possible,
-                // so we don't deadlock:
-                // * We send some data.
-                // * We wait for data to be received (and disconnect after timeout).
-                // * We process a message in the buffer (message handler thread).
-                {
-                    TRY_LOCK(pnode->cs_vSend, lockSend);
-                    if (lockSend && !pnode->vSendMsg.empty()) {
-                        FD_SET(pnode->hSocket, &fdsetSend);
-                        continue;
-                    }
-                }
-                {
-                    TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
-                    if (lockRecv && (
-                        pnode->vRecvMsg.empty() || !pnode->vRecvMsg.front().complete() ||
-                        pnode->GetTotalRecvSize() <= ReceiveFloodSize()))
-                        FD_SET(pnode->hSocket, &fdsetRecv);
-                }
-            }
-        }
-
-        int nSelect = select(have_fds ? hSocketMax + 1 : 0,
-                             &fdsetRecv, &fdsetSend, &fdsetError, &timeout);
+        SocketInterestMap mapInterest;
+        GenerateSocketInterest(mapInterest);
+
+        int64_t nWaitStart = GetTimeMicros();
+        std::map<SOCKET, int> mapReady;
+#ifdef HAVE_SYS_EPOLL_H
+        if (socketEventsMode == SOCKETEVENTS_EPOLL)
+            SocketEventsEpoll(mapInterest, mapReady);
+        else
+#endif
+            SocketEventsSelect(mapInterest, mapReady);
+        int64_t nWaitEnd = GetTimeMicros();
         boost::this_thread::interruption_point();
 
-        if (nSelect == SOCKET_ERROR)
-        {
-            if (have_fds)
-            {
-                int nErr = WSAGetLastError();
-                LogPrintf("socket select error %s\n", NetworkErrorString(nErr));
-                for (unsigned int i = 0; i <= hSocketMax; i++)
-                    FD_SET(i, &fdsetRecv);
-            }
-            FD_ZERO(&fdsetSend);
-            FD_ZERO(&fdsetError);
-            MilliSleep(timeout.tv_usec/1000);
-        }
-
         //
         // Accept new connections
         //
         BOOST_FOREACH(const ListenSocket& hListenSocket, vhListenSocket)
         {
-            if (hListenSocket.socket != INVALID_SOCKET && FD_ISSET(hListenSocket.socket, &fdsetRecv))
+            if (hListenSocket.socket != INVALID_SOCKET && (GetReadyEvents(mapReady, hListenSocket.socket) & SOCKET_EVENT_RECV))
             {
                 AcceptConnection(hListenSocket);
             }
@@ -1312,7 +1879,8 @@ void ThreadSocketHandler()
             //
             if (pnode->hSocket == INVALID_SOCKET)
                 continue;
-            if (FD_ISSET(pnode->hSocket, &fdsetRecv) || FD_ISSET(pnode->hSocket, &fdsetError))
+            int nReady = GetReadyEvents(mapReady, pnode->hSocket);
+            if (nReady & (SOCKET_EVENT_RECV | SOCKET_EVENT_ERROR))
             {
                 TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
                 if (lockRecv)
@@ -1320,10 +1888,16 @@ void ThreadSocketHandler()
                     {
                         // typical socket buffer is 8K-64K
                         char pchBuf[0x10000];
-                        int nBytes = recv(pnode->hSocket, pchBuf, sizeof(pchBuf), MSG_DONTWAIT);
+                        // the bulk of large messages is read straight into the message
+                        unsigned int nSpace = 0;
+                        char *pchInPlace = pnode->GetReceiveBuffer(nSpace);
+                        int nBytes = pchInPlace ? recv(pnode->hSocket, pchInPlace, nSpace, MSG_DONTWAIT)
+                                                : recv(pnode->hSocket, pchBuf, sizeof(pchBuf), MSG_DONTWAIT);
                         if (nBytes > 0)
                         {
-                            if (!pnode->ReceiveMsgBytes(pchBuf, nBytes))
+                            if (pchInPlace)
+                                pnode->ReceivedInPlace(nBytes);
+                            else if (!pnode->ReceiveMsgBytes(pchBuf, nBytes))
                                 pnode->CloseSocketDisconnect();
                             pnode->nLastRecv = GetTime();
                             pnode->nRecvBytes += nBytes;
@@ -1356,11 +1930,14 @@ void ThreadSocketHandler()
             //
             if (pnode->hSocket == INVALID_SOCKET)
                 continue;
-            if (FD_ISSET(pnode->hSocket, &fdsetSend))
             {
                 TRY_LOCK(pnode->cs_vSend, lockSend);
-                if (lockSend)
-                    SocketSendData(pnode);
+                if (lockSend) {
+                    if (!pnode->vZeroCopyPending.empty() || pnode->nZeroCopyDone != pnode->nZeroCopyNext)
+                        ReadZeroCopyCompletions(pnode);
+                    if (nReady & SOCKET_EVENT_SEND)
+                        SocketSendData(pnode);
+                }
             }
 
             //
@@ -1392,6 +1969,8 @@ void ThreadSocketHandler()
             }
         }
         ReleaseNodeVector(vNodesCopy);
+
+        RecordSocketLoop(mapReady.size(), nWaitEnd - nWaitStart, (nWaitStart - nLoopStart) + (GetTimeMicros() - nWaitEnd));
     }
 }
 
@@ -1900,7 +2479,7 @@ bool OpenNetworkConnection(const CAddress& addrConnect, CSemaphoreGrant *grantOu
 }
 
 
-void ThreadMessageHandler()
+void ThreadMessageHandler(int nThread, int nThreads)
 {
     boost::mutex condition_mutex;
     boost::unique_lock<boost::mutex> lock(condition_mutex);
@@ -1910,6 +2489,11 @@ void ThreadMessageHandler()
     {
         std::vector<CNode*> vNodesCopy = CopyNodeVector();
 
+        // Start every thread at a different node, so they don't all
+        // contend for the same nodes first
+        if (!vNodesCopy.empty())
+            std::rotate(vNodesCopy.begin(), vNodesCopy.begin() + (vNodesCopy.size() * nThread / nThreads), vNodesCopy.end());
+
         bool fSleep = true;
 
         BOOST_FOREACH(CNode* pnode, vNodesCopy)
@@ -1917,6 +2501,11 @@ void ThreadMessageHandler()
             if (pnode->fDisconnect)
                 continue;
 
+            // Another thread is handling this node
+            TRY_LOCK(pnode->cs_messageHandler, lockHandler);
+            if (!lockHandler)
+                continue;
+
             // Receive messages
             {
                 TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
@@ -1936,11 +2525,17 @@ void ThreadMessageHandler()
             }
             boost::this_thread::interruption_point();
 
-            // Send messages
+            // Send messages, written out together once they are all queued
             {
                 TRY_LOCK(pnode->cs_vSend, lockSend);
-                if (lockSend)
+                if (lockSend) {
+                    bool fWasEmpty = pnode->nSendSize == 0;
+                    pnode->fSendCorked = true;
                     GetNodeSignals().SendMessages(pnode);
+                    pnode->fSendCorked = false;
+                    if (fWasEmpty && pnode->nSendSize > 0)
+                        SocketSendData(pnode);
+                }
             }
             boost::this_thread::interruption_point();
         }
@@ -1979,7 +2574,7 @@ bool BindListenPort(const CService &addrBind, std::string& strError, bool fWhite
         LogPrintf("%s\n", strError);
         return false;
     }
-    if (!IsSelectableSocket(hListenSocket))
+    if (!IsPollableSocket(hListenSocket))
     {
         strError = "Error: Couldn't create a listenable socket for incoming connections";
         LogPrintf("%s\n", strError);
@@ -2183,7 +2778,9 @@ void StartNode(boost::thread_group& threadGroup, CScheduler& scheduler)
     threadGroup.create_thread(boost::bind(&TraceThread<void (*)()>, "mnbcon", &ThreadMnbRequestConnections));
 
     // Process messages
-    threadGroup.create_thread(boost::bind(&TraceThread<void (*)()>, "msghand", &ThreadMessageHandler));
+    int nMessageHandlerThreads = std::max(std::min((int)GetArg("-msghandlerthreads", DEFAULT_MSG_HANDLER_THREADS), MAX_MSG_HANDLER_THREADS), 1);
+    for (int i = 0; i < nMessageHandlerThreads; i++)
+        threadGroup.create_thread(boost::bind(&TraceThread<boost::function<void()> >, "msghand", boost::function<void()>(boost::bind(&ThreadMessageHandler, i, nMessageHandlerThreads))));
 
     // Dump network addresses
     scheduler.scheduleEvery(&DumpData, DUMP_ADDRESSES_INTERVAL);
@@ -2241,6 +2838,14 @@ public:
         delete pnodeLocalHost;
         pnodeLocalHost = NULL;
 
+#ifdef HAVE_SYS_EPOLL_H
+        if (hEpoll != -1)
+            close(hEpoll);
+        hEpoll = -1;
+        mapEpollInterest.clear();
+#endif
+        socketEventsMode = SOCKETEVENTS_SELECT;
+
 #ifdef WIN32
         // Shutdown Windows Sockets
         WSACleanup();
@@ -2258,39 +2863,23 @@ void CExplicitNetCleanup::callCleanup()
 }
 
 void RelayTransaction(const CTransaction& tx)
-{
-    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
-    ss.reserve(10000);
-    uint256 hash = tx.GetHash();
-    CTxLockRequest txLockRequest;
-    if(mapDarksendBroadcastTxes.count(hash)) { // MSG_DSTX
-        ss << mapDarksendBroadcastTxes[hash];
-    } else if(instantsend.GetTxLockRequest(hash, txLockRequest)) { // MSG_TXLOCK_REQUEST
-        ss << txLockRequest;
-    } else { // MSG_TX
-        ss << tx;
-    }
-    RelayTransaction(tx, ss);
-}
-
-void RelayTransaction(const CTransaction& tx, const CDataStream& ss)
 {
     uint256 hash = tx.GetHash();
     int nInv = mapDarksendBroadcastTxes.count(hash) ? MSG_DSTX :
                 (instantsend.HasTxLockRequest(hash) ? MSG_TXLOCK_REQUEST : MSG_TX);
     CInv inv(nInv, hash);
+    if (nInv == MSG_TX) {
+        // Keep the transaction around for getdata after it leaves the
+        // mempool, sharing the mempool's copy while it is there. Darksend
+        // broadcasts and lock requests are served from their own maps.
+        CTransactionRef ptx = mempool.get(hash);
+        if (!ptx)
+            ptx = MakeTransactionRef(tx);
+        relayCache.Insert(ptx, GetTime());
+    }
     {
-        LOCK(cs_mapRelay);
-        // Expire old relay messages
-        while (!vRelayExpiration.empty() && vRelayExpiration.front().first < GetTime())
-        {
-            mapRelay.erase(vRelayExpiration.front().second);
-            vRelayExpiration.pop_front();
-        }
-
-        // Save original serialized message so newer versions are preserved
-        mapRelay.insert(std::make_pair(inv, ss));
-        vRelayExpiration.push_back(std::make_pair(GetTime() + 15 * 60, inv));
+        LOCK(cs_invRelay);
+        invRelayStats.nObjectsRelayed++;
     }
     LOCK(cs_vNodes);
     BOOST_FOREACH(CNode* pnode, vNodes)
@@ -2301,17 +2890,61 @@ void RelayTransaction(const CTransaction& tx, const CDataStream& ss)
         if (pnode->pfilter)
         {
             if (pnode->pfilter->IsRelevantAndUpdate(tx))
-                pnode->PushInventory(inv);
+                pnode->PushRelayInventory(inv);
         } else
-            pnode->PushInventory(inv);
+            pnode->PushRelayInventory(inv);
     }
 }
 
 void RelayInv(CInv &inv, const int minProtoVersion) {
+    {
+        LOCK(cs_invRelay);
+        invRelayStats.nObjectsRelayed++;
+    }
     LOCK(cs_vNodes);
     BOOST_FOREACH(CNode* pnode, vNodes)
         if(pnode->nVersion >= minProtoVersion)
-            pnode->PushInventory(inv);
+            pnode->PushRelayInventory(inv);
+}
+
+// Most inv batches kept with their serialized message
+static const unsigned int MAX_RECENT_INV_MESSAGES = 8;
+
+void PushInventoryMessage(CNode* pnode, const std::vector<CInv>& vInv)
+{
+    boost::shared_ptr<const CSerializeData> pmsg;
+    {
+        LOCK(cs_invRelay);
+        for (size_t i = 0; i < vRecentInvMessages.size(); i++) {
+            if (vRecentInvMessages[i].first == vInv) {
+                pmsg = vRecentInvMessages[i].second;
+                invRelayStats.nInvMsgsShared++;
+                break;
+            }
+        }
+    }
+
+    if (!pmsg) {
+        CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+        ss << CMessageHeader(Params().MessageStart(), NetMsgType::INV, 0) << vInv;
+        unsigned int nSize = ss.size() - CMessageHeader::HEADER_SIZE;
+        WriteLE32((uint8_t*)&ss[CMessageHeader::MESSAGE_SIZE_OFFSET], nSize);
+        uint256 hash = Hash(ss.begin() + CMessageHeader::HEADER_SIZE, ss.end());
+        memcpy((char*)&ss[CMessageHeader::CHECKSUM_OFFSET], hash.begin(), CMessageHeader::CHECKSUM_SIZE);
+        pmsg.reset(new CSerializeData(ss.begin(), ss.end()));
+
+        LOCK(cs_invRelay);
+        vRecentInvMessages.push_front(std::make_pair(vInv, pmsg));
+        if (vRecentInvMessages.size() > MAX_RECENT_INV_MESSAGES)
+            vRecentInvMessages.pop_back();
+    }
+
+    pnode->PushSerializedMessage(NetMsgType::INV, *pmsg);
+
+    LOCK(cs_invRelay);
+    invRelayStats.nInvsSent += vInv.size();
+    invRelayStats.nInvMsgsSent++;
+    invRelayStats.nInvBytesSent += pmsg->size();
 }
 
 void CNode::RecordBytesRecv(uint64_t bytes)
@@ -2604,6 +3237,15 @@ CNode::CNode(SOCKET hSocketIn, const CAddress& addrIn, const std::string& addrNa
     nRefCount = 0;
     nSendSize = 0;
     nSendOffset = 0;
+    nSendLane = -1;
+    for (int i = 0; i < SEND_LANE_MAX; i++)
+        nSendLanePass[i] = 0;
+    nSendPass = 0;
+    fSendCorked = false;
+    fZeroCopySend = EnableZeroCopySend(hSocket);
+    fZeroCopyMsg = false;
+    nZeroCopyNext = 0;
+    nZeroCopyDone = 0;
     hashContinue = uint256();
     nStartingHeight = -1;
     filterInventoryKnown.reset();
@@ -2706,6 +3348,8 @@ void CNode::BeginMessage(const char* pszCommand) EXCLUSIVE_LOCK_FUNCTION(cs_vSen
 {
     ENTER_CRITICAL_SECTION(cs_vSend);
     assert(ssSend.size() == 0);
+    if (ssSend.capacity() == 0)
+        sendBufferPool.Get(ssSend, 0);
     ssSend << CMessageHeader(Params().MessageStart(), pszCommand, 0);
     LogPrint("net", "sending: %s ", SanitizeString(pszCommand));
 }
@@ -2754,15 +3398,42 @@ void CNode::EndMessage(const char* pszCommand) UNLOCK_FUNCTION(cs_vSend)
 
     LogPrint("net", "(%d bytes) peer=%d\n", nSize, id);
 
-    std::deque<CSerializeData>::iterator it = vSendMsg.insert(vSendMsg.end(), CSerializeData());
-    ssSend.GetAndClear(*it);
-    nSendSize += (*it).size();
+    QueueMessage(pszCommand);
+
+    LEAVE_CRITICAL_SECTION(cs_vSend);
+}
+
+void CNode::PushSerializedMessage(const char* pszCommand, const CSerializeData& vchMessage)
+{
+    LOCK(cs_vSend);
+    assert(ssSend.size() == 0);
+    if (ssSend.capacity() == 0)
+        sendBufferPool.Get(ssSend, vchMessage.size());
+    ssSend.write(&vchMessage[0], vchMessage.size());
+
+    mapSendBytesPerMsgCmd[std::string(pszCommand)] += vchMessage.size();
+    LogPrint("net", "sending: %s (%d bytes) peer=%d\n", SanitizeString(pszCommand), vchMessage.size() - CMessageHeader::HEADER_SIZE, id);
+
+    QueueMessage(pszCommand);
+}
+
+void CNode::QueueMessage(const char* pszCommand)
+{
+    SendLane lane = GetSendLane(pszCommand);
+    std::deque<std::pair<int64_t, CSerializeData> >& queue = vSendMsg[lane];
+    // A lane gets no credit for the time it was idle
+    if (queue.empty())
+        nSendLanePass[lane] = std::max(nSendLanePass[lane], nSendPass);
+    queue.push_back(std::make_pair(GetTimeMicros(), CSerializeData()));
+    // Hand over the buffer itself, the next message takes one from sendBufferPool
+    ssSend.swap(queue.back().second);
+    size_t nMsgSize = queue.back().second.size();
+    nSendSize += nMsgSize;
+    sendLaneStats[lane].nQueuedBytes += nMsgSize;
 
     // If write queue empty, attempt "optimistic write"
-    if (it == vSendMsg.begin())
+    if (nSendSize == nMsgSize && !fSendCorked)
         SocketSendData(this);
-
-    LEAVE_CRITICAL_SECTION(cs_vSend);
 }
 
 std::vector<unsigned char> CNode::CalculateKeyedNetGroup(CAddress& address)
@@ -2891,6 +3562,13 @@ int64_t PoissonNextSend(int64_t nNow, int average_interval_seconds) {
     return nNow + (int64_t)(log1p(GetRand(1ULL << 48) * -0.0000000000000035527136788 /* -1/2^48 */) * average_interval_seconds * -1000000.0 + 0.5);
 }
 
+int64_t PoissonNextSendInbound(int64_t nNow, int average_interval_seconds) {
+    LOCK(cs_invRelay);
+    if (nNextInvSendInbound < nNow)
+        nNextInvSendInbound = PoissonNextSend(nNow, average_interval_seconds);
+    return nNextInvSendInbound;
+}
+
 std::vector<CNode*> CopyNodeVector()
 {
     std::vector<CNode*> vecNodesCopy;
@@ -8,10 +8,13 @@
 
 #include "bloom.h"
 #include "compat.h"
+#include "hash.h"
 #include "limitedmap.h"
 #include "netbase.h"
+#include "primitives/transaction.h"
 #include "protocol.h"
 #include "random.h"
+#include "relaycache.h"
 #include "streams.h"
 #include "sync.h"
 #include "uint256.h"
@@ -75,12 +78,63 @@ static const bool DEFAULT_BLOCKSONLY = false;
 static const bool DEFAULT_FORCEDNSSEED = false;
 static const size_t DEFAULT_MAXRECEIVEBUFFER = 5 * 1000;
 static const size_t DEFAULT_MAXSENDBUFFER    = 1 * 1000;
+/** -msghandlerthreads default */
+static const int DEFAULT_MSG_HANDLER_THREADS = 4;
+/** Maximum number of message handler threads */
+static const int MAX_MSG_HANDLER_THREADS = 16;
 
 static const ServiceFlags REQUIRED_SERVICES = NODE_NETWORK;
 
 // NOTE: When adjusting this, update rpcnet:setban's help ("24h")
 static const unsigned int DEFAULT_MISBEHAVING_BANTIME = 60 * 60 * 24;  // Default 24-hour ban
 
+/** -socketevents default */
+#ifdef HAVE_SYS_EPOLL_H
+static const char * const DEFAULT_SOCKETEVENTS = "epoll";
+#else
+static const char * const DEFAULT_SOCKETEVENTS = "select";
+#endif
+
+/** How the socket handler thread waits for socket events */
+enum SocketEventsMode {
+    SOCKETEVENTS_SELECT,
+    SOCKETEVENTS_EPOLL,
+};
+
+/** Time spent in the socket handler thread, see getnettotals */
+struct CSocketLoopStats
+{
+    uint64_t nLoops;
+    //! Number of ready sockets reported
+    uint64_t nEvents;
+    int64_t nWaitMicros;
+    int64_t nBusyMicros;
+    //! Longest time spent handling sockets in one loop
+    int64_t nMaxBusyMicros;
+    //! Socket writes, the messages they completed and the writes done with MSG_ZEROCOPY
+    uint64_t nSendCalls;
+    uint64_t nSendMsgs;
+    uint64_t nZeroCopySends;
+
+    CSocketLoopStats() : nLoops(0), nEvents(0), nWaitMicros(0), nBusyMicros(0), nMaxBusyMicros(0),
+                         nSendCalls(0), nSendMsgs(0), nZeroCopySends(0) {}
+};
+
+/** Inventory announcements, see getnettotals */
+struct CInvRelayStats
+{
+    //! Objects passed to RelayTransaction and RelayInv
+    uint64_t nObjectsRelayed;
+    //! Inventory items announced and the inv messages (with headers) used for it
+    uint64_t nInvsSent;
+    uint64_t nInvMsgsSent;
+    uint64_t nInvBytesSent;
+    //! Inv messages that were serialized once for several peers
+    uint64_t nInvMsgsShared;
+
+    CInvRelayStats() : nObjectsRelayed(0), nInvsSent(0), nInvMsgsSent(0), nInvBytesSent(0), nInvMsgsShared(0) {}
+};
+
 unsigned int ReceiveFloodSize();
 unsigned int SendBufferSize();
 
@@ -100,6 +154,18 @@ bool BindListenPort(const CService &bindAddr, std::string& strError, bool fWhite
 void StartNode(boost::thread_group& threadGroup, CScheduler& scheduler);
 bool StopNode();
 void SocketSendData(CNode *pnode);
+/** Release send buffers of MSG_ZEROCOPY writes the kernel is done with, requires LOCK(cs_vSend) */
+void ReadZeroCopyCompletions(CNode *pnode);
+/** Set the -socketevents mode, before any sockets are opened. Falls back to select if epoll can't be used. */
+bool SetSocketEventsMode(const std::string& strMode, std::string& strError);
+SocketEventsMode GetSocketEventsMode();
+std::string GetSocketEventsModeName();
+/** Whether the socket handler can wait for events on the socket */
+bool IsPollableSocket(SOCKET hSocket);
+void GetSocketLoopStats(CSocketLoopStats& stats);
+void GetInvRelayStats(CInvRelayStats& stats);
+/** Announce vInv to pnode. Batches sent to several peers are serialized only once. */
+void PushInventoryMessage(CNode* pnode, const std::vector<CInv>& vInv);
 
 typedef int NodeId;
 
@@ -170,9 +236,7 @@ extern int nMaxConnections;
 
 extern std::vector<CNode*> vNodes;
 extern CCriticalSection cs_vNodes;
-extern std::map<CInv, CDataStream> mapRelay;
-extern std::deque<std::pair<int64_t, CInv> > vRelayExpiration;
-extern CCriticalSection cs_mapRelay;
+extern CRelayCache relayCache;
 extern limitedmap<uint256, int64_t> mapAlreadyAskedFor;
 
 extern std::vector<std::string> vAddedNodes;
@@ -193,6 +257,33 @@ extern CCriticalSection cs_mapLocalHost;
 extern std::map<CNetAddr, LocalServiceInfo> mapLocalHost;
 typedef std::map<std::string, uint64_t> mapMsgCmdSize; //command, total bytes
 
+/**
+ * Every peer has a send queue per lane. Messages within a lane are sent in
+ * the order they were queued, the lanes share the socket by weight so block
+ * and InstantSend traffic does not wait behind masternode and governance sync.
+ */
+enum SendLane {
+    SEND_LANE_BLOCK,        //! blocks, compact blocks and headers
+    SEND_LANE_INSTANTSEND,  //! InstantSend lock requests and votes
+    SEND_LANE_NORMAL,       //! everything else
+    SEND_LANE_BULK,         //! masternode lists, payment votes and governance objects
+    SEND_LANE_MAX
+};
+
+/** The lane messages of a command are queued in */
+SendLane GetSendLane(const std::string& strCommand);
+std::string GetSendLaneName(int nLane);
+
+struct CSendLaneStats
+{
+    uint64_t nQueuedBytes;   //! bytes waiting in the lane
+    uint64_t nMsgs;          //! messages sent completely
+    int64_t nDelayMicros;    //! total time messages spent in the lane until sent
+    int64_t nMaxDelayMicros;
+
+    CSendLaneStats() : nQueuedBytes(0), nMsgs(0), nDelayMicros(0), nMaxDelayMicros(0) {}
+};
+
 class CNodeStats
 {
 public:
@@ -212,6 +303,7 @@ public:
     mapMsgCmdSize mapSendBytesPerMsgCmd;
     uint64_t nRecvBytes;
     mapMsgCmdSize mapRecvBytesPerMsgCmd;
+    CSendLaneStats sendLaneStats[SEND_LANE_MAX];
     bool fWhitelisted;
     double dPingTime;
     double dPingWait;
@@ -222,7 +314,45 @@ public:
 
 
 
+/** Most buffers kept for reuse by each pool */
+static const unsigned int MAX_NET_BUFFER_POOL_SIZE = 256;
+/** Most bytes of buffers kept for reuse by each pool */
+static const size_t MAX_NET_BUFFER_POOL_BYTES = 8 * 1024 * 1024;
+
+/**
+ * Message buffers are recycled through these pools, so a busy connection
+ * does not allocate (and cleanse when freeing) a new buffer for every
+ * message it receives or sends.
+ */
+class CNetBufferPool
+{
+private:
+    CCriticalSection cs;
+    std::vector<CSerializeData> vFree;
+    size_t nFreeBytes;
+
+public:
+    //! Buffers allocated or grown, and buffers taken from the pool
+    std::atomic<uint64_t> nAllocs;
+    std::atomic<uint64_t> nReuses;
+
+    CNetBufferPool() : nFreeBytes(0), nAllocs(0), nReuses(0) { vFree.reserve(MAX_NET_BUFFER_POOL_SIZE); }
+
+    /** Give an empty stream a buffer for at least nSize bytes, recycled if possible */
+    void Get(CDataStream& s, size_t nSize);
+    /** Take a buffer that is no longer used */
+    void Put(CDataStream& s);
+    void Put(CSerializeData& vch);
+};
+
+extern CNetBufferPool recvBufferPool;
+extern CNetBufferPool sendBufferPool;
+
 class CNetMessage {
+private:
+    mutable CHash256 hasher;        // checksum of the data, computed while receiving
+    mutable uint256 data_hash;
+
 public:
     bool in_data;                   // parsing header (false) or data (true)
 
@@ -256,8 +386,15 @@ public:
         vRecv.SetVersion(nVersionIn);
     }
 
+    /** Double SHA256 of the data, only valid once the message is complete */
+    const uint256& GetMessageHash() const;
+
     int readHeader(const char *pch, unsigned int nBytes);
     int readData(const char *pch, unsigned int nBytes);
+
+    /** Room for up to nMax more bytes of data, to be filled and passed to ReceivedData() */
+    char* GetDataBuffer(unsigned int nMax, unsigned int& nSpace);
+    void ReceivedData(unsigned int nBytes);
 };
 
 
@@ -332,14 +469,35 @@ public:
     SOCKET hSocket;
     CDataStream ssSend;
     size_t nSendSize; // total size of all vSendMsg entries
-    size_t nSendOffset; // offset inside the first vSendMsg already sent
+    size_t nSendOffset; // offset inside the message of nSendLane already sent
     uint64_t nSendBytes;
-    std::deque<CSerializeData> vSendMsg;
+    // queued messages with the time they were queued, by lane
+    std::deque<std::pair<int64_t, CSerializeData> > vSendMsg[SEND_LANE_MAX];
+    // the lane the message being sent is from, a message is sent completely
+    // before another lane gets its turn
+    int nSendLane;
+    // virtual finish times of the lanes, see SocketSendData
+    uint64_t nSendLanePass[SEND_LANE_MAX];
+    uint64_t nSendPass;
+    CSendLaneStats sendLaneStats[SEND_LANE_MAX];
+    // set while the message handler queues messages, to write them out
+    // together once it is done instead of one at a time
+    bool fSendCorked;
+    // MSG_ZEROCOPY writes: the buffers of messages written with it stay in
+    // use by the kernel until the write with the given id completed
+    bool fZeroCopySend;
+    bool fZeroCopyMsg; // the message being sent was partly written with it
+    uint32_t nZeroCopyNext;
+    uint32_t nZeroCopyDone;
+    std::deque<std::pair<uint32_t, CSerializeData> > vZeroCopyPending;
     CCriticalSection cs_vSend;
 
     std::deque<CInv> vRecvGetData;
     std::deque<CNetMessage> vRecvMsg;
     CCriticalSection cs_vRecvMsg;
+    // Held by the message handler thread processing this node, so its
+    // messages are handled in order by one thread at a time
+    CCriticalSection cs_messageHandler;
     uint64_t nRecvBytes;
     int nRecvVersion;
 
@@ -412,7 +570,10 @@ public:
 
     // inventory based relay
     CRollingBloomFilter filterInventoryKnown;
+    // Announced with the next SendMessages (answers to sync requests, blocks)
     std::vector<CInv> vInventoryToSend;
+    // Relayed inventory, announced in batches at nNextInvSend
+    std::deque<CInv> vInventoryToRelay;
     CCriticalSection cs_inventory;
     std::set<uint256> setAskFor;
     std::multimap<int64_t, CInv> mapAskFor;
@@ -463,6 +624,12 @@ private:
     CNode(const CNode&);
     void operator=(const CNode&);
 
+    // requires LOCK(cs_vRecvMsg)
+    void RecvMsgComplete(CNetMessage& msg);
+
+    // Queue the message in ssSend, requires LOCK(cs_vSend)
+    void QueueMessage(const char* pszCommand);
+
 public:
 
     NodeId GetId() const {
@@ -488,6 +655,17 @@ public:
     // requires LOCK(cs_vRecvMsg)
     bool ReceiveMsgBytes(const char *pch, unsigned int nBytes);
 
+    // requires LOCK(cs_vRecvMsg)
+    // Room to receive the rest of a large message straight into, or NULL
+    char* GetReceiveBuffer(unsigned int& nSpace);
+
+    // requires LOCK(cs_vRecvMsg)
+    void ReceivedInPlace(unsigned int nBytes);
+
+    // requires LOCK(cs_vRecvMsg)
+    // Drop processed messages, recycling their buffers
+    void PopRecvMsgs(std::deque<CNetMessage>::iterator itEnd);
+
     // requires LOCK(cs_vRecvMsg)
     void SetRecvVersion(int nVersionIn)
     {
@@ -553,6 +731,16 @@ public:
         }
     }
 
+    void PushRelayInventory(const CInv& inv)
+    {
+        {
+            LOCK(cs_inventory);
+            if (filterInventoryKnown.contains(inv.hash))
+                return;
+            vInventoryToRelay.push_back(inv);
+        }
+    }
+
     void PushBlockHash(const uint256 &hash)
     {
         LOCK(cs_inventory);
@@ -570,6 +758,9 @@ public:
     // TODO: Document the precondition of this function.  Is cs_vSend locked?
     void EndMessage(const char* pszCommand) UNLOCK_FUNCTION(cs_vSend);
 
+    /** Queue a complete message (header included) that was serialized beforehand */
+    void PushSerializedMessage(const char* pszCommand, const CSerializeData& vchMessage);
+
     void PushVersion();
 
 
@@ -854,9 +1045,7 @@ public:
     static void callCleanup();
 };
 
-class CTransaction;
 void RelayTransaction(const CTransaction& tx);
-void RelayTransaction(const CTransaction& tx, const CDataStream& ss);
 void RelayInv(CInv &inv, const int minProtoVersion = MIN_PEER_PROTO_VERSION);
 
 /** Access to the (IP) address database (peers.dat) */
@@ -884,6 +1073,8 @@ public:
 
 /** Return a timestamp in the future (in microseconds) for exponentially distributed events. */
 int64_t PoissonNextSend(int64_t nNow, int average_interval_seconds);
+/** Like PoissonNextSend, but the same timestamp for all callers until it has passed. */
+int64_t PoissonNextSendInbound(int64_t nNow, int average_interval_seconds);
 
 std::vector<CNode*> CopyNodeVector();
 
@@ -12,132 +12,123 @@
 #include "txmempool.h"
 #include "util.h"
 
-void TxConfirmStats::Initialize(std::vector<double>& defaultBuckets,
-                                unsigned int maxConfirms, double _decay, std::string _dataTypeString)
-{
-    decay = _decay;
-    dataTypeString = _dataTypeString;
-    for (unsigned int i = 0; i < defaultBuckets.size(); i++) {
-        buckets.push_back(defaultBuckets[i]);
-        bucketMap[defaultBuckets[i]] = i;
-    }
-    confAvg.resize(maxConfirms);
-    curBlockConf.resize(maxConfirms);
-    unconfTxs.resize(maxConfirms);
-    for (unsigned int i = 0; i < maxConfirms; i++) {
-        confAvg[i].resize(buckets.size());
-        curBlockConf[i].resize(buckets.size());
-        unconfTxs[i].resize(buckets.size());
-    }
+/** Rescale the moving averages before the scale factor overflows */
+static const double MAX_SCALE_FACTOR = 1e100;
 
-    oldUnconfTxs.resize(buckets.size());
-    curBlockTxCt.resize(buckets.size());
+TxConfirmStats::TxConfirmStats(const std::vector<double>& defaultBuckets, unsigned int _maxPeriods,
+                               unsigned int _scale, double _decay, std::string _dataTypeString)
+    : buckets(defaultBuckets), scale(_scale), maxPeriods(_maxPeriods), decay(_decay),
+      scaleNow(1), dataTypeString(_dataTypeString)
+{
     txCtAvg.resize(buckets.size());
-    curBlockVal.resize(buckets.size());
     avg.resize(buckets.size());
+    confAvg.resize(maxPeriods * buckets.size());
+    unconfTxs.resize(maxPeriods * buckets.size());
+    oldUnconfTxs.resize(buckets.size());
 }
 
-// Zero out the data for the current block
-void TxConfirmStats::ClearCurrent(unsigned int nBlockHeight)
+void TxConfirmStats::Rescale(double factor)
 {
     for (unsigned int j = 0; j < buckets.size(); j++) {
-        oldUnconfTxs[j] += unconfTxs[nBlockHeight%unconfTxs.size()][j];
-        unconfTxs[nBlockHeight%unconfTxs.size()][j] = 0;
-        for (unsigned int i = 0; i < curBlockConf.size(); i++)
-            curBlockConf[i][j] = 0;
-        curBlockTxCt[j] = 0;
-        curBlockVal[j] = 0;
+        txCtAvg[j] *= factor;
+        avg[j] *= factor;
     }
+    for (unsigned int i = 0; i < confAvg.size(); i++)
+        confAvg[i] *= factor;
 }
 
-
-void TxConfirmStats::Record(int blocksToConfirm, double val)
+void TxConfirmStats::NewBlock(unsigned int nBlockHeight)
 {
-    // blocksToConfirm is 1-based
-    if (blocksToConfirm < 1)
-        return;
-    unsigned int bucketindex = bucketMap.lower_bound(val)->second;
-    for (size_t i = blocksToConfirm; i <= curBlockConf.size(); i++) {
-        curBlockConf[i - 1][bucketindex]++;
+    // The transactions that entered maxPeriods periods ago are now old
+    if (nBlockHeight % scale == 0) {
+        unsigned int nOffset = (nBlockHeight / scale) % maxPeriods * buckets.size();
+        for (unsigned int j = 0; j < buckets.size(); j++) {
+            oldUnconfTxs[j] += unconfTxs[nOffset + j];
+            unconfTxs[nOffset + j] = 0;
+        }
+    }
+
+    // Decaying everything recorded so far is the same as giving more weight
+    // to everything recorded from now on
+    scaleNow /= decay;
+    if (scaleNow > MAX_SCALE_FACTOR) {
+        Rescale(1 / scaleNow);
+        scaleNow = 1;
     }
-    curBlockTxCt[bucketindex]++;
-    curBlockVal[bucketindex] += val;
 }
 
-void TxConfirmStats::UpdateMovingAverages()
+void TxConfirmStats::Record(int blocksToConfirm, unsigned int bucketIndex, double val)
 {
-    for (unsigned int j = 0; j < buckets.size(); j++) {
-        for (unsigned int i = 0; i < confAvg.size(); i++)
-            confAvg[i][j] = confAvg[i][j] * decay + curBlockConf[i][j];
-        avg[j] = avg[j] * decay + curBlockVal[j];
-        txCtAvg[j] = txCtAvg[j] * decay + curBlockTxCt[j];
-    }
+    // blocksToConfirm is 1-based
+    if (blocksToConfirm < 1)
+        return;
+    unsigned int periodsToConfirm = (blocksToConfirm + scale - 1) / scale;
+    if (periodsToConfirm <= maxPeriods)
+        confAvg[(periodsToConfirm - 1) * buckets.size() + bucketIndex] += scaleNow;
+    txCtAvg[bucketIndex] += scaleNow;
+    avg[bucketIndex] += val * scaleNow;
 }
 
 // returns -1 on error conditions
 double TxConfirmStats::EstimateMedianVal(int confTarget, double sufficientTxVal,
-                                         double successBreakPoint, bool requireGreater,
-                                         unsigned int nBlockHeight)
+                                         double successBreakPoint, unsigned int nBlockHeight) const
 {
-    // Counters for a bucket (or range of buckets)
+    // Counters for a bucket (or range of buckets), all but extraNum scaled by scaleNow
     double nConf = 0; // Number of tx's confirmed within the confTarget
     double totalNum = 0; // Total number of tx's that were ever confirmed
     int extraNum = 0;  // Number of tx's still in mempool for confTarget or longer
 
-    int maxbucketindex = buckets.size() - 1;
+    const unsigned int numBuckets = buckets.size();
+    const int maxbucketindex = numBuckets - 1;
+    const unsigned int periodTarget = (confTarget + scale - 1) / scale;
+    const unsigned int curPeriod = nBlockHeight / scale;
+    const double sufficientNum = sufficientTxVal / (1 - decay) * scaleNow;
 
-    // requireGreater means we are looking for the lowest fee/priority such that all higher
-    // values pass, so we start at maxbucketindex (highest fee) and look at succesively
-    // smaller buckets until we reach failure.  Otherwise, we are looking for the highest
-    // fee/priority such that all lower values fail, and we go in the opposite direction.
-    unsigned int startbucket = requireGreater ? maxbucketindex : 0;
-    int step = requireGreater ? -1 : 1;
+    // We are looking for the lowest fee such that all higher values pass, so
+    // we start at maxbucketindex (highest fee) and look at succesively
+    // smaller buckets until we reach failure.
 
     // We'll combine buckets until we have enough samples.
     // The near and far variables will define the range we've combined
     // The best variables are the last range we saw which still had a high
     // enough confirmation rate to count as success.
     // The cur variables are the current range we're counting.
-    unsigned int curNearBucket = startbucket;
-    unsigned int bestNearBucket = startbucket;
-    unsigned int curFarBucket = startbucket;
-    unsigned int bestFarBucket = startbucket;
+    unsigned int curNearBucket = maxbucketindex;
+    unsigned int bestNearBucket = maxbucketindex;
+    unsigned int curFarBucket = maxbucketindex;
+    unsigned int bestFarBucket = maxbucketindex;
 
     bool foundAnswer = false;
-    unsigned int bins = unconfTxs.size();
 
-    // Start counting from highest(default) or lowest fee/pri transactions
-    for (int bucket = startbucket; bucket >= 0 && bucket <= maxbucketindex; bucket += step) {
+    // Start counting from highest fee transactions
+    for (int bucket = maxbucketindex; bucket >= 0; bucket--) {
         curFarBucket = bucket;
-        nConf += confAvg[confTarget - 1][bucket];
+        for (unsigned int period = 0; period < periodTarget; period++)
+            nConf += confAvg[period * numBuckets + bucket];
         totalNum += txCtAvg[bucket];
-        for (unsigned int confct = confTarget; confct < GetMaxConfirms(); confct++)
-            extraNum += unconfTxs[(nBlockHeight - confct)%bins][bucket];
+        for (unsigned int periodsAgo = periodTarget; periodsAgo < maxPeriods && periodsAgo <= curPeriod; periodsAgo++)
+            extraNum += unconfTxs[(curPeriod - periodsAgo) % maxPeriods * numBuckets + bucket];
         extraNum += oldUnconfTxs[bucket];
         // If we have enough transaction data points in this range of buckets,
         // we can test for success
         // (Only count the confirmed data points, so that each confirmation count
         // will be looking at the same amount of data and same bucket breaks)
-        if (totalNum >= sufficientTxVal / (1 - decay)) {
-            double curPct = nConf / (totalNum + extraNum);
+        if (totalNum >= sufficientNum) {
+            double curPct = nConf / (totalNum + extraNum * scaleNow);
 
             // Check to see if we are no longer getting confirmed at the success rate
-            if (requireGreater && curPct < successBreakPoint)
-                break;
-            if (!requireGreater && curPct > successBreakPoint)
+            if (curPct < successBreakPoint)
                 break;
 
             // Otherwise update the cumulative stats, and the bucket variables
             // and reset the counters
-            else {
-                foundAnswer = true;
-                nConf = 0;
-                totalNum = 0;
-                extraNum = 0;
-                bestNearBucket = curNearBucket;
-                bestFarBucket = curFarBucket;
-                curNearBucket = bucket + step;
-            }
+            foundAnswer = true;
+            nConf = 0;
+            totalNum = 0;
+            extraNum = 0;
+            bestNearBucket = curNearBucket;
+            bestFarBucket = curFarBucket;
+            curNearBucket = bucket - 1;
         }
     }
 
@@ -148,8 +139,8 @@ double TxConfirmStats::EstimateMedianVal(int confTarget, double sufficientTxVal,
     // Find the bucket with the median transaction and then report the average fee from that bucket
     // This is a compromise between finding the median which we can't since we don't save all tx's
     // and reporting the average which is less accurate
-    unsigned int minBucket = bestNearBucket < bestFarBucket ? bestNearBucket : bestFarBucket;
-    unsigned int maxBucket = bestNearBucket > bestFarBucket ? bestNearBucket : bestFarBucket;
+    unsigned int minBucket = bestFarBucket;
+    unsigned int maxBucket = bestNearBucket;
     for (unsigned int j = minBucket; j <= maxBucket; j++) {
         txSum += txCtAvg[j];
     }
@@ -165,187 +156,158 @@ double TxConfirmStats::EstimateMedianVal(int confTarget, double sufficientTxVal,
         }
     }
 
-    LogPrint("estimatefee", "%3d: For conf success %s %4.2f need %s %s: %12.5g from buckets %8g - %8g  Cur Bucket stats %6.2f%%  %8.1f/(%.1f+%d mempool)\n",
-             confTarget, requireGreater ? ">" : "<", successBreakPoint, dataTypeString,
-             requireGreater ? ">" : "<", median, buckets[minBucket], buckets[maxBucket],
-             100 * nConf / (totalNum + extraNum), nConf, totalNum, extraNum);
+    LogPrint("estimatefee", "%3d: For conf success > %4.2f need %s FeeRate > %12.5g from buckets %8g - %8g  Cur Bucket stats %6.2f%%  %8.1f/(%.1f+%d mempool)\n",
+             confTarget, successBreakPoint, dataTypeString, median, buckets[minBucket], buckets[maxBucket],
+             100 * nConf / (totalNum + extraNum * scaleNow), nConf / scaleNow, totalNum / scaleNow, extraNum);
 
     return median;
 }
 
-void TxConfirmStats::Write(CAutoFile& fileout)
+void TxConfirmStats::Write(CAutoFile& fileout) const
 {
+    // The averages are written unscaled
+    std::vector<double> fileAvg(avg), fileTxCtAvg(txCtAvg), fileConfAvg(confAvg);
+    for (unsigned int j = 0; j < buckets.size(); j++) {
+        fileAvg[j] /= scaleNow;
+        fileTxCtAvg[j] /= scaleNow;
+    }
+    for (unsigned int i = 0; i < fileConfAvg.size(); i++)
+        fileConfAvg[i] /= scaleNow;
+
     fileout << decay;
-    fileout << buckets;
-    fileout << avg;
-    fileout << txCtAvg;
-    fileout << confAvg;
+    fileout << scale;
+    fileout << fileAvg;
+    fileout << fileTxCtAvg;
+    fileout << fileConfAvg;
 }
 
 void TxConfirmStats::Read(CAutoFile& filein)
 {
     // Read data file into temporary variables and do some very basic sanity checking
-    std::vector<double> fileBuckets;
     std::vector<double> fileAvg;
-    std::vector<std::vector<double> > fileConfAvg;
+    std::vector<double> fileConfAvg;
     std::vector<double> fileTxCtAvg;
     double fileDecay;
-    size_t maxConfirms;
-    size_t numBuckets;
+    unsigned int fileScale;
+    size_t numBuckets = buckets.size();
+    size_t filePeriods;
 
     filein >> fileDecay;
     if (fileDecay <= 0 || fileDecay >= 1)
         throw std::runtime_error("Corrupt estimates file. Decay must be between 0 and 1 (non-inclusive)");
-    filein >> fileBuckets;
-    numBuckets = fileBuckets.size();
-    if (numBuckets <= 1 || numBuckets > 1000)
-        throw std::runtime_error("Corrupt estimates file. Must have between 2 and 1000 fee/pri buckets");
+    filein >> fileScale;
+    if (fileScale == 0)
+        throw std::runtime_error("Corrupt estimates file. Scale must be non-zero");
     filein >> fileAvg;
     if (fileAvg.size() != numBuckets)
-        throw std::runtime_error("Corrupt estimates file. Mismatch in fee/pri average bucket count");
+        throw std::runtime_error("Corrupt estimates file. Mismatch in fee average bucket count");
     filein >> fileTxCtAvg;
     if (fileTxCtAvg.size() != numBuckets)
         throw std::runtime_error("Corrupt estimates file. Mismatch in tx count bucket count");
     filein >> fileConfAvg;
-    maxConfirms = fileConfAvg.size();
-    if (maxConfirms <= 0 || maxConfirms > 6 * 24 * 7) // one week
+    if (fileConfAvg.size() % numBuckets != 0)
+        throw std::runtime_error("Corrupt estimates file. Mismatch in fee conf average bucket count");
+    filePeriods = fileConfAvg.size() / numBuckets;
+    if (filePeriods <= 0 || filePeriods * fileScale > 6 * 24 * 7) // one week
         throw std::runtime_error("Corrupt estimates file.  Must maintain estimates for between 1 and 1008 (one week) confirms");
-    for (unsigned int i = 0; i < maxConfirms; i++) {
-        if (fileConfAvg[i].size() != numBuckets)
-            throw std::runtime_error("Corrupt estimates file. Mismatch in fee/pri conf average bucket count");
-    }
+
     // Now that we've processed the entire fee estimate data file and not
     // thrown any errors, we can copy it to our data structures
     decay = fileDecay;
-    buckets = fileBuckets;
+    scale = fileScale;
+    maxPeriods = filePeriods;
     avg = fileAvg;
-    confAvg = fileConfAvg;
     txCtAvg = fileTxCtAvg;
-    bucketMap.clear();
-
-    // Resize the current block variables which aren't stored in the data file
-    // to match the number of confirms and buckets
-    curBlockConf.resize(maxConfirms);
-    for (unsigned int i = 0; i < maxConfirms; i++) {
-        curBlockConf[i].resize(buckets.size());
-    }
-    curBlockTxCt.resize(buckets.size());
-    curBlockVal.resize(buckets.size());
-
-    unconfTxs.resize(maxConfirms);
-    for (unsigned int i = 0; i < maxConfirms; i++) {
-        unconfTxs[i].resize(buckets.size());
-    }
-    oldUnconfTxs.resize(buckets.size());
+    confAvg = fileConfAvg;
+    scaleNow = 1;
 
-    for (unsigned int i = 0; i < buckets.size(); i++)
-        bucketMap[buckets[i]] = i;
+    // Resize the mempool counters which aren't stored in the data file
+    // to match the number of periods and buckets
+    unconfTxs.assign(maxPeriods * numBuckets, 0);
+    oldUnconfTxs.assign(numBuckets, 0);
 
-    LogPrint("estimatefee", "Reading estimates: %u %s buckets counting confirms up to %u blocks\n",
-             numBuckets, dataTypeString, maxConfirms);
+    LogPrint("estimatefee", "Reading estimates: %u buckets counting confirms up to %u blocks in the %s horizon\n",
+             numBuckets, GetMaxConfirms(), dataTypeString);
 }
 
-unsigned int TxConfirmStats::NewTx(unsigned int nBlockHeight, double val)
+void TxConfirmStats::NewTx(unsigned int nBlockHeight, unsigned int bucketIndex)
 {
-    unsigned int bucketindex = bucketMap.lower_bound(val)->second;
-    unsigned int blockIndex = nBlockHeight % unconfTxs.size();
-    unconfTxs[blockIndex][bucketindex]++;
-    LogPrint("estimatefee", "adding to %s", dataTypeString);
-    return bucketindex;
+    unconfTxs[(nBlockHeight / scale) % maxPeriods * buckets.size() + bucketIndex]++;
 }
 
 void TxConfirmStats::removeTx(unsigned int entryHeight, unsigned int nBestSeenHeight, unsigned int bucketindex)
 {
     //nBestSeenHeight is not updated yet for the new block
-    int blocksAgo = nBestSeenHeight - entryHeight;
+    int periodsAgo = nBestSeenHeight / scale - entryHeight / scale;
     if (nBestSeenHeight == 0)  // the BlockPolicyEstimator hasn't seen any blocks yet
-        blocksAgo = 0;
-    if (blocksAgo < 0) {
+        periodsAgo = 0;
+    if (periodsAgo < 0) {
         LogPrint("estimatefee", "Blockpolicy error, blocks ago is negative for mempool tx\n");
         return;  //This can't happen because we call this with our best seen height, no entries can have higher
     }
 
-    if (blocksAgo >= (int)unconfTxs.size()) {
+    if (periodsAgo >= (int)maxPeriods) {
         if (oldUnconfTxs[bucketindex] > 0)
             oldUnconfTxs[bucketindex]--;
         else
-            LogPrint("estimatefee", "Blockpolicy error, mempool tx removed from >25 blocks,bucketIndex=%u already\n",
-                     bucketindex);
+            LogPrint("estimatefee", "Blockpolicy error, mempool tx removed from >%u blocks,bucketIndex=%u already\n",
+                     GetMaxConfirms(), bucketindex);
     }
     else {
-        unsigned int blockIndex = entryHeight % unconfTxs.size();
-        if (unconfTxs[blockIndex][bucketindex] > 0)
-            unconfTxs[blockIndex][bucketindex]--;
+        unsigned int periodIndex = (entryHeight / scale) % maxPeriods;
+        int& nUnconf = unconfTxs[periodIndex * buckets.size() + bucketindex];
+        if (nUnconf > 0)
+            nUnconf--;
         else
-            LogPrint("estimatefee", "Blockpolicy error, mempool tx removed from blockIndex=%u,bucketIndex=%u already\n",
-                     blockIndex, bucketindex);
+            LogPrint("estimatefee", "Blockpolicy error, mempool tx removed from periodIndex=%u,bucketIndex=%u already\n",
+                     periodIndex, bucketindex);
     }
 }
 
-void CBlockPolicyEstimator::removeTx(uint256 hash)
+void CBlockPolicyEstimator::removeTx(const uint256& hash)
 {
-    std::map<uint256, TxStatsInfo>::iterator pos = mapMemPoolTxs.find(hash);
-    if (pos == mapMemPoolTxs.end()) {
-        LogPrint("estimatefee", "Blockpolicy error mempool tx %s not found for removeTx\n", hash.ToString());
+    // Only the transactions used for estimates are tracked
+    boost::unordered_map<uint256, TxStatsInfo, CCoinsKeyHasher>::iterator pos = mapMemPoolTxs.find(hash);
+    if (pos == mapMemPoolTxs.end())
         return;
-    }
-    TxConfirmStats *stats = pos->second.stats;
     unsigned int entryHeight = pos->second.blockHeight;
     unsigned int bucketIndex = pos->second.bucketIndex;
 
-    if (stats != NULL)
-        stats->removeTx(entryHeight, nBestSeenHeight, bucketIndex);
-    mapMemPoolTxs.erase(hash);
+    shortStats.removeTx(entryHeight, nBestSeenHeight, bucketIndex);
+    medStats.removeTx(entryHeight, nBestSeenHeight, bucketIndex);
+    longStats.removeTx(entryHeight, nBestSeenHeight, bucketIndex);
+    mapMemPoolTxs.erase(pos);
 }
 
-CBlockPolicyEstimator::CBlockPolicyEstimator(const CFeeRate& _minRelayFee)
-    : nBestSeenHeight(0)
+static std::vector<double> FeeBuckets(const CFeeRate& minTrackedFee)
 {
-    minTrackedFee = _minRelayFee < CFeeRate(MIN_FEERATE) ? CFeeRate(MIN_FEERATE) : _minRelayFee;
     std::vector<double> vfeelist;
     for (double bucketBoundary = minTrackedFee.GetFeePerK(); bucketBoundary <= MAX_FEERATE; bucketBoundary *= FEE_SPACING) {
         vfeelist.push_back(bucketBoundary);
     }
     vfeelist.push_back(INF_FEERATE);
-    feeStats.Initialize(vfeelist, MAX_BLOCK_CONFIRMS, DEFAULT_DECAY, "FeeRate");
-
-    minTrackedPriority = AllowFreeThreshold() < MIN_PRIORITY ? MIN_PRIORITY : AllowFreeThreshold();
-    std::vector<double> vprilist;
-    for (double bucketBoundary = minTrackedPriority; bucketBoundary <= MAX_PRIORITY; bucketBoundary *= PRI_SPACING) {
-        vprilist.push_back(bucketBoundary);
-    }
-    vprilist.push_back(INF_PRIORITY);
-    priStats.Initialize(vprilist, MAX_BLOCK_CONFIRMS, DEFAULT_DECAY, "Priority");
-
-    feeUnlikely = CFeeRate(0);
-    feeLikely = CFeeRate(INF_FEERATE);
-    priUnlikely = 0;
-    priLikely = INF_PRIORITY;
+    return vfeelist;
 }
 
-bool CBlockPolicyEstimator::isFeeDataPoint(const CFeeRate &fee, double pri)
-{
-    if ((pri < minTrackedPriority && fee >= minTrackedFee) ||
-        (pri < priUnlikely && fee > feeLikely)) {
-        return true;
-    }
-    return false;
-}
-
-bool CBlockPolicyEstimator::isPriDataPoint(const CFeeRate &fee, double pri)
+CBlockPolicyEstimator::CBlockPolicyEstimator(const CFeeRate& _minRelayFee)
+    : minTrackedFee(_minRelayFee < CFeeRate(MIN_FEERATE) ? CFeeRate(MIN_FEERATE) : _minRelayFee),
+      nBestSeenHeight(0),
+      buckets(FeeBuckets(minTrackedFee)),
+      shortStats(buckets, SHORT_BLOCK_PERIODS, SHORT_SCALE, SHORT_DECAY, "short"),
+      medStats(buckets, MED_BLOCK_PERIODS, MED_SCALE, MED_DECAY, "medium"),
+      longStats(buckets, LONG_BLOCK_PERIODS, LONG_SCALE, LONG_DECAY, "long"),
+      vEstimateCache(longStats.GetMaxConfirms()),
+      nEstimateGeneration(1)
 {
-    if ((fee < minTrackedFee && pri >= minTrackedPriority) ||
-        (fee < feeUnlikely && pri > priLikely)) {
-        return true;
-    }
-    return false;
+    for (unsigned int i = 0; i < buckets.size(); i++)
+        bucketMap[buckets[i]] = i;
 }
 
 void CBlockPolicyEstimator::processTransaction(const CTxMemPoolEntry& entry, bool fCurrentEstimate)
 {
     unsigned int txHeight = entry.GetHeight();
     uint256 hash = entry.GetTx().GetHash();
-    if (mapMemPoolTxs[hash].stats != NULL) {
+    if (mapMemPoolTxs.count(hash)) {
         LogPrint("estimatefee", "Blockpolicy error mempool tx %s already being tracked\n", hash.ToString());
         return;
     }
@@ -371,27 +333,18 @@ void CBlockPolicyEstimator::processTransaction(const CTxMemPoolEntry& entry, boo
     // Fees are stored and reported as BTC-per-kb:
     CFeeRate feeRate(entry.GetFee(), entry.GetTxSize());
 
-    // Want the priority of the tx at confirmation. However we don't know
-    // what that will be and its too hard to continue updating it
-    // so use starting priority as a proxy
-    double curPri = entry.GetPriority(txHeight);
-    mapMemPoolTxs[hash].blockHeight = txHeight;
-
-    LogPrint("estimatefee", "Blockpolicy mempool tx %s ", hash.ToString().substr(0,10));
-    // Record this as a priority estimate
-    if (entry.GetFee() == 0 || isPriDataPoint(feeRate, curPri)) {
-        mapMemPoolTxs[hash].stats = &priStats;
-        mapMemPoolTxs[hash].bucketIndex =  priStats.NewTx(txHeight, curPri);
-    }
-    // Record this as a fee estimate
-    else if (isFeeDataPoint(feeRate, curPri)) {
-        mapMemPoolTxs[hash].stats = &feeStats;
-        mapMemPoolTxs[hash].bucketIndex = feeStats.NewTx(txHeight, (double)feeRate.GetFeePerK());
-    }
-    else {
-        LogPrint("estimatefee", "not adding");
-    }
-    LogPrint("estimatefee", "\n");
+    // Transactions paying less than we track can only get in by priority
+    if (feeRate < minTrackedFee)
+        return;
+
+    TxStatsInfo& info = mapMemPoolTxs[hash];
+    info.blockHeight = txHeight;
+    info.bucketIndex = bucketMap.lower_bound(feeRate.GetFeePerK())->second;
+    shortStats.NewTx(txHeight, info.bucketIndex);
+    medStats.NewTx(txHeight, info.bucketIndex);
+    longStats.NewTx(txHeight, info.bucketIndex);
+
+    LogPrint("estimatefee", "Blockpolicy mempool tx %s adding to bucket %u\n", hash.ToString().substr(0,10), info.bucketIndex);
 }
 
 void CBlockPolicyEstimator::processBlockTx(unsigned int nBlockHeight, const CTxMemPoolEntry& entry)
@@ -416,24 +369,22 @@ void CBlockPolicyEstimator::processBlockTx(unsigned int nBlockHeight, const CTxM
 
     // Fees are stored and reported as BTC-per-kb:
     CFeeRate feeRate(entry.GetFee(), entry.GetTxSize());
+    if (feeRate < minTrackedFee)
+        return;
 
-    // Want the priority of the tx at confirmation.  The priority when it
-    // entered the mempool could easily be very small and change quickly
-    double curPri = entry.GetPriority(nBlockHeight);
-
-    // Record this as a priority estimate
-    if (entry.GetFee() == 0 || isPriDataPoint(feeRate, curPri)) {
-        priStats.Record(blocksToConfirm, curPri);
-    }
-    // Record this as a fee estimate
-    else if (isFeeDataPoint(feeRate, curPri)) {
-        feeStats.Record(blocksToConfirm, (double)feeRate.GetFeePerK());
-    }
+    double val = feeRate.GetFeePerK();
+    unsigned int bucketIndex = bucketMap.lower_bound(val)->second;
+    shortStats.Record(blocksToConfirm, bucketIndex, val);
+    medStats.Record(blocksToConfirm, bucketIndex, val);
+    longStats.Record(blocksToConfirm, bucketIndex, val);
 }
 
 void CBlockPolicyEstimator::processBlock(unsigned int nBlockHeight,
                                          std::vector<CTxMemPoolEntry>& entries, bool fCurrentEstimate)
 {
+    // The block changed the mempool, so the cached estimates are stale either way
+    nEstimateGeneration++;
+
     if (nBlockHeight <= nBestSeenHeight) {
         // Ignore side chains and re-orgs; assuming they are random
         // they don't affect the estimate.
@@ -449,53 +400,62 @@ void CBlockPolicyEstimator::processBlock(unsigned int nBlockHeight,
     if (!fCurrentEstimate)
         return;
 
-    // Update the dynamic cutoffs
-    // a fee/priority is "likely" the reason your tx was included in a block if >85% of such tx's
-    // were confirmed in 2 blocks and is "unlikely" if <50% were confirmed in 10 blocks
-    LogPrint("estimatefee", "Blockpolicy recalculating dynamic cutoffs:\n");
-    priLikely = priStats.EstimateMedianVal(2, SUFFICIENT_PRITXS, MIN_SUCCESS_PCT, true, nBlockHeight);
-    if (priLikely == -1)
-        priLikely = INF_PRIORITY;
-
-    double feeLikelyEst = feeStats.EstimateMedianVal(2, SUFFICIENT_FEETXS, MIN_SUCCESS_PCT, true, nBlockHeight);
-    if (feeLikelyEst == -1)
-        feeLikely = CFeeRate(INF_FEERATE);
-    else
-        feeLikely = CFeeRate(feeLikelyEst);
-
-    priUnlikely = priStats.EstimateMedianVal(10, SUFFICIENT_PRITXS, UNLIKELY_PCT, false, nBlockHeight);
-    if (priUnlikely == -1)
-        priUnlikely = 0;
-
-    double feeUnlikelyEst = feeStats.EstimateMedianVal(10, SUFFICIENT_FEETXS, UNLIKELY_PCT, false, nBlockHeight);
-    if (feeUnlikelyEst == -1)
-        feeUnlikely = CFeeRate(0);
-    else
-        feeUnlikely = CFeeRate(feeUnlikelyEst);
-
-    // Clear the current block states
-    feeStats.ClearCurrent(nBlockHeight);
-    priStats.ClearCurrent(nBlockHeight);
-
-    // Repopulate the current block states
+    // Decay the moving averages and age the mempool counts
+    shortStats.NewBlock(nBlockHeight);
+    medStats.NewBlock(nBlockHeight);
+    longStats.NewBlock(nBlockHeight);
+
+    // Add the data from the current block
     for (unsigned int i = 0; i < entries.size(); i++)
         processBlockTx(nBlockHeight, entries[i]);
 
-    // Update all exponential averages with the current block states
-    feeStats.UpdateMovingAverages();
-    priStats.UpdateMovingAverages();
-
     LogPrint("estimatefee", "Blockpolicy after updating estimates for %u confirmed entries, new mempool map size %u\n",
              entries.size(), mapMemPoolTxs.size());
 }
 
+double CBlockPolicyEstimator::EstimateMedianVal(int confTarget)
+{
+    if (vEstimateCache[confTarget - 1].nGeneration == nEstimateGeneration)
+        return vEstimateCache[confTarget - 1].dMedian;
+
+    // Find the shortest horizon tracking confTarget
+    const TxConfirmStats* horizons[] = { &shortStats, &medStats, &longStats };
+    unsigned int nHorizon = 0;
+    while ((unsigned int)confTarget > horizons[nHorizon]->GetMaxConfirms())
+        nHorizon++;
+    const TxConfirmStats& stats = *horizons[nHorizon];
+
+    double median = stats.EstimateMedianVal(confTarget, nHorizon == 0 ? SUFFICIENT_TXS_SHORT : SUFFICIENT_FEETXS,
+                                            MIN_SUCCESS_PCT, nBestSeenHeight);
+
+    // A fee good enough for a shorter target is good enough for this one,
+    // even if the shorter horizon has seen different transactions
+    unsigned int nFirstTarget = 1;
+    if (nHorizon > 0) {
+        nFirstTarget = horizons[nHorizon - 1]->GetMaxConfirms() + 1;
+        double shorterMedian = EstimateMedianVal(nFirstTarget - 1);
+        if (shorterMedian >= 0 && (median < 0 || shorterMedian < median))
+            median = shorterMedian;
+    }
+
+    // All targets in the same period get the same answer
+    unsigned int nScale = stats.GetScale();
+    unsigned int nPeriodEnd = (confTarget + nScale - 1) / nScale * nScale;
+    unsigned int nPeriodStart = std::max(nPeriodEnd - nScale + 1, nFirstTarget);
+    for (unsigned int i = nPeriodStart; i <= std::min(nPeriodEnd, stats.GetMaxConfirms()); i++) {
+        vEstimateCache[i - 1].nGeneration = nEstimateGeneration;
+        vEstimateCache[i - 1].dMedian = median;
+    }
+    return median;
+}
+
 CFeeRate CBlockPolicyEstimator::estimateFee(int confTarget)
 {
     // Return failure if trying to analyze a target we're not tracking
-    if (confTarget <= 0 || (unsigned int)confTarget > feeStats.GetMaxConfirms())
+    if (confTarget <= 0 || (unsigned int)confTarget > GetMaxConfirms())
         return CFeeRate(0);
 
-    double median = feeStats.EstimateMedianVal(confTarget, SUFFICIENT_FEETXS, MIN_SUCCESS_PCT, true, nBestSeenHeight);
+    double median = EstimateMedianVal(confTarget);
 
     if (median < 0)
         return CFeeRate(0);
@@ -508,12 +468,12 @@ CFeeRate CBlockPolicyEstimator::estimateSmartFee(int confTarget, int *answerFoun
     if (answerFoundAtTarget)
         *answerFoundAtTarget = confTarget;
     // Return failure if trying to analyze a target we're not tracking
-    if (confTarget <= 0 || (unsigned int)confTarget > feeStats.GetMaxConfirms())
+    if (confTarget <= 0 || (unsigned int)confTarget > GetMaxConfirms())
         return CFeeRate(0);
 
     double median = -1;
-    while (median < 0 && (unsigned int)confTarget <= feeStats.GetMaxConfirms()) {
-        median = feeStats.EstimateMedianVal(confTarget++, SUFFICIENT_FEETXS, MIN_SUCCESS_PCT, true, nBestSeenHeight);
+    while (median < 0 && (unsigned int)confTarget <= GetMaxConfirms()) {
+        median = EstimateMedianVal(confTarget++);
     }
 
     if (answerFoundAtTarget)
@@ -532,49 +492,58 @@ CFeeRate CBlockPolicyEstimator::estimateSmartFee(int confTarget, int *answerFoun
 
 double CBlockPolicyEstimator::estimatePriority(int confTarget)
 {
-    // Return failure if trying to analyze a target we're not tracking
-    if (confTarget <= 0 || (unsigned int)confTarget > priStats.GetMaxConfirms())
-        return -1;
-
-    return priStats.EstimateMedianVal(confTarget, SUFFICIENT_PRITXS, MIN_SUCCESS_PCT, true, nBestSeenHeight);
+    return -1;
 }
 
 double CBlockPolicyEstimator::estimateSmartPriority(int confTarget, int *answerFoundAtTarget, const CTxMemPool& pool)
 {
     if (answerFoundAtTarget)
         *answerFoundAtTarget = confTarget;
-    // Return failure if trying to analyze a target we're not tracking
-    if (confTarget <= 0 || (unsigned int)confTarget > priStats.GetMaxConfirms())
-        return -1;
 
     // If mempool is limiting txs, no priority txs are allowed
     CAmount minPoolFee = pool.GetMinFee(GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000).GetFeePerK();
     if (minPoolFee > 0)
         return INF_PRIORITY;
 
-    double median = -1;
-    while (median < 0 && (unsigned int)confTarget <= priStats.GetMaxConfirms()) {
-        median = priStats.EstimateMedianVal(confTarget++, SUFFICIENT_PRITXS, MIN_SUCCESS_PCT, true, nBestSeenHeight);
-    }
-
-    if (answerFoundAtTarget)
-        *answerFoundAtTarget = confTarget - 1;
-
-    return median;
+    return -1;
 }
 
-void CBlockPolicyEstimator::Write(CAutoFile& fileout)
+void CBlockPolicyEstimator::Write(CAutoFile& fileout) const
 {
     fileout << nBestSeenHeight;
-    feeStats.Write(fileout);
-    priStats.Write(fileout);
+    fileout << buckets;
+    shortStats.Write(fileout);
+    medStats.Write(fileout);
+    longStats.Write(fileout);
 }
 
 void CBlockPolicyEstimator::Read(CAutoFile& filein)
 {
     int nFileBestSeenHeight;
+    std::vector<double> fileBuckets;
     filein >> nFileBestSeenHeight;
-    feeStats.Read(filein);
-    priStats.Read(filein);
+    filein >> fileBuckets;
+    if (fileBuckets.size() <= 1 || fileBuckets.size() > 1000)
+        throw std::runtime_error("Corrupt estimates file. Must have between 2 and 1000 fee buckets");
+
+    TxConfirmStats fileShortStats(fileBuckets, SHORT_BLOCK_PERIODS, SHORT_SCALE, SHORT_DECAY, "short");
+    TxConfirmStats fileMedStats(fileBuckets, MED_BLOCK_PERIODS, MED_SCALE, MED_DECAY, "medium");
+    TxConfirmStats fileLongStats(fileBuckets, LONG_BLOCK_PERIODS, LONG_SCALE, LONG_DECAY, "long");
+    fileShortStats.Read(filein);
+    fileMedStats.Read(filein);
+    fileLongStats.Read(filein);
+    if (fileShortStats.GetMaxConfirms() >= fileMedStats.GetMaxConfirms() ||
+        fileMedStats.GetMaxConfirms() >= fileLongStats.GetMaxConfirms())
+        throw std::runtime_error("Corrupt estimates file. Horizons must track increasing numbers of confirms");
+
+    buckets = fileBuckets;
+    bucketMap.clear();
+    for (unsigned int i = 0; i < buckets.size(); i++)
+        bucketMap[buckets[i]] = i;
+    shortStats = fileShortStats;
+    medStats = fileMedStats;
+    longStats = fileLongStats;
     nBestSeenHeight = nFileBestSeenHeight;
+    vEstimateCache.assign(longStats.GetMaxConfirms(), CachedEstimate());
+    nEstimateGeneration++;
 }
@@ -11,6 +11,9 @@
 #include "serialize.h"
 #include "uint256.h"
 
+#include <boost/make_shared.hpp>
+#include <boost/shared_ptr.hpp>
+
 /** An outpoint - a combination of a transaction hash and an index n into its vout */
 class COutPoint
 {
@@ -338,4 +341,12 @@ struct CMutableTransaction
 
 };
 
+/**
+ * A transaction shared read-only between the mempool, relay and darksend
+ * instead of being copied into each of them.
+ */
+typedef boost::shared_ptr<const CTransaction> CTransactionRef;
+static inline CTransactionRef MakeTransactionRef() { return boost::make_shared<CTransaction>(); }
+template <typename Tx> static inline CTransactionRef MakeTransactionRef(const Tx& txIn) { return boost::make_shared<CTransaction>(txIn); }
+
 #endif // BITCOIN_PRIMITIVES_TRANSACTION_H
@@ -0,0 +1,76 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "relaycache.h"
+
+#include "core_memusage.h"
+#include "memusage.h"
+
+CRelayCache::CRelayCache(size_t nMaxBytesIn, int64_t nExpiryIn) :
+    nMaxShardBytes(nMaxBytesIn / SHARDS), nExpiry(nExpiryIn)
+{
+}
+
+void CRelayCache::Insert(const CTransactionRef& ptx, int64_t nNow)
+{
+    const uint256& hash = ptx->GetHash();
+    // The transaction and the map node are allocated for it, the deque
+    // entry is small enough to be left out
+    size_t nBytes = RecursiveDynamicUsage(ptx) +
+                    memusage::MallocUsage(sizeof(std::pair<const uint256, CTransactionRef>) + sizeof(void*));
+
+    if (nBytes > nMaxShardBytes)
+        return;
+
+    Shard& shard = GetShard(hash);
+    LOCK(shard.cs);
+    if (shard.mapTx.count(hash))
+        return;
+    while (!shard.vEntries.empty() &&
+           (shard.vEntries.front().nTime + nExpiry < nNow || shard.nBytes + nBytes > nMaxShardBytes)) {
+        shard.mapTx.erase(shard.vEntries.front().hash);
+        shard.nBytes -= shard.vEntries.front().nBytes;
+        shard.vEntries.pop_front();
+    }
+
+    shard.mapTx.insert(std::make_pair(hash, ptx));
+    shard.vEntries.push_back(Entry(nNow, hash, nBytes));
+    shard.nBytes += nBytes;
+}
+
+CTransactionRef CRelayCache::Find(const uint256& hash)
+{
+    Shard& shard = GetShard(hash);
+    LOCK(shard.cs);
+    boost::unordered_map<uint256, CTransactionRef, TxHasher>::const_iterator it = shard.mapTx.find(hash);
+    if (it == shard.mapTx.end()) {
+        shard.nMisses++;
+        return CTransactionRef();
+    }
+    shard.nHits++;
+    return it->second;
+}
+
+void CRelayCache::GetStats(CRelayCacheStats& stats)
+{
+    stats = CRelayCacheStats();
+    stats.nMaxBytes = nMaxShardBytes * SHARDS;
+    for (unsigned int i = 0; i < SHARDS; i++) {
+        LOCK(vShards[i].cs);
+        stats.nEntries += vShards[i].mapTx.size();
+        stats.nBytes += vShards[i].nBytes;
+        stats.nHits += vShards[i].nHits;
+        stats.nMisses += vShards[i].nMisses;
+    }
+}
+
+void CRelayCache::Clear()
+{
+    for (unsigned int i = 0; i < SHARDS; i++) {
+        LOCK(vShards[i].cs);
+        vShards[i].mapTx.clear();
+        vShards[i].vEntries.clear();
+        vShards[i].nBytes = 0;
+    }
+}
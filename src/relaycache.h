@@ -0,0 +1,97 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_RELAYCACHE_H
+#define BITCOIN_RELAYCACHE_H
+
+#include "primitives/transaction.h"
+#include "sync.h"
+#include "uint256.h"
+
+#include <deque>
+
+#include <boost/unordered_map.hpp>
+
+/** Seconds a relayed transaction is kept for getdata requests */
+static const int64_t RELAY_CACHE_EXPIRY = 15 * 60;
+/** Memory the relay cache may use */
+static const size_t DEFAULT_RELAY_CACHE_BYTES = 32 * 1000 * 1000;
+
+struct CRelayCacheStats
+{
+    uint64_t nEntries;
+    //! Memory used by the cached transactions and the cache itself
+    uint64_t nBytes;
+    uint64_t nMaxBytes;
+    //! getdata requests answered from the cache, and ones it could not
+    uint64_t nHits;
+    uint64_t nMisses;
+
+    CRelayCacheStats() : nEntries(0), nBytes(0), nMaxBytes(0), nHits(0), nMisses(0) {}
+};
+
+/**
+ * Transactions we relayed, kept for the getdata requests of our peers even
+ * if they leave the mempool in between. Entries share the transaction
+ * object (usually the mempool's) instead of holding a serialized copy.
+ *
+ * The cache is split in shards with a lock each, so threads serving getdata
+ * rarely wait for each other. Every shard gets an equal part of the byte
+ * budget and drops its oldest entries first, when they expire or when the
+ * budget is used up.
+ */
+class CRelayCache
+{
+public:
+    static const unsigned int SHARDS = 16;
+
+    CRelayCache(size_t nMaxBytesIn = DEFAULT_RELAY_CACHE_BYTES, int64_t nExpiryIn = RELAY_CACHE_EXPIRY);
+
+    /** Keep ptx until nNow + expiry */
+    void Insert(const CTransactionRef& ptx, int64_t nNow);
+    /** Look up a transaction for a getdata request, NULL if it is not cached */
+    CTransactionRef Find(const uint256& hash);
+    void GetStats(CRelayCacheStats& stats);
+    void Clear();
+
+private:
+    struct TxHasher
+    {
+        size_t operator()(const uint256& hash) const { return hash.GetCheapHash(); }
+    };
+
+    struct Entry
+    {
+        int64_t nTime;
+        uint256 hash;
+        size_t nBytes;
+
+        Entry(int64_t nTimeIn, const uint256& hashIn, size_t nBytesIn) : nTime(nTimeIn), hash(hashIn), nBytes(nBytesIn) {}
+    };
+
+    struct Shard
+    {
+        CCriticalSection cs;
+        boost::unordered_map<uint256, CTransactionRef, TxHasher> mapTx;
+        //! Entries in the order they were inserted
+        std::deque<Entry> vEntries;
+        size_t nBytes;
+        uint64_t nHits;
+        uint64_t nMisses;
+
+        Shard() : nBytes(0), nHits(0), nMisses(0) {}
+    };
+
+    const size_t nMaxShardBytes;
+    const int64_t nExpiry;
+    Shard vShards[SHARDS];
+
+    Shard& GetShard(const uint256& hash)
+    {
+        // GetCheapHash uses the first bytes for the buckets, shard by the last one
+        return vShards[*(hash.end() - 1) % SHARDS];
+    }
+};
+
+#endif // BITCOIN_RELAYCACHE_H
@@ -233,17 +233,24 @@ UniValue mempoolToJSON(bool fVerbose = false)
 
 UniValue getrawmempool(const UniValue& params, bool fHelp)
 {
-    if (fHelp || params.size() > 1)
+    if (fHelp || params.size() > 2)
         throw runtime_error(
-            "getrawmempool ( verbose )\n"
+            "getrawmempool ( verbose mempool_sequence )\n"
             "\nReturns all transaction ids in memory pool as a json array of string transaction ids.\n"
             "\nArguments:\n"
             "1. verbose           (boolean, optional, default=false) true for a json object, false for array of transaction ids\n"
+            "2. mempool_sequence  (boolean, optional, default=false) if verbose is false, also return the mempool sequence\n"
+            "                     number to follow changes from with getmempoolevents\n"
             "\nResult: (for verbose = false):\n"
             "[                     (json array of string)\n"
             "  \"transactionid\"     (string) The transaction id\n"
             "  ,...\n"
             "]\n"
+            "\nResult: (for verbose = false and mempool_sequence = true):\n"
+            "{\n"
+            "  \"txids\" : [ \"transactionid\", ... ],  (json array of string) The transaction ids\n"
+            "  \"mempool_sequence\" : n               (numeric) The sequence number of the last mempool event\n"
+            "}\n"
             "\nResult: (for verbose = true):\n"
             "{                           (json object)\n"
             "  \"transactionid\" : {       (json object)\n"
@@ -271,7 +278,95 @@ UniValue getrawmempool(const UniValue& params, bool fHelp)
     if (params.size() > 0)
         fVerbose = params[0].get_bool();
 
-    return mempoolToJSON(fVerbose);
+    bool fSequence = false;
+    if (params.size() > 1)
+        fSequence = params[1].get_bool();
+
+    if (!fSequence)
+        return mempoolToJSON(fVerbose);
+
+    if (fVerbose)
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "Verbose results cannot contain mempool sequence values");
+
+    // Take the transaction ids and the sequence number at the same time
+    LOCK(mempool.cs);
+    UniValue o(UniValue::VOBJ);
+    o.push_back(Pair("txids", mempoolToJSON(false)));
+    o.push_back(Pair("mempool_sequence", (uint64_t)mempool.GetSequence()));
+    return o;
+}
+
+UniValue getmempoolevents(const UniValue& params, bool fHelp)
+{
+    if (fHelp || params.size() < 1 || params.size() > 2)
+        throw runtime_error(
+            "getmempoolevents since ( count )\n"
+            "\nReturns the transactions that entered or left the memory pool after the given mempool sequence number.\n"
+            "Start from the mempool_sequence of getrawmempool false true, and continue from the sequence of the last\n"
+            "call. The same events are published with -zmqpubmempoolseq.\n"
+            "\nArguments:\n"
+            "1. since             (numeric, required) The sequence number of the last event already seen\n"
+            "2. count             (numeric, optional, default=10000) The maximum number of events to return\n"
+            "\nResult:\n"
+            "{\n"
+            "  \"sequence\" : n,          (numeric) The sequence number to continue from\n"
+            "  \"more\" : true|false,     (boolean) Whether there are more events after these\n"
+            "  \"events\" : [\n"
+            "    {\n"
+            "      \"sequence\" : n,      (numeric) The sequence number of the event\n"
+            "      \"event\" : \"type\",    (string) \"added\" or \"removed\"\n"
+            "      \"txid\" : \"id\",       (string) The transaction id\n"
+            "      \"reason\" : \"reason\"  (string, removed only) Why the transaction was removed: \"block\", \"conflict\",\n"
+            "                          \"expiry\", \"sizelimit\", \"reorg\", \"replaced\" (by an InstantSend lock) or \"unknown\"\n"
+            "    }, ...\n"
+            "  ]\n"
+            "}\n"
+            "\nExamples\n"
+            + HelpExampleCli("getmempoolevents", "1000")
+            + HelpExampleRpc("getmempoolevents", "1000")
+        );
+
+    int64_t nSince = params[0].get_int64();
+    if (nSince < 0)
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "Negative sequence number");
+    int nCount = 10000;
+    if (params.size() > 1)
+        nCount = params[1].get_int();
+    if (nCount <= 0)
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "Count must be positive");
+
+    std::vector<CMemPoolEvent> vEvents;
+    uint64_t nSequence;
+    {
+        LOCK(mempool.cs);
+        // Ask for one more to know whether there are more
+        if (!mempool.GetEvents(nSince, nCount + 1, vEvents))
+            throw JSONRPCError(RPC_MISC_ERROR, strprintf("Mempool events after %d are no longer available, start over with getrawmempool", nSince));
+        nSequence = mempool.GetSequence();
+    }
+
+    bool fMore = vEvents.size() > (size_t)nCount;
+    if (fMore)
+        vEvents.erase(vEvents.begin() + nCount, vEvents.end());
+    if (!vEvents.empty())
+        nSequence = vEvents.back().nSequence;
+
+    UniValue events(UniValue::VARR);
+    BOOST_FOREACH(const CMemPoolEvent& event, vEvents) {
+        UniValue e(UniValue::VOBJ);
+        e.push_back(Pair("sequence", (uint64_t)event.nSequence));
+        e.push_back(Pair("event", event.fAdded ? "added" : "removed"));
+        e.push_back(Pair("txid", event.hash.GetHex()));
+        if (!event.fAdded)
+            e.push_back(Pair("reason", GetRemovalReasonName(event.reason)));
+        events.push_back(e);
+    }
+
+    UniValue result(UniValue::VOBJ);
+    result.push_back(Pair("sequence", (uint64_t)nSequence));
+    result.push_back(Pair("more", fMore));
+    result.push_back(Pair("events", events));
+    return result;
 }
 
 UniValue getblockhashes(const UniValue& params, bool fHelp)
@@ -552,11 +647,14 @@ UniValue getblock(const UniValue& params, bool fHelp)
 
 UniValue gettxoutsetinfo(const UniValue& params, bool fHelp)
 {
-    if (fHelp || params.size() != 0)
+    if (fHelp || params.size() > 1)
         throw runtime_error(
-            "gettxoutsetinfo\n"
+            "gettxoutsetinfo ( \"mode\" )\n"
             "\nReturns statistics about the unspent transaction output set.\n"
-            "Note this call may take some time.\n"
+            "\nArguments:\n"
+            "1. \"mode\"    (string, optional, default=\"fast\") \"fast\" returns the statistics maintained while\n"
+            "               connecting blocks. \"full\" recomputes them by scanning a snapshot of the database\n"
+            "               and checks them against the maintained ones; this may take some time.\n"
             "\nResult:\n"
             "{\n"
             "  \"height\":n,     (numeric) The current block height (index)\n"
@@ -564,27 +662,39 @@ UniValue gettxoutsetinfo(const UniValue& params, bool fHelp)
             "  \"transactions\": n,      (numeric) The number of transactions\n"
             "  \"txouts\": n,            (numeric) The number of output transactions\n"
             "  \"bytes_serialized\": n,  (numeric) The serialized size\n"
-            "  \"hash_serialized\": \"hash\",   (string) The serialized hash\n"
+            "  \"hash_serialized\": \"hash\",   (string) Order-independent hash of the serialized set\n"
             "  \"total_amount\": x.xxx          (numeric) The total amount\n"
             "}\n"
             "\nExamples:\n"
             + HelpExampleCli("gettxoutsetinfo", "")
+            + HelpExampleCli("gettxoutsetinfo", "\"full\"")
             + HelpExampleRpc("gettxoutsetinfo", "")
         );
 
-    UniValue ret(UniValue::VOBJ);
+    std::string strMode = "fast";
+    if (params.size() > 0)
+        strMode = params[0].get_str();
 
     CCoinsStats stats;
-    FlushStateToDisk();
-    if (pcoinsTip->GetStats(stats)) {
-        ret.push_back(Pair("height", (int64_t)stats.nHeight));
-        ret.push_back(Pair("bestblock", stats.hashBlock.GetHex()));
-        ret.push_back(Pair("transactions", (int64_t)stats.nTransactions));
-        ret.push_back(Pair("txouts", (int64_t)stats.nTransactionOutputs));
-        ret.push_back(Pair("bytes_serialized", (int64_t)stats.nSerializedSize));
-        ret.push_back(Pair("hash_serialized", stats.hashSerialized.GetHex()));
-        ret.push_back(Pair("total_amount", ValueFromAmount(stats.nTotalAmount)));
+    if (strMode == "fast") {
+        LOCK(cs_main);
+        stats = coinsStatsTip;
+    } else if (strMode == "full") {
+        FlushStateToDisk();
+        if (!pcoinsTip->GetStats(stats))
+            throw JSONRPCError(RPC_DATABASE_ERROR, "UTXO set scan failed or does not match the maintained statistics, see debug.log");
+    } else {
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "Invalid mode");
     }
+
+    UniValue ret(UniValue::VOBJ);
+    ret.push_back(Pair("height", (int64_t)stats.nHeight));
+    ret.push_back(Pair("bestblock", stats.hashBlock.GetHex()));
+    ret.push_back(Pair("transactions", (int64_t)stats.nTransactions));
+    ret.push_back(Pair("txouts", (int64_t)stats.nTransactionOutputs));
+    ret.push_back(Pair("bytes_serialized", (int64_t)stats.nSerializedSize));
+    ret.push_back(Pair("hash_serialized", stats.hashSerialized.GetHex()));
+    ret.push_back(Pair("total_amount", ValueFromAmount(stats.nTotalAmount)));
     return ret;
 }
 
@@ -979,6 +1089,23 @@ UniValue getmempoolinfo(const UniValue& params, bool fHelp)
     return mempoolInfoToJSON();
 }
 
+UniValue savemempool(const UniValue& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "savemempool\n"
+            "\nDumps the mempool to disk.\n"
+            "\nExamples:\n"
+            + HelpExampleCli("savemempool", "")
+            + HelpExampleRpc("savemempool", "")
+        );
+
+    if (!DumpMempool())
+        throw JSONRPCError(RPC_MISC_ERROR, "Unable to dump mempool to disk");
+
+    return NullUniValue;
+}
+
 UniValue invalidateblock(const UniValue& params, bool fHelp)
 {
     if (fHelp || params.size() != 1)
@@ -21,6 +21,7 @@
 #include "pow.h"
 #include "rpc/server.h"
 #include "spork.h"
+#include "templateengine.h"
 #include "txmempool.h"
 #include "util.h"
 #ifdef ENABLE_WALLET
@@ -172,7 +173,7 @@ UniValue generate(const UniValue& params, bool fHelp)
         CBlock *pblock = &pblocktemplate->block;
         {
             LOCK(cs_main);
-            IncrementExtraNonce(pblock, chainActive.Tip(), nExtraNonce);
+            IncrementExtraNonce(pblocktemplate.get(), chainActive.Tip(), nExtraNonce);
         }
         while (!CheckProofOfWork(pblock->GetHash(), pblock->nBits, Params().GetConsensus())) {
             // Yes, there is a chance every nonce could fail to satisfy the -regtest
@@ -359,7 +360,7 @@ UniValue getwork(const UniValue& params, bool fHelp)
     if (IsInitialBlockDownload())
         throw JSONRPCError(RPC_CLIENT_IN_INITIAL_DOWNLOAD, "Sibcoin is downloading blocks...");
 
-    typedef map<uint256, pair<CBlock*, CScript> > mapNewBlock_t;
+    typedef map<uint256, pair<CBlockTemplate*, CScript> > mapNewBlock_t;
     static mapNewBlock_t mapNewBlock;    // FIXME: thread safety
     static vector<CBlockTemplate*> vNewBlockTemplate;
 
@@ -419,10 +420,10 @@ UniValue getwork(const UniValue& params, bool fHelp)
 
         // Update nExtraNonce
         static unsigned int nExtraNonce = 0;
-        IncrementExtraNonce(pblock, pindexPrev, nExtraNonce);
+        IncrementExtraNonce(pblocktemplate, pindexPrev, nExtraNonce);
 
         // Save
-        mapNewBlock[pblock->hashMerkleRoot] = make_pair(pblock, pblock->vtx[0].vin[0].scriptSig);
+        mapNewBlock[pblock->hashMerkleRoot] = make_pair(pblocktemplate, pblock->vtx[0].vin[0].scriptSig);
 
         // Pre-build hash buffers
         char pmidstate[32];
@@ -456,7 +457,8 @@ UniValue getwork(const UniValue& params, bool fHelp)
             
         boost::unique_lock<boost::mutex> lock(csBestBlock);
             
-        CBlock* pblock = mapNewBlock[pdata->hashMerkleRoot].first;
+        CBlockTemplate* pblocktemplate = mapNewBlock[pdata->hashMerkleRoot].first;
+        CBlock* pblock = &pblocktemplate->block;
 
         pblock->nTime = pdata->nTime;
         pblock->nNonce = pdata->nNonce;
@@ -464,7 +466,7 @@ UniValue getwork(const UniValue& params, bool fHelp)
         CMutableTransaction txCoinbase(pblock->vtx[0]);
         txCoinbase.vin[0].scriptSig = mapNewBlock[pdata->hashMerkleRoot].second;
         pblock->vtx[0] = txCoinbase;
-        pblock->hashMerkleRoot = BlockMerkleRoot(*pblock);
+        pblock->hashMerkleRoot = ComputeMerkleRootFromBranch(pblock->vtx[0].GetHash(), pblocktemplate->vCoinbaseMerkleBranch, 0);
 
         assert(pwalletMain != NULL);
         return ProcessBlockFound(pblock, Params());
@@ -498,7 +500,7 @@ UniValue getblocktemplate(const UniValue& params, bool fHelp)
             "     {\n"
             "       \"mode\":\"template\"    (string, optional) This must be set to \"template\" or omitted\n"
             "       \"capabilities\":[       (array, optional) A list of strings\n"
-            "           \"support\"           (string) client side supported feature, 'longpoll', 'coinbasetxn', 'coinbasevalue', 'proposal', 'serverlist', 'workid'\n"
+            "           \"support\"           (string) client side supported feature, 'longpoll', 'coinbasetxn', 'coinbasevalue', 'proposal', 'serverlist', 'workid', 'merklebranch'\n"
             "           ,...\n"
             "         ]\n"
             "     }\n"
@@ -533,6 +535,10 @@ UniValue getblocktemplate(const UniValue& params, bool fHelp)
             "  },\n"
             "  \"coinbasevalue\" : n,               (numeric) maximum allowable input to coinbase transaction, including the generation award and transaction fees (in duffs)\n"
             "  \"coinbasetxn\" : { ... },           (json object) information for coinbase transaction\n"
+            "  \"coinbasemerklebranch\" : [         (array of string) only if \"merklebranch\" is in the request's capabilities: merkle branch of the coinbase\n"
+            "      \"xxxx\"                         (string) hex encoded hash, in the byte order it is hashed in, starting next to the coinbase\n"
+            "      ,...\n"
+            "  ],\n"
             "  \"target\" : \"xxxx\",               (string) The hash target\n"
             "  \"mintime\" : xxx,                   (numeric) The minimum timestamp appropriate for next block time in seconds since epoch (Jan 1 1970 GMT)\n"
             "  \"mutable\" : [                      (array of string) list of ways the block template may be changed \n"
@@ -574,6 +580,7 @@ UniValue getblocktemplate(const UniValue& params, bool fHelp)
     std::string strMode = "template";
     UniValue lpval = NullUniValue;
     std::set<std::string> setClientRules;
+    bool fMerkleBranch = false;
     int64_t nMaxVersionPreVB = -1;
     if (params.size() > 0)
     {
@@ -619,6 +626,14 @@ UniValue getblocktemplate(const UniValue& params, bool fHelp)
             return BIP22ValidationResult(state);
         }
 
+        const UniValue& aClientCaps = find_value(oparam, "capabilities");
+        if (aClientCaps.isArray()) {
+            for (unsigned int i = 0; i < aClientCaps.size(); ++i) {
+                if (aClientCaps[i].isStr() && aClientCaps[i].get_str() == "merklebranch")
+                    fMerkleBranch = true;
+            }
+        }
+
         const UniValue& aClientRules = find_value(oparam, "rules");
         if (aClientRules.isArray()) {
             for (unsigned int i = 0; i < aClientRules.size(); ++i) {
@@ -694,36 +709,14 @@ UniValue getblocktemplate(const UniValue& params, bool fHelp)
         // TODO: Maybe recheck connections/IBD and (if something wrong) send an expires-immediately template to stop miners?
     }
 
-    // Update block
-    static CBlockIndex* pindexPrev;
-    static int64_t nStart;
-    static CBlockTemplate* pblocktemplate;
-    if (pindexPrev != chainActive.Tip() ||
-        (mempool.GetTransactionsUpdated() != nTransactionsUpdatedLast && GetTime() - nStart > 5))
-    {
-        // Clear pindexPrev so future calls make a new block, despite any failures from here on
-        pindexPrev = NULL;
-
-        // Store the chainActive.Tip() used before CreateNewBlock, to avoid races
-        nTransactionsUpdatedLast = mempool.GetTransactionsUpdated();
-        CBlockIndex* pindexPrevNew = chainActive.Tip();
-        nStart = GetTime();
-
-        // Create new block
-        if(pblocktemplate)
-        {
-            delete pblocktemplate;
-            pblocktemplate = NULL;
-        }
-        CScript scriptDummy = CScript() << OP_TRUE;
-        pblocktemplate = CreateNewBlock(Params(), scriptDummy);
-        if (!pblocktemplate)
-            throw JSONRPCError(RPC_OUT_OF_MEMORY, "Out of memory");
-
-        // Need to update only after we know CreateNewBlock succeeded
-        pindexPrev = pindexPrevNew;
-    }
-    CBlock* pblock = &pblocktemplate->block; // pointer for convenience
+    // Templates are kept up to date with the mempool by the template engine;
+    // only a new tip forces a full CreateNewBlock.
+    nTransactionsUpdatedLast = mempool.GetTransactionsUpdated();
+    CBlockIndex* pindexPrev = chainActive.Tip();
+    boost::shared_ptr<const CBlockTemplate> pblocktemplate = GetBlockTemplateEngine().GetTemplate();
+    // The template is shared with other callers: adjust a copy of the header
+    CBlockHeader header = pblocktemplate->block.GetBlockHeader();
+    CBlockHeader* pblock = &header; // pointer for convenience
     const Consensus::Params& consensusParams = Params().GetConsensus();
 
     // Update nTime
@@ -735,7 +728,7 @@ UniValue getblocktemplate(const UniValue& params, bool fHelp)
     UniValue transactions(UniValue::VARR);
     map<uint256, int64_t> setTxIndex;
     int i = 0;
-    BOOST_FOREACH (const CTransaction& tx, pblock->vtx) {
+    BOOST_FOREACH (const CTransaction& tx, pblocktemplate->block.vtx) {
         uint256 txHash = tx.GetHash();
         setTxIndex[txHash] = i++;
 
@@ -834,7 +827,13 @@ UniValue getblocktemplate(const UniValue& params, bool fHelp)
     result.push_back(Pair("previousblockhash", pblock->hashPrevBlock.GetHex()));
     result.push_back(Pair("transactions", transactions));
     result.push_back(Pair("coinbaseaux", aux));
-    result.push_back(Pair("coinbasevalue", (int64_t)pblock->vtx[0].GetValueOut()));
+    result.push_back(Pair("coinbasevalue", (int64_t)pblocktemplate->block.vtx[0].GetValueOut()));
+    if (fMerkleBranch) {
+        UniValue aBranch(UniValue::VARR);
+        BOOST_FOREACH(const uint256& hash, pblocktemplate->vCoinbaseMerkleBranch)
+            aBranch.push_back(HexStr(hash.begin(), hash.end()));
+        result.push_back(Pair("coinbasemerklebranch", aBranch));
+    }
     result.push_back(Pair("longpollid", chainActive.Tip()->GetBlockHash().GetHex() + i64tostr(nTransactionsUpdatedLast)));
     result.push_back(Pair("target", hashTarget.GetHex()));
     result.push_back(Pair("mintime", (int64_t)pindexPrev->GetMedianTimePast()+1));
@@ -847,21 +846,21 @@ UniValue getblocktemplate(const UniValue& params, bool fHelp)
     result.push_back(Pair("height", (int64_t)(pindexPrev->nHeight+1)));
 
     UniValue masternodeObj(UniValue::VOBJ);
-    if(pblock->txoutMasternode != CTxOut()) {
+    if(pblocktemplate->block.txoutMasternode != CTxOut()) {
         CTxDestination address1;
-        ExtractDestination(pblock->txoutMasternode.scriptPubKey, address1);
+        ExtractDestination(pblocktemplate->block.txoutMasternode.scriptPubKey, address1);
         CBitcoinAddress address2(address1);
         masternodeObj.push_back(Pair("payee", address2.ToString().c_str()));
-        masternodeObj.push_back(Pair("script", HexStr(pblock->txoutMasternode.scriptPubKey.begin(), pblock->txoutMasternode.scriptPubKey.end())));
-        masternodeObj.push_back(Pair("amount", pblock->txoutMasternode.nValue));
+        masternodeObj.push_back(Pair("script", HexStr(pblocktemplate->block.txoutMasternode.scriptPubKey.begin(), pblocktemplate->block.txoutMasternode.scriptPubKey.end())));
+        masternodeObj.push_back(Pair("amount", pblocktemplate->block.txoutMasternode.nValue));
     }
     result.push_back(Pair("masternode", masternodeObj));
     result.push_back(Pair("masternode_payments_started", pindexPrev->nHeight + 1 > Params().GetConsensus().nMasternodePaymentsStartBlock));
     result.push_back(Pair("masternode_payments_enforced", sporkManager.IsSporkActive(SPORK_8_MASTERNODE_PAYMENT_ENFORCEMENT)));
 
     UniValue superblockObjArray(UniValue::VARR);
-    if(pblock->voutSuperblock.size()) {
-        BOOST_FOREACH (const CTxOut& txout, pblock->voutSuperblock) {
+    if(pblocktemplate->block.voutSuperblock.size()) {
+        BOOST_FOREACH (const CTxOut& txout, pblocktemplate->block.voutSuperblock) {
             UniValue entry(UniValue::VOBJ);
             CTxDestination address1;
             ExtractDestination(txout.scriptPubKey, address1);
@@ -879,6 +878,70 @@ UniValue getblocktemplate(const UniValue& params, bool fHelp)
     return result;
 }
 
+static UniValue LatencyHistogramToJSON(const CLatencyHistogram& histogram)
+{
+    UniValue buckets(UniValue::VOBJ);
+    for (int i = 0; i < CLatencyHistogram::BUCKETS; i++) {
+        if (histogram.vBuckets[i] != 0)
+            buckets.push_back(Pair(i64tostr((int64_t)1 << i), histogram.vBuckets[i]));
+    }
+    UniValue obj(UniValue::VOBJ);
+    obj.push_back(Pair("count", histogram.nCount));
+    obj.push_back(Pair("total_us", histogram.nTotalMicros));
+    obj.push_back(Pair("max_us", histogram.nMaxMicros));
+    obj.push_back(Pair("buckets", buckets));
+    return obj;
+}
+
+UniValue getblocktemplatestats(const UniValue& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "getblocktemplatestats\n"
+            "\nReturns statistics about how getblocktemplate templates were built and served."
+            "\nResult:\n"
+            "{\n"
+            "  \"height\": n,                 (numeric) Height of the current template, -1 if none was built yet\n"
+            "  \"transactions\": n,           (numeric) Number of transactions in the current template\n"
+            "  \"fullrebuilds\": n,           (numeric) Templates built from scratch (new tips, periodic rebuilds)\n"
+            "  \"incrementalupdates\": n,     (numeric) Templates updated from mempool changes\n"
+            "  \"txadded\": n,                (numeric) Transactions appended by incremental updates\n"
+            "  \"txremoved\": n,              (numeric) Transactions dropped by incremental updates\n"
+            "  \"txdeferred\": n,             (numeric) Transactions left for the next full rebuild\n"
+            "  \"rebuild\": {                 (json object) Latency of full rebuilds\n"
+            "    \"count\": n,                (numeric) Number of samples\n"
+            "    \"total_us\": n,             (numeric) Sum of all samples, in microseconds\n"
+            "    \"max_us\": n,               (numeric) Largest sample, in microseconds\n"
+            "    \"buckets\": {               (json object) Non-empty buckets\n"
+            "      \"xxx\": n                 (numeric) Number of samples below xxx (and at least half of xxx) microseconds\n"
+            "      ,...\n"
+            "    }\n"
+            "  },\n"
+            "  \"update\": {...},             (json object) Latency of incremental updates, same format\n"
+            "  \"serve\": {...}               (json object) Latency of getting a template, same format\n"
+            "}\n"
+            "\nExamples:\n"
+            + HelpExampleCli("getblocktemplatestats", "")
+            + HelpExampleRpc("getblocktemplatestats", "")
+        );
+
+    CBlockTemplateEngineStats stats;
+    GetBlockTemplateEngine().GetStats(stats);
+
+    UniValue obj(UniValue::VOBJ);
+    obj.push_back(Pair("height",             stats.nHeight));
+    obj.push_back(Pair("transactions",       (uint64_t)stats.nTemplateTx));
+    obj.push_back(Pair("fullrebuilds",       stats.nFullRebuilds));
+    obj.push_back(Pair("incrementalupdates", stats.nIncrementalUpdates));
+    obj.push_back(Pair("txadded",            stats.nTxAdded));
+    obj.push_back(Pair("txremoved",          stats.nTxRemoved));
+    obj.push_back(Pair("txdeferred",         stats.nTxDeferred));
+    obj.push_back(Pair("rebuild",            LatencyHistogramToJSON(stats.rebuild)));
+    obj.push_back(Pair("update",             LatencyHistogramToJSON(stats.update)));
+    obj.push_back(Pair("serve",              LatencyHistogramToJSON(stats.serve)));
+    return obj;
+}
+
 class submitblock_StateCatcher : public CValidationInterface
 {
 public:
@@ -994,6 +1057,7 @@ UniValue estimatepriority(const UniValue& params, bool fHelp)
     if (fHelp || params.size() != 1)
         throw runtime_error(
             "estimatepriority nblocks\n"
+            "\nDEPRECATED. Priority is no longer estimated and -1 is always returned.\n"
             "\nEstimates the approximate priority a zero-fee transaction needs to begin\n"
             "confirmation within nblocks blocks.\n"
             "\nArguments:\n"
@@ -1057,7 +1121,8 @@ UniValue estimatesmartpriority(const UniValue& params, bool fHelp)
     if (fHelp || params.size() != 1)
         throw runtime_error(
             "estimatesmartpriority nblocks\n"
-            "\nWARNING: This interface is unstable and may disappear or change!\n"
+            "\nDEPRECATED. Priority is no longer estimated and -1 is returned unless\n"
+            "the mempool is full.\n"
             "\nEstimates the approximate priority a zero-fee transaction needs to begin\n"
             "confirmation within nblocks blocks if possible and return the number of blocks\n"
             "for which the estimate is valid.\n"
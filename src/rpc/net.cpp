@@ -112,6 +112,15 @@ UniValue getpeerinfo(const UniValue& params, bool fHelp)
             "       n,                        (numeric) The heights of blocks we're currently asking from this peer\n"
             "       ...\n"
             "    ]\n"
+            "    \"cmpctblock\": {            (json object) Compact block (BIP152) relay with this peer\n"
+            "       \"highbandwidth_to\": true|false,   (boolean) We announce new blocks to the peer as cmpctblock\n"
+            "       \"highbandwidth_from\": true|false, (boolean) We asked the peer to announce new blocks as cmpctblock\n"
+            "       \"received\": n,         (numeric) The number of compact blocks received from the peer\n"
+            "       \"rebuilt\": n,          (numeric) The number rebuilt without asking for missing transactions\n"
+            "       \"txn_requested\": n,    (numeric) The number that needed a getblocktxn round trip\n"
+            "       \"fallback\": n,         (numeric) The number that had to be downloaded as full blocks\n"
+            "       \"reconstruction_rate\": x.xxx (numeric) The fraction rebuilt without a round trip\n"
+            "    }\n"
             "    \"bytessent_per_msg\": {\n"
             "       \"addr\": n,             (numeric) The total bytes sent aggregated by message type\n"
             "       ...\n"
@@ -120,6 +129,15 @@ UniValue getpeerinfo(const UniValue& params, bool fHelp)
             "       \"addr\": n,             (numeric) The total bytes received aggregated by message type\n"
             "       ...\n"
             "    }\n"
+            "    \"sendlanes\": {             (json object) The send queues of the peer\n"
+            "       \"block\": {             (json object) The lane, one of block, instantsend, normal or bulk\n"
+            "         \"queued\": n,         (numeric) The bytes waiting to be sent\n"
+            "         \"sent\": n,           (numeric) The number of messages sent\n"
+            "         \"avg_delay_usec\": n, (numeric) The average time in microseconds messages waited in the lane\n"
+            "         \"max_delay_usec\": n  (numeric) The longest time in microseconds a message waited in the lane\n"
+            "       }\n"
+            "       ...\n"
+            "    }\n"
             "  }\n"
             "  ,...\n"
             "]\n"
@@ -171,6 +189,15 @@ UniValue getpeerinfo(const UniValue& params, bool fHelp)
                 heights.push_back(height);
             }
             obj.push_back(Pair("inflight", heights));
+            UniValue cmpct(UniValue::VOBJ);
+            cmpct.push_back(Pair("highbandwidth_to", statestats.fPreferHeaderAndIDs));
+            cmpct.push_back(Pair("highbandwidth_from", statestats.fRequestedHeaderAndIDs));
+            cmpct.push_back(Pair("received", statestats.nCmpctBlocks));
+            cmpct.push_back(Pair("rebuilt", statestats.nCmpctNoRoundTrip));
+            cmpct.push_back(Pair("txn_requested", statestats.nCmpctTxnRequested));
+            cmpct.push_back(Pair("fallback", statestats.nCmpctFallback));
+            cmpct.push_back(Pair("reconstruction_rate", statestats.nCmpctBlocks > 0 ? (double)statestats.nCmpctNoRoundTrip / statestats.nCmpctBlocks : 0.0));
+            obj.push_back(Pair("cmpctblock", cmpct));
         }
         obj.push_back(Pair("whitelisted", stats.fWhitelisted));
 
@@ -188,6 +215,18 @@ UniValue getpeerinfo(const UniValue& params, bool fHelp)
         }
         obj.push_back(Pair("bytesrecv_per_msg", recvPerMsgCmd));
 
+        UniValue sendLanes(UniValue::VOBJ);
+        for (int i = 0; i < SEND_LANE_MAX; i++) {
+            const CSendLaneStats& laneStats = stats.sendLaneStats[i];
+            UniValue lane(UniValue::VOBJ);
+            lane.push_back(Pair("queued", laneStats.nQueuedBytes));
+            lane.push_back(Pair("sent", laneStats.nMsgs));
+            lane.push_back(Pair("avg_delay_usec", laneStats.nMsgs > 0 ? laneStats.nDelayMicros / (int64_t)laneStats.nMsgs : 0));
+            lane.push_back(Pair("max_delay_usec", laneStats.nMaxDelayMicros));
+            sendLanes.push_back(Pair(GetSendLaneName(i), lane));
+        }
+        obj.push_back(Pair("sendlanes", sendLanes));
+
         ret.push_back(obj);
     }
 
@@ -352,6 +391,27 @@ UniValue getnettotals(const UniValue& params, bool fHelp)
             "    \"serve_historical_blocks\": true|false,  (boolean) True if serving historical blocks\n"
             "    \"bytes_left_in_cycle\": t,               (numeric) Bytes left in current time cycle\n"
             "    \"time_left_in_cycle\": t                 (numeric) Seconds left in current time cycle\n"
+            "  },\n"
+            "  \"socketevents\":\n"
+            "  {\n"
+            "    \"mode\": \"xxxx\",       (string) How the socket handler waits for socket events (select or epoll)\n"
+            "    \"loops\": n,           (numeric) Iterations of the socket handler loop\n"
+            "    \"events\": n,          (numeric) Total ready sockets reported\n"
+            "    \"wait_usec\": n,       (numeric) Total microseconds spent waiting for socket events\n"
+            "    \"busy_usec\": n,       (numeric) Total microseconds spent handling sockets\n"
+            "    \"max_busy_usec\": n,   (numeric) Longest time in microseconds spent handling sockets in one loop\n"
+            "    \"send_calls\": n,      (numeric) Socket writes\n"
+            "    \"send_msgs\": n,       (numeric) Messages completed by them, several small ones go out with one write\n"
+            "    \"zerocopy_sends\": n   (numeric) Writes done without copying the data (MSG_ZEROCOPY)\n"
+            "  },\n"
+            "  \"invrelay\":\n"
+            "  {\n"
+            "    \"objects_relayed\": n,       (numeric) Transactions and other objects relayed to peers\n"
+            "    \"invs_sent\": n,             (numeric) Inventory items announced\n"
+            "    \"inv_msgs_sent\": n,         (numeric) Inv messages used for it\n"
+            "    \"inv_msgs_shared\": n,       (numeric) Inv messages serialized once for several peers\n"
+            "    \"inv_bytes_sent\": n,        (numeric) Bytes of inv messages, headers included\n"
+            "    \"inv_bytes_per_object\": x.x (numeric) Inv bytes sent per relayed object\n"
             "  }\n"
             "}\n"
             "\nExamples:\n"
@@ -372,6 +432,31 @@ UniValue getnettotals(const UniValue& params, bool fHelp)
     outboundLimit.push_back(Pair("bytes_left_in_cycle", CNode::GetOutboundTargetBytesLeft()));
     outboundLimit.push_back(Pair("time_left_in_cycle", CNode::GetMaxOutboundTimeLeftInCycle()));
     obj.push_back(Pair("uploadtarget", outboundLimit));
+
+    CSocketLoopStats loopStats;
+    GetSocketLoopStats(loopStats);
+    UniValue socketEvents(UniValue::VOBJ);
+    socketEvents.push_back(Pair("mode", GetSocketEventsModeName()));
+    socketEvents.push_back(Pair("loops", loopStats.nLoops));
+    socketEvents.push_back(Pair("events", loopStats.nEvents));
+    socketEvents.push_back(Pair("wait_usec", loopStats.nWaitMicros));
+    socketEvents.push_back(Pair("busy_usec", loopStats.nBusyMicros));
+    socketEvents.push_back(Pair("max_busy_usec", loopStats.nMaxBusyMicros));
+    socketEvents.push_back(Pair("send_calls", loopStats.nSendCalls));
+    socketEvents.push_back(Pair("send_msgs", loopStats.nSendMsgs));
+    socketEvents.push_back(Pair("zerocopy_sends", loopStats.nZeroCopySends));
+    obj.push_back(Pair("socketevents", socketEvents));
+
+    CInvRelayStats relayStats;
+    GetInvRelayStats(relayStats);
+    UniValue invRelay(UniValue::VOBJ);
+    invRelay.push_back(Pair("objects_relayed", relayStats.nObjectsRelayed));
+    invRelay.push_back(Pair("invs_sent", relayStats.nInvsSent));
+    invRelay.push_back(Pair("inv_msgs_sent", relayStats.nInvMsgsSent));
+    invRelay.push_back(Pair("inv_msgs_shared", relayStats.nInvMsgsShared));
+    invRelay.push_back(Pair("inv_bytes_sent", relayStats.nInvBytesSent));
+    invRelay.push_back(Pair("inv_bytes_per_object", relayStats.nObjectsRelayed ? (double)relayStats.nInvBytesSent / relayStats.nObjectsRelayed : 0.0));
+    obj.push_back(Pair("invrelay", invRelay));
     return obj;
 }
 
@@ -428,6 +513,13 @@ UniValue getnetworkinfo(const UniValue& params, bool fHelp)
             "  }\n"
             "  ,...\n"
             "  ]\n"
+            "  \"relaycache\": {                       (json object) relayed transactions kept for getdata\n"
+            "    \"entries\": xxx,                      (numeric) transactions in the cache\n"
+            "    \"bytes\": xxx,                        (numeric) memory used by them\n"
+            "    \"max_bytes\": xxx,                    (numeric) memory the cache may use\n"
+            "    \"hits\": xxx,                         (numeric) getdata requests served from the cache\n"
+            "    \"misses\": xxx                        (numeric) getdata requests for transactions not in the cache\n"
+            "  }\n"
             "  \"warnings\": \"...\"                    (string) any network warnings (such as alert messages) \n"
             "}\n"
             "\nExamples:\n"
@@ -459,6 +551,15 @@ UniValue getnetworkinfo(const UniValue& params, bool fHelp)
         }
     }
     obj.push_back(Pair("localaddresses", localAddresses));
+    CRelayCacheStats relayStats;
+    relayCache.GetStats(relayStats);
+    UniValue relay(UniValue::VOBJ);
+    relay.push_back(Pair("entries", relayStats.nEntries));
+    relay.push_back(Pair("bytes", relayStats.nBytes));
+    relay.push_back(Pair("max_bytes", relayStats.nMaxBytes));
+    relay.push_back(Pair("hits", relayStats.nHits));
+    relay.push_back(Pair("misses", relayStats.nMisses));
+    obj.push_back(Pair("relaycache", relay));
     obj.push_back(Pair("warnings",       GetWarnings("statusbar")));
     return obj;
 }
@@ -11,8 +11,11 @@
 #include "crypto/sha256.h"
 #include "pubkey.h"
 #include "script/script.h"
+#include "streams.h"
 #include "uint256.h"
 
+#include <boost/foreach.hpp>
+
 using namespace std;
 
 typedef vector<unsigned char> valtype;
@@ -1104,9 +1107,90 @@ public:
     }
 };
 
+//! Size of an input serialized with a blank script: prevout, empty script, nSequence
+static const size_t BLANK_INPUT_SIZE = 36 + 1 + 4;
+
+void WriteRange(CHashWriter& ss, const std::vector<unsigned char>& vch, size_t nBegin, size_t nEnd)
+{
+    if (nEnd > nBegin)
+        ss.write((const char*)&vch[nBegin], nEnd - nBegin);
+}
+
+/** Same as serializing CTransactionSignatureSerializer, using the precomputed parts of txTo */
+uint256 SignatureHashPrecomputed(const CTransactionSignatureSerializer& txTmp, const CTransaction& txTo, unsigned int nIn, int nHashType, const PrecomputedTransactionData& cache)
+{
+    const bool fAnyoneCanPay = !!(nHashType & SIGHASH_ANYONECANPAY);
+    const bool fHashSingle = (nHashType & 0x1f) == SIGHASH_SINGLE;
+    const bool fHashNone = (nHashType & 0x1f) == SIGHASH_NONE;
+
+    CHashWriter ss(SER_GETHASH, 0);
+    if (fAnyoneCanPay) {
+        ss << txTo.nVersion;
+        ::WriteCompactSize(ss, 1);
+        txTmp.SerializeInput(ss, nIn, SER_GETHASH, 0);
+    } else {
+        const std::vector<unsigned char>& vchInputs = (fHashSingle || fHashNone) ? cache.vchBlankInputsNoSequence : cache.vchBlankInputs;
+        if (fHashSingle || fHashNone) {
+            ss << txTo.nVersion;
+            ::WriteCompactSize(ss, txTo.vin.size());
+            WriteRange(ss, vchInputs, 0, nIn * BLANK_INPUT_SIZE);
+        } else {
+            ss = cache.vPrefixHashes[nIn];
+        }
+        txTmp.SerializeInput(ss, nIn, SER_GETHASH, 0);
+        WriteRange(ss, vchInputs, (nIn + 1) * BLANK_INPUT_SIZE, vchInputs.size());
+    }
+
+    if (fHashNone) {
+        ::WriteCompactSize(ss, 0);
+    } else if (fHashSingle) {
+        ::WriteCompactSize(ss, nIn + 1);
+        for (unsigned int nOutput = 0; nOutput < nIn; nOutput++)
+            ss << CTxOut();
+        WriteRange(ss, cache.vchOutputs, cache.vOutputOffsets[nIn], cache.vOutputOffsets[nIn + 1]);
+    } else {
+        WriteRange(ss, cache.vchOutputs, 0, cache.vchOutputs.size());
+    }
+
+    ss << txTo.nLockTime << nHashType;
+    return ss.GetHash();
+}
+
 } // anon namespace
 
-uint256 SignatureHash(const CScript& scriptCode, const CTransaction& txTo, unsigned int nIn, int nHashType)
+PrecomputedTransactionData::PrecomputedTransactionData(const CTransaction& txTo)
+{
+    CDataStream ssInputs(SER_GETHASH, 0), ssInputsNoSequence(SER_GETHASH, 0);
+    BOOST_FOREACH(const CTxIn& txin, txTo.vin) {
+        ssInputs << txin.prevout << CScriptBase() << txin.nSequence;
+        ssInputsNoSequence << txin.prevout << CScriptBase() << (int)0;
+    }
+    vchBlankInputs.assign(ssInputs.begin(), ssInputs.end());
+    vchBlankInputsNoSequence.assign(ssInputsNoSequence.begin(), ssInputsNoSequence.end());
+    assert(vchBlankInputs.size() == txTo.vin.size() * BLANK_INPUT_SIZE);
+
+    CHashWriter ss(SER_GETHASH, 0);
+    ss << txTo.nVersion;
+    ::WriteCompactSize(ss, txTo.vin.size());
+    vPrefixHashes.reserve(txTo.vin.size() + 1);
+    vPrefixHashes.push_back(ss);
+    for (unsigned int i = 0; i < txTo.vin.size(); i++) {
+        WriteRange(ss, vchBlankInputs, i * BLANK_INPUT_SIZE, (i + 1) * BLANK_INPUT_SIZE);
+        vPrefixHashes.push_back(ss);
+    }
+
+    CDataStream ssOutputs(SER_GETHASH, 0);
+    ::WriteCompactSize(ssOutputs, txTo.vout.size());
+    vOutputOffsets.reserve(txTo.vout.size() + 1);
+    BOOST_FOREACH(const CTxOut& txout, txTo.vout) {
+        vOutputOffsets.push_back(ssOutputs.size());
+        ssOutputs << txout;
+    }
+    vOutputOffsets.push_back(ssOutputs.size());
+    vchOutputs.assign(ssOutputs.begin(), ssOutputs.end());
+}
+
+uint256 SignatureHash(const CScript& scriptCode, const CTransaction& txTo, unsigned int nIn, int nHashType, const PrecomputedTransactionData* cache)
 {
     static const uint256 one(uint256S("0000000000000000000000000000000000000000000000000000000000000001"));
     if (nIn >= txTo.vin.size()) {
@@ -1125,6 +1209,11 @@ uint256 SignatureHash(const CScript& scriptCode, const CTransaction& txTo, unsig
     // Wrapper to serialize only the necessary parts of the transaction being signed
     CTransactionSignatureSerializer txTmp(txTo, scriptCode, nIn, nHashType);
 
+    if (cache) {
+        assert(cache->vPrefixHashes.size() == txTo.vin.size() + 1);
+        return SignatureHashPrecomputed(txTmp, txTo, nIn, nHashType, *cache);
+    }
+
     // Serialize and hash
     CHashWriter ss(SER_GETHASH, 0);
     ss << txTmp << nHashType;
@@ -1149,7 +1238,7 @@ bool TransactionSignatureChecker::CheckSig(const vector<unsigned char>& vchSigIn
     int nHashType = vchSig.back();
     vchSig.pop_back();
 
-    uint256 sighash = SignatureHash(scriptCode, *txTo, nIn, nHashType);
+    uint256 sighash = SignatureHash(scriptCode, *txTo, nIn, nHashType, txdata);
 
     if (!VerifySignature(vchSig, pubkey, sighash))
         return false;
@@ -6,6 +6,7 @@
 #ifndef BITCOIN_SCRIPT_INTERPRETER_H
 #define BITCOIN_SCRIPT_INTERPRETER_H
 
+#include "hash.h"
 #include "script_error.h"
 #include "primitives/transaction.h"
 
@@ -90,7 +91,31 @@ enum
 
 bool CheckSignatureEncoding(const std::vector<unsigned char> &vchSig, unsigned int flags, ScriptError* serror);
 
-uint256 SignatureHash(const CScript &scriptCode, const CTransaction& txTo, unsigned int nIn, int nHashType);
+/**
+ * Serialized parts of a transaction that are shared by the signature hashes of
+ * all its inputs. Without them, every input's SignatureHash re-serializes the
+ * whole transaction, which is quadratic in the number of inputs. Build it once
+ * per transaction and pass it to all of its checks; the signature scripts of
+ * txTo may change afterwards (they are not part of any signature hash), but
+ * nothing else may.
+ */
+struct PrecomputedTransactionData
+{
+    //! Hash state after nVersion, the input count and the first i blanked inputs, for every i
+    std::vector<CHashWriter> vPrefixHashes;
+    //! Every input with its script blanked out
+    std::vector<unsigned char> vchBlankInputs;
+    //! Same, also with nSequence zeroed (SIGHASH_NONE and SIGHASH_SINGLE)
+    std::vector<unsigned char> vchBlankInputsNoSequence;
+    //! The output count and all outputs
+    std::vector<unsigned char> vchOutputs;
+    //! Offset of each output in vchOutputs, plus the end
+    std::vector<size_t> vOutputOffsets;
+
+    PrecomputedTransactionData(const CTransaction& txTo);
+};
+
+uint256 SignatureHash(const CScript &scriptCode, const CTransaction& txTo, unsigned int nIn, int nHashType, const PrecomputedTransactionData* cache = NULL);
 
 class BaseSignatureChecker
 {
@@ -118,12 +143,13 @@ class TransactionSignatureChecker : public BaseSignatureChecker
 private:
     const CTransaction* txTo;
     unsigned int nIn;
+    const PrecomputedTransactionData* txdata;
 
 protected:
     virtual bool VerifySignature(const std::vector<unsigned char>& vchSig, const CPubKey& vchPubKey, const uint256& sighash) const;
 
 public:
-    TransactionSignatureChecker(const CTransaction* txToIn, unsigned int nInIn) : txTo(txToIn), nIn(nInIn) {}
+    TransactionSignatureChecker(const CTransaction* txToIn, unsigned int nInIn, const PrecomputedTransactionData* txdataIn = NULL) : txTo(txToIn), nIn(nInIn), txdata(txdataIn) {}
     bool CheckSig(const std::vector<unsigned char>& scriptSig, const std::vector<unsigned char>& vchPubKey, const CScript& scriptCode) const;
     bool CheckLockTime(const CScriptNum& nLockTime) const;
     bool CheckSequence(const CScriptNum& nSequence) const;
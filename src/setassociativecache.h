@@ -0,0 +1,158 @@
+// Copyright (c) 2009-2015 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_SETASSOCIATIVECACHE_H
+#define BITCOIN_SETASSOCIATIVECACHE_H
+
+#include "uint256.h"
+
+#include <atomic>
+#include <stdint.h>
+#include <vector>
+
+#include <boost/thread/locks.hpp>
+#include <boost/thread/shared_mutex.hpp>
+
+/** Counters of a CSetAssociativeCache since startup */
+struct CSetAssociativeCacheStats
+{
+    size_t nCapacity;
+    uint64_t nHits;
+    uint64_t nMisses;
+    uint64_t nInserts;
+    uint64_t nEvictions;
+};
+
+/**
+ * Fixed-size, thread safe set of uniformly distributed 256-bit keys (salted
+ * hashes), allocated once by Setup().
+ *
+ * An entry can only be stored in one of the WAYS slots of the bucket selected
+ * by its hash, so lookups and insertions never allocate and touch a single
+ * cache line or two. Buckets are guarded by STRIPES locks (bucket i by lock
+ * i % STRIPES), so concurrent script check threads and mempool acceptance
+ * rarely contend. When a bucket is full, the entry that was inserted first is
+ * replaced (FIFO within the bucket).
+ */
+class CSetAssociativeCache
+{
+private:
+    static const unsigned int WAYS = 8;
+    static const unsigned int STRIPES = 64;
+
+    struct Slot {
+        uint256 entry;
+        //! Insertion sequence number within the stripe, 0 if the slot is empty
+        uint32_t nSequence;
+    };
+
+    std::vector<Slot> vSlots;
+    size_t nBuckets;
+    boost::shared_mutex cs_stripe[STRIPES];
+    uint32_t nNextSequence[STRIPES];
+
+    std::atomic<uint64_t> nHits;
+    std::atomic<uint64_t> nMisses;
+    std::atomic<uint64_t> nInserts;
+    std::atomic<uint64_t> nEvictions;
+
+    size_t BucketOf(const uint256& entry) const
+    {
+        // Entries are salted hashes, so any 64 bits are uniformly distributed.
+        return entry.GetCheapHash() % nBuckets;
+    }
+
+public:
+    CSetAssociativeCache() : nBuckets(0), nHits(0), nMisses(0), nInserts(0), nEvictions(0)
+    {
+        for (unsigned int i = 0; i < STRIPES; i++)
+            nNextSequence[i] = 1;
+    }
+
+    //! Allocate room for nMaxBytes worth of entries. Not thread safe: call before any lookup.
+    void Setup(size_t nMaxBytes)
+    {
+        nBuckets = nMaxBytes / (sizeof(Slot) * WAYS);
+        std::vector<Slot>(nBuckets * WAYS).swap(vSlots);
+        for (size_t i = 0; i < vSlots.size(); i++)
+            vSlots[i].nSequence = 0;
+    }
+
+    bool Contains(const uint256& entry)
+    {
+        if (nBuckets == 0)
+            return false;
+        size_t nBucket = BucketOf(entry);
+        const Slot* bucket = &vSlots[nBucket * WAYS];
+        boost::shared_lock<boost::shared_mutex> lock(cs_stripe[nBucket % STRIPES]);
+        for (unsigned int i = 0; i < WAYS; i++) {
+            if (bucket[i].nSequence != 0 && bucket[i].entry == entry) {
+                nHits.fetch_add(1, std::memory_order_relaxed);
+                return true;
+            }
+        }
+        nMisses.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+
+    void Erase(const uint256& entry)
+    {
+        if (nBuckets == 0)
+            return;
+        size_t nBucket = BucketOf(entry);
+        Slot* bucket = &vSlots[nBucket * WAYS];
+        boost::unique_lock<boost::shared_mutex> lock(cs_stripe[nBucket % STRIPES]);
+        for (unsigned int i = 0; i < WAYS; i++) {
+            if (bucket[i].nSequence != 0 && bucket[i].entry == entry) {
+                bucket[i].nSequence = 0;
+                return;
+            }
+        }
+    }
+
+    void Insert(const uint256& entry)
+    {
+        if (nBuckets == 0)
+            return;
+        size_t nBucket = BucketOf(entry);
+        unsigned int nStripe = nBucket % STRIPES;
+        Slot* bucket = &vSlots[nBucket * WAYS];
+        boost::unique_lock<boost::shared_mutex> lock(cs_stripe[nStripe]);
+        // Reuse an empty slot (or the entry itself) if there is one, otherwise
+        // replace the oldest entry. Ages are distances from the next sequence
+        // number, which keeps the order correct across wrap-around.
+        unsigned int nVictim = WAYS;
+        uint32_t nVictimAge = 0;
+        for (unsigned int i = 0; i < WAYS; i++) {
+            if (bucket[i].nSequence == 0 || bucket[i].entry == entry) {
+                nVictim = i;
+                nVictimAge = 0;
+                break;
+            }
+            uint32_t nAge = nNextSequence[nStripe] - bucket[i].nSequence;
+            if (nVictim == WAYS || nAge > nVictimAge) {
+                nVictim = i;
+                nVictimAge = nAge;
+            }
+        }
+        if (nVictimAge != 0)
+            nEvictions.fetch_add(1, std::memory_order_relaxed);
+        bucket[nVictim].entry = entry;
+        bucket[nVictim].nSequence = nNextSequence[nStripe]++;
+        if (nNextSequence[nStripe] == 0)
+            nNextSequence[nStripe] = 1;
+        nInserts.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    void GetStats(CSetAssociativeCacheStats& stats) const
+    {
+        stats.nCapacity = vSlots.size();
+        stats.nHits = nHits.load(std::memory_order_relaxed);
+        stats.nMisses = nMisses.load(std::memory_order_relaxed);
+        stats.nInserts = nInserts.load(std::memory_order_relaxed);
+        stats.nEvictions = nEvictions.load(std::memory_order_relaxed);
+    }
+};
+
+#endif // BITCOIN_SETASSOCIATIVECACHE_H
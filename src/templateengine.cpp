@@ -0,0 +1,274 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "templateengine.h"
+
+#include "chain.h"
+#include "chainparams.h"
+#include "consensus/consensus.h"
+#include "consensus/merkle.h"
+#include "main.h"
+#include "miner.h"
+#include "policy/policy.h"
+#include "timedata.h"
+#include "txmempool.h"
+#include "util.h"
+#include "utiltime.h"
+#include "version.h"
+
+#include <boost/bind.hpp>
+#include <boost/foreach.hpp>
+
+CLatencyHistogram::CLatencyHistogram() : nCount(0), nTotalMicros(0), nMaxMicros(0)
+{
+    for (int i = 0; i < BUCKETS; i++)
+        vBuckets[i] = 0;
+}
+
+void CLatencyHistogram::Add(int64_t nMicros)
+{
+    nMicros = std::max(nMicros, (int64_t)0);
+    int nBucket = 0;
+    while (nBucket < BUCKETS - 1 && (nMicros >> nBucket) != 0)
+        nBucket++;
+    vBuckets[nBucket]++;
+    nCount++;
+    nTotalMicros += nMicros;
+    nMaxMicros = std::max(nMaxMicros, nMicros);
+}
+
+CBlockTemplateEngine::CBlockTemplateEngine(const CChainParams& _chainparams, CTxMemPool& _pool)
+    : chainparams(_chainparams), pool(_pool), scriptPubKey(CScript() << OP_TRUE),
+      pindexPrev(NULL), nLastRebuild(0), fDeferred(false),
+      nBlockSize(0), nBlockSigOps(0), nBlockMaxSize(0), nFees(0),
+      fPendingOverflow(false),
+      connAdded(_pool.NotifyEntryAdded.connect(boost::bind(&CBlockTemplateEngine::TransactionAdded, this, _1))),
+      connRemoved(_pool.NotifyEntryRemoved.connect(boost::bind(&CBlockTemplateEngine::TransactionRemoved, this, _1)))
+{
+    stats.nHeight = -1;
+    stats.nTemplateTx = 0;
+    stats.nFullRebuilds = 0;
+    stats.nIncrementalUpdates = 0;
+    stats.nTxAdded = 0;
+    stats.nTxRemoved = 0;
+    stats.nTxDeferred = 0;
+}
+
+void CBlockTemplateEngine::TransactionAdded(const uint256& hash)
+{
+    LOCK(cs_pending);
+    if (fPendingOverflow)
+        return;
+    if (vPendingAdded.size() + vPendingRemoved.size() >= MAX_PENDING) {
+        // Nobody asked for a template in a long time; don't keep growing
+        vPendingAdded.clear();
+        vPendingRemoved.clear();
+        fPendingOverflow = true;
+        return;
+    }
+    vPendingAdded.push_back(hash);
+}
+
+void CBlockTemplateEngine::TransactionRemoved(const uint256& hash)
+{
+    LOCK(cs_pending);
+    if (fPendingOverflow)
+        return;
+    if (vPendingAdded.size() + vPendingRemoved.size() >= MAX_PENDING) {
+        vPendingAdded.clear();
+        vPendingRemoved.clear();
+        fPendingOverflow = true;
+        return;
+    }
+    vPendingRemoved.push_back(hash);
+}
+
+CBlockTemplate& CBlockTemplateEngine::Writable()
+{
+    // Only this engine can hand out new references (with cs_engine held), so
+    // a unique template cannot be observed by anybody else while we modify it.
+    if (!ptemplate.unique())
+        ptemplate.reset(new CBlockTemplate(*ptemplate));
+    return *ptemplate;
+}
+
+void CBlockTemplateEngine::Rebuild(const CBlockIndex* pindexTip)
+{
+    int64_t nTimeStart = GetTimeMicros();
+
+    // Everything queued so far is reflected by the new template. Changes
+    // racing with the rebuild may be queued as well, which is harmless: they
+    // are applied idempotently by Update().
+    {
+        LOCK(cs_pending);
+        vPendingAdded.clear();
+        vPendingRemoved.clear();
+        fPendingOverflow = false;
+    }
+
+    // Clear pindexPrev so the next call rebuilds again if this one throws
+    pindexPrev = NULL;
+    ptemplate.reset();
+    setInTemplate.clear();
+
+    BlockAssembler assembler(chainparams, pool);
+    ptemplate.reset(assembler.CreateNewBlock(scriptPubKey));
+    if (!ptemplate)
+        throw std::runtime_error("CBlockTemplateEngine: out of memory");
+
+    const CBlock& block = ptemplate->block;
+    for (size_t i = 1; i < block.vtx.size(); i++)
+        setInTemplate.insert(block.vtx[i].GetHash());
+    nBlockSize = assembler.GetBlockSize();
+    nBlockSigOps = assembler.GetBlockSigOps();
+    nBlockMaxSize = assembler.GetBlockMaxSize();
+    nFees = assembler.GetFees();
+    fDeferred = false;
+    nLastRebuild = GetTime();
+    pindexPrev = pindexTip;
+
+    stats.nFullRebuilds++;
+    stats.rebuild.Add(GetTimeMicros() - nTimeStart);
+}
+
+void CBlockTemplateEngine::Update(const std::vector<uint256>& vAdded, const std::vector<uint256>& vRemoved)
+{
+    AssertLockHeld(pool.cs);
+    int64_t nTimeStart = GetTimeMicros();
+    bool fChanged = false;
+
+    std::set<uint256> setDropped;
+    BOOST_FOREACH(const uint256& hash, vRemoved) {
+        if (setInTemplate.count(hash))
+            setDropped.insert(hash);
+    }
+    if (!setDropped.empty()) {
+        CBlockTemplate& tmpl = Writable();
+        std::vector<CTransaction>& vtx = tmpl.block.vtx;
+        // The template is in dependency order, so a single pass also finds
+        // everything spending a dropped transaction.
+        size_t nKept = 1;
+        for (size_t i = 1; i < vtx.size(); i++) {
+            const uint256& hash = vtx[i].GetHash();
+            bool fDrop = setDropped.count(hash) > 0;
+            for (unsigned int j = 0; !fDrop && j < vtx[i].vin.size(); j++)
+                fDrop = setDropped.count(vtx[i].vin[j].prevout.hash) > 0;
+            if (fDrop) {
+                setDropped.insert(hash);
+                setInTemplate.erase(hash);
+                nBlockSize -= ::GetSerializeSize(vtx[i], SER_NETWORK, PROTOCOL_VERSION);
+                nBlockSigOps -= tmpl.vTxSigOps[i];
+                nFees -= tmpl.vTxFees[i];
+                stats.nTxRemoved++;
+                continue;
+            }
+            if (nKept != i) {
+                vtx[nKept] = vtx[i];
+                tmpl.vTxFees[nKept] = tmpl.vTxFees[i];
+                tmpl.vTxSigOps[nKept] = tmpl.vTxSigOps[i];
+            }
+            nKept++;
+        }
+        vtx.resize(nKept);
+        tmpl.vTxFees.resize(nKept);
+        tmpl.vTxSigOps.resize(nKept);
+        fChanged = true;
+    }
+
+    const int nHeight = pindexPrev->nHeight + 1;
+    const int64_t nLockTimeCutoff = (STANDARD_LOCKTIME_VERIFY_FLAGS & LOCKTIME_MEDIAN_TIME_PAST)
+                                    ? pindexPrev->GetMedianTimePast()
+                                    : GetAdjustedTime();
+    BOOST_FOREACH(const uint256& hash, vAdded) {
+        if (setInTemplate.count(hash))
+            continue;
+        CTxMemPool::txiter it = pool.mapTx.find(hash);
+        if (it == pool.mapTx.end())
+            continue;
+        // A full rebuild would not select these on their own either
+        if (it->GetModifiedFee() < ::minRelayTxFee.GetFee(it->GetTxSize()) ||
+            !IsFinalTx(it->GetTx(), nHeight, nLockTimeCutoff))
+            continue;
+
+        bool fParentsIncluded = true;
+        BOOST_FOREACH(const CTxMemPoolEntry* parent, it->GetMemPoolParents()) {
+            if (!setInTemplate.count(parent->GetTx().GetHash())) {
+                fParentsIncluded = false;
+                break;
+            }
+        }
+        if (!fParentsIncluded ||
+            nBlockSize + it->GetTxSize() >= nBlockMaxSize ||
+            nBlockSigOps + it->GetSigOpCount() >= MAX_BLOCK_SIGOPS) {
+            fDeferred = true;
+            stats.nTxDeferred++;
+            continue;
+        }
+
+        CBlockTemplate& tmpl = Writable();
+        tmpl.block.vtx.push_back(it->GetTx());
+        tmpl.vTxFees.push_back(it->GetFee());
+        tmpl.vTxSigOps.push_back(it->GetSigOpCount());
+        nBlockSize += it->GetTxSize();
+        nBlockSigOps += it->GetSigOpCount();
+        nFees += it->GetFee();
+        setInTemplate.insert(hash);
+        stats.nTxAdded++;
+        fChanged = true;
+    }
+
+    if (!fChanged)
+        return;
+
+    CBlockTemplate& tmpl = Writable();
+    tmpl.vCoinbaseMerkleBranch = BlockMerkleBranch(tmpl.block, 0);
+    FillCoinbase(&tmpl, pindexPrev, nFees, scriptPubKey);
+    stats.nIncrementalUpdates++;
+    stats.update.Add(GetTimeMicros() - nTimeStart);
+}
+
+boost::shared_ptr<const CBlockTemplate> CBlockTemplateEngine::GetTemplate()
+{
+    AssertLockHeld(cs_main);
+    int64_t nTimeStart = GetTimeMicros();
+
+    LOCK(cs_engine);
+    const CBlockIndex* pindexTip = chainActive.Tip();
+    bool fOverflow;
+    {
+        LOCK(cs_pending);
+        fOverflow = fPendingOverflow;
+    }
+    if (pindexPrev != pindexTip || fOverflow ||
+        (fDeferred && GetTime() - nLastRebuild >= REBUILD_INTERVAL)) {
+        Rebuild(pindexTip);
+    } else {
+        std::vector<uint256> vAdded, vRemoved;
+        LOCK(pool.cs);
+        {
+            LOCK(cs_pending);
+            vAdded.swap(vPendingAdded);
+            vRemoved.swap(vPendingRemoved);
+        }
+        if (!vAdded.empty() || !vRemoved.empty())
+            Update(vAdded, vRemoved);
+    }
+
+    stats.serve.Add(GetTimeMicros() - nTimeStart);
+    return ptemplate;
+}
+
+void CBlockTemplateEngine::GetStats(CBlockTemplateEngineStats& statsOut) const
+{
+    LOCK(cs_engine);
+    statsOut = stats;
+    statsOut.nHeight = pindexPrev ? pindexPrev->nHeight + 1 : -1;
+    statsOut.nTemplateTx = ptemplate ? ptemplate->block.vtx.size() - 1 : 0;
+}
+
+CBlockTemplateEngine& GetBlockTemplateEngine()
+{
+    static CBlockTemplateEngine engine(Params(), mempool);
+    return engine;
+}
@@ -0,0 +1,129 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_TEMPLATEENGINE_H
+#define BITCOIN_TEMPLATEENGINE_H
+
+#include "amount.h"
+#include "script/script.h"
+#include "sync.h"
+#include "uint256.h"
+
+#include <set>
+#include <stdint.h>
+#include <vector>
+
+#include <boost/shared_ptr.hpp>
+#include <boost/signals2/connection.hpp>
+
+class CBlockIndex;
+class CChainParams;
+class CTxMemPool;
+struct CBlockTemplate;
+
+/** Latency distribution in power-of-two microsecond buckets */
+class CLatencyHistogram
+{
+public:
+    //! Bucket i counts durations below 2^i microseconds (and at least 2^(i-1))
+    static const int BUCKETS = 32;
+
+    uint64_t nCount;
+    int64_t nTotalMicros;
+    int64_t nMaxMicros;
+    uint64_t vBuckets[BUCKETS];
+
+    CLatencyHistogram();
+    void Add(int64_t nMicros);
+};
+
+/** Counters of a CBlockTemplateEngine since startup */
+struct CBlockTemplateEngineStats
+{
+    int nHeight;
+    size_t nTemplateTx;
+    uint64_t nFullRebuilds;
+    uint64_t nIncrementalUpdates;
+    uint64_t nTxAdded;
+    uint64_t nTxRemoved;
+    uint64_t nTxDeferred;
+    CLatencyHistogram rebuild;
+    CLatencyHistogram update;
+    CLatencyHistogram serve;
+};
+
+/**
+ * Keeps a block template on top of the active tip for getblocktemplate.
+ *
+ * A full CreateNewBlock only runs when the tip changes. In between, mempool
+ * additions and removals are queued by the pool's notification signals and
+ * applied to the current template on the next request: removed transactions
+ * are dropped together with whatever in the template spends them, and new
+ * transactions whose in-mempool parents are already included are appended
+ * while they fit. Transactions that cannot be placed that way (missing
+ * parents, full block) are left for a full rebuild, which happens at most
+ * every REBUILD_INTERVAL seconds while any are waiting.
+ *
+ * Callers get immutable snapshots; a snapshot still held by a caller is
+ * copied rather than modified in place.
+ */
+class CBlockTemplateEngine
+{
+public:
+    static const int64_t REBUILD_INTERVAL = 30;
+    static const size_t MAX_PENDING = 100000;
+
+private:
+    const CChainParams& chainparams;
+    CTxMemPool& pool;
+    const CScript scriptPubKey;
+
+    mutable CCriticalSection cs_engine;
+    boost::shared_ptr<CBlockTemplate> ptemplate;
+    const CBlockIndex* pindexPrev;
+    int64_t nLastRebuild;
+    //! Some mempool transactions could not be placed without a full rebuild
+    bool fDeferred;
+    std::set<uint256> setInTemplate;
+    uint64_t nBlockSize;
+    unsigned int nBlockSigOps;
+    unsigned int nBlockMaxSize;
+    CAmount nFees;
+    CBlockTemplateEngineStats stats;
+
+    //! Innermost lock: taken by the mempool signal handlers with pool.cs held
+    CCriticalSection cs_pending;
+    std::vector<uint256> vPendingAdded;
+    std::vector<uint256> vPendingRemoved;
+    //! More than MAX_PENDING changes were queued and dropped: rebuild
+    bool fPendingOverflow;
+
+    boost::signals2::scoped_connection connAdded;
+    boost::signals2::scoped_connection connRemoved;
+
+    /** The template, copied first if a caller still holds a snapshot of it */
+    CBlockTemplate& Writable();
+
+    void TransactionAdded(const uint256& hash);
+    void TransactionRemoved(const uint256& hash);
+
+    /** Build a new template with CreateNewBlock */
+    void Rebuild(const CBlockIndex* pindexTip);
+    /** Apply queued mempool changes to the current template */
+    void Update(const std::vector<uint256>& vAdded, const std::vector<uint256>& vRemoved);
+
+public:
+    CBlockTemplateEngine(const CChainParams& chainparams, CTxMemPool& pool);
+
+    /** Return a template on top of the active tip reflecting the mempool.
+     *  Requires cs_main. Throws if a full rebuild fails. */
+    boost::shared_ptr<const CBlockTemplate> GetTemplate();
+
+    void GetStats(CBlockTemplateEngineStats& statsOut) const;
+};
+
+/** The engine serving getblocktemplate from the global mempool */
+CBlockTemplateEngine& GetBlockTemplateEngine();
+
+#endif // BITCOIN_TEMPLATEENGINE_H
@@ -11,6 +11,7 @@
 #include "pow.h"
 #include "script/sign.h"
 #include "serialize.h"
+#include "txorphanpool.h"
 #include "util.h"
 
 #include "test/test_sibcoin.h"
@@ -22,17 +23,6 @@
 #include <boost/foreach.hpp>
 #include <boost/test/unit_test.hpp>
 
-// Tests this internal-to-main.cpp method:
-extern bool AddOrphanTx(const CTransaction& tx, NodeId peer);
-extern void EraseOrphansFor(NodeId peer);
-extern unsigned int LimitOrphanTxSize(unsigned int nMaxOrphans);
-struct COrphanTx {
-    CTransaction tx;
-    NodeId fromPeer;
-};
-extern std::map<uint256, COrphanTx> mapOrphanTransactions;
-extern std::map<uint256, std::set<uint256> > mapOrphanTransactionsByPrev;
-
 CService ip(uint32_t i)
 {
     struct in_addr s;
@@ -105,13 +95,13 @@ BOOST_AUTO_TEST_CASE(DoS_bantime)
     BOOST_CHECK(!CNode::IsBanned(addr));
 }
 
-CTransaction RandomOrphan()
+CTransaction RandomOrphan(const CTxOrphanPool& orphanpool, const std::vector<CTransaction>& vOrphans)
 {
-    std::map<uint256, COrphanTx>::iterator it;
-    it = mapOrphanTransactions.lower_bound(GetRandHash());
-    if (it == mapOrphanTransactions.end())
-        it = mapOrphanTransactions.begin();
-    return it->second.tx;
+    while (true) {
+        const CTransaction& tx = vOrphans[GetRand(vOrphans.size())];
+        if (orphanpool.HaveTx(tx.GetHash()))
+            return tx;
+    }
 }
 
 BOOST_AUTO_TEST_CASE(DoS_mapOrphans)
@@ -120,6 +110,8 @@ BOOST_AUTO_TEST_CASE(DoS_mapOrphans)
     key.MakeNewKey(true);
     CBasicKeyStore keystore;
     keystore.AddKey(key);
+    CTxOrphanPool orphanpool;
+    std::vector<CTransaction> vOrphans;
 
     // 50 orphan transactions:
     for (int i = 0; i < 50; i++)
@@ -133,13 +125,14 @@ BOOST_AUTO_TEST_CASE(DoS_mapOrphans)
         tx.vout[0].nValue = 1*CENT;
         tx.vout[0].scriptPubKey = GetScriptForDestination(key.GetPubKey().GetID());
 
-        AddOrphanTx(tx, i);
+        BOOST_CHECK(orphanpool.AddTx(tx, i));
+        vOrphans.push_back(tx);
     }
 
     // ... and 50 that depend on other orphans:
     for (int i = 0; i < 50; i++)
     {
-        CTransaction txPrev = RandomOrphan();
+        CTransaction txPrev = RandomOrphan(orphanpool, vOrphans);
 
         CMutableTransaction tx;
         tx.vin.resize(1);
@@ -150,13 +143,14 @@ BOOST_AUTO_TEST_CASE(DoS_mapOrphans)
         tx.vout[0].scriptPubKey = GetScriptForDestination(key.GetPubKey().GetID());
         SignSignature(keystore, txPrev, tx, 0);
 
-        AddOrphanTx(tx, i);
+        orphanpool.AddTx(tx, i);
+        vOrphans.push_back(tx);
     }
 
     // This really-big orphan should be ignored:
     for (int i = 0; i < 10; i++)
     {
-        CTransaction txPrev = RandomOrphan();
+        CTransaction txPrev = RandomOrphan(orphanpool, vOrphans);
 
         CMutableTransaction tx;
         tx.vout.resize(1);
@@ -174,25 +168,93 @@ BOOST_AUTO_TEST_CASE(DoS_mapOrphans)
         for (unsigned int j = 1; j < tx.vin.size(); j++)
             tx.vin[j].scriptSig = tx.vin[0].scriptSig;
 
-        BOOST_CHECK(!AddOrphanTx(tx, i));
+        BOOST_CHECK(!orphanpool.AddTx(tx, i));
     }
 
-    // Test EraseOrphansFor:
+    // Test EraseForPeer:
     for (NodeId i = 0; i < 3; i++)
     {
-        size_t sizeBefore = mapOrphanTransactions.size();
-        EraseOrphansFor(i);
-        BOOST_CHECK(mapOrphanTransactions.size() < sizeBefore);
+        size_t sizeBefore = orphanpool.size();
+        BOOST_CHECK(orphanpool.EraseForPeer(i) > 0);
+        BOOST_CHECK(orphanpool.size() < sizeBefore);
+        BOOST_CHECK_EQUAL(orphanpool.GetPeerBytes(i), 0);
+    }
+
+    // Test LimitOrphans() function:
+    orphanpool.LimitOrphans(40);
+    BOOST_CHECK(orphanpool.size() <= 40);
+    orphanpool.LimitOrphans(10);
+    BOOST_CHECK(orphanpool.size() <= 10);
+    orphanpool.LimitOrphans(0);
+    BOOST_CHECK_EQUAL(orphanpool.size(), 0);
+    std::vector<CTransaction> vChildren;
+    std::vector<NodeId> vFromPeer;
+    orphanpool.GetChildren(vOrphans, vChildren, vFromPeer);
+    BOOST_CHECK(vChildren.empty());
+}
+
+static CTransaction OrphanSpending(const COutPoint& prevout, int nOutputs = 1)
+{
+    CMutableTransaction tx;
+    tx.vin.resize(1);
+    tx.vin[0].prevout = prevout;
+    tx.vin[0].scriptSig << OP_1;
+    tx.vout.resize(nOutputs);
+    for (int i = 0; i < nOutputs; i++) {
+        tx.vout[i].nValue = 1*CENT;
+        tx.vout[i].scriptPubKey = CScript() << OP_TRUE;
     }
+    return tx;
+}
 
-    // Test LimitOrphanTxSize() function:
-    LimitOrphanTxSize(40);
-    BOOST_CHECK(mapOrphanTransactions.size() <= 40);
-    LimitOrphanTxSize(10);
-    BOOST_CHECK(mapOrphanTransactions.size() <= 10);
-    LimitOrphanTxSize(0);
-    BOOST_CHECK(mapOrphanTransactions.empty());
-    BOOST_CHECK(mapOrphanTransactionsByPrev.empty());
+BOOST_AUTO_TEST_CASE(DoS_orphanQuotas)
+{
+    CTransaction txOne = OrphanSpending(COutPoint(GetRandHash(), 0));
+    unsigned int nTxSize = txOne.GetSerializeSize(SER_NETWORK, PROTOCOL_VERSION);
+    // Room for three orphans per peer
+    CTxOrphanPool orphanpool(3 * nTxSize);
+
+    // A peer over its quota only pushes out its own oldest orphans
+    std::vector<CTransaction> vFlood;
+    for (int i = 0; i < 10; i++) {
+        vFlood.push_back(OrphanSpending(COutPoint(GetRandHash(), 0)));
+        BOOST_CHECK(orphanpool.AddTx(vFlood.back(), 1));
+    }
+    BOOST_CHECK(orphanpool.AddTx(txOne, 2));
+    BOOST_CHECK_EQUAL(orphanpool.size(), 4);
+    BOOST_CHECK_EQUAL(orphanpool.GetPeerBytes(1), 3 * nTxSize);
+    BOOST_CHECK(!orphanpool.HaveTx(vFlood[6].GetHash()));
+    BOOST_CHECK(orphanpool.HaveTx(vFlood[7].GetHash()));
+    BOOST_CHECK(orphanpool.HaveTx(txOne.GetHash()));
+
+    // A full pool evicts from the peer using the most space first
+    orphanpool.LimitOrphans(2);
+    BOOST_CHECK_EQUAL(orphanpool.size(), 2);
+    BOOST_CHECK(orphanpool.HaveTx(vFlood[9].GetHash()));
+    BOOST_CHECK(orphanpool.HaveTx(txOne.GetHash()));
+
+    // Children of several parents are found through the outpoints they spend
+    CTransaction parent = OrphanSpending(COutPoint(GetRandHash(), 0), 2);
+    CTransaction child0 = OrphanSpending(COutPoint(parent.GetHash(), 0));
+    CTransaction child1 = OrphanSpending(COutPoint(parent.GetHash(), 1));
+    BOOST_CHECK(orphanpool.AddTx(child0, 3));
+    BOOST_CHECK(orphanpool.AddTx(child1, 4));
+    BOOST_CHECK(!orphanpool.AddTx(child1, 4));
+    std::vector<CTransaction> vParents, vChildren;
+    vParents.push_back(parent);
+    vParents.push_back(txOne);
+    std::vector<NodeId> vFromPeer;
+    orphanpool.GetChildren(vParents, vChildren, vFromPeer);
+    BOOST_CHECK_EQUAL(vChildren.size(), 2);
+    BOOST_CHECK_EQUAL(vFromPeer[0] + vFromPeer[1], 7);
+
+    // Orphans expire
+    int64_t nStartTime = GetTime();
+    SetMockTime(nStartTime + ORPHAN_TX_EXPIRE_TIME + 1);
+    orphanpool.LimitOrphans(100);
+    BOOST_CHECK_EQUAL(orphanpool.size(), 0);
+    BOOST_CHECK_EQUAL(orphanpool.GetPeerBytes(1), 0);
+    SetMockTime(0);
 }
 
 BOOST_AUTO_TEST_SUITE_END()
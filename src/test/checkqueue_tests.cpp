@@ -0,0 +1,110 @@
+// Copyright (c) 2012-2015 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "checkqueue.h"
+#include "test/test_sibcoin.h"
+
+#include <atomic>
+#include <vector>
+
+#include <boost/bind.hpp>
+#include <boost/test/unit_test.hpp>
+#include <boost/thread.hpp>
+
+BOOST_FIXTURE_TEST_SUITE(checkqueue_tests, BasicTestingSetup)
+
+static std::atomic<unsigned int> nChecked(0);
+
+/** Counts how often it runs; fails if fOk is false */
+struct FakeCheck
+{
+    bool fOk;
+
+    FakeCheck() : fOk(true) {}
+    FakeCheck(bool fOkIn) : fOk(fOkIn) {}
+
+    bool operator()()
+    {
+        nChecked++;
+        return fOk;
+    }
+
+    void swap(FakeCheck& check)
+    {
+        std::swap(fOk, check.fOk);
+    }
+};
+
+typedef CCheckQueue<FakeCheck> FakeCheckQueue;
+
+static void StartWorkers(FakeCheckQueue& queue, boost::thread_group& threadGroup, int nWorkers)
+{
+    for (int i = 0; i < nWorkers; i++)
+        threadGroup.create_thread(boost::bind(&FakeCheckQueue::Thread, &queue));
+}
+
+// Add nChecks checks in batches of nBatch, with the check at index nFail failing
+static bool RunChecks(FakeCheckQueue& queue, unsigned int nChecks, unsigned int nBatch, unsigned int nFail = (unsigned int)-1)
+{
+    CCheckQueueControl<FakeCheck> control(&queue);
+    for (unsigned int i = 0; i < nChecks; i += nBatch) {
+        std::vector<FakeCheck> vChecks;
+        for (unsigned int j = i; j < std::min(nChecks, i + nBatch); j++)
+            vChecks.push_back(FakeCheck(j != nFail));
+        control.Add(vChecks);
+    }
+    return control.Wait();
+}
+
+BOOST_AUTO_TEST_CASE(checkqueue_master_only)
+{
+    FakeCheckQueue queue(128);
+    nChecked = 0;
+    BOOST_CHECK(RunChecks(queue, 1000, 7));
+    BOOST_CHECK_EQUAL(nChecked, 1000);
+    BOOST_CHECK(!RunChecks(queue, 10, 3, 5));
+    BOOST_CHECK(queue.IsIdle());
+}
+
+BOOST_AUTO_TEST_CASE(checkqueue_all_checks_run)
+{
+    FakeCheckQueue queue(128);
+    boost::thread_group threadGroup;
+    StartWorkers(queue, threadGroup, 3);
+
+    // Every check runs exactly once, whatever the batching, and the queue
+    // is ready for the next block as soon as Wait() returns
+    unsigned int nBatches[] = {1, 2, 5, 100, 2000};
+    for (unsigned int i = 0; i < sizeof(nBatches) / sizeof(nBatches[0]); i++) {
+        nChecked = 0;
+        BOOST_CHECK(RunChecks(queue, 2000, nBatches[i]));
+        BOOST_CHECK_EQUAL(nChecked, 2000);
+        BOOST_CHECK(queue.IsIdle());
+    }
+
+    // Empty blocks
+    BOOST_CHECK(RunChecks(queue, 0, 1));
+
+    threadGroup.interrupt_all();
+    threadGroup.join_all();
+}
+
+BOOST_AUTO_TEST_CASE(checkqueue_failure)
+{
+    FakeCheckQueue queue(128);
+    boost::thread_group threadGroup;
+    StartWorkers(queue, threadGroup, 3);
+
+    for (unsigned int nFail = 0; nFail < 1000; nFail += 111) {
+        BOOST_CHECK(!RunChecks(queue, 1000, 10, nFail));
+        BOOST_CHECK(queue.IsIdle());
+    }
+    // The failure is not remembered for later blocks
+    BOOST_CHECK(RunChecks(queue, 1000, 10));
+
+    threadGroup.interrupt_all();
+    threadGroup.join_all();
+}
+
+BOOST_AUTO_TEST_SUITE_END()
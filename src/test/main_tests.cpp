@@ -4,7 +4,9 @@
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
 #include "chainparams.h"
+#include "consensus/validation.h"
 #include "main.h"
+#include "script/sign.h"
 
 #include "test/test_sibcoin.h"
 
@@ -78,4 +80,56 @@ BOOST_AUTO_TEST_CASE(test_combiner_all)
     Test.disconnect(&ReturnTrue);
     BOOST_CHECK(Test());
 }
+
+static void CheckCoinsStatsTip()
+{
+    FlushStateToDisk();
+    CCoinsStats scanned;
+    BOOST_CHECK(pcoinsTip->GetStats(scanned));
+    LOCK(cs_main);
+    BOOST_CHECK(scanned.hashBlock == chainActive.Tip()->GetBlockHash());
+    BOOST_CHECK(coinsStatsTip.hashBlock == scanned.hashBlock);
+    BOOST_CHECK_EQUAL(coinsStatsTip.nHeight, scanned.nHeight);
+    BOOST_CHECK(coinsStatsTip.SameTotals(scanned));
+}
+
+BOOST_FIXTURE_TEST_CASE(coins_stats_incremental, TestChain100Setup)
+{
+    CheckCoinsStatsTip();
+    CCoinsStats statsBefore = coinsStatsTip;
+
+    // Spend the first coinbase into two outputs
+    CScript scriptPubKey = CScript() << ToByteVector(coinbaseKey.GetPubKey()) << OP_CHECKSIG;
+    CMutableTransaction spend;
+    spend.vin.resize(1);
+    spend.vin[0].prevout = COutPoint(coinbaseTxns[0].GetHash(), 0);
+    spend.vout.resize(2);
+    spend.vout[0].nValue = 11*CENT;
+    spend.vout[0].scriptPubKey = scriptPubKey;
+    spend.vout[1].nValue = 22*CENT;
+    spend.vout[1].scriptPubKey = scriptPubKey;
+    std::vector<unsigned char> vchSig;
+    uint256 hash = SignatureHash(scriptPubKey, spend, 0, SIGHASH_ALL);
+    BOOST_CHECK(coinbaseKey.Sign(hash, vchSig));
+    vchSig.push_back((unsigned char)SIGHASH_ALL);
+    spend.vin[0].scriptSig << vchSig;
+
+    std::vector<CMutableTransaction> txns;
+    txns.push_back(spend);
+    CBlock block = CreateAndProcessBlock(txns, scriptPubKey);
+    BOOST_CHECK(chainActive.Tip()->GetBlockHash() == block.GetHash());
+    CheckCoinsStatsTip();
+    BOOST_CHECK_EQUAL(coinsStatsTip.nTransactions, statsBefore.nTransactions + 1);
+
+    // Disconnecting the block restores the previous statistics exactly
+    {
+        LOCK(cs_main);
+        CValidationState state;
+        BOOST_CHECK(InvalidateBlock(state, Params().GetConsensus(), chainActive.Tip()));
+    }
+    CheckCoinsStatsTip();
+    BOOST_CHECK(coinsStatsTip.SameTotals(statsBefore));
+    BOOST_CHECK(coinsStatsTip.hashBlock == statsBefore.hashBlock);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -2,6 +2,7 @@
 // Distributed under the MIT software license, see the accompanying
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
+#include "streams.h"
 #include "txmempool.h"
 #include "util.h"
 
@@ -318,6 +319,211 @@ BOOST_AUTO_TEST_CASE(MempoolIndexingTest)
 }
 
 
+BOOST_AUTO_TEST_CASE(MempoolAncestorIndexingTest)
+{
+    CTxMemPool pool(CFeeRate(0));
+    TestMemPoolEntryHelper entry;
+    entry.hadNoDependencies = true;
+
+    /* 3rd highest fee */
+    CMutableTransaction tx1 = CMutableTransaction();
+    tx1.vout.resize(1);
+    tx1.vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+    tx1.vout[0].nValue = 10 * COIN;
+    pool.addUnchecked(tx1.GetHash(), entry.Fee(10000LL).Priority(10.0).FromTx(tx1));
+
+    /* highest fee */
+    CMutableTransaction tx2 = CMutableTransaction();
+    tx2.vout.resize(1);
+    tx2.vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+    tx2.vout[0].nValue = 2 * COIN;
+    pool.addUnchecked(tx2.GetHash(), entry.Fee(20000LL).Priority(9.0).FromTx(tx2));
+    uint64_t tx2Size = ::GetSerializeSize(tx2, SER_NETWORK, PROTOCOL_VERSION);
+
+    /* lowest fee */
+    CMutableTransaction tx3 = CMutableTransaction();
+    tx3.vout.resize(1);
+    tx3.vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+    tx3.vout[0].nValue = 5 * COIN;
+    pool.addUnchecked(tx3.GetHash(), entry.Fee(0LL).Priority(100.0).FromTx(tx3));
+
+    /* 2nd highest fee */
+    CMutableTransaction tx4 = CMutableTransaction();
+    tx4.vout.resize(1);
+    tx4.vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+    tx4.vout[0].nValue = 6 * COIN;
+    pool.addUnchecked(tx4.GetHash(), entry.Fee(15000LL).Priority(1.0).FromTx(tx4));
+
+    /* equal fee rate to tx1, but newer */
+    CMutableTransaction tx5 = CMutableTransaction();
+    tx5.vout.resize(1);
+    tx5.vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+    tx5.vout[0].nValue = 11 * COIN;
+    pool.addUnchecked(tx5.GetHash(), entry.Fee(10000LL).FromTx(tx5));
+    BOOST_CHECK_EQUAL(pool.size(), 5);
+
+    std::vector<std::string> sortedOrder;
+    sortedOrder.resize(5);
+    sortedOrder[0] = tx2.GetHash().ToString(); // 20000
+    sortedOrder[1] = tx4.GetHash().ToString(); // 15000
+    // tx1 and tx5 are both 10000
+    // Ties are broken by hash, not timestamp, so determine which
+    // hash comes first.
+    if (tx1.GetHash() < tx5.GetHash()) {
+        sortedOrder[2] = tx1.GetHash().ToString();
+        sortedOrder[3] = tx5.GetHash().ToString();
+    } else {
+        sortedOrder[2] = tx5.GetHash().ToString();
+        sortedOrder[3] = tx1.GetHash().ToString();
+    }
+    sortedOrder[4] = tx3.GetHash().ToString(); // 0
+
+    CheckSort<4>(pool, sortedOrder);
+
+    /* low fee parent with high fee child */
+    /* tx6 (0) -> tx7 (high) */
+    CMutableTransaction tx6 = CMutableTransaction();
+    tx6.vout.resize(1);
+    tx6.vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+    tx6.vout[0].nValue = 20 * COIN;
+    uint64_t tx6Size = ::GetSerializeSize(tx6, SER_NETWORK, PROTOCOL_VERSION);
+
+    pool.addUnchecked(tx6.GetHash(), entry.Fee(0LL).FromTx(tx6));
+    BOOST_CHECK_EQUAL(pool.size(), 6);
+    sortedOrder.push_back(tx6.GetHash().ToString());
+    CheckSort<4>(pool, sortedOrder);
+
+    CMutableTransaction tx7 = CMutableTransaction();
+    tx7.vin.resize(1);
+    tx7.vin[0].prevout = COutPoint(tx6.GetHash(), 0);
+    tx7.vin[0].scriptSig = CScript() << OP_11;
+    tx7.vout.resize(1);
+    tx7.vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+    tx7.vout[0].nValue = 10 * COIN;
+    uint64_t tx7Size = ::GetSerializeSize(tx7, SER_NETWORK, PROTOCOL_VERSION);
+
+    /* set the fee to just below tx2's feerate when including ancestor */
+    CAmount fee = (20000/tx2Size)*(tx7Size + tx6Size) - 1;
+
+    pool.addUnchecked(tx7.GetHash(), entry.Fee(fee).FromTx(tx7));
+    BOOST_CHECK_EQUAL(pool.size(), 7);
+    sortedOrder.insert(sortedOrder.begin()+1, tx7.GetHash().ToString());
+    CheckSort<4>(pool, sortedOrder);
+
+    CTxMemPool::txiter it7 = pool.mapTx.find(tx7.GetHash());
+    BOOST_CHECK_EQUAL(it7->GetCountWithAncestors(), 2);
+    BOOST_CHECK_EQUAL(it7->GetSizeWithAncestors(), tx6Size + tx7Size);
+    BOOST_CHECK_EQUAL(it7->GetModFeesWithAncestors(), fee);
+
+    /* after tx6 is mined, tx7 should move up in the sort */
+    std::vector<CTransaction> vtx;
+    vtx.push_back(tx6);
+    std::list<CTransaction> dummy;
+    pool.removeForBlock(vtx, 1, dummy, false);
+
+    it7 = pool.mapTx.find(tx7.GetHash());
+    BOOST_CHECK_EQUAL(it7->GetCountWithAncestors(), 1);
+    BOOST_CHECK_EQUAL(it7->GetSizeWithAncestors(), tx7Size);
+
+    sortedOrder.erase(sortedOrder.begin()+1);
+    sortedOrder.pop_back();
+    sortedOrder.insert(sortedOrder.begin(), tx7.GetHash().ToString());
+    CheckSort<4>(pool, sortedOrder);
+}
+
+BOOST_AUTO_TEST_CASE(MempoolReorgTest)
+{
+    CTxMemPool pool(CFeeRate(0));
+    TestMemPoolEntryHelper entry;
+
+    // A, B and C get mined and reorged back; C spends both A and B, and D
+    // spends both B and C, so A is reachable over several paths.
+    CMutableTransaction txA;
+    txA.vin.resize(1);
+    txA.vin[0].scriptSig = CScript() << OP_11;
+    txA.vout.resize(2);
+    for (int i = 0; i < 2; i++) {
+        txA.vout[i].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+        txA.vout[i].nValue = 10 * COIN;
+    }
+    CMutableTransaction txB;
+    txB.vin.resize(1);
+    txB.vin[0].prevout = COutPoint(txA.GetHash(), 0);
+    txB.vout = txA.vout;
+    CMutableTransaction txC;
+    txC.vin.resize(2);
+    txC.vin[0].prevout = COutPoint(txA.GetHash(), 1);
+    txC.vin[1].prevout = COutPoint(txB.GetHash(), 0);
+    txC.vout.resize(1);
+    txC.vout[0] = txA.vout[0];
+    CMutableTransaction txD;
+    txD.vin.resize(2);
+    txD.vin[0].prevout = COutPoint(txB.GetHash(), 1);
+    txD.vin[1].prevout = COutPoint(txC.GetHash(), 0);
+    txD.vout.resize(1);
+    txD.vout[0] = txA.vout[0];
+    CMutableTransaction txE;
+    txE.vin.resize(1);
+    txE.vin[0].prevout = COutPoint(txD.GetHash(), 0);
+    txE.vout.resize(1);
+    txE.vout[0] = txA.vout[0];
+
+    std::vector<CTransaction> vBlock;
+    vBlock.push_back(txA);
+    vBlock.push_back(txB);
+    vBlock.push_back(txC);
+    std::vector<uint256> vHashUpdate;
+    BOOST_FOREACH(const CTransaction& tx, vBlock)
+        vHashUpdate.push_back(tx.GetHash());
+
+    pool.addUnchecked(txA.GetHash(), entry.Fee(1000LL).FromTx(txA));
+    pool.addUnchecked(txB.GetHash(), entry.FromTx(txB));
+    pool.addUnchecked(txC.GetHash(), entry.FromTx(txC));
+    pool.addUnchecked(txD.GetHash(), entry.FromTx(txD));
+    pool.addUnchecked(txE.GetHash(), entry.FromTx(txE));
+
+    std::list<CTransaction> dummy;
+    pool.removeForBlock(vBlock, 1, dummy, false);
+    BOOST_CHECK_EQUAL(pool.size(), 2);
+    CTxMemPool::txiter itD = pool.mapTx.find(txD.GetHash());
+    BOOST_CHECK_EQUAL(itD->GetCountWithAncestors(), 1);
+    BOOST_CHECK(pool.GetMemPoolParents(itD).empty());
+
+    // DisconnectTip re-adds the block transactions, then fixes up the links
+    // to their in-mempool descendants
+    BOOST_FOREACH(const CTransaction& tx, vBlock) {
+        CMutableTransaction mtx(tx);
+        pool.addUnchecked(tx.GetHash(), entry.FromTx(mtx));
+    }
+    pool.UpdateTransactionsFromBlock(vHashUpdate);
+
+    CTxMemPool::txiter itA = pool.mapTx.find(txA.GetHash());
+    CTxMemPool::txiter itB = pool.mapTx.find(txB.GetHash());
+    CTxMemPool::txiter itC = pool.mapTx.find(txC.GetHash());
+    CTxMemPool::txiter itE = pool.mapTx.find(txE.GetHash());
+    itD = pool.mapTx.find(txD.GetHash());
+    BOOST_CHECK_EQUAL(itA->GetCountWithDescendants(), 5);
+    BOOST_CHECK_EQUAL(itB->GetCountWithDescendants(), 4);
+    BOOST_CHECK_EQUAL(itC->GetCountWithDescendants(), 3);
+    BOOST_CHECK_EQUAL(itD->GetCountWithAncestors(), 4);
+    BOOST_CHECK_EQUAL(itE->GetCountWithAncestors(), 5);
+    BOOST_CHECK_EQUAL(itE->GetModFeesWithAncestors(), 5000);
+    BOOST_CHECK_EQUAL(pool.GetMemPoolParents(itD).size(), 2);
+    BOOST_CHECK_EQUAL(pool.GetMemPoolChildren(itA).size(), 2);
+    BOOST_CHECK_EQUAL(pool.GetMemPoolChildren(itB).size(), 2);
+
+    CTxMemPool::setEntries setDescendants;
+    pool.CalculateDescendants(itA, setDescendants);
+    BOOST_CHECK_EQUAL(setDescendants.size(), 5);
+    CTxMemPool::setEntries setAncestors;
+    std::string dummyErr;
+    uint64_t nNoLimit = std::numeric_limits<uint64_t>::max();
+    BOOST_CHECK(pool.CalculateMemPoolAncestors(*itE, setAncestors, nNoLimit, nNoLimit, nNoLimit, nNoLimit, dummyErr, false));
+    BOOST_CHECK_EQUAL(setAncestors.size(), 4);
+    setAncestors.clear();
+    BOOST_CHECK(!pool.CalculateMemPoolAncestors(*itE, setAncestors, 4, nNoLimit, nNoLimit, nNoLimit, dummyErr, false));
+}
+
 BOOST_AUTO_TEST_CASE(MempoolSizeLimitTest)
 {
     CTxMemPool pool(CFeeRate(1000));
@@ -473,4 +679,109 @@ BOOST_AUTO_TEST_CASE(MempoolSizeLimitTest)
     SetMockTime(0);
 }
 
+BOOST_AUTO_TEST_CASE(MempoolSharedTxTest)
+{
+    CTxMemPool pool(CFeeRate(0));
+
+    CMutableTransaction tx = CMutableTransaction();
+    tx.vin.resize(1);
+    tx.vin[0].scriptSig = CScript() << OP_1;
+    tx.vout.resize(1);
+    tx.vout[0].scriptPubKey = CScript() << OP_1 << OP_EQUAL;
+    tx.vout[0].nValue = 10 * COIN;
+    CTransactionRef ptx = MakeTransactionRef(tx);
+    uint256 hash = ptx->GetHash();
+
+    BOOST_CHECK(!pool.get(hash));
+    pool.addUnchecked(hash, CTxMemPoolEntry(ptx, 1000, 0, 0.0, 1, true, 0, false, 1, LockPoints()));
+
+    // The pool keeps the transaction it was given rather than a copy
+    BOOST_CHECK(pool.get(hash) == ptx);
+    BOOST_CHECK(&pool.mapTx.find(hash)->GetTx() == ptx.get());
+
+    // A serialized shared transaction reads back as an equal transaction
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << pool.get(hash);
+    CTransactionRef ptxRead;
+    ss >> ptxRead;
+    BOOST_CHECK(ptxRead && ptxRead != ptx);
+    BOOST_CHECK(*ptxRead == *ptx);
+
+    std::list<CTransaction> removed;
+    pool.remove(*ptx, removed, false);
+    BOOST_CHECK(!pool.get(hash));
+    BOOST_CHECK(ptx.unique());
+}
+
+BOOST_AUTO_TEST_CASE(MempoolEventLogTest)
+{
+    CTxMemPool pool(CFeeRate(0));
+    TestMemPoolEntryHelper entry;
+
+    CMutableTransaction txParent;
+    txParent.vin.resize(1);
+    txParent.vin[0].scriptSig = CScript() << OP_11;
+    txParent.vout.resize(1);
+    txParent.vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+    txParent.vout[0].nValue = 33000LL;
+    CMutableTransaction txChild;
+    txChild.vin.resize(1);
+    txChild.vin[0].scriptSig = CScript() << OP_11;
+    txChild.vin[0].prevout = COutPoint(txParent.GetHash(), 0);
+    txChild.vout.resize(1);
+    txChild.vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+    txChild.vout[0].nValue = 11000LL;
+
+    uint64_t nStart = pool.GetSequence();
+    pool.addUnchecked(txParent.GetHash(), entry.FromTx(txParent));
+    pool.addUnchecked(txChild.GetHash(), entry.FromTx(txChild));
+    std::list<CTransaction> removed;
+    pool.remove(txParent, removed, true, REMOVAL_CONFLICT);
+    BOOST_CHECK_EQUAL(pool.GetSequence(), nStart + 4);
+
+    std::vector<CMemPoolEvent> vEvents;
+    BOOST_CHECK(pool.GetEvents(nStart, 100, vEvents));
+    BOOST_CHECK_EQUAL(vEvents.size(), 4);
+    BOOST_CHECK(vEvents[0].fAdded && vEvents[0].hash == txParent.GetHash());
+    BOOST_CHECK(vEvents[1].fAdded && vEvents[1].hash == txChild.GetHash());
+    for (unsigned int i = 0; i < vEvents.size(); i++) {
+        BOOST_CHECK_EQUAL(vEvents[i].nSequence, nStart + 1 + i);
+        if (i >= 2)
+            BOOST_CHECK(!vEvents[i].fAdded && vEvents[i].reason == REMOVAL_CONFLICT);
+    }
+
+    // Continuing from an event, at most nMax at a time
+    vEvents.clear();
+    BOOST_CHECK(pool.GetEvents(nStart + 2, 1, vEvents));
+    BOOST_CHECK_EQUAL(vEvents.size(), 1);
+    BOOST_CHECK_EQUAL(vEvents[0].nSequence, nStart + 3);
+    vEvents.clear();
+    BOOST_CHECK(pool.GetEvents(pool.GetSequence(), 100, vEvents));
+    BOOST_CHECK(vEvents.empty());
+
+    // Removal reasons are passed along
+    pool.addUnchecked(txParent.GetHash(), entry.Time(1).FromTx(txParent));
+    pool.Expire(2);
+    vEvents.clear();
+    BOOST_CHECK(pool.GetEvents(pool.GetSequence() - 1, 100, vEvents));
+    BOOST_CHECK_EQUAL(vEvents.size(), 1);
+    BOOST_CHECK(!vEvents[0].fAdded && vEvents[0].reason == REMOVAL_EXPIRY);
+    BOOST_CHECK_EQUAL(GetRemovalReasonName(vEvents[0].reason), "expiry");
+
+    // Events dropped from the log can't be asked for any more
+    pool.SetEventLogSize(2);
+    vEvents.clear();
+    BOOST_CHECK(!pool.GetEvents(nStart, 100, vEvents));
+    BOOST_CHECK(pool.GetEvents(pool.GetSequence() - 2, 100, vEvents));
+    BOOST_CHECK_EQUAL(vEvents.size(), 2);
+
+    // Nor can anything from before the pool was cleared
+    uint64_t nBeforeClear = pool.GetSequence();
+    pool.clear();
+    vEvents.clear();
+    BOOST_CHECK(!pool.GetEvents(nBeforeClear, 100, vEvents));
+    BOOST_CHECK(pool.GetEvents(pool.GetSequence(), 100, vEvents));
+    BOOST_CHECK(vEvents.empty());
+}
+
 BOOST_AUTO_TEST_SUITE_END()
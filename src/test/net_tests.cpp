@@ -9,6 +9,7 @@
 #include "serialize.h"
 #include "streams.h"
 #include "net.h"
+#include "random.h"
 #include "chainparams.h"
 
 using namespace std;
@@ -164,4 +165,124 @@ BOOST_AUTO_TEST_CASE(cnode_simple_test)
     BOOST_CHECK(pnode2->fFeeler == false);
 }
 
+static void AppendTestMessage(std::vector<char>& vData, const char* pszCommand, unsigned int nSize)
+{
+    std::vector<unsigned char> vPayload(nSize);
+    for (unsigned int i = 0; i < nSize; i++)
+        vPayload[i] = i * 7;
+
+    CMessageHeader hdr(Params().MessageStart(), pszCommand, nSize);
+    uint256 hash = Hash(vPayload.begin(), vPayload.end());
+    memcpy(&hdr.nChecksum, hash.begin(), CMessageHeader::CHECKSUM_SIZE);
+
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << hdr;
+    vData.insert(vData.end(), ss.begin(), ss.end());
+    vData.insert(vData.end(), vPayload.begin(), vPayload.end());
+}
+
+BOOST_AUTO_TEST_CASE(cnode_receive_in_place)
+{
+    in_addr ipv4Addr;
+    ipv4Addr.s_addr = 0xa0b0c001;
+    CAddress addr = CAddress(CService(ipv4Addr, 7777), NODE_NETWORK);
+    CNode node(INVALID_SOCKET, addr, "", true);
+
+    std::vector<char> vData;
+    AppendTestMessage(vData, NetMsgType::PING, 8);
+    AppendTestMessage(vData, NetMsgType::BLOCK, 300000);
+    AppendTestMessage(vData, NetMsgType::VERACK, 0);
+    AppendTestMessage(vData, NetMsgType::TX, 250);
+
+    LOCK(node.cs_vRecvMsg);
+    size_t nPos = 0;
+    int nInPlace = 0;
+    while (nPos < vData.size()) {
+        unsigned int nBytes = std::min((size_t)1000, vData.size() - nPos);
+        unsigned int nSpace = 0;
+        char *pchInPlace = node.GetReceiveBuffer(nSpace);
+        if (pchInPlace) {
+            nBytes = std::min(nBytes, nSpace);
+            memcpy(pchInPlace, &vData[nPos], nBytes);
+            node.ReceivedInPlace(nBytes);
+            nInPlace++;
+        } else {
+            BOOST_CHECK(node.ReceiveMsgBytes(&vData[nPos], nBytes));
+        }
+        nPos += nBytes;
+    }
+    // Most of the block was received in place, the rest was copied
+    BOOST_CHECK(nInPlace > 0);
+
+    BOOST_CHECK_EQUAL(node.vRecvMsg.size(), 4U);
+    BOOST_FOREACH(const CNetMessage& msg, node.vRecvMsg) {
+        BOOST_CHECK(msg.complete());
+        BOOST_CHECK_EQUAL(msg.vRecv.size(), msg.hdr.nMessageSize);
+        BOOST_CHECK_EQUAL(ReadLE32(msg.GetMessageHash().begin()), msg.hdr.nChecksum);
+        uint256 hash = Hash(msg.vRecv.begin(), msg.vRecv.end());
+        BOOST_CHECK(hash == msg.GetMessageHash());
+    }
+
+    // Buffers of processed messages are reused for the next ones
+    uint64_t nReuses = recvBufferPool.nReuses;
+    node.PopRecvMsgs(node.vRecvMsg.end());
+    BOOST_CHECK(node.vRecvMsg.empty());
+    vData.clear();
+    AppendTestMessage(vData, NetMsgType::TX, 250);
+    BOOST_CHECK(node.ReceiveMsgBytes(&vData[0], vData.size()));
+    BOOST_CHECK_EQUAL(recvBufferPool.nReuses, nReuses + 1);
+    BOOST_CHECK_EQUAL(ReadLE32(node.vRecvMsg.front().GetMessageHash().begin()), node.vRecvMsg.front().hdr.nChecksum);
+}
+
+BOOST_AUTO_TEST_CASE(inv_message_shared)
+{
+    in_addr ipv4Addr;
+    ipv4Addr.s_addr = 0xa0b0c001;
+    CAddress addr = CAddress(CService(ipv4Addr, 7777), NODE_NETWORK);
+    CNode node1(INVALID_SOCKET, addr, "", true);
+    CNode node2(INVALID_SOCKET, addr, "", true);
+    node1.fSendCorked = true;
+    node2.fSendCorked = true;
+
+    std::vector<CInv> vInv;
+    for (int i = 0; i < 3; i++)
+        vInv.push_back(CInv(MSG_TX, GetRandHash()));
+
+    // Relayed inventory the peer already knows about is not queued
+    node1.AddInventoryKnown(vInv[0]);
+    node1.PushRelayInventory(vInv[0]);
+    node1.PushRelayInventory(vInv[1]);
+    BOOST_CHECK_EQUAL(node1.vInventoryToRelay.size(), 1U);
+
+    CInvRelayStats statsBefore, stats;
+    GetInvRelayStats(statsBefore);
+    PushInventoryMessage(&node1, vInv);
+    PushInventoryMessage(&node2, vInv);
+    GetInvRelayStats(stats);
+    BOOST_CHECK_EQUAL(stats.nInvMsgsSent, statsBefore.nInvMsgsSent + 2);
+    BOOST_CHECK_EQUAL(stats.nInvMsgsShared, statsBefore.nInvMsgsShared + 1);
+    BOOST_CHECK_EQUAL(stats.nInvsSent, statsBefore.nInvsSent + 6);
+
+    // Both peers got the same complete message
+    LOCK2(node1.cs_vSend, node2.cs_vSend);
+    int nLane = GetSendLane(NetMsgType::INV);
+    BOOST_CHECK_EQUAL(node1.vSendMsg[nLane].size(), 1U);
+    BOOST_CHECK_EQUAL(node2.vSendMsg[nLane].size(), 1U);
+    const CSerializeData& vchMessage = node1.vSendMsg[nLane].front().second;
+    BOOST_CHECK(vchMessage == node2.vSendMsg[nLane].front().second);
+    BOOST_CHECK_EQUAL(stats.nInvBytesSent, statsBefore.nInvBytesSent + 2 * vchMessage.size());
+
+    CDataStream ss(vchMessage.begin(), vchMessage.end(), SER_NETWORK, PROTOCOL_VERSION);
+    CMessageHeader hdr(Params().MessageStart());
+    ss >> hdr;
+    BOOST_CHECK(hdr.IsValid(Params().MessageStart()));
+    BOOST_CHECK_EQUAL(hdr.GetCommand(), NetMsgType::INV);
+    BOOST_CHECK_EQUAL(hdr.nMessageSize, ss.size());
+    uint256 hash = Hash(ss.begin(), ss.end());
+    BOOST_CHECK_EQUAL(ReadLE32(hash.begin()), hdr.nChecksum);
+    std::vector<CInv> vInvRead;
+    ss >> vInvRead;
+    BOOST_CHECK(vInvRead == vInv);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -2,13 +2,16 @@
 // Distributed under the MIT software license, see the accompanying
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
+#include "clientversion.h"
 #include "policy/fees.h"
+#include "streams.h"
 #include "txmempool.h"
 #include "uint256.h"
 #include "util.h"
 
 #include "test/test_sibcoin.h"
 
+#include <boost/foreach.hpp>
 #include <boost/test/unit_test.hpp>
 
 BOOST_FIXTURE_TEST_SUITE(policyestimator_tests, BasicTestingSetup)
@@ -18,26 +21,17 @@ BOOST_AUTO_TEST_CASE(BlockPolicyEstimates)
     CTxMemPool mpool(CFeeRate(10000)); // we have 10x higher fee
     TestMemPoolEntryHelper entry;
     CAmount basefee(20000); // we have 10x higher fee
-    double basepri = 1e6;
     CAmount deltaFee(1000); // we have 10x higher fee
-    double deltaPri=5e5;
-    std::vector<CAmount> feeV[2];
-    std::vector<double> priV[2];
+    std::vector<CAmount> feeV;
 
-    // Populate vectors of increasing fees or priorities
+    // Populate vector of increasing fees
     for (int j = 0; j < 10; j++) {
-        //V[0] is for fee transactions
-        feeV[0].push_back(basefee * (j+1));
-        priV[0].push_back(0);
-        //V[1] is for priority transactions
-        feeV[1].push_back(CAmount(0));
-        priV[1].push_back(basepri * pow(10, j+1));
+        feeV.push_back(basefee * (j+1));
     }
 
     // Store the hashes of transactions that have been
-    // added to the mempool by their associate fee/pri
-    // txHashes[j] is populated with transactions either of
-    // fee = basefee * (j+1)  OR  pri = 10^6 * 10^(j+1)
+    // added to the mempool by their associate fee
+    // txHashes[j] is populated with transactions of fee = basefee * (j+1)
     std::vector<uint256> txHashes[10];
 
     // Create a transaction template
@@ -57,22 +51,22 @@ BOOST_AUTO_TEST_CASE(BlockPolicyEstimates)
     int blocknum = 0;
 
     // Loop through 200 blocks
-    // At a decay .998 and 4 fee transactions per block
-    // This makes the tx count about 1.33 per bucket, above the 1 threshold
+    // At a decay .962 and 4 fee transactions per block
+    // This makes the tx count about 105 per bucket in the short horizon, above the 13 threshold
     while (blocknum < 200) {
-        for (int j = 0; j < 10; j++) { // For each fee/pri multiple
-            for (int k = 0; k < 5; k++) { // add 4 fee txs for every priority tx
+        for (int j = 0; j < 10; j++) { // For each fee
+            for (int k = 0; k < 4; k++) { // add 4 fee txs
                 tx.vin[0].prevout.n = 10000*blocknum+100*j+k; // make transaction unique
                 uint256 hash = tx.GetHash();
-                mpool.addUnchecked(hash, entry.Fee(feeV[k/4][j]).Time(GetTime()).Priority(priV[k/4][j]).Height(blocknum).FromTx(tx, &mpool));
+                mpool.addUnchecked(hash, entry.Fee(feeV[j]).Time(GetTime()).Height(blocknum).FromTx(tx, &mpool));
                 txHashes[j].push_back(hash);
             }
         }
-        //Create blocks where higher fee/pri txs are included more often
+        //Create blocks where higher fee txs are included more often
         for (int h = 0; h <= blocknum%10; h++) {
-            // 10/10 blocks add highest fee/pri transactions
+            // 10/10 blocks add highest fee transactions
             // 9/10 blocks add 2nd highest and so on until ...
-            // 1/10 blocks add lowest fee/pri transactions
+            // 1/10 blocks add lowest fee transactions
             while (txHashes[9-h].size()) {
                 CTransaction btx;
                 if (mpool.lookup(txHashes[9-h].back(), btx))
@@ -82,66 +76,65 @@ BOOST_AUTO_TEST_CASE(BlockPolicyEstimates)
         }
         mpool.removeForBlock(block, ++blocknum, dummyConflicted);
         block.clear();
-        if (blocknum == 30) {
-            // At this point we should need to combine 5 buckets to get enough data points
-            // So estimateFee(1,2,3) should fail and estimateFee(4) should return somewhere around
-            // 8*baserate.  estimateFee(4) %'s are 100,100,100,100,90 = average 98%
+        if (blocknum == 2) {
+            // At this point each bucket has only seen about 8 transactions, the
+            // short horizon needs 13, so the 2 highest buckets are combined.
+            // Those txs are 100% and 90% confirmed within 1 block, so the
+            // estimate for 1 block fails and the one for 2 blocks is the
+            // median of the 2 buckets.
             BOOST_CHECK(mpool.estimateFee(1) == CFeeRate(0));
-            BOOST_CHECK(mpool.estimateFee(2) == CFeeRate(0));
-            BOOST_CHECK(mpool.estimateFee(3) == CFeeRate(0));
-            BOOST_CHECK(mpool.estimateFee(4).GetFeePerK() < 8*baseRate.GetFeePerK() + deltaFee);
-            BOOST_CHECK(mpool.estimateFee(4).GetFeePerK() > 8*baseRate.GetFeePerK() - deltaFee);
+            BOOST_CHECK(mpool.estimateFee(2).GetFeePerK() > 9*baseRate.GetFeePerK() - deltaFee);
             int answerFound;
-            BOOST_CHECK(mpool.estimateSmartFee(1, &answerFound) == mpool.estimateFee(4) && answerFound == 4);
-            BOOST_CHECK(mpool.estimateSmartFee(3, &answerFound) == mpool.estimateFee(4) && answerFound == 4);
-            BOOST_CHECK(mpool.estimateSmartFee(4, &answerFound) == mpool.estimateFee(4) && answerFound == 4);
-            BOOST_CHECK(mpool.estimateSmartFee(8, &answerFound) == mpool.estimateFee(8) && answerFound == 8);
+            BOOST_CHECK(mpool.estimateSmartFee(1, &answerFound) == mpool.estimateFee(2) && answerFound == 2);
+            BOOST_CHECK(mpool.estimateSmartFee(2, &answerFound) == mpool.estimateFee(2) && answerFound == 2);
         }
     }
 
     std::vector<CAmount> origFeeEst;
-    std::vector<double> origPriEst;
     // Highest feerate is 10*baseRate and gets in all blocks,
     // second highest feerate is 9*baseRate and gets in 9/10 blocks = 90%,
     // third highest feerate is 8*base rate, and gets in 8/10 blocks = 80%,
     // so estimateFee(1) should return 10*baseRate.
     // Second highest feerate has 100% chance of being included by 2 blocks,
     // so estimateFee(2) should return 9*baseRate etc...
-    for (int i = 1; i < 10;i++) {
+    // Every transaction is included within 10 blocks, so the medium and long
+    // horizons return the lowest feerate.
+    for (int i = 1; i < 50; i++) {
         origFeeEst.push_back(mpool.estimateFee(i).GetFeePerK());
-        origPriEst.push_back(mpool.estimatePriority(i));
         if (i > 1) { // Fee estimates should be monotonically decreasing
             BOOST_CHECK(origFeeEst[i-1] <= origFeeEst[i-2]);
-            BOOST_CHECK(origPriEst[i-1] <= origPriEst[i-2]);
         }
-        int mult = 11-i;
+        int mult = std::max(11-i, 1);
         BOOST_CHECK(origFeeEst[i-1] < mult*baseRate.GetFeePerK() + deltaFee);
         BOOST_CHECK(origFeeEst[i-1] > mult*baseRate.GetFeePerK() - deltaFee);
-        BOOST_CHECK(origPriEst[i-1] < pow(10,mult) * basepri + deltaPri);
-        BOOST_CHECK(origPriEst[i-1] > pow(10,mult) * basepri - deltaPri);
+        int answerFound;
+        BOOST_CHECK(mpool.estimateSmartFee(i, &answerFound) == mpool.estimateFee(i) && answerFound == i);
     }
+    BOOST_CHECK(mpool.estimateFee(500).GetFeePerK() < baseRate.GetFeePerK() + deltaFee);
+    BOOST_CHECK(mpool.estimateFee(500).GetFeePerK() > baseRate.GetFeePerK() - deltaFee);
+    BOOST_CHECK(mpool.estimateFee(1008) == mpool.estimateFee(500));
+    BOOST_CHECK(mpool.estimateFee(1009) == CFeeRate(0));
+    BOOST_CHECK(mpool.estimateSmartFee(1009) == CFeeRate(0));
 
-    // Mine 50 more blocks with no transactions happening, estimates shouldn't change
+    // Mine 20 more blocks with no transactions happening, estimates shouldn't change
     // We haven't decayed the moving average enough so we still have enough data points in every bucket
-    while (blocknum < 250)
+    while (blocknum < 220)
         mpool.removeForBlock(block, ++blocknum, dummyConflicted);
 
-    for (int i = 1; i < 10;i++) {
+    for (int i = 1; i < 50; i++) {
         BOOST_CHECK(mpool.estimateFee(i).GetFeePerK() < origFeeEst[i-1] + deltaFee);
         BOOST_CHECK(mpool.estimateFee(i).GetFeePerK() > origFeeEst[i-1] - deltaFee);
-        BOOST_CHECK(mpool.estimatePriority(i) < origPriEst[i-1] + deltaPri);
-        BOOST_CHECK(mpool.estimatePriority(i) > origPriEst[i-1] - deltaPri);
     }
 
 
     // Mine 15 more blocks with lots of transactions happening and not getting mined
     // Estimates should go up
-    while (blocknum < 265) {
-        for (int j = 0; j < 10; j++) { // For each fee/pri multiple
-            for (int k = 0; k < 5; k++) { // add 4 fee txs for every priority tx
+    while (blocknum < 235) {
+        for (int j = 0; j < 10; j++) { // For each fee multiple
+            for (int k = 0; k < 4; k++) { // add 4 fee txs
                 tx.vin[0].prevout.n = 10000*blocknum+100*j+k;
                 uint256 hash = tx.GetHash();
-                mpool.addUnchecked(hash, entry.Fee(feeV[k/4][j]).Time(GetTime()).Priority(priV[k/4][j]).Height(blocknum).FromTx(tx, &mpool));
+                mpool.addUnchecked(hash, entry.Fee(feeV[j]).Time(GetTime()).Height(blocknum).FromTx(tx, &mpool));
                 txHashes[j].push_back(hash);
             }
         }
@@ -149,11 +142,11 @@ BOOST_AUTO_TEST_CASE(BlockPolicyEstimates)
     }
 
     int answerFound;
-    for (int i = 1; i < 10;i++) {
+    for (int i = 1; i < 50; i++) {
         BOOST_CHECK(mpool.estimateFee(i) == CFeeRate(0) || mpool.estimateFee(i).GetFeePerK() > origFeeEst[i-1] - deltaFee);
-        BOOST_CHECK(mpool.estimateSmartFee(i, &answerFound).GetFeePerK() > origFeeEst[answerFound-1] - deltaFee);
-        BOOST_CHECK(mpool.estimatePriority(i) == -1 || mpool.estimatePriority(i) > origPriEst[i-1] - deltaPri);
-        BOOST_CHECK(mpool.estimateSmartPriority(i, &answerFound) > origPriEst[answerFound-1] - deltaPri);
+        CFeeRate smartFee = mpool.estimateSmartFee(i, &answerFound);
+        BOOST_CHECK(answerFound >= i && answerFound < 50);
+        BOOST_CHECK(smartFee.GetFeePerK() > origFeeEst[answerFound-1] - deltaFee);
     }
 
     // Mine all those transactions
@@ -166,21 +159,20 @@ BOOST_AUTO_TEST_CASE(BlockPolicyEstimates)
             txHashes[j].pop_back();
         }
     }
-    mpool.removeForBlock(block, 265, dummyConflicted);
+    mpool.removeForBlock(block, 235, dummyConflicted);
     block.clear();
     for (int i = 1; i < 10;i++) {
         BOOST_CHECK(mpool.estimateFee(i).GetFeePerK() > origFeeEst[i-1] - deltaFee);
-        BOOST_CHECK(mpool.estimatePriority(i) > origPriEst[i-1] - deltaPri);
     }
 
     // Mine 200 more blocks where everything is mined every block
     // Estimates should be below original estimates
-    while (blocknum < 465) {
-        for (int j = 0; j < 10; j++) { // For each fee/pri multiple
-            for (int k = 0; k < 5; k++) { // add 4 fee txs for every priority tx
+    while (blocknum < 435) {
+        for (int j = 0; j < 10; j++) { // For each fee multiple
+            for (int k = 0; k < 4; k++) { // add 4 fee txs
                 tx.vin[0].prevout.n = 10000*blocknum+100*j+k;
                 uint256 hash = tx.GetHash();
-                mpool.addUnchecked(hash, entry.Fee(feeV[k/4][j]).Time(GetTime()).Priority(priV[k/4][j]).Height(blocknum).FromTx(tx, &mpool));
+                mpool.addUnchecked(hash, entry.Fee(feeV[j]).Time(GetTime()).Height(blocknum).FromTx(tx, &mpool));
                 CTransaction btx;
                 if (mpool.lookup(hash, btx))
                     block.push_back(btx);
@@ -191,15 +183,17 @@ BOOST_AUTO_TEST_CASE(BlockPolicyEstimates)
     }
     for (int i = 1; i < 10; i++) {
         BOOST_CHECK(mpool.estimateFee(i).GetFeePerK() < origFeeEst[i-1] - deltaFee);
-        BOOST_CHECK(mpool.estimatePriority(i) < origPriEst[i-1] - deltaPri);
+        // Priority is not estimated anymore
+        BOOST_CHECK(mpool.estimatePriority(i) == -1);
+        BOOST_CHECK(mpool.estimateSmartPriority(i) == -1);
     }
 
     // Test that if the mempool is limited, estimateSmartFee won't return a value below the mempool min fee
     // and that estimateSmartPriority returns essentially an infinite value
-    mpool.addUnchecked(tx.GetHash(),  entry.Fee(feeV[0][5]).Time(GetTime()).Priority(priV[1][5]).Height(blocknum).FromTx(tx, &mpool));
-    // evict that transaction which should set a mempool min fee of minRelayTxFee + feeV[0][5]
+    mpool.addUnchecked(tx.GetHash(),  entry.Fee(feeV[5]).Time(GetTime()).Height(blocknum).FromTx(tx, &mpool));
+    // evict that transaction which should set a mempool min fee of minRelayTxFee + feeV[5]
     mpool.TrimToSize(1);
-    BOOST_CHECK(mpool.GetMinFee(1).GetFeePerK() > feeV[0][5]);
+    BOOST_CHECK(mpool.GetMinFee(1).GetFeePerK() > feeV[5]);
     for (int i = 1; i < 10; i++) {
         BOOST_CHECK(mpool.estimateSmartFee(i).GetFeePerK() >= mpool.estimateFee(i).GetFeePerK());
         BOOST_CHECK(mpool.estimateSmartFee(i).GetFeePerK() >= mpool.GetMinFee(1).GetFeePerK());
@@ -207,4 +201,56 @@ BOOST_AUTO_TEST_CASE(BlockPolicyEstimates)
     }
 }
 
+BOOST_AUTO_TEST_CASE(BlockPolicyEstimatesFile)
+{
+    CTxMemPool mpool(CFeeRate(10000));
+    TestMemPoolEntryHelper entry;
+    std::list<CTransaction> dummyConflicted;
+    std::vector<CTransaction> block;
+    CMutableTransaction tx;
+    tx.vin.resize(1);
+    tx.vout.resize(1);
+    tx.vout[0].nValue = 0;
+
+    // Transactions paying more are mined sooner
+    std::vector<uint256> vHashes[10];
+    for (int blocknum = 0; blocknum < 100; blocknum++) {
+        for (int j = 0; j < 10; j++) {
+            tx.vin[0].prevout.n = 100*blocknum+j;
+            mpool.addUnchecked(tx.GetHash(), entry.Fee(10000 * (j+1)).Height(blocknum).FromTx(tx, &mpool));
+            vHashes[j].push_back(tx.GetHash());
+            if (blocknum % (10-j) == 0) {
+                BOOST_FOREACH(const uint256& hash, vHashes[j]) {
+                    CTransaction btx;
+                    if (mpool.lookup(hash, btx))
+                        block.push_back(btx);
+                }
+                vHashes[j].clear();
+            }
+        }
+        mpool.removeForBlock(block, blocknum + 1, dummyConflicted);
+        block.clear();
+    }
+    BOOST_CHECK(mpool.estimateFee(1) > CFeeRate(0));
+
+    // The estimates survive a round trip through a file
+    CAutoFile file(tmpfile(), SER_DISK, CLIENT_VERSION);
+    BOOST_CHECK(mpool.WriteFeeEstimates(file));
+    rewind(file.Get());
+    CTxMemPool mpoolRead(CFeeRate(10000));
+    BOOST_CHECK(mpoolRead.ReadFeeEstimates(file));
+    for (int i = 1; i <= 1008; i++) {
+        CAmount nDiff = mpoolRead.estimateFee(i).GetFeePerK() - mpool.estimateFee(i).GetFeePerK();
+        BOOST_CHECK(nDiff >= -1 && nDiff <= 1);
+    }
+
+    // Files in the format written before FEE_ESTIMATES_VERSION are ignored
+    CAutoFile fileOld(tmpfile(), SER_DISK, CLIENT_VERSION);
+    fileOld << 120000 << CLIENT_VERSION << 0;
+    rewind(fileOld.Get());
+    CTxMemPool mpoolOld(CFeeRate(10000));
+    BOOST_CHECK(!mpoolOld.ReadFeeEstimates(fileOld));
+    BOOST_CHECK(mpoolOld.estimateFee(1) == CFeeRate(0));
+}
+
 BOOST_AUTO_TEST_SUITE_END()
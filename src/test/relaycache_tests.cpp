@@ -0,0 +1,103 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "relaycache.h"
+#include "random.h"
+
+#include "test/test_sibcoin.h"
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_FIXTURE_TEST_SUITE(relaycache_tests, BasicTestingSetup)
+
+static CTransactionRef MakeTestTransaction(size_t nScriptSize)
+{
+    CMutableTransaction tx;
+    tx.vin.resize(1);
+    tx.vin[0].prevout.hash = GetRandHash();
+    tx.vin[0].scriptSig.resize(nScriptSize);
+    tx.vout.resize(1);
+    tx.vout[0].nValue = 42;
+    return MakeTransactionRef(tx);
+}
+
+BOOST_AUTO_TEST_CASE(relaycache_find)
+{
+    CRelayCache cache;
+    CTransactionRef ptx = MakeTestTransaction(100);
+    cache.Insert(ptx, 1000);
+
+    // The cache shares the transaction, it does not copy it
+    BOOST_CHECK(cache.Find(ptx->GetHash()) == ptx);
+    BOOST_CHECK(!cache.Find(GetRandHash()));
+
+    CRelayCacheStats stats;
+    cache.GetStats(stats);
+    BOOST_CHECK_EQUAL(stats.nEntries, 1U);
+    BOOST_CHECK_EQUAL(stats.nHits, 1U);
+    BOOST_CHECK_EQUAL(stats.nMisses, 1U);
+    BOOST_CHECK(stats.nBytes > 100);
+
+    // Inserting it again changes nothing
+    cache.Insert(ptx, 1001);
+    CRelayCacheStats stats2;
+    cache.GetStats(stats2);
+    BOOST_CHECK_EQUAL(stats2.nEntries, 1U);
+    BOOST_CHECK_EQUAL(stats2.nBytes, stats.nBytes);
+
+    cache.Clear();
+    BOOST_CHECK(!cache.Find(ptx->GetHash()));
+}
+
+BOOST_AUTO_TEST_CASE(relaycache_expiry)
+{
+    CRelayCache cache(DEFAULT_RELAY_CACHE_BYTES, 60);
+    std::vector<CTransactionRef> vtx;
+    for (int i = 0; i < 200; i++) {
+        vtx.push_back(MakeTestTransaction(100));
+        cache.Insert(vtx.back(), 1000);
+    }
+    for (int i = 0; i < 200; i++)
+        BOOST_CHECK(cache.Find(vtx[i]->GetHash()));
+
+    // Entries expire when a later insert into their shard comes by
+    for (int i = 0; i < 200; i++)
+        cache.Insert(MakeTestTransaction(100), 1061);
+    CRelayCacheStats stats;
+    cache.GetStats(stats);
+    BOOST_CHECK_EQUAL(stats.nEntries, 200U);
+    for (int i = 0; i < 200; i++)
+        BOOST_CHECK(!cache.Find(vtx[i]->GetHash()));
+}
+
+BOOST_AUTO_TEST_CASE(relaycache_budget)
+{
+    const size_t nMaxBytes = CRelayCache::SHARDS * 20000;
+    CRelayCache cache(nMaxBytes);
+    std::vector<CTransactionRef> vtx;
+    for (int i = 0; i < 2000; i++) {
+        vtx.push_back(MakeTestTransaction(1000));
+        cache.Insert(vtx.back(), 1000 + i);
+    }
+
+    CRelayCacheStats stats;
+    cache.GetStats(stats);
+    BOOST_CHECK(stats.nBytes <= nMaxBytes);
+    BOOST_CHECK(stats.nBytes > nMaxBytes / 2);
+    BOOST_CHECK(stats.nEntries < 2000U);
+
+    // The newest transactions stayed, the oldest were dropped
+    BOOST_CHECK(cache.Find(vtx.back()->GetHash()));
+    BOOST_CHECK(!cache.Find(vtx.front()->GetHash()));
+
+    // A transaction too large for a shard is not kept at all
+    CTransactionRef ptxLarge = MakeTestTransaction(50000);
+    cache.Insert(ptxLarge, 5000);
+    BOOST_CHECK(!cache.Find(ptxLarge->GetHash()));
+    CRelayCacheStats stats2;
+    cache.GetStats(stats2);
+    BOOST_CHECK_EQUAL(stats2.nEntries, stats.nEntries);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,134 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "chainparams.h"
+#include "consensus/merkle.h"
+#include "main.h"
+#include "miner.h"
+#include "templateengine.h"
+#include "txmempool.h"
+
+#include "test/test_sibcoin.h"
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_FIXTURE_TEST_SUITE(templateengine_tests, TestingSetup)
+
+static CMutableTransaction SpendOutput(const uint256& hash, CAmount nValue)
+{
+    CMutableTransaction tx;
+    tx.vin.resize(1);
+    tx.vin[0].prevout = COutPoint(hash, 0);
+    tx.vin[0].scriptSig = CScript() << OP_1;
+    tx.vout.resize(1);
+    tx.vout[0].scriptPubKey = CScript() << OP_TRUE;
+    tx.vout[0].nValue = nValue;
+    return tx;
+}
+
+BOOST_AUTO_TEST_CASE(templateengine_incremental)
+{
+    LOCK(cs_main);
+    TestMemPoolEntryHelper entry;
+    CBlockTemplateEngine engine(Params(), mempool);
+    CBlockTemplateEngineStats stats;
+
+    // The first template is built from scratch
+    boost::shared_ptr<const CBlockTemplate> ptemplate0 = engine.GetTemplate();
+    BOOST_CHECK_EQUAL(ptemplate0->block.vtx.size(), 1);
+    CAmount nCoinbaseValue = ptemplate0->block.vtx[0].GetValueOut();
+    BOOST_CHECK(engine.GetTemplate() == ptemplate0);
+
+    // A parent and its child are appended without a rebuild
+    CMutableTransaction parent = SpendOutput(GetRandHash(), 10 * COIN);
+    mempool.addUnchecked(parent.GetHash(), entry.Fee(10000).FromTx(parent));
+    CMutableTransaction child = SpendOutput(parent.GetHash(), 9 * COIN);
+    mempool.addUnchecked(child.GetHash(), entry.Fee(20000).FromTx(child));
+
+    boost::shared_ptr<const CBlockTemplate> ptemplate1 = engine.GetTemplate();
+    BOOST_CHECK_EQUAL(ptemplate1->block.vtx.size(), 3);
+    BOOST_CHECK(ptemplate1->block.vtx[1].GetHash() == parent.GetHash());
+    BOOST_CHECK(ptemplate1->block.vtx[2].GetHash() == child.GetHash());
+    BOOST_CHECK_EQUAL(ptemplate1->block.vtx[0].GetValueOut(), nCoinbaseValue + 30000);
+    BOOST_CHECK_EQUAL(ptemplate1->vTxFees[0], -30000);
+    BOOST_CHECK(ptemplate1->block.hashMerkleRoot == BlockMerkleRoot(ptemplate1->block));
+    // Snapshots handed out earlier are not modified
+    BOOST_CHECK_EQUAL(ptemplate0->block.vtx.size(), 1);
+
+    // A child whose parent is not in the template waits for a rebuild
+    CMutableTransaction freeParent = SpendOutput(GetRandHash(), 10 * COIN);
+    mempool.addUnchecked(freeParent.GetHash(), entry.Fee(0).FromTx(freeParent));
+    CMutableTransaction cpfpChild = SpendOutput(freeParent.GetHash(), 9 * COIN);
+    mempool.addUnchecked(cpfpChild.GetHash(), entry.Fee(100000).FromTx(cpfpChild));
+    BOOST_CHECK_EQUAL(engine.GetTemplate()->block.vtx.size(), 3);
+    engine.GetStats(stats);
+    BOOST_CHECK_EQUAL(stats.nTxDeferred, 1);
+
+    // Removing a transaction drops what spends it as well
+    std::list<CTransaction> removed;
+    mempool.remove(parent, removed, true);
+    BOOST_CHECK_EQUAL(removed.size(), 2);
+    boost::shared_ptr<const CBlockTemplate> ptemplate2 = engine.GetTemplate();
+    BOOST_CHECK_EQUAL(ptemplate2->block.vtx.size(), 1);
+    BOOST_CHECK_EQUAL(ptemplate2->block.vtx[0].GetValueOut(), nCoinbaseValue);
+    BOOST_CHECK(ptemplate2->vCoinbaseMerkleBranch.empty());
+    BOOST_CHECK(ptemplate2->block.hashMerkleRoot == ptemplate2->block.vtx[0].GetHash());
+    BOOST_CHECK_EQUAL(ptemplate1->block.vtx.size(), 3);
+
+    engine.GetStats(stats);
+    BOOST_CHECK_EQUAL(stats.nHeight, chainActive.Height() + 1);
+    BOOST_CHECK_EQUAL(stats.nTemplateTx, 0);
+    BOOST_CHECK_EQUAL(stats.nFullRebuilds, 1);
+    BOOST_CHECK_EQUAL(stats.nIncrementalUpdates, 2);
+    BOOST_CHECK_EQUAL(stats.nTxAdded, 2);
+    BOOST_CHECK_EQUAL(stats.nTxRemoved, 2);
+    BOOST_CHECK_EQUAL(stats.rebuild.nCount, 1);
+    BOOST_CHECK_EQUAL(stats.update.nCount, 2);
+    BOOST_CHECK_EQUAL(stats.serve.nCount, 5);
+
+    mempool.clear();
+}
+
+BOOST_AUTO_TEST_CASE(coinbase_merkle_branch)
+{
+    LOCK(cs_main);
+    CBlockTemplate tmpl;
+    tmpl.block.vtx.resize(1);
+    for (int i = 0; i < 11; i++)
+        tmpl.block.vtx.push_back(SpendOutput(GetRandHash(), COIN));
+    tmpl.vTxFees.resize(tmpl.block.vtx.size());
+    tmpl.vTxSigOps.resize(tmpl.block.vtx.size());
+    tmpl.vCoinbaseMerkleBranch = BlockMerkleBranch(tmpl.block, 0);
+    FillCoinbase(&tmpl, chainActive.Tip(), 0, CScript() << OP_TRUE);
+    BOOST_CHECK_EQUAL(tmpl.vCoinbaseMerkleBranch.size(), 4);
+    BOOST_CHECK(tmpl.block.hashMerkleRoot == BlockMerkleRoot(tmpl.block));
+
+    // Rolling the extra nonce through the branch matches a full recomputation
+    CBlock block = tmpl.block;
+    unsigned int nExtraNonce = 0;
+    IncrementExtraNonce(&tmpl, chainActive.Tip(), nExtraNonce);
+    nExtraNonce = 0;
+    IncrementExtraNonce(&block, chainActive.Tip(), nExtraNonce);
+    BOOST_CHECK(tmpl.block.vtx[0].GetHash() == block.vtx[0].GetHash());
+    BOOST_CHECK(tmpl.block.hashMerkleRoot == block.hashMerkleRoot);
+    BOOST_CHECK(tmpl.block.hashMerkleRoot == BlockMerkleRoot(tmpl.block));
+}
+
+BOOST_AUTO_TEST_CASE(latency_histogram)
+{
+    CLatencyHistogram histogram;
+    histogram.Add(0);
+    histogram.Add(1);
+    histogram.Add(1000);
+    histogram.Add(1023);
+    histogram.Add((int64_t)1 << 40);
+    BOOST_CHECK_EQUAL(histogram.nCount, 5);
+    BOOST_CHECK_EQUAL(histogram.vBuckets[0], 1);
+    BOOST_CHECK_EQUAL(histogram.vBuckets[1], 1);
+    BOOST_CHECK_EQUAL(histogram.vBuckets[10], 2);
+    BOOST_CHECK_EQUAL(histogram.vBuckets[CLatencyHistogram::BUCKETS - 1], 1);
+    BOOST_CHECK_EQUAL(histogram.nMaxMicros, (int64_t)1 << 40);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -9,11 +9,13 @@
 #include "pubkey.h"
 #include "txmempool.h"
 #include "random.h"
+#include "script/sigcache.h"
 #include "script/standard.h"
 #include "test/test_sibcoin.h"
 #include "utiltime.h"
 
 #include <boost/test/unit_test.hpp>
+#include <boost/thread.hpp>
 
 BOOST_AUTO_TEST_SUITE(tx_validationcache_tests)
 
@@ -83,4 +85,219 @@ BOOST_FIXTURE_TEST_CASE(tx_mempool_block_doublespend, TestChain100Setup)
     BOOST_CHECK_EQUAL(mempool.size(), 0);
 }
 
+BOOST_FIXTURE_TEST_CASE(checkinputs_script_execution_cache, TestChain100Setup)
+{
+    // Scripts that fully validated under some flags are remembered, and only
+    // for those flags.
+    CScript scriptPubKey = CScript() <<  ToByteVector(coinbaseKey.GetPubKey()) << OP_CHECKSIG;
+
+    CMutableTransaction spend;
+    spend.vin.resize(1);
+    spend.vin[0].prevout.hash = coinbaseTxns[0].GetHash();
+    spend.vin[0].prevout.n = 0;
+    spend.vout.resize(1);
+    spend.vout[0].nValue = 11*CENT;
+    spend.vout[0].scriptPubKey = scriptPubKey;
+
+    std::vector<unsigned char> vchSig;
+    uint256 hash = SignatureHash(scriptPubKey, spend, 0, SIGHASH_ALL);
+    BOOST_CHECK(coinbaseKey.Sign(hash, vchSig));
+    vchSig.push_back((unsigned char)SIGHASH_ALL);
+    spend.vin[0].scriptSig << vchSig;
+
+    // Same inputs, but the signature no longer commits to the outputs
+    CMutableTransaction badSpendMutable = spend;
+    badSpendMutable.vout[0].nValue = 12*CENT;
+
+    CTransaction spendTx(spend), badSpend(badSpendMutable);
+    PrecomputedTransactionData txdata(spendTx), badTxdata(badSpend);
+
+    LOCK(cs_main);
+    CCoinsViewCache view(pcoinsTip);
+    CValidationState state;
+    CSetAssociativeCacheStats before, after;
+
+    GetScriptExecutionCacheStats(before);
+    BOOST_CHECK(CheckInputs(spendTx, state, view, true, SCRIPT_VERIFY_P2SH, true, true, txdata));
+    GetScriptExecutionCacheStats(after);
+    BOOST_CHECK_EQUAL(after.nInserts, before.nInserts + 1);
+
+    // Cached: no script execution, only a lookup
+    before = after;
+    BOOST_CHECK(CheckInputs(spendTx, state, view, true, SCRIPT_VERIFY_P2SH, true, true, txdata));
+    GetScriptExecutionCacheStats(after);
+    BOOST_CHECK_EQUAL(after.nHits, before.nHits + 1);
+    BOOST_CHECK_EQUAL(after.nInserts, before.nInserts);
+
+    // Other flags are not covered by the cached result
+    before = after;
+    BOOST_CHECK(CheckInputs(spendTx, state, view, true, SCRIPT_VERIFY_P2SH | SCRIPT_VERIFY_DERSIG, true, false, txdata));
+    GetScriptExecutionCacheStats(after);
+    BOOST_CHECK_EQUAL(after.nHits, before.nHits);
+    BOOST_CHECK_EQUAL(after.nInserts, before.nInserts);
+
+    // Failures are never cached
+    before = after;
+    BOOST_CHECK(!CheckInputs(badSpend, state, view, true, SCRIPT_VERIFY_P2SH, true, true, badTxdata));
+    GetScriptExecutionCacheStats(after);
+    BOOST_CHECK_EQUAL(after.nInserts, before.nInserts);
+
+    // Deferred checks have not run yet, so they are not cached either
+    std::vector<CScriptCheck> vChecks;
+    before = after;
+    BOOST_CHECK(CheckInputs(badSpend, state, view, true, SCRIPT_VERIFY_P2SH | SCRIPT_VERIFY_DERSIG, true, true, badTxdata, &vChecks));
+    GetScriptExecutionCacheStats(after);
+    BOOST_CHECK_EQUAL(vChecks.size(), 1);
+    BOOST_CHECK_EQUAL(after.nInserts, before.nInserts);
+}
+
+BOOST_FIXTURE_TEST_CASE(tx_mempool_block_script_execution_cache, TestChain100Setup)
+{
+    // A transaction accepted to the memory pool is found in the script
+    // execution cache when the block including it is connected.
+    CScript scriptPubKey = CScript() <<  ToByteVector(coinbaseKey.GetPubKey()) << OP_CHECKSIG;
+
+    std::vector<CMutableTransaction> spends;
+    spends.resize(1);
+    spends[0].vin.resize(1);
+    spends[0].vin[0].prevout.hash = coinbaseTxns[0].GetHash();
+    spends[0].vin[0].prevout.n = 0;
+    spends[0].vout.resize(1);
+    spends[0].vout[0].nValue = 11*CENT;
+    spends[0].vout[0].scriptPubKey = scriptPubKey;
+
+    std::vector<unsigned char> vchSig;
+    uint256 hash = SignatureHash(scriptPubKey, spends[0], 0, SIGHASH_ALL);
+    BOOST_CHECK(coinbaseKey.Sign(hash, vchSig));
+    vchSig.push_back((unsigned char)SIGHASH_ALL);
+    spends[0].vin[0].scriptSig << vchSig;
+
+    CSetAssociativeCacheStats before, after;
+    GetScriptExecutionCacheStats(before);
+    BOOST_CHECK(ToMemPool(spends[0]));
+    GetScriptExecutionCacheStats(after);
+    BOOST_CHECK_EQUAL(after.nInserts, before.nInserts + 1);
+
+    before = after;
+    CBlock block = CreateAndProcessBlock(spends, scriptPubKey);
+    BOOST_CHECK(chainActive.Tip()->GetBlockHash() == block.GetHash());
+    GetScriptExecutionCacheStats(after);
+    BOOST_CHECK(after.nHits > before.nHits);
+    BOOST_CHECK_EQUAL(mempool.size(), 0);
+}
+
+static CMutableTransaction
+SpendToKey(const CKey& key, const COutPoint& prevout, const CScript& scriptPubKey, CAmount nValue, int nOutputs = 1)
+{
+    CMutableTransaction spend;
+    spend.vin.resize(1);
+    spend.vin[0].prevout = prevout;
+    spend.vout.resize(nOutputs);
+    for (int i = 0; i < nOutputs; i++) {
+        spend.vout[i].nValue = nValue;
+        spend.vout[i].scriptPubKey = scriptPubKey;
+    }
+
+    std::vector<unsigned char> vchSig;
+    uint256 hash = SignatureHash(scriptPubKey, spend, 0, SIGHASH_ALL);
+    BOOST_CHECK(key.Sign(hash, vchSig));
+    vchSig.push_back((unsigned char)SIGHASH_ALL);
+    spend.vin[0].scriptSig << vchSig;
+    return spend;
+}
+
+BOOST_FIXTURE_TEST_CASE(tx_mempool_batch, TestChain100Setup)
+{
+    // Transactions accepted as a batch get the same verdicts as they would
+    // one at a time, also when their scripts are checked on another thread.
+    CScript scriptPubKey = CScript() <<  ToByteVector(coinbaseKey.GetPubKey()) << OP_CHECKSIG;
+
+    // Mature outputs to spend
+    std::vector<CMutableTransaction> vFanOut;
+    vFanOut.push_back(SpendToKey(coinbaseKey, COutPoint(coinbaseTxns[0].GetHash(), 0), scriptPubKey, 11*CENT, 3));
+    CreateAndProcessBlock(vFanOut, scriptPubKey);
+    const uint256 hashFanOut = vFanOut[0].GetHash();
+
+    std::vector<CTransaction> vtx;
+    vtx.push_back(SpendToKey(coinbaseKey, COutPoint(hashFanOut, 0), scriptPubKey, 10*CENT));
+    // Invalid signature
+    CMutableTransaction badSpend = SpendToKey(coinbaseKey, COutPoint(hashFanOut, 1), scriptPubKey, 10*CENT);
+    badSpend.vout[0].nValue = 9*CENT;
+    vtx.push_back(badSpend);
+    vtx.push_back(SpendToKey(coinbaseKey, COutPoint(hashFanOut, 2), scriptPubKey, 10*CENT));
+    // Spends the first one, which has to be in the pool by then
+    vtx.push_back(SpendToKey(coinbaseKey, COutPoint(vtx[0].GetHash(), 0), scriptPubKey, 9*CENT));
+    // Double spends the third one without paying more
+    vtx.push_back(SpendToKey(coinbaseKey, COutPoint(hashFanOut, 2), scriptPubKey, 10*CENT + 1));
+    // Inputs unknown
+    vtx.push_back(SpendToKey(coinbaseKey, COutPoint(GetRandHash(), 0), scriptPubKey, 10*CENT));
+
+    boost::thread_group threadGroup;
+    threadGroup.create_thread(&ThreadScriptCheck);
+    nScriptCheckThreads = 1;
+
+    std::vector<CValidationState> vState;
+    std::vector<bool> vAccepted, vMissingInputs;
+    {
+        LOCK(cs_main);
+        AcceptToMemoryPoolBatch(mempool, vtx, false, vState, vAccepted, vMissingInputs);
+    }
+
+    nScriptCheckThreads = 0;
+    threadGroup.interrupt_all();
+    threadGroup.join_all();
+
+    BOOST_CHECK(vAccepted[0]);
+    BOOST_CHECK(!vAccepted[1]);
+    int nDoS = 0;
+    BOOST_CHECK(vState[1].IsInvalid(nDoS) && nDoS > 0);
+    BOOST_CHECK(vAccepted[2]);
+    BOOST_CHECK(vAccepted[3]);
+    BOOST_CHECK(!vAccepted[4]);
+    BOOST_CHECK_EQUAL(vState[4].GetRejectReason(), "txn-mempool-conflict");
+    BOOST_CHECK(!vAccepted[5]);
+    BOOST_CHECK(vMissingInputs[5]);
+    BOOST_CHECK_EQUAL(mempool.size(), 3);
+    BOOST_CHECK(mempool.exists(vtx[3].GetHash()));
+    mempool.clear();
+}
+
+BOOST_FIXTURE_TEST_CASE(mempool_dump_load, TestChain100Setup)
+{
+    // Transactions, their entry times and fee deltas survive a dump and load
+    CScript scriptPubKey = CScript() <<  ToByteVector(coinbaseKey.GetPubKey()) << OP_CHECKSIG;
+    CTransaction parent = SpendToKey(coinbaseKey, COutPoint(coinbaseTxns[0].GetHash(), 0), scriptPubKey, 11*CENT);
+    CTransaction child = SpendToKey(coinbaseKey, COutPoint(parent.GetHash(), 0), scriptPubKey, 10*CENT);
+    int64_t nTime = GetTime() - 60 * 60;
+    {
+        LOCK(cs_main);
+        SetMockTime(nTime);
+        CValidationState state;
+        BOOST_CHECK(AcceptToMemoryPool(mempool, state, parent, false, NULL));
+        SetMockTime(0);
+        BOOST_CHECK(AcceptToMemoryPool(mempool, state, child, false, NULL));
+    }
+    mempool.PrioritiseTransaction(child.GetHash(), child.GetHash().ToString(), 0, 12345);
+    uint256 hashOther = GetRandHash();
+    mempool.PrioritiseTransaction(hashOther, hashOther.ToString(), 0, 54321);
+
+    BOOST_CHECK(DumpMempool());
+    mempool.clear();
+    mempool.ClearPrioritisation(child.GetHash());
+    mempool.ClearPrioritisation(hashOther);
+    BOOST_CHECK(LoadMempool());
+
+    BOOST_CHECK_EQUAL(mempool.size(), 2);
+    LOCK(mempool.cs);
+    CTxMemPool::txiter it = mempool.mapTx.find(parent.GetHash());
+    BOOST_CHECK(it != mempool.mapTx.end() && it->GetTime() == nTime);
+    it = mempool.mapTx.find(child.GetHash());
+    BOOST_CHECK(it != mempool.mapTx.end() && it->GetModifiedFee() == it->GetFee() + 12345);
+    double dPriorityDelta = 0;
+    CAmount nFeeDelta = 0;
+    mempool.ApplyDeltas(hashOther, dPriorityDelta, nFeeDelta);
+    BOOST_CHECK_EQUAL(nFeeDelta, 54321);
+    mempool.clear();
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -14,6 +14,7 @@
 
 #include <stdint.h>
 
+#include <boost/bind.hpp>
 #include <boost/thread.hpp>
 
 using namespace std;
@@ -28,12 +29,13 @@ static const char DB_SPENTINDEX = 'p';
 static const char DB_BLOCK_INDEX = 'b';
 
 static const char DB_BEST_BLOCK = 'B';
+static const char DB_COINS_STATS = 'S';
 static const char DB_FLAG = 'F';
 static const char DB_REINDEX_FLAG = 'R';
 static const char DB_LAST_BLOCK = 'l';
 
 
-CCoinsViewDB::CCoinsViewDB(size_t nCacheSize, bool fMemory, bool fWipe) : db(GetDataDir() / "chainstate", nCacheSize, fMemory, fWipe, true) 
+CCoinsViewDB::CCoinsViewDB(size_t nCacheSize, bool fMemory, bool fWipe) : db(GetDataDir() / "chainstate", nCacheSize, fMemory, fWipe, true), pstatsTip(NULL)
 {
 }
 
@@ -68,8 +70,12 @@ bool CCoinsViewDB::BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock) {
         CCoinsMap::iterator itOld = it++;
         mapCoins.erase(itOld);
     }
-    if (!hashBlock.IsNull())
+    if (!hashBlock.IsNull()) {
         batch.Write(DB_BEST_BLOCK, hashBlock);
+        // Commit the running statistics atomically with the state they describe
+        if (pstatsTip && pstatsTip->hashBlock == hashBlock)
+            batch.Write(DB_COINS_STATS, *pstatsTip);
+    }
 
     LogPrint("coindb", "Committing %u changed transactions (out of %u) to coin database...\n", (unsigned int)changed, (unsigned int)count);
     return db.WriteBatch(batch);
@@ -98,49 +104,77 @@ bool CBlockTreeDB::ReadLastBlockFile(int &nFile) {
     return Read(DB_LAST_BLOCK, nFile);
 }
 
-bool CCoinsViewDB::GetStats(CCoinsStats &stats) const {
-    /* It seems that there are no "const iterators" for LevelDB.  Since we
-       only need read operations on it, use a const-cast to get around
-       that restriction.  */
-    boost::scoped_ptr<CDBIterator> pcursor(const_cast<CDBWrapper*>(&db)->NewIterator());
-    pcursor->Seek(DB_COINS);
+bool CCoinsViewDB::ReadStats(CCoinsStats &stats) const {
+    return db.Read(DB_COINS_STATS, stats);
+}
 
-    CHashWriter ss(SER_GETHASH, PROTOCOL_VERSION);
-    stats.hashBlock = GetBestBlock();
-    ss << stats.hashBlock;
-    CAmount nTotalAmount = 0;
+/** Scan the coins records in a snapshot whose txid starts with a byte in [nBegin, nEnd). */
+static void ScanCoinsRange(CDBWrapper* pdb, const leveldb::Snapshot* snapshot, unsigned int nBegin, unsigned int nEnd, CCoinsStats* pstats, char* pfOk)
+{
+    boost::scoped_ptr<CDBIterator> pcursor(pdb->NewIterator(snapshot));
+    uint256 start;
+    *start.begin() = nBegin;
+    pcursor->Seek(make_pair(DB_COINS, start));
+    *pfOk = false;
     while (pcursor->Valid()) {
         boost::this_thread::interruption_point();
         std::pair<char, uint256> key;
-        CCoins coins;
-        if (pcursor->GetKey(key) && key.first == DB_COINS) {
-            if (pcursor->GetValue(coins)) {
-                stats.nTransactions++;
-                for (unsigned int i=0; i<coins.vout.size(); i++) {
-                    const CTxOut &out = coins.vout[i];
-                    if (!out.IsNull()) {
-                        stats.nTransactionOutputs++;
-                        ss << VARINT(i+1);
-                        ss << out;
-                        nTotalAmount += out.nValue;
-                    }
-                }
-                stats.nSerializedSize += 32 + pcursor->GetValueSize();
-                ss << VARINT(0);
-            } else {
-                return error("CCoinsViewDB::GetStats() : unable to read value");
-            }
-        } else {
+        if (!pcursor->GetKey(key) || key.first != DB_COINS || *key.second.begin() >= nEnd)
             break;
+        CCoins coins;
+        if (!pcursor->GetValue(coins)) {
+            error("CCoinsViewDB::GetStats() : unable to read value");
+            return;
         }
+        pstats->Add(key.second, coins);
         pcursor->Next();
     }
+    *pfOk = true;
+}
+
+bool CCoinsViewDB::GetStats(CCoinsStats &stats) const {
+    /* It seems that there are no "const iterators" for LevelDB.  Since we
+       only need read operations on it, use a const-cast to get around
+       that restriction.  */
+    CDBWrapper* pdb = const_cast<CDBWrapper*>(&db);
+    // Scan a snapshot, so that neither cs_main nor writers need to be held
+    // off, splitting the key space by the first txid byte across threads.
+    const leveldb::Snapshot* snapshot = pdb->GetSnapshot();
+    int nThreads = std::max(1, std::min(GetNumCores(), MAX_COINS_STATS_THREADS));
+    std::vector<CCoinsStats> vStats(nThreads);
+    std::vector<char> vOk(nThreads, 0);
+    boost::thread_group threadGroup;
+    try {
+        for (int i = 1; i < nThreads; i++)
+            threadGroup.create_thread(boost::bind(&ScanCoinsRange, pdb, snapshot, 256 * i / nThreads, 256 * (i + 1) / nThreads, &vStats[i], &vOk[i]));
+        ScanCoinsRange(pdb, snapshot, 0, 256 / nThreads, &vStats[0], &vOk[0]);
+        threadGroup.join_all();
+    } catch (...) {
+        threadGroup.interrupt_all();
+        threadGroup.join_all();
+        pdb->ReleaseSnapshot(snapshot);
+        throw;
+    }
+
+    CCoinsStats committed;
+    bool fHaveCommitted = db.Read(DB_COINS_STATS, committed, snapshot);
+    if (!db.Read(DB_BEST_BLOCK, stats.hashBlock, snapshot))
+        stats.hashBlock.SetNull();
+    pdb->ReleaseSnapshot(snapshot);
+
+    for (int i = 0; i < nThreads; i++) {
+        if (!vOk[i])
+            return false;
+        stats.Merge(vStats[i]);
+    }
     {
         LOCK(cs_main);
-        stats.nHeight = mapBlockIndex.find(stats.hashBlock)->second->nHeight;
+        BlockMap::iterator mi = mapBlockIndex.find(stats.hashBlock);
+        if (mi != mapBlockIndex.end())
+            stats.nHeight = mi->second->nHeight;
     }
-    stats.hashSerialized = ss.GetHash();
-    stats.nTotalAmount = nTotalAmount;
+    if (fHaveCommitted && committed.hashBlock == stats.hashBlock && !committed.SameTotals(stats))
+        return error("CCoinsViewDB::GetStats() : coin database scan at %s does not match the running statistics", stats.hashBlock.ToString());
     return true;
 }
 
@@ -35,11 +35,16 @@ static const int64_t nMaxDbCache = sizeof(void*) > 4 ? 16384 : 1024;
 //! min. -dbcache in (MiB)
 static const int64_t nMinDbCache = 4;
 
+//! max. number of threads used to scan the coin database in GetStats
+static const int MAX_COINS_STATS_THREADS = 8;
+
 /** CCoinsView backed by the coin database (chainstate/) */
 class CCoinsViewDB : public CCoinsView
 {
 protected:
     CDBWrapper db;
+    //! Running statistics of the chain tip, written along with each new best block
+    const CCoinsStats *pstatsTip;
 public:
     CCoinsViewDB(size_t nCacheSize, bool fMemory = false, bool fWipe = false);
 
@@ -47,7 +52,13 @@ public:
     bool HaveCoins(const uint256 &txid) const;
     uint256 GetBestBlock() const;
     bool BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock);
+    //! Full scan of the database; also checks it against the committed running statistics
     bool GetStats(CCoinsStats &stats) const;
+
+    //! Read the running statistics committed by the last BatchWrite
+    bool ReadStats(CCoinsStats &stats) const;
+    //! Commit *pstatsTipIn on every BatchWrite whose best block it describes
+    void SetTipStats(const CCoinsStats *pstatsTipIn) { pstatsTip = pstatsTipIn; }
 };
 
 /** Access to the block database (blocks/index/) */
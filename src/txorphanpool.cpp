@@ -0,0 +1,209 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "txorphanpool.h"
+
+#include "random.h"
+#include "util.h"
+#include "utiltime.h"
+#include "version.h"
+
+#include <boost/foreach.hpp>
+
+COutPointHasher::COutPointHasher() : salt(GetRandHash()) {}
+
+CTxOrphanPool::CTxOrphanPool(unsigned int nMaxPeerBytesIn) :
+    nMaxPeerBytes(nMaxPeerBytesIn), nSequence(0), nNextSweep(0)
+{
+}
+
+void CTxOrphanPool::Erase(OrphanMap::iterator it)
+{
+    AssertLockHeld(cs);
+    BOOST_FOREACH(const CTxIn& txin, it->second.tx.vin) {
+        PrevMap::iterator itPrev = mapByPrev.find(txin.prevout);
+        if (itPrev == mapByPrev.end())
+            continue;
+        itPrev->second.erase(it);
+        if (itPrev->second.empty())
+            mapByPrev.erase(itPrev);
+    }
+
+    std::map<NodeId, CPeerOrphans>::iterator itPeer = mapPeers.find(it->second.fromPeer);
+    assert(itPeer != mapPeers.end());
+    itPeer->second.nBytes -= it->second.nTxSize;
+    itPeer->second.mapBySequence.erase(it->second.nSequence);
+    if (itPeer->second.mapBySequence.empty())
+        mapPeers.erase(itPeer);
+
+    mapOrphans.erase(it);
+}
+
+bool CTxOrphanPool::AddTx(const CTransaction& tx, NodeId peer)
+{
+    LOCK(cs);
+    const uint256& hash = tx.GetHash();
+    if (mapOrphans.count(hash))
+        return false;
+
+    // Ignore big transactions, to avoid a
+    // send-big-orphans memory exhaustion attack. If a peer has a legitimate
+    // large transaction with a missing parent then we assume
+    // it will rebroadcast it later, after the parent transaction(s)
+    // have been mined or received.
+    unsigned int sz = tx.GetSerializeSize(SER_NETWORK, CTransaction::CURRENT_VERSION);
+    if (sz > MAX_ORPHAN_TX_SIZE || sz > nMaxPeerBytes)
+    {
+        LogPrint("mempool", "ignoring large orphan tx (size: %u, hash: %s)\n", sz, hash.ToString());
+        return false;
+    }
+
+    // Make room within the peer's quota at the expense of its own orphans
+    unsigned int nEvicted = 0;
+    std::map<NodeId, CPeerOrphans>::iterator itPeer = mapPeers.find(peer);
+    while (itPeer != mapPeers.end() && itPeer->second.nBytes + sz > nMaxPeerBytes) {
+        Erase(itPeer->second.mapBySequence.begin()->second);
+        nEvicted++;
+        itPeer = mapPeers.find(peer);
+    }
+    if (nEvicted > 0)
+        LogPrint("mempool", "orphan quota of peer=%d exceeded, removed %u tx\n", peer, nEvicted);
+
+    OrphanMap::iterator it = mapOrphans.insert(std::make_pair(hash, COrphanTx())).first;
+    COrphanTx& orphan = it->second;
+    orphan.tx = tx;
+    orphan.fromPeer = peer;
+    orphan.nTimeExpire = GetTime() + ORPHAN_TX_EXPIRE_TIME;
+    orphan.nTxSize = sz;
+    orphan.nSequence = nSequence++;
+    BOOST_FOREACH(const CTxIn& txin, tx.vin)
+        mapByPrev[txin.prevout].insert(it);
+    CPeerOrphans& peerOrphans = mapPeers[peer];
+    peerOrphans.nBytes += sz;
+    peerOrphans.mapBySequence.insert(std::make_pair(orphan.nSequence, it));
+
+    LogPrint("mempool", "stored orphan tx %s (mapsz %u outsz %u)\n", hash.ToString(),
+             mapOrphans.size(), mapByPrev.size());
+    return true;
+}
+
+bool CTxOrphanPool::HaveTx(const uint256& hash) const
+{
+    LOCK(cs);
+    return mapOrphans.count(hash) > 0;
+}
+
+bool CTxOrphanPool::EraseTx(const uint256& hash)
+{
+    LOCK(cs);
+    OrphanMap::iterator it = mapOrphans.find(hash);
+    if (it == mapOrphans.end())
+        return false;
+    Erase(it);
+    return true;
+}
+
+unsigned int CTxOrphanPool::EraseForPeer(NodeId peer)
+{
+    LOCK(cs);
+    unsigned int nErased = 0;
+    std::map<NodeId, CPeerOrphans>::iterator itPeer = mapPeers.find(peer);
+    while (itPeer != mapPeers.end()) {
+        Erase(itPeer->second.mapBySequence.begin()->second);
+        nErased++;
+        itPeer = mapPeers.find(peer);
+    }
+    if (nErased > 0) LogPrint("mempool", "Erased %d orphan tx from peer %d\n", nErased, peer);
+    return nErased;
+}
+
+unsigned int CTxOrphanPool::EraseExpired()
+{
+    AssertLockHeld(cs);
+    int64_t nNow = GetTime();
+    if (nNextSweep > nNow)
+        return 0;
+
+    unsigned int nErased = 0;
+    // Orphans expiring before the next sweep go now, so none is kept much
+    // longer than ORPHAN_TX_EXPIRE_TIME.
+    int64_t nMinExpire = nNow + ORPHAN_TX_EXPIRE_TIME - ORPHAN_TX_EXPIRE_INTERVAL;
+    OrphanMap::iterator it = mapOrphans.begin();
+    while (it != mapOrphans.end()) {
+        OrphanMap::iterator maybeErase = it++;
+        if (maybeErase->second.nTimeExpire <= nNow) {
+            Erase(maybeErase);
+            nErased++;
+        } else {
+            nMinExpire = std::min(maybeErase->second.nTimeExpire, nMinExpire);
+        }
+    }
+    nNextSweep = nMinExpire + ORPHAN_TX_EXPIRE_INTERVAL;
+    if (nErased > 0) LogPrint("mempool", "Erased %d orphan tx due to expiration\n", nErased);
+    return nErased;
+}
+
+unsigned int CTxOrphanPool::LimitOrphans(unsigned int nMaxOrphans)
+{
+    LOCK(cs);
+    EraseExpired();
+
+    unsigned int nEvicted = 0;
+    while (mapOrphans.size() > nMaxOrphans) {
+        // Evict the oldest orphan of the peer using the most space, so a
+        // peer flooding us with orphans cannot push out everybody else's
+        std::map<NodeId, CPeerOrphans>::iterator itLargest = mapPeers.begin();
+        for (std::map<NodeId, CPeerOrphans>::iterator itPeer = mapPeers.begin(); itPeer != mapPeers.end(); ++itPeer) {
+            if (itPeer->second.nBytes > itLargest->second.nBytes)
+                itLargest = itPeer;
+        }
+        Erase(itLargest->second.mapBySequence.begin()->second);
+        ++nEvicted;
+    }
+    return nEvicted;
+}
+
+void CTxOrphanPool::GetChildren(const std::vector<CTransaction>& vParents, std::vector<CTransaction>& vChildren, std::vector<NodeId>& vFromPeer) const
+{
+    LOCK(cs);
+    std::set<OrphanMap::iterator, CompareIteratorByHash> setChildren;
+    BOOST_FOREACH(const CTransaction& tx, vParents) {
+        const uint256& hash = tx.GetHash();
+        for (unsigned int i = 0; i < tx.vout.size(); i++) {
+            PrevMap::const_iterator itPrev = mapByPrev.find(COutPoint(hash, i));
+            if (itPrev != mapByPrev.end())
+                setChildren.insert(itPrev->second.begin(), itPrev->second.end());
+        }
+    }
+
+    vChildren.clear();
+    vFromPeer.clear();
+    vChildren.reserve(setChildren.size());
+    vFromPeer.reserve(setChildren.size());
+    BOOST_FOREACH(const OrphanMap::iterator& it, setChildren) {
+        vChildren.push_back(it->second.tx);
+        vFromPeer.push_back(it->second.fromPeer);
+    }
+}
+
+size_t CTxOrphanPool::size() const
+{
+    LOCK(cs);
+    return mapOrphans.size();
+}
+
+size_t CTxOrphanPool::GetPeerBytes(NodeId peer) const
+{
+    LOCK(cs);
+    std::map<NodeId, CPeerOrphans>::const_iterator itPeer = mapPeers.find(peer);
+    return itPeer == mapPeers.end() ? 0 : itPeer->second.nBytes;
+}
+
+void CTxOrphanPool::clear()
+{
+    LOCK(cs);
+    mapOrphans.clear();
+    mapByPrev.clear();
+    mapPeers.clear();
+}
@@ -0,0 +1,121 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_TXORPHANPOOL_H
+#define BITCOIN_TXORPHANPOOL_H
+
+#include "net.h"
+#include "primitives/transaction.h"
+#include "sync.h"
+#include "uint256.h"
+
+#include <map>
+#include <set>
+#include <stdint.h>
+#include <vector>
+
+#include <boost/unordered_map.hpp>
+
+/** Orphans larger than this are not kept, see CTxOrphanPool::AddTx */
+static const unsigned int MAX_ORPHAN_TX_SIZE = 5000;
+/** Serialized size of the orphans kept from a single peer */
+static const unsigned int MAX_ORPHAN_PEER_BYTES = 100000;
+/** Seconds an orphan is kept waiting for its parents */
+static const int64_t ORPHAN_TX_EXPIRE_TIME = 20 * 60;
+/** Minimum seconds between sweeps for expired orphans */
+static const int64_t ORPHAN_TX_EXPIRE_INTERVAL = 5 * 60;
+
+class COutPointHasher
+{
+private:
+    uint256 salt;
+
+public:
+    COutPointHasher();
+
+    size_t operator()(const COutPoint& outpoint) const {
+        return outpoint.hash.GetHash(salt) ^ outpoint.n;
+    }
+};
+
+/**
+ * Transactions we received before their parents.
+ *
+ * Orphans are indexed by the outpoints they spend, so the orphans waiting
+ * for a transaction are found without scanning the pool. Every peer may
+ * have at most MAX_ORPHAN_PEER_BYTES of orphans in the pool; a peer going
+ * over its quota only evicts its own oldest orphans. When the pool as a
+ * whole is full, the oldest orphans of the peer using the most space go
+ * first. Orphans are dropped after ORPHAN_TX_EXPIRE_TIME.
+ */
+class CTxOrphanPool
+{
+public:
+    struct COrphanTx {
+        CTransaction tx;
+        NodeId fromPeer;
+        int64_t nTimeExpire;
+        unsigned int nTxSize;
+        uint64_t nSequence;
+    };
+
+private:
+    typedef std::map<uint256, COrphanTx> OrphanMap;
+
+    struct CompareIteratorByHash {
+        bool operator()(const OrphanMap::iterator& a, const OrphanMap::iterator& b) const {
+            return a->first < b->first;
+        }
+    };
+
+    //! The orphans spending each outpoint
+    typedef boost::unordered_map<COutPoint, std::set<OrphanMap::iterator, CompareIteratorByHash>, COutPointHasher> PrevMap;
+
+    struct CPeerOrphans {
+        size_t nBytes;
+        //! The orphans of the peer, oldest first
+        std::map<uint64_t, OrphanMap::iterator> mapBySequence;
+
+        CPeerOrphans() : nBytes(0) {}
+    };
+
+    mutable CCriticalSection cs;
+    const unsigned int nMaxPeerBytes;
+    OrphanMap mapOrphans;
+    PrevMap mapByPrev;
+    std::map<NodeId, CPeerOrphans> mapPeers;
+    uint64_t nSequence;
+    int64_t nNextSweep;
+
+    void Erase(OrphanMap::iterator it);
+    unsigned int EraseExpired();
+
+public:
+    CTxOrphanPool(unsigned int nMaxPeerBytesIn = MAX_ORPHAN_PEER_BYTES);
+
+    /** Store a transaction with missing inputs. Returns false if it was not kept. */
+    bool AddTx(const CTransaction& tx, NodeId peer);
+    bool HaveTx(const uint256& hash) const;
+    bool EraseTx(const uint256& hash);
+    /** Drop the orphans received from a peer, returns how many were dropped */
+    unsigned int EraseForPeer(NodeId peer);
+    /**
+     * Drop expired orphans, then evict orphans until at most nMaxOrphans are
+     * left. Returns the number of orphans evicted to make room.
+     */
+    unsigned int LimitOrphans(unsigned int nMaxOrphans);
+
+    /**
+     * The orphans spending outputs of any of vParents, each once and in
+     * order of their hashes, with the peers they came from.
+     */
+    void GetChildren(const std::vector<CTransaction>& vParents, std::vector<CTransaction>& vChildren, std::vector<NodeId>& vFromPeer) const;
+
+    size_t size() const;
+    /** Serialized size of the orphans received from a peer */
+    size_t GetPeerBytes(NodeId peer) const;
+    void clear();
+};
+
+#endif // BITCOIN_TXORPHANPOOL_H
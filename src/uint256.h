@@ -127,6 +127,12 @@ public:
         return ReadLE64(data);
     }
 
+    /** The pos'th 64 bit word, read as little endian */
+    uint64_t GetUint64(int pos) const
+    {
+        return ReadLE64(data + pos * 8);
+    }
+
     /** A more secure, salted hash function.
      * @note This hash is not stable between little and big endian.
      */
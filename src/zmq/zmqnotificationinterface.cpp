@@ -10,6 +10,8 @@
 #include "streams.h"
 #include "util.h"
 
+#include <boost/bind.hpp>
+
 void zmqError(const char *str)
 {
     LogPrint("zmq", "zmq: Error: %s, errno=%s\n", str, zmq_strerror(errno));
@@ -41,6 +43,7 @@ CZMQNotificationInterface* CZMQNotificationInterface::CreateWithArguments(const
     factories["pubrawblock"] = CZMQAbstractNotifier::Create<CZMQPublishRawBlockNotifier>;
     factories["pubrawtx"] = CZMQAbstractNotifier::Create<CZMQPublishRawTransactionNotifier>;
     factories["pubrawtxlock"] = CZMQAbstractNotifier::Create<CZMQPublishRawTransactionLockNotifier>;
+    factories["pubmempoolseq"] = CZMQAbstractNotifier::Create<CZMQPublishMempoolSequenceNotifier>;
 
     for (std::map<std::string, CZMQNotifierFactory>::const_iterator i=factories.begin(); i!=factories.end(); ++i)
     {
@@ -105,6 +108,9 @@ bool CZMQNotificationInterface::Initialize()
         return false;
     }
 
+    connAdded = mempool.NotifyEntryAdded.connect(boost::bind(&CZMQNotificationInterface::MempoolEntryAdded, this, _1, _2));
+    connRemoved = mempool.NotifyEntryRemoved.connect(boost::bind(&CZMQNotificationInterface::MempoolEntryRemoved, this, _1, _2, _3));
+
     return true;
 }
 
@@ -112,6 +118,8 @@ bool CZMQNotificationInterface::Initialize()
 void CZMQNotificationInterface::Shutdown()
 {
     LogPrint("zmq", "zmq: Shutdown notification interface\n");
+    connAdded.disconnect();
+    connRemoved.disconnect();
     if (pcontext)
     {
         for (std::list<CZMQAbstractNotifier*>::iterator i=notifiers.begin(); i!=notifiers.end(); ++i)
@@ -176,3 +184,30 @@ void CZMQNotificationInterface::NotifyTransactionLock(const CTransaction &tx)
         }
     }
 }
+
+void CZMQNotificationInterface::MempoolEntryAdded(const uint256 &hash, uint64_t nSequence)
+{
+    NotifyMempoolEvent(CMemPoolEvent(nSequence, hash, true, REMOVAL_UNKNOWN));
+}
+
+void CZMQNotificationInterface::MempoolEntryRemoved(const uint256 &hash, MemPoolRemovalReason reason, uint64_t nSequence)
+{
+    NotifyMempoolEvent(CMemPoolEvent(nSequence, hash, false, reason));
+}
+
+void CZMQNotificationInterface::NotifyMempoolEvent(const CMemPoolEvent &event)
+{
+    for (std::list<CZMQAbstractNotifier*>::iterator i = notifiers.begin(); i!=notifiers.end(); )
+    {
+        CZMQAbstractNotifier *notifier = *i;
+        if (notifier->NotifyMempoolEvent(event))
+        {
+            i++;
+        }
+        else
+        {
+            notifier->Shutdown();
+            i = notifiers.erase(i);
+        }
+    }
+}
@@ -5,10 +5,13 @@
 #ifndef BITCOIN_ZMQ_ZMQNOTIFICATIONINTERFACE_H
 #define BITCOIN_ZMQ_ZMQNOTIFICATIONINTERFACE_H
 
+#include "txmempool.h"
 #include "validationinterface.h"
 #include <string>
 #include <map>
 
+#include <boost/signals2/connection.hpp>
+
 class CBlockIndex;
 class CZMQAbstractNotifier;
 
@@ -28,11 +31,18 @@ protected:
     void UpdatedBlockTip(const CBlockIndex *pindex);
     void NotifyTransactionLock(const CTransaction &tx);
 
+    // CTxMemPool
+    void MempoolEntryAdded(const uint256 &hash, uint64_t nSequence);
+    void MempoolEntryRemoved(const uint256 &hash, MemPoolRemovalReason reason, uint64_t nSequence);
+    void NotifyMempoolEvent(const CMemPoolEvent &event);
+
 private:
     CZMQNotificationInterface();
 
     void *pcontext;
     std::list<CZMQAbstractNotifier*> notifiers;
+    boost::signals2::connection connAdded;
+    boost::signals2::connection connRemoved;
 };
 
 #endif // BITCOIN_ZMQ_ZMQNOTIFICATIONINTERFACE_H
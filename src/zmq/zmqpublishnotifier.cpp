@@ -5,6 +5,7 @@
 #include "chainparams.h"
 #include "zmqpublishnotifier.h"
 #include "main.h"
+#include "txmempool.h"
 #include "util.h"
 
 static std::multimap<std::string, CZMQAbstractPublishNotifier*> mapPublishNotifiers;
@@ -15,6 +16,7 @@ static const char *MSG_HASHTXLOCK = "hashtxlock";
 static const char *MSG_RAWBLOCK   = "rawblock";
 static const char *MSG_RAWTX      = "rawtx";
 static const char *MSG_RAWTXLOCK = "rawtxlock";
+static const char *MSG_MEMPOOLSEQ = "mempoolseq";
 
 // Internal function to send multipart message
 static int zmq_send_multipart(void *sock, const void* data, size_t size, ...)
@@ -210,3 +212,16 @@ bool CZMQPublishRawTransactionLockNotifier::NotifyTransactionLock(const CTransac
     ss << transaction;
     return SendMessage(MSG_RAWTXLOCK, &(*ss.begin()), ss.size());
 }
+
+bool CZMQPublishMempoolSequenceNotifier::NotifyMempoolEvent(const CMemPoolEvent &event)
+{
+    LogPrint("zmq", "zmq: Publish mempoolseq %s %u\n", event.hash.GetHex(), event.nSequence);
+    /* txid, 'A'dded or 'R'emoved, LE 8byte mempool sequence number, removal reason */
+    unsigned char data[32 + 1 + 8 + 1];
+    for (unsigned int i = 0; i < 32; i++)
+        data[31 - i] = event.hash.begin()[i];
+    data[32] = event.fAdded ? 'A' : 'R';
+    WriteLE64(&data[33], event.nSequence);
+    data[41] = (unsigned char)event.reason;
+    return SendMessage(MSG_MEMPOOLSEQ, data, sizeof(data));
+}
@@ -64,4 +64,10 @@ public:
     bool NotifyTransactionLock(const CTransaction &transaction);
 };
 
+class CZMQPublishMempoolSequenceNotifier : public CZMQAbstractPublishNotifier
+{
+public:
+    bool NotifyMempoolEvent(const CMemPoolEvent &event);
+};
+
 #endif // BITCOIN_ZMQ_ZMQPUBLISHNOTIFIER_H